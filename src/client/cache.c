@@ -0,0 +1,172 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Client
+ *
+ * cache.c
+ * - On-disk copy of the item list
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * The list is stored as the server sent it, so it can be shown straight
+ * away and then brought up to date with `ENUM_ITEMS since:<generation>`.
+ *   gen <generation>
+ *   202 Item <type>:<id> <status> <price> <desc>
+ *   ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>	// PATH_MAX
+#include <unistd.h>	// getpid/unlink
+#include <sys/stat.h>	// mkdir
+#include "common.h"
+
+// === PROTOTYPES ===
+ int	ItemCache_Load(void);
+void	ItemCache_Save(void);
+static int	_GetCachePath(char *Dest, size_t Size, int bCreateDir);
+
+// === GLOBALS ===
+ int	gbUseItemCache = 1;	//!< Config 'item_cache'
+unsigned int	giItemCache_Generation;	//!< Generation of the cache file on disk
+
+// === CODE ===
+/**
+ * \brief Load the cached item list into gaItems
+ * \return Boolean Failure (no usable cache)
+ */
+int ItemCache_Load(void)
+{
+	char	path[PATH_MAX];
+	char	*line = NULL;
+	size_t	lineSize = 0;
+	FILE	*fp;
+	unsigned int	generation;
+	tItem	*items = NULL;
+	 int	nItems = 0;
+
+	if( !gbUseItemCache )	return 1;
+	if( _GetCachePath(path, sizeof(path), 0) )	return 1;
+
+	fp = fopen(path, "r");
+	if( !fp )	return 1;
+
+	if( fscanf(fp, "gen %u\n", &generation) != 1 || generation == 0 ) {
+		fclose(fp);
+		return 1;
+	}
+
+	while( getline(&line, &lineSize, fp) > 0 )
+	{
+		line[ strcspn(line, "\n") ] = '\0';
+		items = realloc(items, (nItems + 1) * sizeof(tItem));
+		if( ParseItemInfo(line, &items[nItems]) ) {
+			// Corrupt cache, ignore it
+			for( int i = 0; i < nItems; i ++ ) {
+				free(items[i].Type);
+				free(items[i].Desc);
+			}
+			free(items);
+			free(line);
+			fclose(fp);
+			return 1;
+		}
+		nItems ++;
+	}
+	free(line);
+	fclose(fp);
+
+	gaItems = items;
+	giNumItems = nItems;
+	giItemListGeneration = generation;
+	giItemCache_Generation = generation;
+	return 0;
+}
+
+/**
+ * \brief Write gaItems to the cache (if it has changed)
+ */
+void ItemCache_Save(void)
+{
+	char	path[PATH_MAX], tmppath[PATH_MAX+16];
+	FILE	*fp;
+
+	if( !gbUseItemCache )	return ;
+	if( giItemListGeneration == 0 || giItemListGeneration == giItemCache_Generation )
+		return ;
+	if( _GetCachePath(path, sizeof(path), 1) )	return ;
+
+	// Write to a temporary and rename, so concurrent clients never see half a file
+	snprintf(tmppath, sizeof(tmppath), "%s.%i", path, getpid());
+	fp = fopen(tmppath, "w");
+	if( !fp )	return ;
+
+	fprintf(fp, "gen %u\n", giItemListGeneration);
+	for( int i = 0; i < giNumItems; i ++ )
+	{
+		const char	*status;
+		switch( gaItems[i].Status )
+		{
+		case 0:	status = "avail";	break;
+		case 1:	status = "sold";	break;
+		default:	status = "error";	break;
+		}
+		fprintf(fp, "202 Item %s:%i %s %i %s\n",
+			gaItems[i].Type, gaItems[i].ID, status, gaItems[i].Price, gaItems[i].Desc);
+	}
+
+	if( fclose(fp) != 0 || rename(tmppath, path) != 0 ) {
+		unlink(tmppath);
+		return ;
+	}
+	giItemCache_Generation = giItemListGeneration;
+}
+
+/**
+ * \brief Get the cache file for the current server
+ *
+ * $XDG_CACHE_HOME/opendispense/items-<server>-<port>, <server> being the one
+ * that answered (see OpenConnection), with $XDG_CACHE_HOME
+ * defaulting to ~/.cache ('/' in a socket path becomes '_')
+ * \return Boolean Failure
+ */
+int _GetCachePath(char *Dest, size_t Size, int bCreateDir)
+{
+	const char	*base = getenv("XDG_CACHE_HOME");
+	const char	*home = getenv("HOME");
+	 int	len;
+
+	if( base && base[0] == '/' )
+		len = snprintf(Dest, Size, "%s/opendispense", base);
+	else if( home && home[0] )
+		len = snprintf(Dest, Size, "%s/.cache/opendispense", home);
+	else
+		return 1;
+	if( len < 0 || (size_t)len >= Size )
+		return 1;
+
+	if( bCreateDir )
+	{
+		// Only the last two levels are created, $HOME should already exist
+		char	*slash = strrchr(Dest, '/');
+		*slash = '\0';
+		mkdir(Dest, 0700);
+		*slash = '/';
+		mkdir(Dest, 0700);
+	}
+
+	{
+		 int	start = len + 1;
+		len += snprintf(Dest + len, Size - len, "/items-%s-%i",
+			gsConnectedServer ? gsConnectedServer : gsDispenseServer, giDispensePort);
+		if( (size_t)len >= Size )
+			return 1;
+		// Local servers are named by their socket path
+		for( char *pos = Dest + start; *pos; pos ++ ) {
+			if( *pos == '/' )	*pos = '_';
+		}
+	}
+	return 0;
+}
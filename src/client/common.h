@@ -45,10 +45,14 @@ enum eReturnValues
 	RV_UNKNOWN_RESPONSE = -3,
 };
 
-extern regex_t	gArrayRegex;
-extern regex_t	gItemRegex;
+extern const char	*gsDispenseServer;
+extern const char	**gasDispenseServers;
+extern int	giNumDispenseServers;
+extern const char	*gsConnectedServer;
+extern int	giDispensePort;
+extern int	giDispenseConnectTimeout;
+
 extern regex_t	gSaltRegex;
-extern regex_t	gUserInfoRegex;
 extern regex_t	gUserItemIdentRegex;
 
 extern int	gbDryRun;
@@ -65,16 +69,29 @@ extern char	*gsUserFlags;
 
 extern int	giNumItems;
 extern tItem	*gaItems;
+extern unsigned int	giItemListGeneration;
+extern unsigned int	giItemCache_Generation;
+extern int	gbUseItemCache;
 
 extern int	RunRegex(regex_t *regex, const char *str, int nMatches, regmatch_t *matches, const char *errmsg);
 
-extern int	ShowNCursesUI(void);
+extern int	ShowNCursesUI(int RevalidateSocket);
+
+extern int	ItemCache_Load(void);
+extern void	ItemCache_Save(void);
 
-extern int	OpenConnection(const char *Host, int Port);
+extern int	Dispense_GetConnection(void);
+extern void	Dispense_CloseConnection(void);
+extern int	OpenConnection(const char * const *Hosts, int NumHosts, int Port);
 extern int	Authenticate(int Socket);
 extern int	GetUserBalance(int Socket);
 extern void	PopulateItemList(int Socket);
+extern int	Dispense_GetUserAndItems(int Socket);
+extern void	Dispense_RequestUserAndItems(int Socket);
+extern int	Dispense_ReadUserAndItems(int Socket);
+extern int	ParseItemInfo(char *Line, tItem *Dest);
 extern int	Dispense_ItemInfo(int Socket, const char *Type, int ID);
+extern int	Dispense_ItemInfoAuth(int Socket, const char *Type, int ID);
 extern int	DispenseItem(int Socket, const char *Type, int ID);
 extern int	Dispense_AlterBalance(int Socket, const char *Username, int Ammount, const char *Reason);
 extern int	Dispense_SetBalance(int Socket, const char *Username, int Balance, const char *Reason);
@@ -83,7 +100,7 @@ extern int	Dispense_Refund(int Socket, const char *Username, const char *Item, i
 extern int	Dispense_Donate(int Socket, int Ammount, const char *Reason);
 extern int	Dispense_EnumUsers(int Socket);
 extern int	Dispense_ShowUser(int Socket, const char *Username);
-extern void	_PrintUserLine(const char *Line);
+extern void	_PrintUserLine(char *Line);
 extern int	Dispense_AddUser(int Socket, const char *Username);
 extern int	Dispense_SetUserType(int Socket, const char *Username, const char *TypeString, const char *Reason);
 extern int	Dispense_SetItem(int Socket, const char *Type, int ID, int NewPrice, const char *NewName);
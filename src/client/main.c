@@ -42,13 +42,18 @@ void	CompileRegex(regex_t *regex, const char *pattern, int flags);
 const	char	*gsConfigFile = "/etc/opendispense/client.conf";
 
 const	char	*gsDispenseServer = "merlo.ucc.gu.uwa.edu.au";
+const	char	**gasDispenseServers = &gsDispenseServer;	//!< Servers to try, in order ('dispense_server' can be repeated)
+ int	giNumDispenseServers = 1;
+const	char	*gsConnectedServer;	//!< Which of gasDispenseServers answered (NULL until connected)
+ int	giDispenseConnectTimeout = 3;	//!< Seconds to wait for any server to answer
  int	giDispensePort = 11020;
  int	giDispenseServerSet = 0; // True if set by command line
  int	giDispensePortSet = 0; // True if set by command line
 
 tItem	*gaItems;
  int	giNumItems;
-regex_t	gArrayRegex, gItemRegex, gSaltRegex, gUserInfoRegex, gUserItemIdentRegex;
+unsigned int	giItemListGeneration;	//!< Server's generation of gaItems (0 = unknown)
+regex_t	gSaltRegex, gUserItemIdentRegex;
  int	gbIsAuthenticated = 0;
 
 char	*gsItemPattern;	//!< Item pattern
@@ -177,7 +182,7 @@ void ShowUsage(void)
 int subcommand_finger(void)
 {
 	// Connect to server
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 
 	// Get items
@@ -214,12 +219,12 @@ int subcommand_acct(void)
 	int ret = 0;
 
 	// Connect to server
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 	// List accounts?
 	if( giTextArgc == 1 ) {
 		ret = Dispense_EnumUsers(sock);
-		close(sock);
+		Dispense_CloseConnection();
 		return ret;
 	}
 		
@@ -260,14 +265,14 @@ int subcommand_acct(void)
 	}
 	// On error, quit
 	if( ret ) {
-		close(sock);
+		Dispense_CloseConnection();
 		return ret;
 	}
 	
 	// Show user information
 	ret = Dispense_ShowUser(sock, gsTextArgs[1]);
 	
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -292,7 +297,7 @@ int subcommand_give(int argc, char *args[])
 	const char *message = args[2];
 	
 	// Connect to server
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 	
 	// Authenticate
@@ -307,7 +312,7 @@ int subcommand_give(int argc, char *args[])
 	}
 	ret = Dispense_Give(sock, dst_acct, amt, message);
 
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -327,7 +332,7 @@ int subcommand_user(int argc, char *args[])
 	}
 	
 	// Connect to server
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 	
 	// Attempt authentication
@@ -362,7 +367,7 @@ int subcommand_user(int argc, char *args[])
 		ShowUsage();
 		return RV_ARGUMENTS;
 	}
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -382,7 +387,7 @@ int subcommand_donate(int argc, char *args[])
 	}
 	
 	// Connect to server
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 	
 	// Attempt authentication
@@ -392,7 +397,7 @@ int subcommand_donate(int argc, char *args[])
 	// Do donation
 	ret = Dispense_Donate(sock, atoi(args[0]), args[1]);
 			
-	close(sock);
+	Dispense_CloseConnection();
 
 	return ret;
 }
@@ -415,7 +420,7 @@ int subcommand_refund(int argc, char *args[])
 	}
 
 	// Connect to server
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if(sock < 0)	return RV_SOCKET_ERROR;	
 
 	// Attempt authentication
@@ -435,7 +440,7 @@ int subcommand_refund(int argc, char *args[])
 	ret = Dispense_Refund(sock, args[0], args[1], price);
 
 	// TODO: More
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -466,11 +471,11 @@ int subcommand_iteminfo(int argc, char *args[])
 	item_id[ matches[1].rm_eo ] = '\0';
 	 int	id = atoi( item_id + matches[2].rm_so );
 
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 	
 	ret = Dispense_ItemInfo(sock, type, id);
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -520,7 +525,7 @@ int subcommand_slot(int argc, char *args[])
 	}
 	
 	// Connect & Authenticate
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 	
 	ret = Authenticate(sock);
@@ -529,7 +534,7 @@ int subcommand_slot(int argc, char *args[])
 	// Update the slot
 	ret = Dispense_SetItem(sock, item_type, item_id, price, newname);
 	
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -553,7 +558,7 @@ int subcommand_pincheck(int argc, char *args[])
 	const char *pin = args[0];
 	const char *user = (argc > 1 ? args[1] : gsUserName);
 	
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 	
 	ret = Authenticate(sock);
@@ -561,7 +566,7 @@ int subcommand_pincheck(int argc, char *args[])
 	
 	ret = DispenseCheckPin(sock, user, pin);
 	
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -581,7 +586,7 @@ int subcommand_pinset(int argc, char *args[])
 	
 	const char *pin = args[0];
 	
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 
 	ret = Authenticate(sock);
@@ -589,7 +594,7 @@ int subcommand_pinset(int argc, char *args[])
 
 	ret = DispenseSetPin(sock, pin);
 	
-	close(sock);
+	Dispense_CloseConnection();
 	return ret;
 }
 
@@ -601,14 +606,8 @@ int main(int argc, char *argv[])
 	gsTextArgs[0] = "";
 
 	// -- Create regular expressions
-	// > Code Type Count ...
-	CompileRegex(&gArrayRegex, "^([0-9]{3})\\s+([A-Za-z]+)\\s+([0-9]+)", REG_EXTENDED);	//
-	// > Code Type Ident Status Price Desc
-	CompileRegex(&gItemRegex, "^([0-9]{3})\\s+([A-Za-z]+)\\s+([A-Za-z]+):([0-9]+)\\s+(avail|sold|error)\\s+([0-9]+)\\s+(.+)$", REG_EXTENDED);
 	// > Code 'SALT' salt
 	CompileRegex(&gSaltRegex, "^([0-9]{3})\\s+([A-Za-z]+)\\s+(.+)$", REG_EXTENDED);
-	// > Code 'User' Username Balance Flags
-	CompileRegex(&gUserInfoRegex, "^([0-9]{3})\\s+([A-Za-z]+)\\s+([^ ]+)\\s+(-?[0-9]+)\\s+(.+)$", REG_EXTENDED);
 	// > Item Ident
 	CompileRegex(&gUserItemIdentRegex, "^([A-Za-z]+):([0-9]+)$", REG_EXTENDED);
 
@@ -624,12 +623,22 @@ int main(int argc, char *argv[])
 	}
 
 	// Parse config values
-	if( !giDispenseServerSet ) {
-		Config_GetValue_Str("dispense_server", &gsDispenseServer);
+	if( !giDispenseServerSet && Config_GetValueCount("dispense_server") > 0 ) {
+		giNumDispenseServers = Config_GetValueCount("dispense_server");
+		gasDispenseServers = malloc( giNumDispenseServers * sizeof(char*) );
+		for( i = 0; i < giNumDispenseServers; i ++ )
+			gasDispenseServers[i] = Config_GetValue_Idx("dispense_server", i);
+		gsDispenseServer = gasDispenseServers[0];
 	}
 	if (!giDispensePortSet) {
 		Config_GetValue_Int("dispense_port", &giDispensePort);
 	}
+	Config_GetValue_Int("dispense_connect_timeout", &giDispenseConnectTimeout);
+	{
+		bool	use_cache = true;
+		Config_GetValue_Bool("item_cache", &use_cache);
+		gbUseItemCache = use_cache;
+	}
 
 
 	// Sub-commands
@@ -669,18 +678,24 @@ int main(int argc, char *argv[])
 	}
 	
 	// Connect to server
-	int sock = OpenConnection(gsDispenseServer, giDispensePort);
+	// - The connection is kept for the rest of the run (and re-opened if the server drops it)
+	int sock = Dispense_GetConnection();
 	if( sock < 0 )	return RV_SOCKET_ERROR;
 
-	// Get the user's balance
-	ret = GetUserBalance(sock);
-	if(ret)	return ret;
-
-	// Get items
-	PopulateItemList(sock);
-	
-	// Disconnect from server
-	close(sock);
+	// Get the user's balance and the items
+	// - With a cached list only the changes are fetched, and the menu can be
+	//   shown before they arrive
+	int revalidate_sock = -1;
+	if( ItemCache_Load() == 0 && !(gsItemPattern && gsItemPattern[0]) && giUIMode != UI_MODE_BASIC )
+	{
+		Dispense_RequestUserAndItems(sock);
+		revalidate_sock = sock;
+	}
+	else
+	{
+		ret = Dispense_GetUserAndItems(sock);
+		if(ret)	return ret;
+	}
 	
 	if( gsItemPattern && gsItemPattern[0] )
 	{
@@ -688,13 +703,11 @@ int main(int argc, char *argv[])
 		// Door (hard coded)
 		if( strcmp(gsItemPattern, "door") == 0 )
 		{
-			// Connect, Authenticate, dispense and close
-			sock = OpenConnection(gsDispenseServer, giDispensePort);
-			if( sock < 0 )	return RV_SOCKET_ERROR;
+			// Authenticate, dispense and close
 			ret = Authenticate(sock);
 			if(ret)	return ret;
 			ret = DispenseItem(sock, "door", 0);
-			close(sock);
+			Dispense_CloseConnection();
 			return ret;
 		}
 		// Item id (<type>:<num>)
@@ -709,16 +722,11 @@ int main(int argc, char *argv[])
 			// Get ID
 			id = atoi( gsItemPattern + matches[2].rm_so );
 			
-			// Connect, Authenticate, dispense and close
-			sock = OpenConnection(gsDispenseServer, giDispensePort);
-			if( sock < 0 )	return RV_SOCKET_ERROR;
-			
-			Dispense_ItemInfo(sock, ident, id);
-			
-			ret = Authenticate(sock);
+			// Authenticate, dispense and close
+			ret = Dispense_ItemInfoAuth(sock, ident, id);
 			if(ret)	return ret;
 			ret = DispenseItem(sock, ident, id);
-			close(sock);
+			Dispense_CloseConnection();
 			return ret;
 		}
 		// Item number (6 = coke)
@@ -776,7 +784,7 @@ int main(int argc, char *argv[])
 	}
 	else if( giUIMode != UI_MODE_BASIC )
 	{
-		i = ShowNCursesUI();
+		i = ShowNCursesUI(revalidate_sock);
 	}
 	else
 	{
@@ -820,14 +828,11 @@ int main(int argc, char *argv[])
 	if( i >= 0 )
 	{
 		 int j;
-		// Connect, Authenticate, dispense and close
-		sock = OpenConnection(gsDispenseServer, giDispensePort);
+		// Reconnect (if the server timed us out while choosing), authenticate, dispense and close
+		sock = Dispense_GetConnection();
 		if( sock < 0 )	return RV_SOCKET_ERROR;
 			
-		ret = Dispense_ItemInfo(sock, gaItems[i].Type, gaItems[i].ID);
-		if(ret)	return ret;
-		
-		ret = Authenticate(sock);
+		ret = Dispense_ItemInfoAuth(sock, gaItems[i].Type, gaItems[i].ID);
 		if(ret)	return ret;
 		
 		for( j = 0; j < giDispenseCount; j ++ ) {
@@ -838,7 +843,7 @@ int main(int argc, char *argv[])
 			printf("%i items dispensed\n", j);
 		}
 		Dispense_ShowUser(sock, gsUserName);
-		close(sock);
+		Dispense_CloseConnection();
 
 	}
 
@@ -9,7 +9,9 @@
  * COPYING for full details.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <ncurses.h>
+#include <poll.h>
 #include <pwd.h>	// getpwuids
 #include <unistd.h>	// getuid
 #include "common.h"
@@ -19,17 +21,35 @@
 #define COLOURPAIR_CANTBUY	1
 #define COLOURPAIR_SELECTED	2
 
+// === TYPES ===
+/**
+ * \brief What is currently drawn on a row of the item list
+ * \note Item status/price only change with a new list, which redraws everything
+ */
+typedef struct sMenuRow
+{
+	 int	Item;	//!< Index passed to ShowItemAt, -1 for "...", -2 not drawn
+	 int	bHilighted;
+	char	Scrollbar;
+} tMenuRow;
+
 // === PROTOTYPES ===
  int	ShowItemAt(int Row, int Col, int Width, int Index, int bHilighted);
 void	PrintAlign(int Row, int Col, int Width, const char *Left, char Pad1, const char *Mid, char Pad2, const char *Right, ...);
 
+// === GLOBALS ===
+ int	gbMenu_BalanceUnknown;	//!< Showing the cached list, the balance hasn't arrived yet
+ int	giMenu_PriceWidth = 4;	//!< Width of the price column (widest price in the list)
+
 // -------------------
 // --- NCurses GUI ---
 // -------------------
 /**
  * \brief Render the NCurses UI
+ * \param RevalidateSocket	Socket with Dispense_RequestUserAndItems replies
+ *        pending (the shown list is from the cache), or -1
  */
-int ShowNCursesUI(void)
+int ShowNCursesUI(int RevalidateSocket)
 {
 	 int	ch;
 	 int	i, times;
@@ -41,6 +61,8 @@ int ShowNCursesUI(void)
 	 int	itemBase = 0;
 	 int	currentItem;
 	 int	ret = -2;	// -2: Used for marking "no return yet"
+	tMenuRow	*rows = NULL;	// Rows as drawn, so only changed ones are redrawn
+	 int	bRedrawFrame;
 	
 	char	balance_str[5+1+2+1];	// If $9999.99 is too little, something's wrong
 	char	*username;
@@ -78,6 +100,63 @@ int ShowNCursesUI(void)
 		}
 	}
 
+	void _Layout(void)
+	{
+		// Get balance
+		if( gbMenu_BalanceUnknown )
+			snprintf(balance_str, sizeof(balance_str), "$-.--");
+		else
+			snprintf(balance_str, sizeof(balance_str), "$%i.%02i", giUserBalance/100, abs(giUserBalance)%100);
+		
+		// Get max index
+		maxItemIndex = ShowItemAt(0, 0, 0, -1, 0);
+		// Get item count per screen
+		// - 6: randomly chosen (Need at least 3)
+		items_in_view = LINES - 6;
+		if( items_in_view > maxItemIndex )
+			items_in_view = maxItemIndex;
+		// Keep the selection on an item
+		if( currentItem >= maxItemIndex )
+			currentItem = 0;
+		while( ShowItemAt(0, 0, 0, currentItem, 0) == -1 )
+			currentItem ++;
+		if( itemBase > maxItemIndex - items_in_view )
+			itemBase = maxItemIndex - items_in_view;
+		
+		// Get dimensions
+		height = items_in_view + 3;
+		width = displayMinWidth;
+		
+		// Get positions
+		xBase = COLS/2 - width/2;
+		yBase = LINES/2 - height/2;
+		
+		// Price column fits the most expensive item
+		giMenu_PriceWidth = 4;
+		for( int j = 0; j < giNumItems; j ++ ) {
+			 int	len = snprintf(NULL, 0, "%i", gaItems[j].Price);
+			if( len > giMenu_PriceWidth )	giMenu_PriceWidth = len;
+		}
+		
+		// Nothing is drawn yet
+		rows = realloc(rows, items_in_view * sizeof(tMenuRow));
+		for( int j = 0; j < items_in_view; j ++ )
+			rows[j].Item = -2;
+		bRedrawFrame = 1;
+	}
+	
+	// Read the server's replies, and show the up to date list
+	void _Revalidate(void)
+	{
+		 int	rv = Dispense_ReadUserAndItems(RevalidateSocket);
+		RevalidateSocket = -1;
+		gbMenu_BalanceUnknown = 0;
+		if( rv ) {
+			endwin();
+			exit(rv);
+		}
+	}
+
 	// Get Username
 	if( gsEffectiveUser )
 		username = gsEffectiveUser;
@@ -85,8 +164,7 @@ int ShowNCursesUI(void)
 		pwd = getpwuid( getuid() );
 		username = pwd->pw_name;
 	}
-	// Get balance
-	snprintf(balance_str, sizeof(balance_str), "$%i.%02i", giUserBalance/100, abs(giUserBalance)%100);
+	gbMenu_BalanceUnknown = (RevalidateSocket != -1);
 	
 	// Enter curses mode
 	initscr();
@@ -97,95 +175,113 @@ int ShowNCursesUI(void)
 	init_pair(COLOURPAIR_SELECTED, COLOR_GREEN,  -1);	// Selected
 	cbreak(); noecho();
 	
-	// Get max index
-	maxItemIndex = ShowItemAt(0, 0, 0, -1, 0);
-	// Get item count per screen
-	// - 6: randomly chosen (Need at least 3)
-	items_in_view = LINES - 6;
-	if( items_in_view > maxItemIndex )
-		items_in_view = maxItemIndex;
-	// Get first index
 	currentItem = 0;
-	while( ShowItemAt(0, 0, 0, currentItem, 0) == -1 )
-		currentItem ++;
-	
-	
-	// Get dimensions
-	height = items_in_view + 3;
-	width = displayMinWidth;
-	
-	// Get positions
-	xBase = COLS/2 - width/2;
-	yBase = LINES/2 - height/2;
+	_Layout();
 	
 	for( ;; )
 	{
-		// Header
-		PrintAlign(yBase, xBase, width, "/", '-', titleString, '-', "\\");
+		if( bRedrawFrame )
+		{
+			erase();
+			// Header
+			PrintAlign(yBase, xBase, width, "/", '-', titleString, '-', "\\");
+			
+			// Footer
+			PrintAlign(yBase+height-2, xBase, width, "\\", '-', "", '-', "/");
+			
+			// User line
+			// - Username, balance, flags
+			PrintAlign(yBase+height-1, xBase+1, width-2,
+				username, ' ', balance_str, ' ', (gsUserFlags ? gsUserFlags : ""));
+			PrintAlign(yBase+height, xBase+1, width-2,
+				"q: Quit", ' ', "Arrows: Select", ' ', "Enter: Buy");
+			bRedrawFrame = 0;
+		}
 		
 		// Items
 		for( i = 0; i < items_in_view; i ++ )
 		{
+			tMenuRow	row;
 			 int	pos = 0;
 			
-			move( yBase + 1 + i, xBase );
-			printw("| ");
-			
-			pos += 2;
-			
 			// Check for the '...' row
 			// - Oh god, magic numbers!
 			if( (i == 0 && itemBase > 0)
 			 || (i == items_in_view - 1 && itemBase < maxItemIndex - items_in_view) )
-			{
-				printw("     ...");	pos += 8;
-				times = (width - pos) - 1;
-				while(times--)	addch(' ');
-			}
-			// Show an item
-			else {
-				ShowItemAt(
-					yBase + 1 + i, xBase + pos,	// Position
-					(width - pos) - 3,	// Width
-					itemBase + i,	// Index
-					!!(currentItem == itemBase + i)	// Hilighted
-					);
-				printw("  ");
-			}
+				row.Item = -1;
+			else
+				row.Item = itemBase + i;
+			row.bHilighted = (row.Item >= 0 && currentItem == row.Item);
 			
 			// Scrollbar (if needed)
 			if( maxItemIndex > items_in_view ) {
 				if( i == 0 ) {
-					addch('A');
+					row.Scrollbar = 'A';
 				}
 				else if( i == items_in_view - 1 ) {
-					addch('V');
+					row.Scrollbar = 'V';
 				}
 				else {
 					 int	percentage = itemBase * 100 / (maxItemIndex-items_in_view);
 					if( i-1 == percentage*(items_in_view-3)/100 ) {
-						addch('#');
+						row.Scrollbar = '#';
 					}
 					else {
-						addch('|');
+						row.Scrollbar = '|';
 					}
 				}
 			}
 			else {
-				addch('|');
+				row.Scrollbar = '|';
+			}
+			
+			// Skip rows that haven't changed
+			if( row.Item == rows[i].Item && row.bHilighted == rows[i].bHilighted
+			 && row.Scrollbar == rows[i].Scrollbar )
+				continue ;
+			rows[i] = row;
+			
+			move( yBase + 1 + i, xBase );
+			printw("| ");
+			
+			pos += 2;
+			
+			if( row.Item == -1 )
+			{
+				printw("     ...");	pos += 8;
+				times = (width - pos) - 1;
+				while(times--)	addch(' ');
+			}
+			// Show an item
+			else {
+				ShowItemAt(
+					yBase + 1 + i, xBase + pos,	// Position
+					(width - pos) - 3,	// Width
+					row.Item,	// Index
+					row.bHilighted	// Hilighted
+					);
+				printw("  ");
+			}
+			addch(row.Scrollbar);
+		}
+		// Leave the cursor at the end of the help line (where a full redraw would)
+		move(yBase + height, xBase + width - 1);
+
+		// Showing the cached list? Wait for either a key or the server
+		if( RevalidateSocket != -1 )
+		{
+			struct pollfd	fds[2] = {
+				{.fd = STDIN_FILENO, .events = POLLIN},
+				{.fd = RevalidateSocket, .events = POLLIN}
+				};
+			refresh();
+			if( poll(fds, 2, -1) > 0 && fds[1].revents )
+			{
+				_Revalidate();
+				_Layout();
+				continue ;
 			}
 		}
-		
-		// Footer
-		PrintAlign(yBase+height-2, xBase, width, "\\", '-', "", '-', "/");
-		
-		// User line
-		// - Username, balance, flags
-		PrintAlign(yBase+height-1, xBase+1, width-2,
-			username, ' ', balance_str, ' ', gsUserFlags);
-		PrintAlign(yBase+height, xBase+1, width-2,
-			"q: Quit", ' ', "Arrows: Select", ' ', "Enter: Buy");
-		
 		
 		// Get input
 		ch = getch();
@@ -222,6 +318,9 @@ int ShowNCursesUI(void)
 			case 'q':
 				ret = -1;	// -1: Return with no dispense
 				break;
+			case KEY_RESIZE:
+				_Layout();
+				break;
 			}
 			
 			// Check if the return value was changed
@@ -248,6 +347,29 @@ int ShowNCursesUI(void)
 	
 	// Leave
 	endwin();
+	free(rows);
+	
+	// Bought before the server replied? Find the item in the updated list
+	if( RevalidateSocket != -1 )
+	{
+		char	*type = (ret >= 0 ? strdup(gaItems[ret].Type) : NULL);
+		 int	id = (ret >= 0 ? gaItems[ret].ID : 0);
+		
+		_Revalidate();
+		if( type )
+		{
+			ret = -1;
+			for( i = 0; i < giNumItems; i ++ ) {
+				if( gaItems[i].ID == id && strcmp(gaItems[i].Type, type) == 0 ) {
+					ret = i;
+					break;
+				}
+			}
+			if( ret == -1 )
+				fprintf(stderr, "%s:%i is no longer available\n", type, id);
+			free(type);
+		}
+	}
 	return ret;
 }
 
@@ -316,8 +438,8 @@ int ShowItemAt(int Row, int Col, int Width, int Index, int bHilighted)
 	// Width = 0, don't print
 	if( Width > 0 )
 	{
-		// 4 preceding, 5 price
-		int nameWidth = Width - 4 - snprintf(NULL, 0, " %4i", price);
+		// 4 preceding, then the price column
+		int nameWidth = Width - 4 - 1 - giMenu_PriceWidth;
 		move( Row, Col );
 		
 		if( Index >= 0 )
@@ -330,7 +452,7 @@ int ShowItemAt(int Row, int Col, int Width, int Index, int bHilighted)
 					color_set( COLOURPAIR_SELECTED, NULL );
 					printw("->  ");
 				}
-				else if( price > giUserBalance ) {
+				else if( price > giUserBalance && !gbMenu_BalanceUnknown ) {
 					attrset(A_BOLD);
 					color_set( COLOURPAIR_CANTBUY, NULL );
 					printw("    ");
@@ -355,7 +477,7 @@ int ShowItemAt(int Row, int Col, int Width, int Index, int bHilighted)
 			
 			printw("%-*.*s", nameWidth, nameWidth, name);
 		
-			printw(" %4i", price);
+			printw(" %*i", giMenu_PriceWidth, price);
 			color_set(0, NULL);
 			attrset(A_NORMAL);
 		}
@@ -366,7 +488,7 @@ int ShowItemAt(int Row, int Col, int Width, int Index, int bHilighted)
 	}
 	
 	// If the item isn't availiable for sale, return -1 (so it's skipped)
-	if( status > 0 || (price > giUserBalance && gbDisallowSelectWithoutBalance) )
+	if( status > 0 || (price > giUserBalance && gbDisallowSelectWithoutBalance && !gbMenu_BalanceUnknown) )
 		Index = -2;
 	
 	return Index;
@@ -14,10 +14,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <netdb.h>	// gethostbyname
+#include <netdb.h>	// getaddrinfo
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>	// TCP_NODELAY
+#include <sys/un.h>	// Local server sockets
 #include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>	// clock_gettime
 //#include <openssl/sha.h>	// SHA1
 #include <pwd.h>	// getpwuids
 #include <unistd.h>	// close/getuid
@@ -26,61 +32,271 @@
 #include <ctype.h>	// isdigit
 #include "common.h"
 
+#define READER_BUFSIZE	8192	//!< Also the longest line that can be read
+#define CONNECT_STAGGER_MS	250	//!< Head start given to each address before the next is tried
+
+typedef struct sReader
+{
+	 int	Socket;
+	size_t	Start;	//!< First unread byte
+	size_t	End;	//!< End of received data
+	 int	bSkipLine;	//!< Discarding the rest of an over-long line
+	char	Data[READER_BUFSIZE];
+} tReader;
+
 // === PROTOTYPES ===
 char	*ReadLine(int Socket);
+char	*ReadLineView(int Socket);
+static void	_ResetReader(int Socket);
+static int	_StartConnect(const struct addrinfo *Addr);
+static void	_BindLowPort(int Socket, int Family);
+static long	_GetTimeMS(void);
+static char	*_NextField(char **Pos);
+static int	_ParseArrayHeader(char *Line, const char *Type, int *Count);
+static int	_ParseUserLine(char *Line, char **Username, int *Balance, char **Flags);
  int	sendf(int Socket, const char *Format, ...);
+ int	ReadItemInfo(int Socket, tItem *Dest);
+ int	ParseItemInfo(char *Line, tItem *Dest);
+static void	_RequestUserInfo(int Socket);
+static int	_ReadUserInfo(int Socket);
+static void	_RequestItemList(int Socket);
+static void	_ReadItemList(int Socket);
+static int	_ReadItemListChanges(int Socket);
+static int	_SkipToListEnd(int Socket);
+static unsigned int	_GetListGeneration(const char *Header);
+static int	_PrintItemInfo(int Socket);
+static void	Authenticate_Start(int Socket);
+static int	Authenticate_Finish(int Socket);
+
+// === GLOBALS ===
+ int	giServerSocket = -1;	//!< Connection used for the whole invocation
+ int	gbAutoAuthPending;	//!< AUTOAUTH sent, reply not yet read
+ int	gbItemListDeltaPending;	//!< ENUM_ITEMS request was for changes only
+tReader	gReader = {.Socket = -1};	//!< Buffered input from giServerSocket
 
 // ---------------------
 // --- Coke Protocol ---
 // ---------------------
-int OpenConnection(const char *Host, int Port)
+/**
+ * \brief Get the connection to the server
+ * 
+ * The connection is kept open between requests, and re-opened (and
+ * re-authenticated by the next Authenticate) if the server has closed it
+ * in the meantime (e.g. idle timeout while the menu is shown).
+ */
+int Dispense_GetConnection(void)
 {
-	struct hostent	*host;
-	struct sockaddr_in	serverAddr;
-	 int	sock;
-	
-	host = gethostbyname(Host);
-	if( !host ) {
-		fprintf(stderr, "Unable to look up '%s'\n", Host);
-		return -1;
+	if( giServerSocket != -1 )
+	{
+		struct pollfd	pfd = {.fd = giServerSocket, .events = POLLIN};
+		char	ch;
+		// Nothing should be waiting between requests, so readable == closed
+		if( poll(&pfd, 1, 0) == 0 )
+			return giServerSocket;
+		if( (pfd.revents & POLLIN) && recv(giServerSocket, &ch, 1, MSG_PEEK|MSG_DONTWAIT) > 0 )
+			return giServerSocket;
+		close(giServerSocket);
 	}
 	
-	memset(&serverAddr, 0, sizeof(serverAddr));
-	
-	serverAddr.sin_family = AF_INET;	// IPv4
-	// NOTE: I have a suspicion that IPv6 will play sillybuggers with this :)
-	serverAddr.sin_addr.s_addr = *((unsigned long *) host->h_addr_list[0]);
-	serverAddr.sin_port = htons(Port);
-	
-	sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if( sock < 0 ) {
-		fprintf(stderr, "Failed to create socket\n");
-		return -1;
+	{
+		const char	*prevServer = gsConnectedServer;
+		giServerSocket = OpenConnection(gasDispenseServers, giNumDispenseServers, giDispensePort);
+		// A generation only means something to the server that issued it
+		if( prevServer && gsConnectedServer && strcmp(prevServer, gsConnectedServer) != 0 ) {
+			giItemListGeneration = 0;
+			giItemCache_Generation = 0;
+		}
 	}
+	_ResetReader(giServerSocket);
+	return giServerSocket;
+}
+
+void Dispense_CloseConnection(void)
+{
+	if( giServerSocket == -1 )	return ;
+	close(giServerSocket);
+	giServerSocket = -1;
+	gbIsAuthenticated = 0;
+	_ResetReader(-1);
+}
 
-	if( geteuid() == 0 || getuid() == 0 )
+/**
+ * \brief Connect to whichever of the servers answers first
+ * \param Hosts	Server names/addresses, in order of preference
+ *
+ * Every address of every server is tried, each attempt getting a
+ * CONNECT_STAGGER_MS head start on the next (or less, if it fails), and the
+ * first connection to complete is used. A dead server or unreachable address
+ * family then costs the stagger delay instead of a TCP timeout.
+ * The name of the server that answered is left in gsConnectedServer.
+ */
+int OpenConnection(const char * const *Hosts, int NumHosts, int Port)
+{
+	struct addrinfo	hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo	*lists[NumHosts];
+	struct addrinfo	localAddrs[NumHosts];	// Servers given as a socket path
+	struct sockaddr_un	localPaths[NumHosts];
+	const struct addrinfo	**addrs = NULL;
+	 int	*addrHost = NULL;	// Index into Hosts of each addrs entry
+	 int	nAddrs = 0;
+	char	portStr[8];
+	 int	sock = -1;
+	
+	// Resolve everything up front
+	snprintf(portStr, sizeof(portStr), "%i", Port);
+	for( int i = 0; i < NumHosts; i ++ )
 	{
-		 int	i;
-		struct sockaddr_in	localAddr;
-		memset(&localAddr, 0, sizeof(localAddr));
-		localAddr.sin_family = AF_INET;	// IPv4
+		struct addrinfo	*ai;
+		 int	rv, nFirst = 0, nOther = 0;
 		
-		// Loop through all the top ports until one is avaliable
-		for( i = 512; i < 1024; i ++)
+		// A path is the server's local socket, there's nothing to look up
+		if( Hosts[i][0] == '/' )
 		{
-			localAddr.sin_port = htons(i);	// IPv4
-			// Attempt to bind to low port for autoauth
-			if( bind(sock, (struct sockaddr*)&localAddr, sizeof(localAddr)) == 0 )
+			lists[i] = NULL;
+			if( strlen(Hosts[i]) >= sizeof(localPaths[i].sun_path) ) {
+				fprintf(stderr, "Socket path '%s' is too long\n", Hosts[i]);
+				continue ;
+			}
+			localPaths[i].sun_family = AF_UNIX;
+			strcpy(localPaths[i].sun_path, Hosts[i]);
+			memset(&localAddrs[i], 0, sizeof(localAddrs[i]));
+			localAddrs[i].ai_family = AF_UNIX;
+			localAddrs[i].ai_socktype = SOCK_STREAM;
+			localAddrs[i].ai_addr = (struct sockaddr*)&localPaths[i];
+			localAddrs[i].ai_addrlen = sizeof(localPaths[i]);
+			addrs = realloc(addrs, (nAddrs + 1) * sizeof(*addrs));
+			addrHost = realloc(addrHost, (nAddrs + 1) * sizeof(*addrHost));
+			addrHost[nAddrs] = i;
+			addrs[nAddrs++] = &localAddrs[i];
+			continue ;
+		}
+		
+		rv = getaddrinfo(Hosts[i], portStr, &hints, &lists[i]);
+		if( rv ) {
+			fprintf(stderr, "Unable to look up '%s': %s\n", Hosts[i], gai_strerror(rv));
+			lists[i] = NULL;
+			continue ;
+		}
+		for( ai = lists[i]; ai; ai = ai->ai_next ) {
+			if( ai->ai_family == lists[i]->ai_family )
+				nFirst ++;
+			else
+				nOther ++;
+		}
+		addrs = realloc(addrs, (nAddrs + nFirst + nOther) * sizeof(*addrs));
+		addrHost = realloc(addrHost, (nAddrs + nFirst + nOther) * sizeof(*addrHost));
+		for( int j = 0; j < nFirst + nOther; j ++ )
+			addrHost[nAddrs + j] = i;
+		
+		// Alternate address families, so a broken IPv6 route doesn't hold up IPv4
+		{
+			const struct addrinfo	*first[nFirst], *other[nOther ? nOther : 1];
+			 int	f = 0, o = 0;
+			for( ai = lists[i]; ai; ai = ai->ai_next ) {
+				if( ai->ai_family == lists[i]->ai_family )
+					first[f++] = ai;
+				else
+					other[o++] = ai;
+			}
+			for( f = 0, o = 0; f < nFirst || o < nOther; ) {
+				if( f < nFirst )	addrs[nAddrs++] = first[f++];
+				if( o < nOther )	addrs[nAddrs++] = other[o++];
+			}
+		}
+	}
+	
+	// Race the connections
+	{
+		struct pollfd	fds[nAddrs ? nAddrs : 1];
+		 int	fdHost[nAddrs ? nAddrs : 1];
+		 int	nFds = 0, next = 0;
+		long	now = _GetTimeMS();
+		long	deadline = now + giDispenseConnectTimeout * 1000;
+		long	nextStart = now;
+		
+		while( sock == -1 )
+		{
+			now = _GetTimeMS();
+			
+			// Start the next attempt
+			if( next < nAddrs && now >= nextStart )
+			{
+				 int	fd = _StartConnect(addrs[next]);
+				if( fd >= 0 ) {
+					fdHost[nFds] = addrHost[next];
+					fds[nFds].fd = fd;
+					fds[nFds].events = POLLOUT;
+					nFds ++;
+					nextStart = now + CONNECT_STAGGER_MS;
+				}
+				next ++;
+				continue ;
+			}
+			if( nFds == 0 && next == nAddrs )
+				break;	// All failed
+			if( now >= deadline ) {
+				fprintf(stderr, "Timed out connecting to server\n");
 				break;
+			}
+			
+			// Wait for one to finish, or for the next one to be due
+			{
+				long	wait = deadline;
+				if( next < nAddrs && nextStart < wait )
+					wait = nextStart;
+				if( poll(fds, nFds, wait - now) < 0 && errno != EINTR )
+					break;
+			}
+			
+			for( int i = 0; i < nFds; i ++ )
+			{
+				 int	err = 0;
+				socklen_t	len = sizeof(err);
+				if( !fds[i].revents )	continue ;
+				
+				getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if( err == 0 ) {
+					sock = fds[i].fd;
+					gsConnectedServer = Hosts[fdHost[i]];
+				}
+				else {
+					close(fds[i].fd);
+					// Don't wait out the head start of a failed attempt
+					nextStart = _GetTimeMS();
+				}
+				nFds --;
+				fds[i] = fds[nFds];
+				fdHost[i] = fdHost[nFds];
+				i --;
+				if( sock != -1 )	break;
+			}
 		}
-		if( i == 1024 )
-			printf("Warning: AUTOAUTH unavaliable\n");
+		
+		// Drop the losers
+		for( int i = 0; i < nFds; i ++ )
+			close(fds[i].fd);
+	}
+	
+	free(addrs);
+	free(addrHost);
+	for( int i = 0; i < NumHosts; i ++ ) {
+		if( lists[i] )	freeaddrinfo(lists[i]);
 	}
 	
-	if( connect(sock, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) < 0 ) {
+	if( sock == -1 ) {
 		fprintf(stderr, "Failed to connect to server\n");
 		return -1;
 	}
+	
+	// Back to blocking for the rest of the protocol
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+	
+	// Requests are pipelined, don't hold the second one back waiting for an ACK
+	// (fails harmlessly on a local socket)
+	{
+		 int	one = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
 
 	// We're not authenticated if the connection has just opened
 	gbIsAuthenticated = 0;
@@ -88,15 +304,73 @@ int OpenConnection(const char *Host, int Port)
 	return sock;
 }
 
+/**
+ * \brief Start a non-blocking connect to an address
+ * \return Socket, or -1 if it failed straight away
+ */
+int _StartConnect(const struct addrinfo *Addr)
+{
+	 int	sock;
+	
+	sock = socket(Addr->ai_family, Addr->ai_socktype, Addr->ai_protocol);
+	if( sock < 0 )
+		return -1;
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	
+	if( Addr->ai_family != AF_UNIX && (geteuid() == 0 || getuid() == 0) )
+		_BindLowPort(sock, Addr->ai_family);
+	
+	if( connect(sock, Addr->ai_addr, Addr->ai_addrlen) < 0 && errno != EINPROGRESS ) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/**
+ * \brief Bind to a privileged port, so the server will accept AUTOAUTH
+ */
+void _BindLowPort(int Socket, int Family)
+{
+	struct sockaddr_storage	localAddr;
+	socklen_t	len;
+	 int	i;
+	
+	memset(&localAddr, 0, sizeof(localAddr));
+	localAddr.ss_family = Family;
+	len = (Family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	
+	// Loop through all the top ports until one is avaliable
+	for( i = 512; i < 1024; i ++)
+	{
+		if( Family == AF_INET6 )
+			((struct sockaddr_in6*)&localAddr)->sin6_port = htons(i);
+		else
+			((struct sockaddr_in*)&localAddr)->sin_port = htons(i);
+		// Attempt to bind to low port for autoauth
+		if( bind(Socket, (struct sockaddr*)&localAddr, len) == 0 )
+			break;
+	}
+	if( i == 1024 )
+		printf("Warning: AUTOAUTH unavaliable\n");
+}
+
+long _GetTimeMS(void)
+{
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Read the reply to an AUTOAUTH (sent by Authenticate_Start)
+ */
 int Authenticate_AutoAuth(int Socket, const char *Username)
 {
 	char	*buf;
 	 int	responseCode;
 	 int	ret = -1;
 	
-	// Attempt automatic authentication
-	sendf(Socket, "AUTOAUTH %s\n", Username);
-	
 	// Check if it worked
 	buf = ReadLine(Socket);
 	
@@ -248,6 +522,29 @@ int Authenticate_Password(int Socket, const char *Username)
  * \return Boolean Failure
  */
 int Authenticate(int Socket)
+{
+	Authenticate_Start(Socket);
+	return Authenticate_Finish(Socket);
+}
+
+/**
+ * \brief Send the AUTOAUTH request (so it can share a round trip with other requests)
+ */
+void Authenticate_Start(int Socket)
+{
+	struct passwd	*pwd;
+	
+	if( gbIsAuthenticated || gbAutoAuthPending )	return ;
+	
+	pwd = getpwuid( getuid() );
+	sendf(Socket, "AUTOAUTH %s\n", pwd->pw_name);
+	gbAutoAuthPending = 1;
+}
+
+/**
+ * \brief Complete authentication started by Authenticate_Start
+ */
+int Authenticate_Finish(int Socket)
 {
 	struct passwd	*pwd;
 	
@@ -257,6 +554,9 @@ int Authenticate(int Socket)
 	pwd = getpwuid( getuid() );
 
 	// Attempt AUTOAUTH
+	if( !gbAutoAuthPending )
+		Authenticate_Start(Socket);
+	gbAutoAuthPending = 0;
 	if( Authenticate_AutoAuth(Socket, pwd->pw_name) == 0 )
 		;
 	else if( Authenticate_AuthIdent(Socket) == 0 )
@@ -306,10 +606,46 @@ int Authenticate(int Socket)
 
 int GetUserBalance(int Socket)
 {
-	regmatch_t	matches[6];
+	_RequestUserInfo(Socket);
+	return _ReadUserInfo(Socket);
+}
+
+/**
+ * \brief Get the user's balance and the item list, in one round trip
+ * \return Boolean Failure (of getting the balance)
+ */
+int Dispense_GetUserAndItems(int Socket)
+{
+	Dispense_RequestUserAndItems(Socket);
+	return Dispense_ReadUserAndItems(Socket);
+}
+
+/**
+ * \brief Send the requests for Dispense_GetUserAndItems
+ * \note Dispense_ReadUserAndItems must be called before anything else is sent
+ */
+void Dispense_RequestUserAndItems(int Socket)
+{
+	_RequestUserInfo(Socket);
+	_RequestItemList(Socket);
+}
+
+/**
+ * \brief Read the replies to Dispense_RequestUserAndItems
+ * \return Boolean Failure (of getting the balance)
+ */
+int Dispense_ReadUserAndItems(int Socket)
+{
+	 int	ret;
+	
+	ret = _ReadUserInfo(Socket);
+	_ReadItemList(Socket);
+	return ret;
+}
+
+void _RequestUserInfo(int Socket)
+{
 	struct passwd	*pwd;
-	char	*buf;
-	 int	responseCode;
 	
 	if( !gsUserName )
 	{
@@ -323,7 +659,14 @@ int GetUserBalance(int Socket)
 	}
 	
 	sendf(Socket, "USER_INFO %s\n", gsUserName);
-	buf = ReadLine(Socket);
+}
+
+int _ReadUserInfo(int Socket)
+{
+	char	*buf, *username, *flags;
+	 int	responseCode;
+	
+	buf = ReadLineView(Socket);
 	responseCode = atoi(buf);
 	switch(responseCode)
 	{
@@ -331,22 +674,19 @@ int GetUserBalance(int Socket)
 	
 	case 404:
 		printf("Invalid user? (USER_INFO failed)\n");
-		free(buf);
 		return RV_INVALID_USER;
 	
 	default:
 		fprintf(stderr, "Unkown response code %i from server\n", responseCode);
 		printf("%s\n", buf);
-		free(buf);
 		return RV_UNKNOWN_ERROR;
 	}
 
-	RunRegex(&gUserInfoRegex, buf, 6, matches, "Malformed server response");
-	
-	giUserBalance = atoi( buf + matches[4].rm_so );
-	gsUserFlags = strdup( buf + matches[5].rm_so );
-	
-	free(buf);
+	if( _ParseUserLine(buf, &username, &giUserBalance, &flags) ) {
+		fprintf(stderr, "Malformed server response\n");
+		return RV_UNKNOWN_ERROR;
+	}
+	gsUserFlags = strdup( flags );
 	
 	return 0;
 }
@@ -357,15 +697,20 @@ int GetUserBalance(int Socket)
  */
 int ReadItemInfo(int Socket, tItem *Dest)
 {
-	char	*buf;
+	return ParseItemInfo( ReadLineView(Socket), Dest );
+}
+
+/**
+ * \brief Parse a "202 Item <type>:<id> <status> <price> <desc>" line
+ * \param Line	Line read from the server (modified in place)
+ */
+int ParseItemInfo(char *Line, tItem *Dest)
+{
+	char	*pos = Line, *field, *end;
+	char	*type, *statusStr, *desc;
 	 int	responseCode;
 	
-	regmatch_t	matches[8];
-	char	*statusStr;
-	
-	// Get item info
-	buf = ReadLine(Socket);
-	responseCode = atoi(buf);
+	responseCode = atoi(Line);
 	
 	switch(responseCode)
 	{
@@ -373,25 +718,27 @@ int ReadItemInfo(int Socket, tItem *Dest)
 	
 	case 406:
 		printf("Bad item name\n");
-		free(buf);
 		return RV_BAD_ITEM;
 	
 	default:
-		fprintf(stderr, "Unknown response from dispense server (Response Code %i)\n%s", responseCode, buf);
-		free(buf);
+		fprintf(stderr, "Unknown response from dispense server (Response Code %i)\n%s\n", responseCode, Line);
 		return RV_UNKNOWN_ERROR;
 	}
 	
-	RunRegex(&gItemRegex, buf, 8, matches, "Malformed server response");
-	
-	buf[ matches[3].rm_eo ] = '\0';
-	buf[ matches[5].rm_eo ] = '\0';
-	buf[ matches[7].rm_eo ] = '\0';
+	_NextField(&pos);	// "202"
+	if( !(field = _NextField(&pos)) || strcmp(field, "Item") != 0 )
+		goto _malformed;
 	
-	statusStr = &buf[ matches[5].rm_so ];
-	
-	Dest->ID = atoi( buf + matches[4].rm_so );
+	// <type>:<id>
+	if( !(type = _NextField(&pos)) || !(field = strchr(type, ':')) )
+		goto _malformed;
+	*field++ = '\0';
+	Dest->ID = strtol(field, &end, 10);
+	if( end == field || *end != '\0' )
+		goto _malformed;
 	
+	if( !(statusStr = _NextField(&pos)) )
+		goto _malformed;
 	if( strcmp(statusStr, "avail") == 0 )
 		Dest->Status = 0;
 	else if( strcmp(statusStr, "sold") == 0 )
@@ -403,20 +750,26 @@ int ReadItemInfo(int Socket, tItem *Dest)
 			statusStr);
 		return RV_UNKNOWN_ERROR;
 	}
-	Dest->Price = atoi( buf + matches[6].rm_so );
 	
-	// Hack a little to reduce heap fragmentation
-	{
-		char	tmpType[strlen(buf + matches[3].rm_so) + 1];
-		char	tmpDesc[strlen(buf + matches[7].rm_so) + 1];
-		strcpy(tmpType, buf + matches[3].rm_so);
-		strcpy(tmpDesc, buf + matches[7].rm_so);
-		free(buf);
-		Dest->Type = strdup( tmpType );
-		Dest->Desc = strdup( tmpDesc );
-	}
+	if( !(field = _NextField(&pos)) )
+		goto _malformed;
+	Dest->Price = strtol(field, &end, 10);
+	if( *end != '\0' )
+		goto _malformed;
+	
+	// Description is the rest of the line
+	for( desc = pos; *desc == ' ' || *desc == '\t'; desc ++ )
+		;
+	if( *desc == '\0' )
+		goto _malformed;
+	
+	Dest->Type = strdup( type );
+	Dest->Desc = strdup( desc );
 	
 	return 0;
+_malformed:
+	fprintf(stderr, "Malformed server response\n");
+	return RV_UNKNOWN_ERROR;
 }
 
 /**
@@ -424,17 +777,47 @@ int ReadItemInfo(int Socket, tItem *Dest)
  * \return Boolean Failure
  */
 void PopulateItemList(int Socket)
+{
+	_RequestItemList(Socket);
+	_ReadItemList(Socket);
+}
+
+void _RequestItemList(int Socket)
+{
+	// Already have a list? Just get what has changed
+	gbItemListDeltaPending = (gaItems && giItemListGeneration);
+	if( gbItemListDeltaPending )
+		sendf(Socket, "ENUM_ITEMS since:%u\n", giItemListGeneration);
+	else
+		sendf(Socket, "ENUM_ITEMS\n");
+}
+
+void _ReadItemList(int Socket)
 {
 	char	*buf;
 	 int	responseCode;
-	
-	char	*arrayType;
 	 int	count, i;
-	regmatch_t	matches[4];
 	
-	// Ask server for stock list
-	send(Socket, "ENUM_ITEMS\n", 11, 0);
-	buf = ReadLine(Socket);
+	if( gbItemListDeltaPending )
+	{
+		gbItemListDeltaPending = 0;
+		if( _ReadItemListChanges(Socket) == 0 ) {
+			ItemCache_Save();
+			return ;
+		}
+		for( i = 0; i < giNumItems; i ++ ) {
+			free(gaItems[i].Type);
+			free(gaItems[i].Desc);
+		}
+		free(gaItems);
+		gaItems = NULL;
+		giNumItems = 0;
+		
+		// Fetch the whole list
+		sendf(Socket, "ENUM_ITEMS\n");
+	}
+	
+	buf = ReadLineView(Socket);
 	
 	//printf("Output: %s\n", buf);
 	
@@ -447,21 +830,13 @@ void PopulateItemList(int Socket)
 	// - Get item list -
 	
 	// Expected format:
-	//  201 Items <count>
+	//  201 Items <count> gen:<generation>
 	//  202 Item <count>
-	RunRegex(&gArrayRegex, buf, 4, matches, "Malformed server response");
-		
-	arrayType = &buf[ matches[2].rm_so ];	buf[ matches[2].rm_eo ] = '\0';
-	count = atoi( &buf[ matches[3].rm_so ] );
-		
-	// Check array type
-	if( strcmp(arrayType, "Items") != 0 ) {
-		// What the?!
-		fprintf(stderr, "Unexpected array type, expected 'Items', got '%s'\n",
-			arrayType);
+	giItemListGeneration = _GetListGeneration(buf);
+	if( _ParseArrayHeader(buf, "Items", &count) ) {
+		fprintf(stderr, "Malformed server response\n");
 		exit(RV_UNKNOWN_ERROR);
 	}
-	free(buf);
 	
 	giNumItems = count;
 	gaItems = malloc( giNumItems * sizeof(tItem) );
@@ -473,7 +848,7 @@ void PopulateItemList(int Socket)
 	}
 	
 	// Read end of list
-	buf = ReadLine(Socket);
+	buf = ReadLineView(Socket);
 	responseCode = atoi(buf);
 		
 	if( responseCode != 200 ) {
@@ -483,22 +858,151 @@ void PopulateItemList(int Socket)
 		exit(-1);
 	}
 	
-	free(buf);
+	ItemCache_Save();
 }
 
 
+/**
+ * \brief Apply the changes since the last fetch to the item list
+ * \return Boolean Failure (the full list needs to be fetched)
+ */
+int _ReadItemListChanges(int Socket)
+{
+	char	*buf;
+	 int	count;
+	unsigned int	generation;
+	
+	buf = ReadLineView(Socket);
+	// 410: The server no longer knows what changed
+	if( atoi(buf) != 201 )
+		return 1;
+	generation = _GetListGeneration(buf);
+	if( _ParseArrayHeader(buf, "Items", &count) )
+		return _SkipToListEnd(Socket);
+	
+	for( int i = 0; i < count; i ++ )
+	{
+		tItem	item;
+		 int	idx, last = -1;
+		
+		buf = ReadLineView(Socket);
+		
+		// Removed item ("203 Removed <type>:<id>")
+		if( atoi(buf) == 203 )
+		{
+			char	*ident = buf + sizeof("203 Removed ") - 1;
+			char	*colon = strchr(ident, ':');
+			if( colon ) {
+				*colon = '\0';
+				for( idx = 0; idx < giNumItems; idx ++ ) {
+					if( strcmp(gaItems[idx].Type, ident) == 0 && gaItems[idx].ID == atoi(colon+1) )
+						break;
+				}
+				if( idx < giNumItems ) {
+					free(gaItems[idx].Type);
+					free(gaItems[idx].Desc);
+					giNumItems --;
+					memmove(&gaItems[idx], &gaItems[idx+1], (giNumItems - idx) * sizeof(tItem));
+				}
+			}
+			continue ;
+		}
+		
+		// (A short list ends early, with the "200" line already read)
+		if( ParseItemInfo(buf, &item) )
+			return (atoi(buf) == 202 ? _SkipToListEnd(Socket) : 1);
+		
+		// Replace the existing entry, or add after the last item of the same type
+		for( idx = 0; idx < giNumItems; idx ++ )
+		{
+			if( strcmp(gaItems[idx].Type, item.Type) != 0 )	continue;
+			last = idx;
+			if( gaItems[idx].ID == item.ID )	break;
+		}
+		if( idx < giNumItems ) {
+			free(gaItems[idx].Type);
+			free(gaItems[idx].Desc);
+			gaItems[idx] = item;
+			continue ;
+		}
+		idx = (last == -1 ? giNumItems : last + 1);
+		gaItems = realloc(gaItems, (giNumItems + 1) * sizeof(tItem));
+		memmove(&gaItems[idx+1], &gaItems[idx], (giNumItems - idx) * sizeof(tItem));
+		gaItems[idx] = item;
+		giNumItems ++;
+	}
+	
+	// Read end of list
+	buf = ReadLineView(Socket);
+	if( atoi(buf) != 200 ) {
+		fprintf(stderr, "Unknown response from dispense server\n'%s'", buf);
+		// More items than the header said, the rest are still to come
+		if( atoi(buf) == 202 || atoi(buf) == 203 )
+			return _SkipToListEnd(Socket);
+		return 1;
+	}
+	
+	giItemListGeneration = generation;
+	return 0;
+}
+
+/**
+ * \brief Discard the rest of an item list response (up to the "200" line)
+ * \return 1, so it can be returned as _ReadItemListChanges' failure
+ */
+int _SkipToListEnd(int Socket)
+{
+	 int	code;
+	do {
+		code = atoi( ReadLineView(Socket) );
+	} while( code == 202 || code == 203 );
+	return 1;
+}
+
+/**
+ * \brief Get the generation from a "201 Items <count> gen:<generation>" line
+ * \return Generation, or 0 if the server didn't send one
+ */
+unsigned int _GetListGeneration(const char *Header)
+{
+	const char	*gen = strstr(Header, " gen:");
+	if( !gen )	return 0;
+	return strtoul(gen + 5, NULL, 10);
+}
+
 /**
  * \brief Get information on an item
  * \return Boolean Failure
  */
 int Dispense_ItemInfo(int Socket, const char *Type, int ID)
 {
-	tItem	item;
-	 int	ret;
-	
 	// Query
 	sendf(Socket, "ITEM_INFO %s:%i\n", Type, ID);
 	
+	return _PrintItemInfo(Socket);
+}
+
+/**
+ * \brief Show an item's information and authenticate, in one round trip
+ * \return Boolean Failure
+ */
+int Dispense_ItemInfoAuth(int Socket, const char *Type, int ID)
+{
+	 int	ret, authret;
+	
+	sendf(Socket, "ITEM_INFO %s:%i\n", Type, ID);
+	Authenticate_Start(Socket);
+	
+	ret = _PrintItemInfo(Socket);
+	authret = Authenticate_Finish(Socket);
+	return (ret ? ret : authret);
+}
+
+int _PrintItemInfo(int Socket)
+{
+	tItem	item;
+	 int	ret;
+	
 	ret = ReadItemInfo(Socket, &item);
 	if(ret)	return ret;
 	
@@ -916,7 +1420,6 @@ int Dispense_EnumUsers(int Socket)
 	char	*buf;
 	 int	responseCode;
 	 int	nUsers;
-	regmatch_t	matches[4];
 	
 	if( giMinimumBalance != INT_MIN ) {
 		if( giMaximumBalance != INT_MAX ) {
@@ -934,7 +1437,7 @@ int Dispense_EnumUsers(int Socket)
 			sendf(Socket, "ENUM_USERS\n");
 		}
 	}
-	buf = ReadLine(Socket);
+	buf = ReadLineView(Socket);
 	responseCode = atoi(buf);
 	
 	switch(responseCode)
@@ -943,38 +1446,32 @@ int Dispense_EnumUsers(int Socket)
 	
 	default:
 		fprintf(stderr, "Unknown response code %i\n%s\n", responseCode, buf);
-		free(buf);
 		return -1;
 	}
 	
 	// Get count (not actually used)
-	RunRegex(&gArrayRegex, buf, 4, matches, "Malformed server response");
-	nUsers = atoi( buf + matches[3].rm_so );
+	if( _ParseArrayHeader(buf, "Users", &nUsers) ) {
+		fprintf(stderr, "Malformed server response\n");
+		return -1;
+	}
 	printf("%i users returned\n", nUsers);
 	
-	// Free string
-	free(buf);
-	
 	// Read returned users
 	do {
-		buf = ReadLine(Socket);
+		buf = ReadLineView(Socket);
 		responseCode = atoi(buf);
 		
 		if( responseCode != 202 )	break;
 		
 		_PrintUserLine(buf);
-		free(buf);
 	} while(responseCode == 202);
 	
 	// Check final response
 	if( responseCode != 200 ) {
 		fprintf(stderr, "Unknown response code %i\n%s\n", responseCode, buf);
-		free(buf);
 		return -1;
 	}
 	
-	free(buf);
-	
 	return 0;
 }
 
@@ -984,7 +1481,7 @@ int Dispense_ShowUser(int Socket, const char *Username)
 	 int	responseCode, ret;
 	
 	sendf(Socket, "USER_INFO %s\n", Username);
-	buf = ReadLine(Socket);
+	buf = ReadLineView(Socket);
 	
 	responseCode = atoi(buf);
 	
@@ -1006,34 +1503,23 @@ int Dispense_ShowUser(int Socket, const char *Username)
 		break;
 	}
 	
-	free(buf);
-	
 	return ret;
 }
 
-void _PrintUserLine(const char *Line)
+/**
+ * \brief Print a "202 User ..." line
+ * \param Line	Line from the server (modified in place)
+ */
+void _PrintUserLine(char *Line)
 {
-	regmatch_t	matches[6];
+	char	*username, *flags;
 	 int	bal;
 	
-	RunRegex(&gUserInfoRegex, Line, 6, matches, "Malformed server response");
-	// 3: Username
-	// 4: Balance
-	// 5: Flags
-	{
-		 int	usernameLen = matches[3].rm_eo - matches[3].rm_so;
-		char	username[usernameLen + 1];
-		 int	flagsLen = matches[5].rm_eo - matches[5].rm_so;
-		char	flags[flagsLen + 1];
-		
-		memcpy(username, Line + matches[3].rm_so, usernameLen);
-		username[usernameLen] = '\0';
-		memcpy(flags, Line + matches[5].rm_so, flagsLen);
-		flags[flagsLen] = '\0';
-		
-		bal = atoi(Line + matches[4].rm_so);
-		printf("%-15s: $%8.02f (%s)\n", username, ((float)bal)/100, flags);
+	if( _ParseUserLine(Line, &username, &bal, &flags) ) {
+		fprintf(stderr, "Malformed server response\n'%s'\n", Line);
+		return ;
 	}
+	printf("%-15s: $%8.02f (%s)\n", username, ((float)bal)/100, flags);
 }
 
 int Dispense_AddUser(int Socket, const char *Username)
@@ -1178,74 +1664,161 @@ int Dispense_SetItem(int Socket, const char *Type, int ID, int NewPrice, const c
 // ===
 // Helpers
 // ===
-/// Read from the input socket until a newline is seen
+/**
+ * \brief Read a line from the server, on the heap
+ * \note Use ReadLineView where the line doesn't need to be kept
+ */
 char *ReadLine(int Socket)
 {
-	static char	buf[BUFSIZ];
-	static int	bufValid = 0;
-	 int	len = 0;
-	char	*newline = NULL;
-	 int	retLen = 0;
-	char	*ret = malloc(32);
+	return strdup( ReadLineView(Socket) );
+}
+
+/**
+ * \brief Read from the input socket until a newline is seen
+ * \return Line (without the newline), valid until the next read
+ *
+ * The line is left in the connection's input buffer, so reading a long
+ * listing doesn't allocate at all. Callers may modify the line in place.
+ */
+char *ReadLineView(int Socket)
+{
+	tReader	*r = &gReader;
+	char	*line, *newline;
+	size_t	scanned = 0;
 	
 	#if DEBUG_TRACE_SERVER
 	printf("ReadLine: ");
 	fflush(stdout);
 	#endif
 	
-	ret[0] = '\0';
+	if( r->Socket != Socket )
+		_ResetReader(Socket);
 	
-	// While a newline hasn't been seen
-	while( !newline )
+	while( !(newline = memchr(r->Data + r->Start + scanned, '\n', r->End - r->Start - scanned)) )
 	{
-		assert(bufValid < BUFSIZ);
-		// If there is data left over from a previous call, use the data from that for the first pass
-		if( bufValid ) {
-			len = bufValid;
-			bufValid = 0;
+		 int	len;
+		
+		scanned = r->End - r->Start;
+		if( r->bSkipLine ) {
+			r->Start = r->End = scanned = 0;
 		}
-		else {
-			// Otherwise read some data
-			len = recv(Socket, buf, BUFSIZ, 0);
-			if( len <= 0 ) {
-				free(ret);
-				return strdup("599 Client Connection Error\n");
+		// Out of space, move the partial line to the start of the buffer
+		else if( r->End == sizeof(r->Data) )
+		{
+			if( r->Start == 0 ) {
+				fprintf(stderr, "Line from server too long (>%i bytes)\n", READER_BUFSIZE);
+				r->Start = r->End = 0;
+				r->bSkipLine = 1;
+				strcpy(r->Data, "599 Client Connection Error");
+				return r->Data;
 			}
+			memmove(r->Data, r->Data + r->Start, scanned);
+			r->Start = 0;
+			r->End = scanned;
 		}
-		assert(len < BUFSIZ);
-		buf[len] = '\0';
 		
-		// Search for newline in buffer
-		newline = strchr( buf, '\n' );
-		if( newline ) {
-			*newline = '\0';
+		len = recv(Socket, r->Data + r->End, sizeof(r->Data) - r->End, 0);
+		if( len <= 0 ) {
+			_ResetReader(Socket);
+			strcpy(r->Data, "599 Client Connection Error");
+			return r->Data;
 		}
-		
-		// Increment return length by amount of data up to newline (or end of read)
-		retLen += strlen(buf);
-		ret = realloc(ret, retLen + 1);
-		assert(ret);	// evil NULL check
-		strcat( ret, buf );	// append buffer data
+		r->End += len;
+	}
+	
+	line = r->Data + r->Start;
+	*newline = '\0';
+	r->Start = newline + 1 - r->Data;
+	if( r->Start == r->End )
+		r->Start = r->End = 0;
+	
+	// Finish discarding an over-long line
+	if( r->bSkipLine ) {
+		r->bSkipLine = 0;
+		return ReadLineView(Socket);
 	}
 	
 	#if DEBUG_TRACE_SERVER
-	printf("%i '%s'\n", retLen, ret);
+	printf("%i '%s'\n", (int)(newline - line), line);
 	#endif
+	
+	return line;
+}
 
-	// If the newline wasn't the last character in the buffer. (I.e. there's extra data for the next call)
-	assert(newline - buf + 1 <= len);
-	if( newline - buf + 1 < len ) {
-		int extra_bytes = len - (newline - buf + 1);
-		// Copy `extra_bytes` from end of buffer down to start and set `bufValid` to `extra_bytes`?
-		memmove(&buf[0], newline + 1, extra_bytes);
-		bufValid = extra_bytes;
-		
-		#if DEBUG_TRACE_SERVER > 1
-		printf("- Caching %i bytes '%.*s'\n", bufValid, bufValid, buf);
-		#endif
+void _ResetReader(int Socket)
+{
+	gReader.Socket = Socket;
+	gReader.Start = 0;
+	gReader.End = 0;
+	gReader.bSkipLine = 0;
+}
+
+/**
+ * \brief Split the next space separated field off a response line
+ * \param Pos	Current position in the line, updated to after the field
+ * \return Field (NUL terminated in place), or NULL at the end of the line
+ */
+char *_NextField(char **Pos)
+{
+	char	*start = *Pos, *end;
+	
+	while( *start == ' ' || *start == '\t' )	start ++;
+	if( *start == '\0' )	return NULL;
+	
+	for( end = start; *end && *end != ' ' && *end != '\t'; end ++ )
+		;
+	if( *end )
+		*end++ = '\0';
+	*Pos = end;
+	return start;
+}
+
+/**
+ * \brief Parse a "201 <Type> <count> ..." array header
+ * \return Boolean Failure
+ */
+int _ParseArrayHeader(char *Line, const char *Type, int *Count)
+{
+	char	*pos = Line, *field, *end;
+	
+	if( !(field = _NextField(&pos)) || strcmp(field, "201") != 0 )
+		return 1;
+	if( !(field = _NextField(&pos)) || strcmp(field, Type) != 0 ) {
+		fprintf(stderr, "Unexpected array type, expected '%s', got '%s'\n", Type, field ? field : "");
+		return 1;
 	}
+	if( !(field = _NextField(&pos)) )
+		return 1;
+	*Count = strtol(field, &end, 10);
+	return (*end != '\0' || *Count < 0);
+}
+
+/**
+ * \brief Parse a "202 User <username> <balance> <flags>" line
+ * \note Username and Flags point into Line
+ * \return Boolean Failure
+ */
+int _ParseUserLine(char *Line, char **Username, int *Balance, char **Flags)
+{
+	char	*pos = Line, *field, *end;
 	
-	return ret;
+	if( !(field = _NextField(&pos)) || strcmp(field, "202") != 0 )
+		return 1;
+	if( !(field = _NextField(&pos)) || strcmp(field, "User") != 0 )
+		return 1;
+	if( !(*Username = _NextField(&pos)) )
+		return 1;
+	if( !(field = _NextField(&pos)) )
+		return 1;
+	*Balance = strtol(field, &end, 10);
+	if( *end != '\0' )
+		return 1;
+	// Flags are the rest of the line
+	while( *pos == ' ' || *pos == '\t' )	pos ++;
+	if( *pos == '\0' )
+		return 1;
+	*Flags = pos;
+	return 0;
 }
 
 int sendf(int Socket, const char *Format, ...)
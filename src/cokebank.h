@@ -15,6 +15,7 @@
 #define _COKEBANK_H_
 
 #include <stdlib.h>
+#include <stdio.h>
 
 #define COKEBANK_SALES_ACCT	">sales"	//!< Sales made into
 #define COKEBANK_SALES_PREFIX	">sales:"	//!< Sales made into
@@ -32,6 +33,13 @@
  */
 typedef struct sAcctIterator	tAcctIterator;
 
+/**
+ * \brief Online backup opaque structure
+ *
+ * Returned by Bank_BackupStart, used by Bank_BackupStep and Bank_BackupFinish
+ */
+typedef struct sBankBackup	tBankBackup;
+
 #if 0
 /**
  * \brief Iterator for a collection of items
@@ -214,6 +222,114 @@ extern int	Bank_GetAcctByCard(const char *CardID);
  */
 extern int	Bank_AddAcctCard(int AcctID, const char *CardID);
 
+/**
+ * \brief Get the cards on an account
+ * \param AcctID	Account ID
+ * \return Heap string of space separated card IDs ("" if none), or NULL on error
+ */
+extern char	*Bank_GetAcctCards(int AcctID);
+
+/**
+ * \brief Write a consistent copy of the bank's tables
+ *
+ * Each table is a "@<table>" line followed by its column names, then one
+ * line per row. Fields are separated by tabs, with NULL written as \N and
+ * tabs, newlines and backslashes escaped as \t, \n and \\.
+ * Can be called from any thread, and doesn't hold up changes while it runs.
+ * \param Out	Stream to write to
+ * \return Boolean failure
+ */
+extern int	Bank_Snapshot(FILE *Out);
+
+/**
+ * \brief Start copying the bank to a file, a few pages at a time
+ * \param Path	File to write (replaced)
+ * \return Backup handle, or NULL on error
+ */
+extern tBankBackup	*Bank_BackupStart(const char *Path);
+
+/**
+ * \brief Copy the next part of a backup
+ *
+ * Changes made between steps are picked up, so the finished file is a copy
+ * of the bank as it was at the last step.
+ * \param Backup	Handle from Bank_BackupStart
+ * \param Pages	Number of pages to copy
+ * \param Remaining	Set to the number of pages left to copy
+ * \param Total	Set to the total number of pages
+ * \return 1 if there is more to do, 0 when finished, -1 on error
+ */
+extern int	Bank_BackupStep(tBankBackup *Backup, int Pages, int *Remaining, int *Total);
+
+/**
+ * \brief Free a backup handle (finished or not)
+ * \return Boolean failure (the file isn't a complete backup)
+ */
+extern int	Bank_BackupFinish(tBankBackup *Backup);
+
+/**
+ * \brief Start a transaction
+ *
+ * Everything done through the bank until Bank_CommitTransaction (or
+ * Bank_RollbackTransaction) is applied as a whole, or not at all.
+ * Transactions do not nest.
+ * \return Boolean failure
+ */
+extern int	Bank_BeginTransaction(void);
+
+/**
+ * \brief Save the changes made since Bank_BeginTransaction
+ * \return Boolean failure (the changes have been rolled back)
+ */
+extern int	Bank_CommitTransaction(void);
+
+/**
+ * \brief Discard the changes made since Bank_BeginTransaction
+ */
+extern void	Bank_RollbackTransaction(void);
+
+// --- Backend Interface ---
+/**
+ * \brief Version of \a tCokebankInterface, bumped on any incompatible change
+ */
+#define COKEBANK_ABI_VERSION	5
+
+/**
+ * \brief Cokebank backend function table
+ *
+ * Backends are loaded at runtime by the server (see the `cokebank_library`
+ * config option) and must export one of these as `gCokebank_Interface`.
+ * The server provides the Bank_* functions above as wrappers around it.
+ */
+typedef struct sCokebankInterface
+{
+	 int	ABIVersion;	//!< COKEBANK_ABI_VERSION the backend was built against
+	 int	(*Initialise)(const char *Argument);
+	 int	(*Transfer)(int SourceAcct, int DestAcct, int Ammount, const char *Reason);
+	 int	(*GetFlags)(int AcctID);
+	 int	(*SetFlags)(int AcctID, int Mask, int Value);
+	 int	(*GetBalance)(int AcctID);
+	char	*(*GetAcctName)(int AcctID);
+	 int	(*GetAcctByName)(const char *Name, int bCreate);
+	 int	(*CreateAcct)(const char *Name);
+	tAcctIterator	*(*Iterator)(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen);
+	 int	(*IteratorNext)(tAcctIterator *It);
+	void	(*DelIterator)(tAcctIterator *It);
+	 int	(*GetUserAuth)(const char *Salt, const char *Username, const char *Password);
+	 int	(*IsPinValid)(int AcctID, int Pin);
+	void	(*SetPin)(int AcctID, int NewPin);
+	 int	(*GetAcctByCard)(const char *CardID);
+	 int	(*AddAcctCard)(int AcctID, const char *CardID);
+	 int	(*BeginTransaction)(void);
+	 int	(*CommitTransaction)(void);
+	void	(*RollbackTransaction)(void);
+	char	*(*GetAcctCards)(int AcctID);
+	 int	(*Snapshot)(FILE *Out);
+	tBankBackup	*(*BackupStart)(const char *Path);
+	 int	(*BackupStep)(tBankBackup *Backup, int Pages, int *Remaining, int *Total);
+	 int	(*BackupFinish)(tBankBackup *Backup);
+} tCokebankInterface;
+
 // === Item Manipulation ===
 #if 0
 extern tItem	*Items_GetItem(char *Handler, int ID);
@@ -12,10 +12,12 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "../cokebank.h"
 #include <sqlite3.h>
 
 #define DEBUG	0
+#define BUSY_TIMEOUT_MS	2000	// How long to wait for another process (e.g. dispsrv --import) to finish writing
 
 const char * const csBank_DatabaseSetup = 
 "CREATE TABLE IF NOT EXISTS accounts ("
@@ -56,6 +58,31 @@ struct sAcctIterator	// Unused really, just used as a void type
 {
 };
 
+struct sBankBackup
+{
+	sqlite3	*Dest;
+	sqlite3_backup	*Backup;
+	 int	LastError;	// Result of the last step that failed
+	 int	bDone;
+};
+
+/**
+ * \brief Statements run often enough to be worth keeping prepared
+ */
+enum eBank_Statements
+{
+	BANK_STMT_ADJUST,
+	BANK_STMT_GETFLAGS,
+	BANK_STMT_GETBALANCE,
+	BANK_STMT_GETNAME,
+	BANK_STMT_GETBYNAME,
+	BANK_STMT_CREATE,
+	BANK_STMT_GETBYCARD,
+	BANK_STMT_ADDCARD,
+	BANK_STMT_GETCARDS,
+	NUM_BANK_STMTS
+};
+
 // === PROTOYPES ===
  int	Bank_Initialise(const char *Argument);
  int	Bank_Transfer(int SourceAcct, int DestAcct, int Ammount, const char *Reason);
@@ -65,13 +92,68 @@ struct sAcctIterator	// Unused really, just used as a void type
 char	*Bank_GetAcctName(int AcctID);
  int	Bank_IsPinValid(int AcctID, int Pin);
 void	Bank_SetPin(int AcctID, int Pin);
+ int	Bank_BeginTransaction(void);
+ int	Bank_CommitTransaction(void);
+void	Bank_RollbackTransaction(void);
+char	*Bank_GetAcctCards(int AcctID);
+ int	Bank_Snapshot(FILE *Out);
+tBankBackup	*Bank_BackupStart(const char *Path);
+ int	Bank_BackupStep(tBankBackup *Backup, int Pages, int *Remaining, int *Total);
+ int	Bank_BackupFinish(tBankBackup *Backup);
+static void	Bank_int_WriteValue(FILE *Out, const char *Value);
+sqlite3_stmt	*Bank_int_Statement(enum eBank_Statements Which);
+void	Bank_int_DoneStatement(sqlite3_stmt *Statement);
 sqlite3_stmt	*Bank_int_MakeStatemnt(sqlite3 *Database, const char *Query);
  int	Bank_int_QueryNone(sqlite3 *Database, const char *Query, char **ErrorMessage);
 sqlite3_stmt	*Bank_int_QuerySingle(sqlite3 *Database, const char *Query);
  int	Bank_int_IsValidName(const char *Name);
 
+// === CONSTANTS ===
+const char * const caBank_Statements[NUM_BANK_STMTS] = {
+	[BANK_STMT_ADJUST] = "UPDATE accounts SET acct_balance=acct_balance+?1,acct_last_seen=datetime('now') WHERE acct_id=?2",
+	[BANK_STMT_GETFLAGS] = "SELECT acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal"
+		" FROM accounts WHERE acct_id=?1 LIMIT 1",
+	[BANK_STMT_GETBALANCE] = "SELECT acct_balance FROM accounts WHERE acct_id=?1 LIMIT 1",
+	[BANK_STMT_GETNAME] = "SELECT acct_name FROM accounts WHERE acct_id=?1 LIMIT 1",
+	[BANK_STMT_GETBYNAME] = "SELECT acct_id FROM accounts WHERE acct_name=?1 LIMIT 1",
+	[BANK_STMT_CREATE] = "INSERT INTO accounts (acct_name) VALUES (?1)",
+	[BANK_STMT_GETBYCARD] = "SELECT acct_id FROM cards WHERE card_name=?1 LIMIT 1",
+	[BANK_STMT_ADDCARD] = "INSERT INTO cards (acct_id,card_name) VALUES (?1,?2)",
+	[BANK_STMT_GETCARDS] = "SELECT card_name FROM cards WHERE acct_id=?1 ORDER BY card_name",
+};
+
 // === GLOBALS ===
 sqlite3	*gBank_Database;
+char	*gsBank_DatabasePath;	// For the snapshot connections
+sqlite3_stmt	*gaBank_Statements[NUM_BANK_STMTS];
+pthread_mutex_t	gBank_StatementLock = PTHREAD_MUTEX_INITIALIZER;	// Held while a prepared statement is in use
+const tCokebankInterface	gCokebank_Interface = {
+	.ABIVersion = COKEBANK_ABI_VERSION,
+	.Initialise = Bank_Initialise,
+	.Transfer = Bank_Transfer,
+	.GetFlags = Bank_GetFlags,
+	.SetFlags = Bank_SetFlags,
+	.GetBalance = Bank_GetBalance,
+	.GetAcctName = Bank_GetAcctName,
+	.GetAcctByName = Bank_GetAcctByName,
+	.CreateAcct = Bank_CreateAcct,
+	.Iterator = Bank_Iterator,
+	.IteratorNext = Bank_IteratorNext,
+	.DelIterator = Bank_DelIterator,
+	.GetUserAuth = Bank_GetUserAuth,
+	.IsPinValid = Bank_IsPinValid,
+	.SetPin = Bank_SetPin,
+	.GetAcctByCard = Bank_GetAcctByCard,
+	.AddAcctCard = Bank_AddAcctCard,
+	.BeginTransaction = Bank_BeginTransaction,
+	.CommitTransaction = Bank_CommitTransaction,
+	.RollbackTransaction = Bank_RollbackTransaction,
+	.GetAcctCards = Bank_GetAcctCards,
+	.Snapshot = Bank_Snapshot,
+	.BackupStart = Bank_BackupStart,
+	.BackupStep = Bank_BackupStep,
+	.BackupFinish = Bank_BackupFinish
+};
 
 // === CODE ===
 int Bank_Initialise(const char *Argument)
@@ -87,6 +169,15 @@ int Bank_Initialise(const char *Argument)
 		sqlite3_close(gBank_Database);
 		return 1;
 	}
+	sqlite3_busy_timeout(gBank_Database, BUSY_TIMEOUT_MS);
+	gsBank_DatabasePath = strdup(Argument);
+	
+	// Write-ahead log, so snapshots (and backups) don't hold up transfers
+	rv = Bank_int_QueryNone(gBank_Database, "PRAGMA journal_mode=WAL", &errmsg);
+	if( rv != SQLITE_OK ) {
+		fprintf(stderr, "Bank_Initialise - Unable to use a write-ahead log: %s\n", errmsg);
+		sqlite3_free(errmsg);
+	}
 
 	// Check structure
 	rv = Bank_int_QueryNone(gBank_Database, "SELECT acct_id FROM accounts LIMIT 1", &errmsg);
@@ -123,43 +214,43 @@ int Bank_Initialise(const char *Argument)
  */
 int Bank_Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason __attribute__((unused)))
 {
-	char	*query;
+	sqlite3_stmt	*statement;
 	 int	rv;
-	char	*errmsg;
 	
 	Reason = "";	// Shut GCC up
 	
-	// Begin SQL Transaction
-	Bank_int_QueryNone(gBank_Database, "BEGIN TRANSACTION", NULL);
+	// Begin SQL Transaction (a savepoint, so it can be part of a larger one)
+	Bank_int_QueryNone(gBank_Database, "SAVEPOINT bank_transfer", NULL);
 
+	statement = Bank_int_Statement(BANK_STMT_ADJUST);
+	if( !statement ) {
+		Bank_int_QueryNone(gBank_Database, "ROLLBACK TO bank_transfer; RELEASE bank_transfer", NULL);
+		return 1;
+	}
+	
 	// Take from the source
-	query = mkstr("UPDATE accounts SET acct_balance=acct_balance%+i,acct_last_seen=datetime('now') WHERE acct_id=%i", -Ammount, SourceUser);
-//	printf("query = \"%s\"\n", query);
-	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
-	free(query);
-	if( rv != SQLITE_OK )
+	sqlite3_bind_int(statement, 1, -Ammount);
+	sqlite3_bind_int(statement, 2, SourceUser);
+	rv = sqlite3_step(statement);
+	if( rv == SQLITE_DONE )
 	{
-		fprintf(stderr, "Bank_Transfer - SQLite Error: %s\n", errmsg);
-		sqlite3_free(errmsg);
-		Bank_int_QueryNone(gBank_Database, "ROLLBACK",  NULL);
-		return 1;
+		// Give to the destination
+		sqlite3_reset(statement);
+		sqlite3_bind_int(statement, 1, Ammount);
+		sqlite3_bind_int(statement, 2, DestUser);
+		rv = sqlite3_step(statement);
 	}
-
-	// Give to the destination
-	query = mkstr("UPDATE accounts SET acct_balance=acct_balance%+i,acct_last_seen=datetime('now') WHERE acct_id=%i", Ammount, DestUser);
-//	printf("query = \"%s\"\n", query);
-	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
-	free(query);
-	if( rv != SQLITE_OK )
+	if( rv != SQLITE_DONE )
 	{
-		fprintf(stderr, "Bank_Transfer - SQLite Error: %s\n", errmsg);
-		sqlite3_free(errmsg);
-		Bank_int_QueryNone(gBank_Database, "ROLLBACK", NULL);
+		fprintf(stderr, "Bank_Transfer - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		Bank_int_DoneStatement(statement);
+		Bank_int_QueryNone(gBank_Database, "ROLLBACK TO bank_transfer; RELEASE bank_transfer", NULL);
 		return 1;
 	}
+	Bank_int_DoneStatement(statement);
 
 	// Commit transaction
-	Bank_int_QueryNone(gBank_Database, "COMMIT", NULL);
+	Bank_int_QueryNone(gBank_Database, "RELEASE bank_transfer", NULL);
 
 	return 0;
 }
@@ -170,18 +261,15 @@ int Bank_Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason
 int Bank_GetFlags(int UserID)
 {
 	sqlite3_stmt	*statement;
-	char	*query;
 	 int	ret;
 
-	// Build Query
-	query = mkstr(
-		"SELECT acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal"
-		" FROM accounts WHERE acct_id=%i LIMIT 1",
-		UserID
-		);
-	statement = Bank_int_QuerySingle(gBank_Database, query);
-	free(query);
+	statement = Bank_int_Statement(BANK_STMT_GETFLAGS);
 	if( !statement )	return -1;
+	sqlite3_bind_int(statement, 1, UserID);
+	if( sqlite3_step(statement) != SQLITE_ROW ) {
+		Bank_int_DoneStatement(statement);
+		return -1;
+	}
 
 	// Get Flags
 	ret = 0;
@@ -196,8 +284,7 @@ int Bank_GetFlags(int UserID)
 	// - Internal
 	if( sqlite3_column_int(statement, 4) )	ret |= USER_FLAG_INTERNAL;
 	
-	// Destroy and return
-	sqlite3_finalize(statement);
+	Bank_int_DoneStatement(statement);
 	
 	return ret;
 }
@@ -248,19 +335,15 @@ int Bank_SetFlags(int UserID, int Mask, int Value)
 int Bank_GetBalance(int AcctID)
 {
 	sqlite3_stmt	*statement;
-	char	*query;
-	 int	ret;
+	 int	ret = INT_MIN;
 	
-	query = mkstr("SELECT acct_balance FROM accounts WHERE acct_id=%i LIMIT 1", AcctID);
-	statement = Bank_int_QuerySingle(gBank_Database, query);
-	free(query);
+	statement = Bank_int_Statement(BANK_STMT_GETBALANCE);
 	if( !statement )	return INT_MIN;
+	sqlite3_bind_int(statement, 1, AcctID);
+	if( sqlite3_step(statement) == SQLITE_ROW )
+		ret = sqlite3_column_int(statement, 0);
 	
-	// Read return value
-	ret = sqlite3_column_int(statement, 0);
-	
-	// Clean up and return
-	sqlite3_finalize(statement);
+	Bank_int_DoneStatement(statement);
 	return ret;
 }
 
@@ -270,19 +353,15 @@ int Bank_GetBalance(int AcctID)
 char *Bank_GetAcctName(int AcctID)
 {
 	sqlite3_stmt	*statement;
-	char	*query;
-	char	*ret;
+	char	*ret = NULL;
 	
-	query = mkstr("SELECT acct_name FROM accounts WHERE acct_id=%i LIMIT 1", AcctID);
-	statement = Bank_int_QuerySingle(gBank_Database, query);
-	free(query);
+	statement = Bank_int_Statement(BANK_STMT_GETNAME);
 	if( !statement )	return NULL;
+	sqlite3_bind_int(statement, 1, AcctID);
+	if( sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_text(statement, 0) )
+		ret = strdup( (const char*)sqlite3_column_text(statement, 0) );
 	
-	// Read return value
-	ret = strdup( (const char*)sqlite3_column_text(statement, 0) );
-	
-	// Clean up and return
-	sqlite3_finalize(statement);
+	Bank_int_DoneStatement(statement);
 	return ret;
 }
 
@@ -291,7 +370,6 @@ char *Bank_GetAcctName(int AcctID)
  */
 int Bank_GetAcctByName(const char *Name, int bCreate)
 {
-	char	*query;
 	sqlite3_stmt	*statement;
 	 int	ret;
 	
@@ -302,17 +380,18 @@ int Bank_GetAcctByName(const char *Name, int bCreate)
 		return -1;
 	}
 	
-	query = mkstr("SELECT acct_id FROM accounts WHERE acct_name='%s' LIMIT 1", Name);
-	statement = Bank_int_QuerySingle(gBank_Database, query);
-	free(query);
-	if( !statement ) {
+	statement = Bank_int_Statement(BANK_STMT_GETBYNAME);
+	if( !statement )	return -1;
+	sqlite3_bind_text(statement, 1, Name, -1, SQLITE_STATIC);
+	if( sqlite3_step(statement) != SQLITE_ROW ) {
+		Bank_int_DoneStatement(statement);
 //		printf("User not found\n");
 		if( bCreate )	return Bank_CreateAcct(Name);
 		return -1;
 	}
 	
 	ret = sqlite3_column_int(statement, 0);
-	sqlite3_finalize(statement);
+	Bank_int_DoneStatement(statement);
 	
 //	printf("ret = %i\n", ret);
 
@@ -327,33 +406,28 @@ int Bank_GetAcctByName(const char *Name, int bCreate)
  */
 int Bank_CreateAcct(const char *Name)
 {
-	char	*query;
-	char	*errmsg;
+	sqlite3_stmt	*statement;
 	 int	rv;
 	
+	if( Name && !Bank_int_IsValidName(Name) )
+		return -1;
+	
+	statement = Bank_int_Statement(BANK_STMT_CREATE);
+	if( !statement )	return -1;
 	if( Name )
+		sqlite3_bind_text(statement, 1, Name, -1, SQLITE_STATIC);
+	rv = sqlite3_step(statement);
+	if( rv != SQLITE_DONE )
 	{
-		if( !Bank_int_IsValidName(Name) )	return -1;
-		query = mkstr("INSERT INTO accounts (acct_name) VALUES ('%s')", Name);
-	}
-	else
-	{
-		query = strdup("INSERT INTO accounts (acct_name) VALUES (NULL)");
-	}
-		
-	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
-	if( rv != SQLITE_OK )
-	{
-		fprintf(stderr, "Bank_CreateAcct - SQLite Error: '%s'\n", errmsg);
-		fprintf(stderr, "Query = '%s'\n", query);
-		sqlite3_free(errmsg);
-		free(query);
+		fprintf(stderr, "Bank_CreateAcct - SQLite Error: '%s'\n", sqlite3_errmsg(gBank_Database));
+		fprintf(stderr, "Name = '%s'\n", Name);
+		Bank_int_DoneStatement(statement);
 		return -1;
 	}
+	rv = sqlite3_last_insert_rowid(gBank_Database);
+	Bank_int_DoneStatement(statement);
 	
-	free(query);
-	
-	return sqlite3_last_insert_rowid(gBank_Database);
+	return rv;
 }
 
 int Bank_IsPinValid(int AcctID, int Pin)
@@ -515,21 +589,19 @@ int Bank_GetUserAuth(const char *Salt, const char *Username, const char *Passwor
  */
 int Bank_GetAcctByCard(const char *CardID)
 {
-	char	*query;
 	sqlite3_stmt	*statement;
-	 int	ret;
+	 int	ret = -1;
 	
 	if( !Bank_int_IsValidName(CardID) )
 		return -1;
 	
-	query = mkstr("SELECT acct_id FROM cards WHERE card_name='%s' LIMIT 1", CardID);
-	statement = Bank_int_QuerySingle(gBank_Database, query);
-	free(query);
+	statement = Bank_int_Statement(BANK_STMT_GETBYCARD);
 	if( !statement )	return -1;
+	sqlite3_bind_text(statement, 1, CardID, -1, SQLITE_STATIC);
+	if( sqlite3_step(statement) == SQLITE_ROW )
+		ret = sqlite3_column_int(statement, 0);
 	
-	ret = sqlite3_column_int(statement, 0);
-	
-	sqlite3_finalize(statement);
+	Bank_int_DoneStatement(statement);
 	
 	return ret;
 }
@@ -539,9 +611,8 @@ int Bank_GetAcctByCard(const char *CardID)
  */
 int Bank_AddAcctCard(int AcctID, const char *CardID)
 {
-	char	*query;
+	sqlite3_stmt	*statement;
 	 int	rv;
-	char	*errmsg;
 	
 	if( !Bank_int_IsValidName(CardID) )
 		return -1;
@@ -549,28 +620,280 @@ int Bank_AddAcctCard(int AcctID, const char *CardID)
 	// TODO: Check the AcctID too
 	
 	// Insert card
-	query = mkstr("INSERT INTO cards (acct_id,card_name) VALUES (%i,'%s')",
-		AcctID, CardID);
-	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
+	statement = Bank_int_Statement(BANK_STMT_ADDCARD);
+	if( !statement )	return -1;
+	sqlite3_bind_int(statement, 1, AcctID);
+	sqlite3_bind_text(statement, 2, CardID, -1, SQLITE_STATIC);
+	rv = sqlite3_step(statement);
 	if( rv == SQLITE_CONSTRAINT )
 	{
-		sqlite3_free(errmsg);
-		free(query);
+		Bank_int_DoneStatement(statement);
 		return 2;	// Card in use
 	}
-	if( rv != SQLITE_OK )
+	if( rv != SQLITE_DONE )
 	{
-		fprintf(stderr, "Bank_AddAcctCard - SQLite Error: '%s'\n", errmsg);
-		fprintf(stderr, "Query = '%s'\n", query);
-		sqlite3_free(errmsg);
-		free(query);
+		fprintf(stderr, "Bank_AddAcctCard - SQLite Error: '%s'\n", sqlite3_errmsg(gBank_Database));
+		fprintf(stderr, "Card = '%s'\n", CardID);
+		Bank_int_DoneStatement(statement);
 		return -1;
 	}
-	free(query);
+	Bank_int_DoneStatement(statement);
 	
 	return 0;
 }
 
+/*
+ * List the cards on an account
+ */
+char *Bank_GetAcctCards(int AcctID)
+{
+	sqlite3_stmt	*statement;
+	char	*ret;
+	size_t	len = 0;
+	 int	rv = SQLITE_DONE;
+	
+	statement = Bank_int_Statement(BANK_STMT_GETCARDS);
+	if( !statement )	return NULL;
+	sqlite3_bind_int(statement, 1, AcctID);
+	
+	ret = strdup("");
+	while( ret && (rv = sqlite3_step(statement)) == SQLITE_ROW )
+	{
+		const char	*card = (const char*)sqlite3_column_text(statement, 0);
+		size_t	cardlen = strlen(card);
+		char	*newret = realloc(ret, len + (len ? 1 : 0) + cardlen + 1);
+		if( !newret ) {
+			free(ret);
+			ret = NULL;
+			break;
+		}
+		ret = newret;
+		if( len )	ret[len++] = ' ';
+		memcpy(ret + len, card, cardlen + 1);
+		len += cardlen;
+	}
+	if( ret && rv != SQLITE_DONE ) {
+		fprintf(stderr, "Bank_GetAcctCards - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		free(ret);
+		ret = NULL;
+	}
+	
+	Bank_int_DoneStatement(statement);
+	return ret;
+}
+
+/*
+ * Dump the tables from a read transaction on a separate connection
+ * NOTE: Called from the server's export threads, so doesn't touch gBank_Database
+ */
+int Bank_Snapshot(FILE *Out)
+{
+	const char * const	tables[] = {"accounts", "cards", "items"};
+	sqlite3	*db;
+	 int	rv = 0;
+	
+	if( sqlite3_open_v2(gsBank_DatabasePath, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "Bank_Snapshot - SQLite Error: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return 1;
+	}
+	sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+	
+	// Everything from here to the COMMIT sees the same version of the database
+	if( Bank_int_QueryNone(db, "BEGIN DEFERRED TRANSACTION", NULL) != SQLITE_OK ) {
+		fprintf(stderr, "Bank_Snapshot - SQLite Error: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return 1;
+	}
+	
+	for( unsigned int i = 0; !rv && i < sizeof(tables)/sizeof(tables[0]); i ++ )
+	{
+		char	query[64];
+		sqlite3_stmt	*statement;
+		 int	nCols, step;
+		
+		snprintf(query, sizeof(query), "SELECT * FROM %s ORDER BY rowid", tables[i]);
+		statement = Bank_int_MakeStatemnt(db, query);
+		if( !statement ) {
+			rv = 1;
+			break;
+		}
+		
+		// Header: table name and column names
+		nCols = sqlite3_column_count(statement);
+		fprintf(Out, "@%s", tables[i]);
+		for( int col = 0; col < nCols; col ++ )
+			fprintf(Out, "\t%s", sqlite3_column_name(statement, col));
+		fputc('\n', Out);
+		
+		while( (step = sqlite3_step(statement)) == SQLITE_ROW )
+		{
+			for( int col = 0; col < nCols; col ++ )
+			{
+				if( col )	fputc('\t', Out);
+				Bank_int_WriteValue(Out, (const char*)sqlite3_column_text(statement, col));
+			}
+			fputc('\n', Out);
+		}
+		if( step != SQLITE_DONE ) {
+			fprintf(stderr, "Bank_Snapshot - SQLite Error: %s\n", sqlite3_errmsg(db));
+			rv = 1;
+		}
+		sqlite3_finalize(statement);
+	}
+	
+	Bank_int_QueryNone(db, "COMMIT TRANSACTION", NULL);
+	sqlite3_close(db);
+	if( ferror(Out) )
+		rv = 1;
+	return rv;
+}
+
+/*
+ * Write a value for Bank_Snapshot (\N for NULL, tabs/newlines/backslashes escaped)
+ */
+void Bank_int_WriteValue(FILE *Out, const char *Value)
+{
+	if( !Value ) {
+		fputs("\\N", Out);
+		return ;
+	}
+	for( ; *Value; Value ++ )
+	{
+		switch(*Value)
+		{
+		case '\t':	fputs("\\t", Out);	break;
+		case '\n':	fputs("\\n", Out);	break;
+		case '\\':	fputs("\\\\", Out);	break;
+		default:	fputc(*Value, Out);	break;
+		}
+	}
+}
+
+/*
+ * Online backup (sqlite3_backup_*) from the main connection
+ * NOTE: Changes made through gBank_Database are copied to the backup as
+ *       they happen, so it only starts again if another process writes.
+ */
+tBankBackup *Bank_BackupStart(const char *Path)
+{
+	tBankBackup	*ret = calloc(1, sizeof(*ret));
+	if( !ret )	return NULL;
+	
+	if( sqlite3_open(Path, &ret->Dest) != SQLITE_OK ) {
+		fprintf(stderr, "Bank_BackupStart - Unable to open '%s': %s\n", Path, sqlite3_errmsg(ret->Dest));
+		sqlite3_close(ret->Dest);
+		free(ret);
+		return NULL;
+	}
+	ret->Backup = sqlite3_backup_init(ret->Dest, "main", gBank_Database, "main");
+	if( !ret->Backup ) {
+		fprintf(stderr, "Bank_BackupStart - SQLite Error: %s\n", sqlite3_errmsg(ret->Dest));
+		sqlite3_close(ret->Dest);
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+int Bank_BackupStep(tBankBackup *Backup, int Pages, int *Remaining, int *Total)
+{
+	 int	rv = sqlite3_backup_step(Backup->Backup, Pages);
+	
+	*Remaining = sqlite3_backup_remaining(Backup->Backup);
+	*Total = sqlite3_backup_pagecount(Backup->Backup);
+	switch(rv)
+	{
+	case SQLITE_DONE:
+		Backup->bDone = 1;
+		return 0;
+	case SQLITE_OK:
+	case SQLITE_BUSY:	// Someone else is writing, try again next step
+	case SQLITE_LOCKED:
+		return 1;
+	default:
+		fprintf(stderr, "Bank_BackupStep - SQLite Error: %s\n", sqlite3_errstr(rv));
+		Backup->LastError = rv;
+		return -1;
+	}
+}
+
+int Bank_BackupFinish(tBankBackup *Backup)
+{
+	 int	rv = sqlite3_backup_finish(Backup->Backup);
+	
+	// (finish is happy with a backup that wasn't run to the end)
+	if( Backup->LastError )
+		rv = Backup->LastError;
+	else if( !Backup->bDone )
+		rv = SQLITE_ABORT;
+	sqlite3_close(Backup->Dest);
+	free(Backup);
+	return rv != SQLITE_OK;
+}
+
+/*
+ * Group several changes into one transaction (and one write to disk)
+ */
+int Bank_BeginTransaction(void)
+{
+	char	*errmsg;
+	 int	rv = Bank_int_QueryNone(gBank_Database, "BEGIN IMMEDIATE TRANSACTION", &errmsg);
+	if( rv != SQLITE_OK )
+	{
+		fprintf(stderr, "Bank_BeginTransaction - SQLite Error: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		return 1;
+	}
+	return 0;
+}
+
+int Bank_CommitTransaction(void)
+{
+	char	*errmsg;
+	 int	rv = Bank_int_QueryNone(gBank_Database, "COMMIT TRANSACTION", &errmsg);
+	if( rv != SQLITE_OK )
+	{
+		fprintf(stderr, "Bank_CommitTransaction - SQLite Error: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		Bank_RollbackTransaction();
+		return 1;
+	}
+	return 0;
+}
+
+void Bank_RollbackTransaction(void)
+{
+	// Fails harmlessly if SQLite has already rolled back
+	Bank_int_QueryNone(gBank_Database, "ROLLBACK TRANSACTION", NULL);
+}
+
+/*
+ * Get one of the kept statements (prepared on first use)
+ * The statement is locked until Bank_int_DoneStatement, as the door handler
+ * checks flags from its own thread.
+ */
+sqlite3_stmt *Bank_int_Statement(enum eBank_Statements Which)
+{
+	pthread_mutex_lock(&gBank_StatementLock);
+	if( !gaBank_Statements[Which] )
+	{
+		gaBank_Statements[Which] = Bank_int_MakeStatemnt(gBank_Database, caBank_Statements[Which]);
+		if( !gaBank_Statements[Which] ) {
+			pthread_mutex_unlock(&gBank_StatementLock);
+			return NULL;
+		}
+	}
+	return gaBank_Statements[Which];
+}
+
+void Bank_int_DoneStatement(sqlite3_stmt *Statement)
+{
+	sqlite3_reset(Statement);
+	sqlite3_clear_bindings(Statement);
+	pthread_mutex_unlock(&gBank_StatementLock);
+}
+
 /*
  * Create a SQLite Statement
  */
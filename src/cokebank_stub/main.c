@@ -2,76 +2,227 @@
  * OpenDispense 2 
  * UCC (University [of WA] Computer Club) Electronic Accounting System
  *
- * cokebank.c - Coke-Bank management
+ * cokebank_stub - Empty Coke-Bank backend
  *
  * This file is licenced under the 3-clause BSD Licence. See the file COPYING
  * for full details.
- * 
- * TODO: Make this a Dynamic Library and load it at runtime
+ *
+ * NOTES:
+ * - Has no accounts: lookups fail and changes are refused (except transfers,
+ *   which are accepted and forgotten). Useful as a starting point for a new
+ *   backend, and for running the server without a database.
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include "../cokebank.h"
+
+#define UNUSED(x)	x __attribute__((unused))
+
+// === TYPES ===
+struct sAcctIterator
+{
+	 int	Unused;
+};
 
 // === PROTOTYPES ===
-void	Init_Cokebank(void);
- int	Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason);
- int	GetBalance(int User);
-char	*GetUserName(int User);
- int	GetUserID(const char *Username); 
- int	GetUserAuth(const char *Username, const char *Password);
+ int	Bank_Initialise(const char *Argument);
+ int	Bank_Transfer(int SourceAcct, int DestAcct, int Ammount, const char *Reason);
+ int	Bank_GetFlags(int AcctID);
+ int	Bank_SetFlags(int AcctID, int Mask, int Value);
+ int	Bank_GetBalance(int AcctID);
+char	*Bank_GetAcctName(int AcctID);
+ int	Bank_GetAcctByName(const char *Name, int bCreate);
+ int	Bank_CreateAcct(const char *Name);
+tAcctIterator	*Bank_Iterator(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen);
+ int	Bank_IteratorNext(tAcctIterator *It);
+void	Bank_DelIterator(tAcctIterator *It);
+ int	Bank_GetUserAuth(const char *Salt, const char *Username, const char *Password);
+ int	Bank_IsPinValid(int AcctID, int Pin);
+void	Bank_SetPin(int AcctID, int NewPin);
+ int	Bank_GetAcctByCard(const char *CardID);
+ int	Bank_AddAcctCard(int AcctID, const char *CardID);
+ int	Bank_BeginTransaction(void);
+ int	Bank_CommitTransaction(void);
+void	Bank_RollbackTransaction(void);
+char	*Bank_GetAcctCards(int AcctID);
+ int	Bank_Snapshot(FILE *Out);
+tBankBackup	*Bank_BackupStart(const char *Path);
+ int	Bank_BackupStep(tBankBackup *Backup, int Pages, int *Remaining, int *Total);
+ int	Bank_BackupFinish(tBankBackup *Backup);
+
+// === GLOBALS ===
+const tCokebankInterface	gCokebank_Interface = {
+	.ABIVersion = COKEBANK_ABI_VERSION,
+	.Initialise = Bank_Initialise,
+	.Transfer = Bank_Transfer,
+	.GetFlags = Bank_GetFlags,
+	.SetFlags = Bank_SetFlags,
+	.GetBalance = Bank_GetBalance,
+	.GetAcctName = Bank_GetAcctName,
+	.GetAcctByName = Bank_GetAcctByName,
+	.CreateAcct = Bank_CreateAcct,
+	.Iterator = Bank_Iterator,
+	.IteratorNext = Bank_IteratorNext,
+	.DelIterator = Bank_DelIterator,
+	.GetUserAuth = Bank_GetUserAuth,
+	.IsPinValid = Bank_IsPinValid,
+	.SetPin = Bank_SetPin,
+	.GetAcctByCard = Bank_GetAcctByCard,
+	.AddAcctCard = Bank_AddAcctCard,
+	.BeginTransaction = Bank_BeginTransaction,
+	.CommitTransaction = Bank_CommitTransaction,
+	.RollbackTransaction = Bank_RollbackTransaction,
+	.GetAcctCards = Bank_GetAcctCards,
+	.Snapshot = Bank_Snapshot,
+	.BackupStart = Bank_BackupStart,
+	.BackupStep = Bank_BackupStep,
+	.BackupFinish = Bank_BackupFinish
+};
 
 // === CODE ===
 /**
  * \brief Load the cokebank database
  */
-void Init_Cokebank(void)
+int Bank_Initialise(const char *UNUSED(Argument))
 {
-	
+	return 0;
 }
 
 /**
  * \brief Transfers money from one user to another
- * \param SourceUser	Source user
- * \param DestUser	Destination user
- * \param Ammount	Ammount of cents to move from \a SourceUser to \a DestUser
+ * \param SourceAcct	Source account
+ * \param DestAcct	Destination account
+ * \param Ammount	Ammount of cents to move from \a SourceAcct to \a DestAcct
  * \param Reason	Reason for the transfer (essentially a comment)
  * \return Boolean failure
  */
-int Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason);
+int Bank_Transfer(int UNUSED(SourceAcct), int UNUSED(DestAcct), int UNUSED(Ammount), const char *UNUSED(Reason))
+{
+	return 0;
+}
+
+int Bank_GetFlags(int UNUSED(AcctID))
 {
 	return 0;
 }
 
+int Bank_SetFlags(int UNUSED(AcctID), int UNUSED(Mask), int UNUSED(Value))
+{
+	return 1;
+}
+
 /**
- * \brief Get the balance of the passed user
+ * \brief Get the balance of the passed account
  */
-int GetBalance(int User)
+int Bank_GetBalance(int UNUSED(AcctID))
 {
 	return 0;
 }
 
 /**
- * \brief Return the name the passed user
+ * \brief Return the name the passed account
  */
-char *GetUserName(int User)
+char *Bank_GetAcctName(int UNUSED(AcctID))
 {
 	return NULL;
 }
 
 /**
- * \brief Get the User ID of the named user
+ * \brief Get the ID of the named account
  */
-int GetUserID(const char *Username)
+int Bank_GetAcctByName(const char *UNUSED(Name), int UNUSED(bCreate))
 {
 	return -1;
 }
 
+int Bank_CreateAcct(const char *UNUSED(Name))
+{
+	return -1;
+}
+
+tAcctIterator *Bank_Iterator(int UNUSED(FlagMask), int UNUSED(FlagValues),
+	int UNUSED(Flags), int UNUSED(MinMaxBalance), time_t UNUSED(LastSeen))
+{
+	return calloc(1, sizeof(tAcctIterator));
+}
+
+int Bank_IteratorNext(tAcctIterator *UNUSED(It))
+{
+	return -1;
+}
+
+void Bank_DelIterator(tAcctIterator *It)
+{
+	free(It);
+}
+
 /**
  * \brief Authenticate a user
- * \return User ID, or -1 if authentication failed
+ * \return Account ID, or -1 if authentication failed
  */
-int GetUserAuth(const char *Username, const char *Password)
+int Bank_GetUserAuth(const char *UNUSED(Salt), const char *UNUSED(Username), const char *UNUSED(Password))
 {
 	return -1;
 }
 
+int Bank_IsPinValid(int UNUSED(AcctID), int UNUSED(Pin))
+{
+	return 0;
+}
+
+void Bank_SetPin(int UNUSED(AcctID), int UNUSED(NewPin))
+{
+}
+
+int Bank_GetAcctByCard(const char *UNUSED(CardID))
+{
+	return -1;
+}
+
+int Bank_AddAcctCard(int UNUSED(AcctID), const char *UNUSED(CardID))
+{
+	return 1;
+}
+
+char *Bank_GetAcctCards(int UNUSED(AcctID))
+{
+	return NULL;
+}
+
+// --- Transactions (nothing is stored, so there's nothing to undo) ---
+int Bank_BeginTransaction(void)
+{
+	return 0;
+}
+
+int Bank_CommitTransaction(void)
+{
+	return 0;
+}
+
+void Bank_RollbackTransaction(void)
+{
+}
+
+// --- Snapshots and backups (not supported) ---
+int Bank_Snapshot(FILE *UNUSED(Out))
+{
+	fprintf(stderr, "cokebank_stub: Snapshots are not supported\n");
+	return 1;
+}
+
+tBankBackup *Bank_BackupStart(const char *UNUSED(Path))
+{
+	fprintf(stderr, "cokebank_stub: Backups are not supported\n");
+	return NULL;
+}
+
+int Bank_BackupStep(tBankBackup *UNUSED(Backup), int UNUSED(Pages), int *UNUSED(Remaining), int *UNUSED(Total))
+{
+	return -1;
+}
+
+int Bank_BackupFinish(tBankBackup *UNUSED(Backup))
+{
+	return 1;
+}
@@ -107,6 +107,23 @@ int Config_ParseFile(const char *Filename)
 	return 0;
 }
 
+/**
+ * \brief Replace the current values with those from a file
+ * \note The old values are left allocated, strings from Config_GetValue_Str
+ *       may still be in use.
+ */
+int Config_ReloadFile(const char *Filename)
+{
+	tConfigKey	*old = gConfig;
+	
+	gConfig = NULL;
+	if( Config_ParseFile(Filename) ) {
+		gConfig = old;
+		return 1;
+	}
+	return 0;
+}
+
 void Config_AddValue(const char *Key, const char *Value)
 {
 	tConfigKey	*key;
@@ -198,8 +215,7 @@ const tConfigValue *Config_int_GetValue(const char *KeyName, int Index)
 
 	tConfigKey *key = Config_int_GetKey(KeyName, 0);
 	if(!key) {
-		fprintf(stderr, "Unknown key '%s'\n", KeyName);
-		exit(1);
+		// Missing keys are left for the caller to handle (OPT_CFG/REQ_CFG)
 		return NULL;
 	}
 	
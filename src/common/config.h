@@ -21,6 +21,7 @@
 
 // --- Config Database ---
 extern int	Config_ParseFile(const char *Filename);
+extern int	Config_ReloadFile(const char *Filename);
 
 extern void	Config_AddValue(const char *Key, const char *Value);
 
@@ -0,0 +1,152 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * backup.c - Online backups of the bank (`backup_file`)
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - Driven by the timer wheel on the server thread: each step copies
+ *   BACKUP_STEP_PAGES pages and then waits BACKUP_STEP_DELAY_MS, so commands
+ *   are never held up by more than one step. Changes made in between are
+ *   copied too, so the result is the bank as it was at the last step.
+ * - Written to <backup_file>.tmp and then rotated in: <backup_file> is the
+ *   newest, <backup_file>.1 the one before it, and so on up to backup_keep.
+ * - The first backup is taken at startup, the next backup_interval seconds
+ *   after each one finishes. A failed one is thrown away.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "../cokebank.h"
+
+#define BACKUP_STEP_PAGES	64
+#define BACKUP_STEP_DELAY_MS	100
+#define BACKUP_MIN_INTERVAL	60	// Seconds
+
+// === PROTOTYPES ===
+void	Backup_Init(void);
+static void	Backup_int_Step(void *Unused);
+static int	Backup_int_Rotate(void);
+static int64_t	Backup_int_Micros(const struct timespec *Start);
+
+// === GLOBALS ===
+const char	*gsBackup_File;	// NULL = no backups
+ int	giBackup_Interval = 3600;	// Seconds from the end of one backup to the next
+ int	giBackup_Keep = 3;	// Backup files kept (including the newest)
+char	*gsBackup_TempFile;
+tTimer	gBackup_Timer;
+tBankBackup	*gpBackup_Current;
+// - Statistics for the backup in progress
+struct timespec	gBackup_StartTime;
+ int	giBackup_Steps;
+int64_t	giBackup_LongestStep;	// Microseconds
+
+// === CODE ===
+/**
+ * \brief Schedule backups (if `backup_file` is set)
+ * \note Needs the timer wheel, so is called by Server_Start
+ */
+void Backup_Init(void)
+{
+	if( !gsBackup_File || !gsBackup_File[0] )
+		return ;
+
+	if( giBackup_Interval < BACKUP_MIN_INTERVAL )
+		giBackup_Interval = BACKUP_MIN_INTERVAL;
+	if( giBackup_Keep < 1 )
+		giBackup_Keep = 1;
+	gsBackup_TempFile = mkstr("%s.tmp", gsBackup_File);
+
+	Timer_Set(&gBackup_Timer, BACKUP_STEP_DELAY_MS, Backup_int_Step, NULL);
+}
+
+/**
+ * \brief Copy the next few pages, starting a backup if there isn't one running
+ */
+void Backup_int_Step(void *UNUSED(Unused))
+{
+	struct timespec	start;
+	 int	remaining = 0, total = 0, rv;
+	int64_t	took;
+
+	if( !gpBackup_Current )
+	{
+		gpBackup_Current = Bank_BackupStart(gsBackup_TempFile);
+		if( !gpBackup_Current ) {
+			Log_Error("Unable to start a backup to '%s'", gsBackup_TempFile);
+			Timer_Set(&gBackup_Timer, giBackup_Interval * 1000, Backup_int_Step, NULL);
+			return ;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &gBackup_StartTime);
+		giBackup_Steps = 0;
+		giBackup_LongestStep = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rv = Bank_BackupStep(gpBackup_Current, BACKUP_STEP_PAGES, &remaining, &total);
+	took = Backup_int_Micros(&start);
+	giBackup_Steps ++;
+	if( took > giBackup_LongestStep )
+		giBackup_LongestStep = took;
+
+	if( rv > 0 )
+	{
+		if( giDebugLevel >= 2 )
+			Debug_Debug("Backup: %i/%i pages", total - remaining, total);
+		Timer_Set(&gBackup_Timer, BACKUP_STEP_DELAY_MS, Backup_int_Step, NULL);
+		return ;
+	}
+
+	if( Bank_BackupFinish(gpBackup_Current) || rv < 0 ) {
+		Log_Error("Backup to '%s' failed after %i of %i pages", gsBackup_TempFile, total - remaining, total);
+		unlink(gsBackup_TempFile);
+	}
+	else if( Backup_int_Rotate() == 0 ) {
+		took = Backup_int_Micros(&gBackup_StartTime);
+		Log_Info("backup of %i pages to %s in %lli.%03llis (%i steps, longest %llius)",
+			total, gsBackup_File, (long long)(took / 1000000), (long long)(took / 1000 % 1000),
+			giBackup_Steps, (long long)giBackup_LongestStep);
+	}
+	gpBackup_Current = NULL;
+
+	Timer_Set(&gBackup_Timer, giBackup_Interval * 1000, Backup_int_Step, NULL);
+}
+
+/**
+ * \brief Move the older backups along and put the new one in place
+ * \return Boolean failure
+ */
+int Backup_int_Rotate(void)
+{
+	for( int i = giBackup_Keep - 1; i > 0; i -- )
+	{
+		char	*from = (i == 1 ? mkstr("%s", gsBackup_File) : mkstr("%s.%i", gsBackup_File, i - 1));
+		char	*to = mkstr("%s.%i", gsBackup_File, i);
+		if( rename(from, to) && errno != ENOENT )
+			Log_Error("Unable to rename backup '%s' to '%s'", from, to);
+		free(from);
+		free(to);
+	}
+
+	if( rename(gsBackup_TempFile, gsBackup_File) ) {
+		Log_Error("Unable to rename backup '%s' to '%s'", gsBackup_TempFile, gsBackup_File);
+		unlink(gsBackup_TempFile);
+		return 1;
+	}
+	return 0;
+}
+
+int64_t Backup_int_Micros(const struct timespec *Start)
+{
+	struct timespec	now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(now.tv_sec - Start->tv_sec) * 1000000 + (now.tv_nsec - Start->tv_nsec) / 1000;
+}
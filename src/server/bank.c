@@ -0,0 +1,238 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * bank.c - Cokebank backend loader
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - The backend is a shared library exporting `gCokebank_Interface`, the
+ *   Bank_* functions here forward to it (so handlers and the rest of the
+ *   server keep using the API in cokebank.h).
+ * - Successful transfers are reported to WATCH subscribers. Inside a
+ *   transaction that waits until it is committed (and is dropped if it isn't).
+ * - Transactions are only used by the server thread, which is also the only
+ *   thread that changes balances, so nothing else can end up inside one.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+
+// === PROTOTYPES ===
+ int	Bank_Load(const char *Library);
+static void	Bank_int_BalanceChanged(int AcctID);
+
+// === GLOBALS ===
+const tCokebankInterface	*gpBank_Interface;
+void	*gBank_Library;
+bool	gbBank_InTransaction;
+ int	*gaBank_ChangedAccts;	// Balance changes waiting on the transaction
+ int	giBank_NumChanged;
+ int	giBank_MaxChanged;
+
+// === CODE ===
+/**
+ * \brief Load a cokebank backend
+ * \param Library	Path (or library search name) of the backend
+ * \return Boolean Failure
+ */
+int Bank_Load(const char *Library)
+{
+	const tCokebankInterface	*iface;
+
+	gBank_Library = dlopen(Library, RTLD_NOW|RTLD_LOCAL);
+	if( !gBank_Library ) {
+		fprintf(stderr, "ERROR: Unable to load cokebank '%s': %s\n", Library, dlerror());
+		return 1;
+	}
+
+	iface = dlsym(gBank_Library, "gCokebank_Interface");
+	if( !iface ) {
+		fprintf(stderr, "ERROR: '%s' is not a cokebank backend (no gCokebank_Interface)\n", Library);
+		dlclose(gBank_Library);
+		return 1;
+	}
+	if( iface->ABIVersion != COKEBANK_ABI_VERSION ) {
+		fprintf(stderr, "ERROR: Cokebank '%s' has ABI version %i, expected %i\n",
+			Library, iface->ABIVersion, COKEBANK_ABI_VERSION);
+		dlclose(gBank_Library);
+		return 1;
+	}
+
+	gpBank_Interface = iface;
+	return 0;
+}
+
+// --- Wrappers ---
+int Bank_Initialise(const char *Argument)
+{
+	return gpBank_Interface->Initialise(Argument);
+}
+
+int Bank_Transfer(int SourceAcct, int DestAcct, int Ammount, const char *Reason)
+{
+	 int	ret = gpBank_Interface->Transfer(SourceAcct, DestAcct, Ammount, Reason);
+	if( ret == 0 ) {
+		Bank_int_BalanceChanged(SourceAcct);
+		Bank_int_BalanceChanged(DestAcct);
+	}
+	return ret;
+}
+
+int Bank_GetFlags(int AcctID)
+{
+	return gpBank_Interface->GetFlags(AcctID);
+}
+
+int Bank_SetFlags(int AcctID, int Mask, int Value)
+{
+	return gpBank_Interface->SetFlags(AcctID, Mask, Value);
+}
+
+int Bank_GetBalance(int AcctID)
+{
+	return gpBank_Interface->GetBalance(AcctID);
+}
+
+char *Bank_GetAcctName(int AcctID)
+{
+	return gpBank_Interface->GetAcctName(AcctID);
+}
+
+int Bank_GetAcctByName(const char *Name, int bCreate)
+{
+	return gpBank_Interface->GetAcctByName(Name, bCreate);
+}
+
+int Bank_CreateAcct(const char *Name)
+{
+	return gpBank_Interface->CreateAcct(Name);
+}
+
+tAcctIterator *Bank_Iterator(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen)
+{
+	return gpBank_Interface->Iterator(FlagMask, FlagValues, Flags, MinMaxBalance, LastSeen);
+}
+
+int Bank_IteratorNext(tAcctIterator *It)
+{
+	return gpBank_Interface->IteratorNext(It);
+}
+
+void Bank_DelIterator(tAcctIterator *It)
+{
+	gpBank_Interface->DelIterator(It);
+}
+
+int Bank_GetUserAuth(const char *Salt, const char *Username, const char *Password)
+{
+	return gpBank_Interface->GetUserAuth(Salt, Username, Password);
+}
+
+int Bank_IsPinValid(int AcctID, int Pin)
+{
+	return gpBank_Interface->IsPinValid(AcctID, Pin);
+}
+
+void Bank_SetPin(int AcctID, int NewPin)
+{
+	gpBank_Interface->SetPin(AcctID, NewPin);
+}
+
+int Bank_GetAcctByCard(const char *CardID)
+{
+	return gpBank_Interface->GetAcctByCard(CardID);
+}
+
+int Bank_AddAcctCard(int AcctID, const char *CardID)
+{
+	return gpBank_Interface->AddAcctCard(AcctID, CardID);
+}
+
+char *Bank_GetAcctCards(int AcctID)
+{
+	return gpBank_Interface->GetAcctCards(AcctID);
+}
+
+int Bank_Snapshot(FILE *Out)
+{
+	return gpBank_Interface->Snapshot(Out);
+}
+
+tBankBackup *Bank_BackupStart(const char *Path)
+{
+	return gpBank_Interface->BackupStart(Path);
+}
+
+int Bank_BackupStep(tBankBackup *Backup, int Pages, int *Remaining, int *Total)
+{
+	return gpBank_Interface->BackupStep(Backup, Pages, Remaining, Total);
+}
+
+int Bank_BackupFinish(tBankBackup *Backup)
+{
+	return gpBank_Interface->BackupFinish(Backup);
+}
+
+int Bank_BeginTransaction(void)
+{
+	if( gbBank_InTransaction )
+		return 1;
+	if( gpBank_Interface->BeginTransaction() )
+		return 1;
+	gbBank_InTransaction = true;
+	giBank_NumChanged = 0;
+	return 0;
+}
+
+int Bank_CommitTransaction(void)
+{
+	 int	ret = gpBank_Interface->CommitTransaction();
+	gbBank_InTransaction = false;
+	if( ret == 0 ) {
+		for( int i = 0; i < giBank_NumChanged; i ++ )
+			Watch_BalanceChanged(gaBank_ChangedAccts[i]);
+	}
+	giBank_NumChanged = 0;
+	return ret;
+}
+
+void Bank_RollbackTransaction(void)
+{
+	gpBank_Interface->RollbackTransaction();
+	gbBank_InTransaction = false;
+	giBank_NumChanged = 0;
+}
+
+/**
+ * \brief Tell WATCH subscribers about a balance change (once it is saved)
+ */
+void Bank_int_BalanceChanged(int AcctID)
+{
+	if( !gbBank_InTransaction ) {
+		Watch_BalanceChanged(AcctID);
+		return ;
+	}
+	
+	for( int i = 0; i < giBank_NumChanged; i ++ )
+	{
+		if( gaBank_ChangedAccts[i] == AcctID )
+			return ;
+	}
+	if( giBank_NumChanged == giBank_MaxChanged )
+	{
+		 int	newmax = giBank_MaxChanged ? giBank_MaxChanged * 2 : 64;
+		 int	*newlist = realloc(gaBank_ChangedAccts, newmax * sizeof(int));
+		if( !newlist ) {
+			Watch_BalanceChanged(AcctID);	// Early is better than never
+			return ;
+		}
+		gaBank_ChangedAccts = newlist;
+		giBank_MaxChanged = newmax;
+	}
+	gaBank_ChangedAccts[giBank_NumChanged++] = AcctID;
+}
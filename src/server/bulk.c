@@ -0,0 +1,382 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * bulk.c - Account import/export (`dispsrv --import/--export/--snapshot <file>`)
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - CSV, one account per line: name,balance,flags,cards
+ *   <flags> are the account's flags as USER_FLAGS names them (so quoted if
+ *   there's more than one), <cards> are space separated MIFARE IDs. Blank
+ *   lines and lines starting with '#' are skipped.
+ * - Importing creates missing accounts, sets the flags to exactly those
+ *   listed, adds any cards that aren't on the account yet, and sets the
+ *   balance (an empty balance leaves it alone). Balances are moved from
+ *   >countersum like SET does, so the accounts still sum to zero. Internal
+ *   accounts only ever change balance through sales, so theirs are skipped.
+ * - The whole file is one bank transaction, a bad line rolls it all back.
+ * - Runs instead of the server, against the configured cokebank.
+ * - --snapshot is the raw tables as Bank_Snapshot writes them (what the
+ *   EXPORT command sends), for backups. It doesn't have to stop the server.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "../cokebank.h"
+
+// === PROTOTYPES ===
+ int	Bulk_Import(const char *File);
+ int	Bulk_Export(const char *File);
+ int	Bulk_Snapshot(const char *File);
+static int	Bulk_int_ImportLine(char *Line, int *bCreated);
+static int	Bulk_int_NextField(char **Pos, char **Field);
+static int	Bulk_int_ParseFlags(const char *Str);
+static void	Bulk_int_WriteField(FILE *Out, const char *Value);
+
+// === CONSTANTS ===
+const struct {
+	const char	*Name;
+	 int	Flag;
+}	caBulk_Flags[] = {
+	{"coke", USER_FLAG_COKE},
+	{"admin", USER_FLAG_ADMIN},
+	{"door", USER_FLAG_DOORGROUP},
+	{"internal", USER_FLAG_INTERNAL},
+	{"disabled", USER_FLAG_DISABLED}
+};
+#define NUM_BULK_FLAGS	((int)(sizeof(caBulk_Flags)/sizeof(caBulk_Flags[0])))
+#define ALL_USER_FLAGS	(USER_FLAG_COKE|USER_FLAG_ADMIN|USER_FLAG_DOORGROUP|USER_FLAG_INTERNAL|USER_FLAG_DISABLED)
+
+// === CODE ===
+/**
+ * \brief Load accounts from a CSV file
+ * \param File	Path to read, or "-" for stdin
+ * \return Boolean failure (nothing was changed)
+ */
+int Bulk_Import(const char *File)
+{
+	FILE	*in;
+	char	*line = NULL;
+	size_t	linespace = 0;
+	 int	lineno = 0, nAccounts = 0, nCreated = 0;
+	 int	rv = 0;
+
+	in = (strcmp(File, "-") == 0 ? stdin : fopen(File, "r"));
+	if( !in ) {
+		perror(File);
+		return 1;
+	}
+
+	if( Bank_BeginTransaction() ) {
+		fprintf(stderr, "Bulk_Import: Unable to start a transaction\n");
+		if( in != stdin )	fclose(in);
+		return 1;
+	}
+	Log_Hold();
+
+	while( getline(&line, &linespace, in) != -1 )
+	{
+		 int	created = 0;
+		lineno ++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if( line[strspn(line, " \t")] == '\0' || line[0] == '#' )
+			continue ;
+
+		if( Bulk_int_ImportLine(line, &created) ) {
+			fprintf(stderr, "%s:%i: Import failed, nothing was changed\n", File, lineno);
+			rv = 1;
+			break;
+		}
+		nAccounts ++;
+		nCreated += created;
+	}
+	if( !rv && ferror(in) ) {
+		perror(File);
+		rv = 1;
+	}
+	free(line);
+	if( in != stdin )	fclose(in);
+
+	if( rv ) {
+		Bank_RollbackTransaction();
+		Log_Release(false);
+		return 1;
+	}
+	if( Bank_CommitTransaction() ) {
+		Log_Release(false);
+		fprintf(stderr, "Bulk_Import: Unable to commit, nothing was changed\n");
+		return 1;
+	}
+	Log_Release(true);
+	Log_Info("import of %i accounts (%i new) from %s", nAccounts, nCreated, File);
+	return 0;
+}
+
+/**
+ * \brief Apply one account's line
+ */
+int Bulk_int_ImportLine(char *Line, int *bCreated)
+{
+	char	*pos = Line;
+	char	*name, *balance, *flags, *cards, *card;
+	 int	uid, wantFlags, wantBalance = 0, curBalance;
+
+	if( Bulk_int_NextField(&pos, &name) || Bulk_int_NextField(&pos, &balance)
+	 || Bulk_int_NextField(&pos, &flags) || Bulk_int_NextField(&pos, &cards) ) {
+		fprintf(stderr, "Bulk_Import: Badly quoted field\n");
+		return 1;
+	}
+	if( !name || !*name ) {
+		fprintf(stderr, "Bulk_Import: No account name\n");
+		return 1;
+	}
+	if( pos ) {
+		fprintf(stderr, "Bulk_Import: Too many fields for '%s'\n", name);
+		return 1;
+	}
+
+	if( balance && *balance )
+	{
+		char	*end;
+		long	val = strtol(balance, &end, 10);
+		if( *end || val < INT_MIN || val > INT_MAX ) {
+			fprintf(stderr, "Bulk_Import: Bad balance '%s' for '%s'\n", balance, name);
+			return 1;
+		}
+		wantBalance = val;
+	}
+	wantFlags = Bulk_int_ParseFlags(flags ? flags : "");
+	if( wantFlags < 0 )
+		return 1;
+
+	// Account
+	uid = Bank_GetAcctByName(name, 0);
+	if( uid == -1 ) {
+		uid = Bank_CreateAcct(name);
+		if( uid == -1 ) {
+			fprintf(stderr, "Bulk_Import: Unable to create '%s'\n", name);
+			return 1;
+		}
+		*bCreated = 1;
+	}
+	if( Bank_SetFlags(uid, ALL_USER_FLAGS, wantFlags) ) {
+		fprintf(stderr, "Bulk_Import: Unable to set flags on '%s'\n", name);
+		return 1;
+	}
+
+	// Cards
+	for( card = (cards ? strtok(cards, " ") : NULL); card; card = strtok(NULL, " ") )
+	{
+		 int	owner = Bank_GetAcctByCard(card);
+		if( owner == uid )
+			continue ;
+		if( owner != -1 || Bank_AddAcctCard(uid, card) ) {
+			fprintf(stderr, "Bulk_Import: Card '%s' for '%s' is already in use\n", card, name);
+			return 1;
+		}
+	}
+
+	// Balance
+	if( !balance || !*balance || (wantFlags & USER_FLAG_INTERNAL) )
+		return 0;
+	curBalance = Bank_GetBalance(uid);
+	if( curBalance == wantBalance )
+		return 0;
+	if( Bank_Transfer(Bank_GetAcctByName(COKEBANK_DEBT_ACCT, 1), uid, wantBalance - curBalance, "import") ) {
+		fprintf(stderr, "Bulk_Import: Unable to set the balance of '%s'\n", name);
+		return 1;
+	}
+	Log_Info("import: set balance of %s to %i [was %i]", name, wantBalance, curBalance);
+	return 0;
+}
+
+/**
+ * \brief Write every account as CSV (in the format Bulk_Import reads)
+ * \param File	Path to write, or "-" for stdout
+ * \return Boolean failure
+ */
+int Bulk_Export(const char *File)
+{
+	FILE	*out;
+	tAcctIterator	*it;
+	 int	uid;
+	 int	rv = 0;
+
+	out = (strcmp(File, "-") == 0 ? stdout : fopen(File, "w"));
+	if( !out ) {
+		perror(File);
+		return 1;
+	}
+
+	it = Bank_Iterator(0, 0, BANK_ITFLAG_SORT_NAME, 0, 0);
+	if( !it ) {
+		if( out != stdout )	fclose(out);
+		return 1;
+	}
+
+	fprintf(out, "# name,balance,flags,cards\n");
+	while( (uid = Bank_IteratorNext(it)) != -1 )
+	{
+		char	*name = Bank_GetAcctName(uid);
+		char	*cards = Bank_GetAcctCards(uid);
+		 int	flags = Bank_GetFlags(uid);
+		char	flagstr[64] = "";
+
+		if( !name || !cards || flags < 0 ) {
+			// Anonymous accounts can't be imported by name, so aren't exported
+			if( name )
+				fprintf(stderr, "Bulk_Export: Unable to read account %i, skipped\n", uid);
+			free(name);
+			free(cards);
+			continue ;
+		}
+
+		for( int i = 0; i < NUM_BULK_FLAGS; i ++ )
+		{
+			if( !(flags & caBulk_Flags[i].Flag) )	continue ;
+			if( flagstr[0] )	strcat(flagstr, ",");
+			strcat(flagstr, caBulk_Flags[i].Name);
+		}
+
+		Bulk_int_WriteField(out, name);
+		fprintf(out, ",%i,", Bank_GetBalance(uid));
+		Bulk_int_WriteField(out, flagstr);
+		fputc(',', out);
+		Bulk_int_WriteField(out, cards);
+		fputc('\n', out);
+
+		free(name);
+		free(cards);
+	}
+	Bank_DelIterator(it);
+
+	if( fflush(out) || ferror(out) ) {
+		perror(File);
+		rv = 1;
+	}
+	if( out != stdout && fclose(out) ) {
+		perror(File);
+		rv = 1;
+	}
+	return rv;
+}
+
+/**
+ * \brief Write a consistent copy of the bank's tables
+ * \param File	Path to write, or "-" for stdout
+ * \return Boolean failure
+ */
+int Bulk_Snapshot(const char *File)
+{
+	FILE	*out;
+	 int	rv;
+
+	out = (strcmp(File, "-") == 0 ? stdout : fopen(File, "w"));
+	if( !out ) {
+		perror(File);
+		return 1;
+	}
+	rv = Bank_Snapshot(out);
+	if( fflush(out) || ferror(out) ) {
+		perror(File);
+		rv = 1;
+	}
+	if( out != stdout && fclose(out) ) {
+		perror(File);
+		rv = 1;
+	}
+	return rv;
+}
+
+/**
+ * \brief Cut the next field off a CSV line (unquoting it in place)
+ * \param Pos	Start of the field, set to NULL after the last one
+ * \param Field	Set to the field, or NULL if there are no more
+ * \return Boolean failure (a quoted field that isn't closed, or is followed
+ *         by anything but a comma)
+ */
+int Bulk_int_NextField(char **Pos, char **Field)
+{
+	char	*field = *Pos, *out;
+
+	*Field = field;
+	if( !field )
+		return 0;
+
+	if( *field != '"' ) {
+		char	*comma = strchr(field, ',');
+		if( comma )	*comma++ = '\0';
+		*Pos = comma;
+		return 0;
+	}
+
+	// Quoted, a doubled quote is a literal one
+	out = field;
+	for( char *in = field + 1; *in; in ++ )
+	{
+		if( *in == '"' ) {
+			if( in[1] != '"' ) {
+				if( in[1] != ',' && in[1] != '\0' )
+					return 1;
+				*out = '\0';
+				*Pos = (in[1] == ',' ? in + 2 : NULL);
+				return 0;
+			}
+			in ++;
+		}
+		*out++ = *in;
+	}
+	// No closing quote
+	return 1;
+}
+
+/**
+ * \brief Convert a list of flag names to a flag set
+ * \return Flags, or -1 if a name isn't known
+ */
+int Bulk_int_ParseFlags(const char *Str)
+{
+	 int	ret = 0;
+
+	while( *Str )
+	{
+		size_t	len = strcspn(Str, ", ");
+		 int	i;
+		for( i = 0; i < NUM_BULK_FLAGS; i ++ )
+		{
+			if( strlen(caBulk_Flags[i].Name) == len && strncmp(Str, caBulk_Flags[i].Name, len) == 0 )
+				break;
+		}
+		if( i < NUM_BULK_FLAGS )
+			ret |= caBulk_Flags[i].Flag;
+		else if( !(len == 4 && strncmp(Str, "user", 4) == 0) ) {
+			// ("user" is what USER_INFO calls an account with no flags)
+			fprintf(stderr, "Bulk_Import: Unknown flag '%.*s'\n", (int)len, Str);
+			return -1;
+		}
+		Str += len;
+		Str += strspn(Str, ", ");
+	}
+	return ret;
+}
+
+void Bulk_int_WriteField(FILE *Out, const char *Value)
+{
+	if( !strpbrk(Value, ",\"") ) {
+		fputs(Value, Out);
+		return ;
+	}
+	fputc('"', Out);
+	for( ; *Value; Value ++ )
+	{
+		if( *Value == '"' )	fputc('"', Out);
+		fputc(*Value, Out);
+	}
+	fputc('"', Out);
+}
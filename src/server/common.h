@@ -10,6 +10,7 @@
 #define _COMMON_H_
 
 #include <stdbool.h>	// Because C
+#include <stdint.h>
 
 #include <regex.h>
 #include "../cokebank.h"
@@ -18,6 +19,12 @@
 #define	DEFAULT_CONFIG_FILE	"/etc/opendispense/main.cfg"
 #define	DEFAULT_ITEM_FILE	"/etc/opendispense/items.cfg"
 
+#define HANDLER_ABI_VERSION	2	//!< Version of tHandler/tHandlerModule
+
+// WATCH subscription flags
+#define WATCH_ITEMS	0x1	//!< Item changes (301/302)
+#define WATCH_BALANCES	0x2	//!< Balance changes (303)
+
 // === HELPER MACROS ===
 
 #define UNUSED(var)    unused__##var __attribute__((__unused__))
@@ -27,6 +34,50 @@ typedef struct sItem	tItem;
 typedef struct sUser	tUser;
 typedef struct sConfigItem	tConfigItem;
 typedef struct sHandler	tHandler;
+typedef struct sHandlerContext	tHandlerContext;
+typedef struct sListing	tListing;
+typedef struct sWatcher	tWatcher;
+typedef struct sIdentQuery	tIdentQuery;
+typedef struct sTimer	tTimer;
+
+/**
+ * \brief Dispense completion callback
+ * \param Result	Result of the dispense (DoDispense return semantics)
+ */
+typedef void	(*tHandlerCompletion)(void *Data, int Result);
+
+/**
+ * \brief IDENT lookup completion callback
+ * \param Username	User that owns the connection, NULL if the lookup failed
+ */
+typedef void	(*tIdentCompletion)(void *Data, const char *Username);
+
+typedef void	(*tTimerCallback)(void *Data);
+
+/**
+ * \brief Timer on the server thread (see Timer_Set), embedded in its owner
+ * \note Zero initialised is not set
+ */
+struct sTimer
+{
+	tTimer	*Next;
+	tTimer	**PrevNext;	//!< NULL when not set
+	int64_t	Expires;	//!< Tick it is due
+	tTimerCallback	Callback;
+	void	*Data;
+};
+
+/**
+ * \brief Rate limited actions (see RateLimit_Take)
+ */
+enum eRateLimitClasses
+{
+	RATELIMIT_CONNECT,	//!< New connections (per address)
+	RATELIMIT_AUTH,	//!< Login attempts (per address and per account)
+	RATELIMIT_PIN,	//!< PIN checks (per address and per account)
+	RATELIMIT_LISTING,	//!< Full item/user listings (per address)
+	NUM_RATELIMIT_CLASSES
+};
 
 struct sItem
 {
@@ -63,15 +114,63 @@ struct sHandler
 	 */
 	 int	(*CanDispense)(int User, int ID);
 	 int	(*DoDispense)(int User, int ID);
+
+	// --- Asynchronous interface (optional) ---
+	/**
+	 * \brief Begin a dispense, \a Complete is called (from any thread) once it finishes
+	 * \return 0 if started, non-zero (DoDispense codes) if it failed immediately
+	 * \note Handlers without this get a worker thread that calls DoDispense
+	 */
+	 int	(*StartDispense)(int User, int ID, tHandlerCompletion Complete, void *Data);
+	/**
+	 * \brief Query the status of several items in one call
+	 * \param Status	One CanDispense return value per entry in \a IDs
+	 * \return Boolean Failure
+	 */
+	 int	(*GetStatus)(int User, int NItems, const int *IDs, int *Status);
+	/**
+	 * \brief Minimum time between the starts of two dispenses (0 = none)
+	 * \note Dispenses that come too soon wait on the server's timer wheel
+	 */
+	 int	MinPeriodMS;
+
+	tHandlerContext	*Context;	//!< Execution context (managed by handler.c)
+	int64_t	NextStartMS;	//!< Earliest start of the next dispense (managed by handler.c)
+};
+
+/**
+ * \brief Descriptor exported by handler modules as `gHandler_Module`
+ */
+typedef struct sHandlerModule
+{
+	 int	ABIVersion;	//!< HANDLER_ABI_VERSION the module was built against
+	tHandler	*Handler;
+} tHandlerModule;
+
+/**
+ * \brief Pre-rendered ENUM_ITEMS response (see listing.c)
+ */
+struct sListing
+{
+	 int	RefCount;
+	unsigned int	Generation;	//!< Bumped whenever the item lines change
+	 int	Count;	//!< Number of items listed
+	char	*Data;	//!< Complete response (header, items and footer)
+	size_t	Length;
+	size_t	BodyOffset;	//!< Offset of the item lines in \a Data
+	size_t	BodyLength;
+	size_t	*LineEnds;	//!< End of each item line (relative to the body)
+	char	Buffer[];
 };
 
 // === GLOBALS ===
 extern tItem	*gaItems;
 extern int	giNumItems;
-extern tHandler	*gaHandlers[];
+extern tHandler	**gaHandlers;
 extern int	giNumHandlers;
 extern int	giDebugLevel;
 extern bool	gbNoCostMode;
+extern const char	*gsConfigFile;
 
 extern bool	gbSyslogDisabled;
 
@@ -81,13 +180,75 @@ extern void	Items_UpdateFile(void);
 // --- Helpers --
 extern void	StartPeriodicThread(void);
 extern void	AddPeriodicFunction(void (*Fcn)(void));
+extern void	WakePeriodicThread(void);
 extern void	CompileRegex(regex_t *Regex, const char *Pattern, int Flags);
 extern int	RunRegex(regex_t *regex, const char *string, int nMatches, regmatch_t *matches, const char *errorMessage);
 extern int	InitSerial(const char *Path, int BaudRate);
 extern char	*mkstr(const char *Format, ...);
 
+// --- Handlers ---
+extern int	Handler_Register(tHandler *Handler);
+extern tHandler	*Handler_GetByName(const char *Name, bool bLoad);
+extern int	Handler_StartWorkers(void);
+extern void	Handler_RunCompletions(void);
+extern int	Handler_StartDispense(tHandler *Handler, int User, int ID, tHandlerCompletion Complete, void *Data);
+extern int	Handler_CheckDispense(tHandler *Handler, int User, int ID, tHandlerCompletion Complete, void *Data);
+extern int	Handler_GetStatus(tHandler *Handler, int User, int NItems, const int *IDs, int *Status);
+extern int	Handler_CanDispense(tHandler *Handler, int User, int ID);
+
+// --- Item listing ---
+extern tListing	*Listing_Get(void);
+extern void	Listing_Release(tListing *Listing);
+extern void	Listing_Invalidate(void);
+extern void	Listing_Refresh(void);
+extern char	*Listing_GetChanges(unsigned int Since, size_t *Length);
+extern char	*Listing_FormatItem(const tItem *Item, int Status);
+extern int	Listing_GetStatus(const tItem *Item);
+
+// --- WATCH subscriptions ---
+extern int	Watch_Init(void);
+extern tWatcher	*Watch_Add(int Socket, int Mask, int Account);
+extern void	Watch_Remove(tWatcher *Watcher);
+extern bool	Watch_HaveItemWatchers(void);
+extern void	Watch_ItemChanged(const char *ItemID, const char *Line);
+extern void	Watch_BalanceChanged(int Account);
+extern void	Watch_RunEvents(void);
+extern void	Watch_FlushAll(void);
+
+// --- Trusted hosts ---
+struct sockaddr;
+extern int	Trust_Load(void);
+extern bool	Trust_IsTrusted(const struct sockaddr *Addr);
+
+// --- Timers ---
+extern int	Timer_Init(void);
+extern void	Timer_Set(tTimer *Timer, int DelayMS, tTimerCallback Callback, void *Data);
+extern void	Timer_Cancel(tTimer *Timer);
+extern void	Timer_Run(void);
+
+// --- Rate limiting ---
+extern int	RateLimit_Take(enum eRateLimitClasses Class, const void *Key, size_t KeyLen);
+
+// --- IDENT lookups ---
+extern int	Ident_Init(void);
+extern tIdentQuery	*Ident_Start(int Socket, tIdentCompletion Complete, void *Data);
+extern void	Ident_Cancel(tIdentQuery *Query);
+extern void	Ident_RunEvents(void);
+
+// --- Bank ---
+extern int	Bank_Load(const char *Library);
+
+// --- Backups ---
+extern void	Backup_Init(void);
+
+// --- Bulk import/export ---
+extern int	Bulk_Import(const char *File);
+extern int	Bulk_Export(const char *File);
+extern int	Bulk_Snapshot(const char *File);
+
 // --- Dispense ---
-extern int	DispenseItem(int ActualUser, int User, tItem *Item);
+extern int	DispenseItem(int ActualUser, int User, tItem *Item, tHandlerCompletion Complete, void *Data);
+extern int	DispenseImmediate(int ActualUser, int User, tItem *Item);
 extern int	DispenseRefund(int ActualUser, int DestUser, tItem *Item, int OverridePrice);
 extern int	DispenseGive(int ActualUser, int SrcUser, int DestUser, int Ammount, const char *ReasonGiven);
 extern int	DispenseAdd(int ActualUser, int User, int Ammount, const char *ReasonGiven);
@@ -99,6 +260,8 @@ extern int	DispenseUpdateItem(int User, tItem *Item, const char *NewName, int Ne
 // to syslog
 extern void	Log_Error(const char *Format, ...);
 extern void	Log_Info(const char *Format, ...);
+extern void	Log_Hold(void);
+extern void	Log_Release(bool bWrite);
 // To stdout
 #define Debug_Notice(msg, v...)	fprintf(stderr, "%08llun: "msg"\n", (unsigned long long)time(NULL) ,##v)
 #define Debug_Debug(msg, v...)	fprintf(stderr, "%08llud: "msg"\n", (unsigned long long)time(NULL) ,##v)
@@ -8,26 +8,101 @@
  int	_GetMinBalance(int Account);
  int	_CanTransfer(int Source, int Destination, int Ammount);
  int	_Transfer(int Source, int Destination, int Ammount, const char *Reason);
- int	_GetSalesAcct(tItem *Item);
+ int	_GetSalesAcct(tHandler *Handler);
+
+// === TYPES ===
+typedef struct sDispenseState
+{
+	 int	ActualUser;
+	 int	User;
+	 int	Price;
+	tHandler	*Handler;
+	 int	ItemID;
+	tHandlerCompletion	Complete;
+	void	*Data;
+	char	ItemName[];	// Copied, the item list can be reloaded while a dispense is in progress
+} tDispenseState;
+
+// === PROTOTYPES ===
+ int	_DispenseCheck(int User, tItem *Item);
+ int	_DispensePay(int User, tHandler *Handler, int ItemID, const char *ItemName, int Price);
+void	_DispenseChecked(void *State, int Result);
+void	_DispenseComplete(void *State, int Result);
+void	_DispenseLog(int ActualUser, int User, int Price, tHandler *Handler, int ItemID, const char *ItemName);
 
 // === CODE ===
 /**
  * \brief Dispense an item for a user
  * 
  * The core of the dispense system, I kinda like it :)
+ *
+ * \return 0 if the dispense was started (\a Complete is called later with the
+ *         final result), otherwise the result code (and \a Complete is not called)
+ *         - 1: Unable to dispense, 2: No balance, -1: Unknown error
+ * \note The handler is asked if the item can be dispensed on its own context,
+ *       so \a Complete can also be given 1 or 2.
  */
-int DispenseItem(int ActualUser, int User, tItem *Item)
+int DispenseItem(int ActualUser, int User, tItem *Item, tHandlerCompletion Complete, void *Data)
 {
-	 int	ret, salesAcct;
-	tHandler	*handler;
-	char	*username, *actualUsername;
+	 int	ret;
+	tHandler	*handler = Item->Handler;
+	tDispenseState	*state;
+	
+	ret = _DispenseCheck(User, Item);
+	if( ret )	return ret;
+	
+	// Ask the handler (on its own context, it may have to talk to the hardware),
+	// then pay and drop in _DispenseChecked, finished in _DispenseComplete
+	state = malloc( sizeof(*state) + strlen(Item->Name) + 1 );
+	if( !state )	return -1;
+	state->ActualUser = ActualUser;
+	state->User = User;
+	state->Price = Item->Price;
+	state->Handler = handler;
+	state->ItemID = Item->ID;
+	state->Complete = Complete;
+	state->Data = Data;
+	strcpy(state->ItemName, Item->Name);
+	
+	if( Handler_CheckDispense( handler, User, Item->ID, _DispenseChecked, state ) ) {
+		free(state);
+		return -1;	// -1: Unknown Error
+	}
 	
-	handler = Item->Handler;
+	return 0;
+}
+
+/**
+ * \brief Dispense an item that has nothing to drive (e.g. pseudo items) straight away
+ * \return DispenseItem's result codes, 1 if the item needs its handler to dispense it
+ * \note Used for batches, where the result is needed before the batch is committed
+ */
+int DispenseImmediate(int ActualUser, int User, tItem *Item)
+{
+	 int	ret;
+	
+	if( Item->Handler->StartDispense || Item->Handler->DoDispense )
+		return 1;
 	
-	salesAcct = _GetSalesAcct(Item);
+	ret = _DispenseCheck(User, Item);
+	if( ret )	return ret;
+	if( Handler_CanDispense( Item->Handler, User, Item->ID ) )
+		return 1;
+	ret = _DispensePay(User, Item->Handler, Item->ID, Item->Name, Item->Price);
+	if( ret )	return ret;
+	
+	_DispenseLog(ActualUser, User, Item->Price, Item->Handler, Item->ID, Item->Name);
+	return 0;
+}
 
+/**
+ * \brief Check that the user can afford an item (without asking its handler)
+ * \return DispenseItem's result codes
+ */
+int _DispenseCheck(int User, tItem *Item)
+{
 	// Check if the user can afford it
-	if( Item->Price && !_CanTransfer(User, salesAcct, Item->Price) )
+	if( Item->Price && !_CanTransfer(User, _GetSalesAcct(Item->Handler), Item->Price) )
 	{
 		return 2;	// 2: No balance
 	}
@@ -36,65 +111,122 @@ int DispenseItem(int ActualUser, int User, tItem *Item)
 	if( strcmp(Item->Name, "dead") == 0 )
 		return 1;
 	
-	// Check if the dispense is possible
-	if( handler->CanDispense ) {
-		ret = handler->CanDispense( User, Item->ID );
-		if(ret)	return 1;	// 1: Unable to dispense
+	return 0;
+}
+
+/**
+ * \brief Take the money for an item
+ * \return DispenseItem's result codes
+ */
+int _DispensePay(int User, tHandler *Handler, int ItemID, const char *ItemName, int Price)
+{
+	 int	salesAcct = _GetSalesAcct(Handler);
+	char	*reason;
+	
+	if( !Price )
+		return 0;
+	
+	// The balance may have changed while the handler was asked
+	if( !_CanTransfer(User, salesAcct, Price) )
+		return 2;	// 2: No balance
+	
+	reason = mkstr("Dispense - %s:%i %s", Handler->Name, ItemID, ItemName);
+	if( _Transfer( User, salesAcct, Price, reason ) != 0 ) {
+		char	*username = Bank_GetAcctName(User);
+		Log_Error("Dispense failed (%s dispensing %s:%i '%s') - Cokebank error!",
+			username, Handler->Name, ItemID, ItemName);
+		free(reason);
+		free( username );
+		return -1;	// -1: Unknown error
 	}
+	free(reason);
+	return 0;
+}
+
+/**
+ * \brief The handler has said whether the item can be dispensed, pay and drop it
+ * \note Runs on the server thread (handler completion)
+ */
+void _DispenseChecked(void *State, int Result)
+{
+	tDispenseState	*state = State;
+	 int	ret;
 	
-	// Get username for debugging
-	username = Bank_GetAcctName(User);
+	if( Result ) {
+		ret = 1;	// 1: Unable to dispense
+		goto _fail;
+	}
 	
 	// Ordering: Pay, Drop. Worst case requires a refund, other ordering leads to drops when payment fails.
+	ret = _DispensePay(state->User, state->Handler, state->ItemID, state->ItemName, state->Price);
+	if( ret )
+		goto _fail;
+	
+	ret = Handler_StartDispense( state->Handler, state->User, state->ItemID, _DispenseComplete, state );
+	if( ret )
+		_DispenseComplete(state, ret);
+	return ;
+_fail:
+	if( state->Complete )
+		state->Complete(state->Data, ret);
+	free(state);
+}
+
+/**
+ * \brief Log the result of a dispense and pass it on to the requester
+ */
+void _DispenseComplete(void *State, int Result)
+{
+	tDispenseState	*state = State;
 	
-	// Take away money
-	if( Item->Price )
+	// The slot may have emptied (or turned out to be empty)
+	Listing_Invalidate();
+
+	if( Result )
 	{
-		char	*reason;
-		reason = mkstr("Dispense - %s:%i %s", handler->Name, Item->ID, Item->Name);
-		if( _Transfer( User, salesAcct, Item->Price, reason ) != 0 ) {
-			Log_Error("Dispense failed (%s dispensing %s:%i '%s') - Cokebank error!",
-				username, Item->Handler->Name, Item->ID, Item->Name);
-			free(reason);
-			free( username );
-			return -1;	// -1: Unknown error
-		}
-		free(reason);
+		char	*username = Bank_GetAcctName(state->User);
+		Log_Error("Dispense failed (%s dispensing %s:%i '%s')",
+			username, state->Handler->Name, state->ItemID, state->ItemName);
+		free( username );
+		if( state->Complete )
+			state->Complete(state->Data, -1);	// -1: Unknown Error
+		free( state );
+		return ;
 	}
 	
-	// Actually do the dispense
-	if( handler->DoDispense ) {
-		ret = handler->DoDispense( User, Item->ID );
-		if(ret) {
-			Log_Error("Dispense failed (%s dispensing %s:%i '%s')",
-				username, Item->Handler->Name, Item->ID, Item->Name);
-			free( username );
-			return -1;	// -1: Unknown Error
-		}
-	}
+	_DispenseLog(state->ActualUser, state->User, state->Price, state->Handler, state->ItemID, state->ItemName);
 	
-	actualUsername = Bank_GetAcctName(ActualUser);
+	if( state->Complete )
+		state->Complete(state->Data, 0);	// 0: EOK
+	free( state );
+}
+
+/**
+ * \brief Log a successful dispense
+ */
+void _DispenseLog(int ActualUser, int User, int Price, tHandler *Handler, int ItemID, const char *ItemName)
+{
+	char	*username = Bank_GetAcctName(User);
+	char	*actualUsername = Bank_GetAcctName(ActualUser);
 	
-	// And log that it happened
 	if( gbNoCostMode )
 	{
 		// Special format for zero cost dispenses
 		Log_Info("test dispense '%s' (%s:%i) for %s by %s [no change]",
-			Item->Name, handler->Name, Item->ID,
+			ItemName, Handler->Name, ItemID,
 			username, actualUsername
 			);
 	}
 	else
 	{
 		Log_Info("dispense '%s' (%s:%i) for %s by %s [cost %i, balance %i]",
-			Item->Name, handler->Name, Item->ID,
-			username, actualUsername, Item->Price, Bank_GetBalance(User)
+			ItemName, Handler->Name, ItemID,
+			username, actualUsername, Price, Bank_GetBalance(User)
 			);
 	}
 	
 	free( username );
 	free( actualUsername );
-	return 0;	// 0: EOK
 }
 
 /**
@@ -106,7 +238,7 @@ int DispenseRefund(int ActualUser, int DestUser, tItem *Item, int OverridePrice)
 	 int	src_acct, price;
 	char	*username, *actualUsername;
 
-	src_acct = _GetSalesAcct(Item);
+	src_acct = _GetSalesAcct(Item->Handler);
 
 	if( OverridePrice > 0 )
 		price = OverridePrice;
@@ -303,6 +435,7 @@ int DispenseUpdateItem(int User, tItem *Item, const char *NewName, int NewPrice)
 	
 	// Update item file
 	Items_UpdateFile();
+	Listing_Invalidate();
 	
 	return 0;
 }
@@ -366,10 +499,10 @@ int _Transfer(int Source, int Destination, int Ammount, const char *Reason)
 	return Bank_Transfer(Source, Destination, Ammount, Reason);
 }
 
-int _GetSalesAcct(tItem *Item)
+int _GetSalesAcct(tHandler *Handler)
 {
-	char string[sizeof(COKEBANK_SALES_PREFIX)+strlen(Item->Handler->Name)];
+	char string[sizeof(COKEBANK_SALES_PREFIX)+strlen(Handler->Name)];
 	strcpy(string, COKEBANK_SALES_PREFIX);
-	strcat(string, Item->Handler->Name);
+	strcat(string, Handler->Name);
 	return Bank_GetAcctByName(string, 1);
 }
@@ -0,0 +1,481 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * handler.c - Handler execution contexts and asynchronous dispense support
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - Handlers that only provide the synchronous DoDispense get a worker
+ *   thread (their execution context), which runs dispenses one at a time.
+ * - Handler_CheckDispense asks the same worker whether an item can be
+ *   dispensed, so a slow status query never runs on the server thread.
+ * - A handler with a MinPeriodMS has dispenses that come too soon held on the
+ *   timer wheel, instead of its worker sleeping through them (which would
+ *   also hold up its status checks).
+ * - All completions are queued and signalled through an eventfd, so the
+ *   caller's completion callback always runs on the server thread (from
+ *   Handler_RunCompletions), never from inside Handler_StartDispense.
+ * - Hardware handlers are shared libraries (handler_<name>.so) exporting a
+ *   tHandlerModule as `gHandler_Module`, loaded when the item list is read at
+ *   startup. A module that fails to load or initialise isn't tried again.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <dlfcn.h>
+
+// === TYPES ===
+typedef struct sHandlerJob	tHandlerJob;
+
+struct sHandlerJob
+{
+	tHandlerJob	*Next;
+	tHandler	*Handler;
+	 int	User;
+	 int	ID;
+	bool	bCheck;	// Only check if the item can be dispensed
+	tTimer	StartTimer;	// Waiting out the handler's MinPeriodMS
+	 int	Result;
+	tHandlerCompletion	Complete;
+	void	*Data;
+};
+
+struct sHandlerContext
+{
+	tHandler	*Handler;
+	pthread_t	Thread;
+	pthread_mutex_t	Lock;
+	pthread_cond_t	Cond;
+	tHandlerJob	*FirstJob;
+	tHandlerJob	*LastJob;
+};
+
+// === PROTOTYPES ===
+ int	Handler_Register(tHandler *Handler);
+tHandler	*Handler_GetByName(const char *Name, bool bLoad);
+static tHandler	*Handler_int_Load(const char *Name);
+static void	Handler_int_StartContext(tHandler *Handler);
+ int	Handler_StartWorkers(void);
+ int	Handler_StartDispense(tHandler *Handler, int User, int ID, tHandlerCompletion Complete, void *Data);
+static void	Handler_int_DelayedStart(void *Job);
+static int	Handler_int_Start(tHandlerJob *Job);
+static int64_t	Handler_int_NowMS(void);
+ int	Handler_CheckDispense(tHandler *Handler, int User, int ID, tHandlerCompletion Complete, void *Data);
+static void	Handler_int_QueueJob(tHandlerContext *Context, tHandlerJob *Job);
+ int	Handler_GetStatus(tHandler *Handler, int User, int NItems, const int *IDs, int *Status);
+ int	Handler_CanDispense(tHandler *Handler, int User, int ID);
+void	Handler_RunCompletions(void);
+void	*Handler_WorkerThread(void *Context);
+static void	Handler_int_PostCompletion(void *Job, int Result);
+
+// === GLOBALS ===
+const char	*gsHandler_Path;	// Directory containing handler modules (NULL = library search path)
+// - Handler list (protected by gHandler_ListLock)
+pthread_mutex_t	gHandler_ListLock = PTHREAD_MUTEX_INITIALIZER;
+tHandler	**gaHandlers;
+ int	giNumHandlers;
+char	**gasHandler_Failed;	// Modules that failed to load/initialise
+ int	giHandler_NumFailed;
+bool	gbHandler_WorkersStarted;
+// - Completions
+ int	giHandler_CompletionFD = -1;
+pthread_mutex_t	gHandler_CompletionLock = PTHREAD_MUTEX_INITIALIZER;
+tHandlerJob	*gpHandler_FirstCompletion;
+tHandlerJob	*gpHandler_LastCompletion;
+
+// === CODE ===
+/**
+ * \brief Initialise and add a handler to the handler list
+ * \return Boolean Failure
+ */
+int Handler_Register(tHandler *Handler)
+{
+	tHandler	**newlist;
+
+	if( Handler->Init && Handler->Init(0, NULL) ) {
+		fprintf(stderr, "ERROR: Initialisation of handler '%s' failed\n", Handler->Name);
+		return 1;
+	}
+
+	pthread_mutex_lock(&gHandler_ListLock);
+	newlist = realloc(gaHandlers, (giNumHandlers + 1) * sizeof(*gaHandlers));
+	if( !newlist ) {
+		pthread_mutex_unlock(&gHandler_ListLock);
+		return 1;
+	}
+	gaHandlers = newlist;
+	gaHandlers[giNumHandlers++] = Handler;
+	// Loaded after the server started, give it a worker now
+	if( gbHandler_WorkersStarted )
+		Handler_int_StartContext(Handler);
+	pthread_mutex_unlock(&gHandler_ListLock);
+
+	return 0;
+}
+
+/**
+ * \brief Find a handler by name
+ * \param bLoad	Load the handler's module if it isn't already loaded
+ * \note Only load from the main thread (at startup)
+ */
+tHandler *Handler_GetByName(const char *Name, bool bLoad)
+{
+	tHandler	*ret = NULL;
+
+	pthread_mutex_lock(&gHandler_ListLock);
+	for( int i = 0; i < giNumHandlers; i ++ )
+	{
+		if( strcmp(gaHandlers[i]->Name, Name) == 0 ) {
+			ret = gaHandlers[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&gHandler_ListLock);
+
+	if( !ret && bLoad )
+	{
+		for( int i = 0; i < giHandler_NumFailed; i ++ )
+		{
+			if( strcmp(gasHandler_Failed[i], Name) == 0 )
+				return NULL;
+		}
+
+		ret = Handler_int_Load(Name);
+		if( ret && Handler_Register(ret) )
+			ret = NULL;
+		if( !ret ) {
+			char	**newlist = realloc(gasHandler_Failed, (giHandler_NumFailed + 1) * sizeof(*newlist));
+			if( newlist ) {
+				gasHandler_Failed = newlist;
+				gasHandler_Failed[giHandler_NumFailed++] = strdup(Name);
+			}
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * \brief Load the module for a handler
+ */
+tHandler *Handler_int_Load(const char *Name)
+{
+	char	*path;
+	void	*lib;
+	const tHandlerModule	*module;
+
+	if( gsHandler_Path )
+		path = mkstr("%s/handler_%s.so", gsHandler_Path, Name);
+	else
+		path = mkstr("handler_%s.so", Name);
+
+	lib = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+	if( !lib ) {
+		fprintf(stderr, "ERROR: Unable to load handler '%s': %s\n", Name, dlerror());
+		free(path);
+		return NULL;
+	}
+
+	module = dlsym(lib, "gHandler_Module");
+	if( !module ) {
+		fprintf(stderr, "ERROR: '%s' is not a handler module (no gHandler_Module)\n", path);
+		goto _err;
+	}
+	if( module->ABIVersion != HANDLER_ABI_VERSION ) {
+		fprintf(stderr, "ERROR: Handler '%s' has ABI version %i, expected %i\n",
+			path, module->ABIVersion, HANDLER_ABI_VERSION);
+		goto _err;
+	}
+	if( strcmp(module->Handler->Name, Name) != 0 ) {
+		fprintf(stderr, "ERROR: '%s' provides handler '%s'\n", path, module->Handler->Name);
+		goto _err;
+	}
+
+	Debug_Notice("Loaded handler '%s' from %s", Name, path);
+	free(path);
+	return module->Handler;
+_err:
+	dlclose(lib);
+	free(path);
+	return NULL;
+}
+
+/**
+ * \brief Create the completion eventfd and the per-handler worker threads
+ * \return File descriptor that becomes readable when completions are ready
+ * \note Must be called after the server has forked
+ */
+int Handler_StartWorkers(void)
+{
+	giHandler_CompletionFD = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if( giHandler_CompletionFD == -1 ) {
+		perror("Handler_StartWorkers - eventfd");
+		return -1;
+	}
+
+	pthread_mutex_lock(&gHandler_ListLock);
+	for( int i = 0; i < giNumHandlers; i ++ )
+		Handler_int_StartContext(gaHandlers[i]);
+	gbHandler_WorkersStarted = true;
+	pthread_mutex_unlock(&gHandler_ListLock);
+
+	return giHandler_CompletionFD;
+}
+
+/**
+ * \brief Start the execution context (worker thread) for a synchronous handler
+ */
+void Handler_int_StartContext(tHandler *Handler)
+{
+	tHandlerContext	*ctx;
+
+	// Native asynchronous handlers (and ones with nothing to do) don't need a thread
+	if( Handler->StartDispense || !Handler->DoDispense )
+		return ;
+
+	ctx = calloc(1, sizeof(*ctx));
+	ctx->Handler = Handler;
+	pthread_mutex_init(&ctx->Lock, NULL);
+	pthread_cond_init(&ctx->Cond, NULL);
+	if( pthread_create(&ctx->Thread, NULL, Handler_WorkerThread, ctx) ) {
+		perror("Handler_int_StartContext - pthread_create");
+		free(ctx);
+		return ;
+	}
+	Handler->Context = ctx;
+}
+
+/**
+ * \brief Begin a dispense on a handler
+ * \return 0 if started (\a Complete will be called later), or a DoDispense
+ *         style code if the dispense could not be started.
+ */
+int Handler_StartDispense(tHandler *Handler, int User, int ID, tHandlerCompletion Complete, void *Data)
+{
+	tHandlerJob	*job;
+	 int	ret;
+
+	job = calloc(1, sizeof(*job));
+	if( !job )	return -1;
+	job->Handler = Handler;
+	job->User = User;
+	job->ID = ID;
+	job->Complete = Complete;
+	job->Data = Data;
+
+	// Too soon after the last one, start it from the timer wheel
+	if( Handler->MinPeriodMS > 0 )
+	{
+		int64_t	now = Handler_int_NowMS();
+		int64_t	start = (Handler->NextStartMS > now ? Handler->NextStartMS : now);
+		Handler->NextStartMS = start + Handler->MinPeriodMS;
+		if( start > now ) {
+			Debug_Debug("%s: Waiting %llims before dispensing (minimum period)",
+				Handler->Name, (long long)(start - now));
+			Timer_Set(&job->StartTimer, start - now, Handler_int_DelayedStart, job);
+			return 0;
+		}
+	}
+
+	ret = Handler_int_Start(job);
+	if( ret )
+		free(job);
+	return ret;
+}
+
+/**
+ * \brief Timer callback, start a dispense that was held for the minimum period
+ */
+void Handler_int_DelayedStart(void *Job)
+{
+	tHandlerJob	*job = Job;
+	 int	ret = Handler_int_Start(job);
+	// Already told the caller it started, so a failure is its completion
+	if( ret )
+		Handler_int_PostCompletion(job, ret);
+}
+
+/**
+ * \brief Hand a dispense to the handler
+ * \return 0 if started, otherwise a DoDispense code (the job is still the caller's)
+ */
+int Handler_int_Start(tHandlerJob *Job)
+{
+	tHandler	*handler = Job->Handler;
+
+	if( handler->StartDispense )
+		return handler->StartDispense(Job->User, Job->ID, Handler_int_PostCompletion, Job);
+
+	if( handler->Context )
+	{
+		Handler_int_QueueJob(handler->Context, Job);
+	}
+	else if( handler->DoDispense )
+	{
+		// No worker (thread creation failed), fall back to doing it inline
+		Handler_int_PostCompletion(Job, handler->DoDispense(Job->User, Job->ID));
+	}
+	else
+	{
+		// Pseudo handlers, nothing to do
+		Handler_int_PostCompletion(Job, 0);
+	}
+	return 0;
+}
+
+int64_t Handler_int_NowMS(void)
+{
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Check if an item can be dispensed, on the handler's execution context
+ * \param Complete	Called on the server thread with the CanDispense result
+ *                 (0: can dispense, 1: can't, -1: error)
+ * \return Boolean failure (\a Complete is not called)
+ * \note Handlers without a worker thread are asked straight away, but the
+ *       result still goes through the completion queue.
+ */
+int Handler_CheckDispense(tHandler *Handler, int User, int ID, tHandlerCompletion Complete, void *Data)
+{
+	tHandlerJob	*job;
+
+	job = calloc(1, sizeof(*job));
+	if( !job )	return 1;
+	job->Handler = Handler;
+	job->User = User;
+	job->ID = ID;
+	job->bCheck = true;
+	job->Complete = Complete;
+	job->Data = Data;
+
+	if( Handler->Context )
+		Handler_int_QueueJob(Handler->Context, job);
+	else
+		Handler_int_PostCompletion(job, Handler_CanDispense(Handler, User, ID));
+	return 0;
+}
+
+void Handler_int_QueueJob(tHandlerContext *Context, tHandlerJob *Job)
+{
+	pthread_mutex_lock(&Context->Lock);
+	if( Context->LastJob )
+		Context->LastJob->Next = Job;
+	else
+		Context->FirstJob = Job;
+	Context->LastJob = Job;
+	pthread_cond_signal(&Context->Cond);
+	pthread_mutex_unlock(&Context->Lock);
+}
+
+/**
+ * \brief Get the status of several items owned by a handler
+ * \param Status	Filled with CanDispense return codes (0: avail, 1: sold, -1: error)
+ */
+int Handler_GetStatus(tHandler *Handler, int User, int NItems, const int *IDs, int *Status)
+{
+	if( Handler->GetStatus )
+		return Handler->GetStatus(User, NItems, IDs, Status);
+
+	for( int i = 0; i < NItems; i ++ )
+		Status[i] = (Handler->CanDispense ? Handler->CanDispense(User, IDs[i]) : 0);
+	return 0;
+}
+
+int Handler_CanDispense(tHandler *Handler, int User, int ID)
+{
+	 int	status;
+	if( Handler_GetStatus(Handler, User, 1, &ID, &status) )
+		return -1;
+	return status;
+}
+
+/**
+ * \brief Call the completion callbacks for all finished dispenses
+ * \note Called by the server thread when the completion FD is readable
+ */
+void Handler_RunCompletions(void)
+{
+	uint64_t	count;
+	tHandlerJob	*job, *next;
+
+	if( read(giHandler_CompletionFD, &count, sizeof(count)) < 0 && errno != EAGAIN )
+		perror("Handler_RunCompletions - read");
+
+	pthread_mutex_lock(&gHandler_CompletionLock);
+	job = gpHandler_FirstCompletion;
+	gpHandler_FirstCompletion = NULL;
+	gpHandler_LastCompletion = NULL;
+	pthread_mutex_unlock(&gHandler_CompletionLock);
+
+	for( ; job; job = next )
+	{
+		next = job->Next;
+		job->Complete(job->Data, job->Result);
+		free(job);
+	}
+}
+
+/**
+ * \brief Execution context for a synchronous handler
+ */
+void *Handler_WorkerThread(void *Context)
+{
+	tHandlerContext	*ctx = Context;
+
+	for( ;; )
+	{
+		tHandlerJob	*job;
+
+		pthread_mutex_lock(&ctx->Lock);
+		while( !ctx->FirstJob )
+			pthread_cond_wait(&ctx->Cond, &ctx->Lock);
+		job = ctx->FirstJob;
+		ctx->FirstJob = job->Next;
+		if( !ctx->FirstJob )
+			ctx->LastJob = NULL;
+		pthread_mutex_unlock(&ctx->Lock);
+
+		job->Next = NULL;
+		if( job->bCheck )
+			Handler_int_PostCompletion(job, Handler_CanDispense(ctx->Handler, job->User, job->ID));
+		else
+			Handler_int_PostCompletion(job, ctx->Handler->DoDispense(job->User, job->ID));
+	}
+	return NULL;
+}
+
+/**
+ * \brief Queue a finished job for the server thread (callable from any thread)
+ */
+void Handler_int_PostCompletion(void *Job, int Result)
+{
+	tHandlerJob	*job = Job;
+	uint64_t	one = 1;
+
+	job->Result = Result;
+
+	pthread_mutex_lock(&gHandler_CompletionLock);
+	if( gpHandler_LastCompletion )
+		gpHandler_LastCompletion->Next = job;
+	else
+		gpHandler_FirstCompletion = job;
+	gpHandler_LastCompletion = job;
+	pthread_mutex_unlock(&gHandler_CompletionLock);
+
+	if( write(giHandler_CompletionFD, &one, sizeof(one)) != sizeof(one) )
+		perror("Handler_int_PostCompletion - write");
+}
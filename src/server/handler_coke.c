@@ -34,27 +34,31 @@ const int	ciCoke_StatusBitBase = 16;
  int	Coke_InitHandler();
  int	Coke_CanDispense(int User, int Item);
  int	Coke_DoDispense(int User, int Item);
+ int	Coke_GetStatus(int User, int NItems, const int *Items, int *Status);
  int	Coke_int_ConnectToPLC(void);
  int	Coke_int_GetSlotFromItem(int Item, int bDispensing);
  int	Coke_int_IsSlotEmpty(int Slot);
  int	Coke_int_DropSlot(int Slot);
 static int	_ReadBit(int BitNum, uint8_t *Value);
+static int	_ReadBits(int BitNum, int Count, uint8_t *Values);
 static int	_WriteBit(int BitNum, uint8_t Value);
 
 // === GLOBALS ===
 tHandler	gCoke_Handler = {
-	"coke",
-	Coke_InitHandler,
-	Coke_CanDispense,
-	Coke_DoDispense
+	.Name = "coke",
+	.Init = Coke_InitHandler,
+	.CanDispense = Coke_CanDispense,
+	.DoDispense = Coke_DoDispense,
+	.GetStatus = Coke_GetStatus
 };
+const tHandlerModule	gHandler_Module = {HANDLER_ABI_VERSION, &gCoke_Handler};
 // - Config
 const char	*gsCoke_ModbusAddress = "130.95.13.73";
  int		giCoke_ModbusPort = 502;
 bool	gbCoke_DummyMode = false;
 // - State
+pthread_mutex_t	gCoke_Lock = PTHREAD_MUTEX_INITIALIZER;	// Protects the modbus connection and slot rotation
 modbus_t	*gCoke_Modbus;
-time_t	gtCoke_LastDispenseTime;
 time_t	gtCoke_LastReconnectTime;
  int	giCoke_NextCokeSlot = 0;
 
@@ -65,10 +69,18 @@ int Coke_InitHandler()
 	// TODO: Find a better way of handling missing/invalid options
 	Config_GetValue_Bool("coke_dummy_mode", &gbCoke_DummyMode);
 
+	if( !Config_GetValue_Str("coke_modbus_address", &gsCoke_ModbusAddress) && !gbCoke_DummyMode ) {
+		fprintf(stderr, "ERROR: coke_modbus_address is required for the coke handler\n");
+		return 1;
+	}
+	Config_GetValue_Int("coke_modbus_port", &giCoke_ModbusPort);
+
 	// Open modbus
 	if( !gbCoke_DummyMode )
 	{
 		Coke_int_ConnectToPLC();
+		// Held off by the server (on its timer wheel), not slept through here
+		gCoke_Handler.MinPeriodMS = ciCoke_MinPeriod * 1000;
 	}
 
 	return 0;
@@ -76,17 +88,55 @@ int Coke_InitHandler()
 
 int Coke_CanDispense(int UNUSED(User), int Item)
 {
-	 int	slot;
+	 int	slot, ret;
 	
 	// Check for 'dummy' mode
 	if( gbCoke_DummyMode )
 		return 0;
 
+	pthread_mutex_lock(&gCoke_Lock);
 	// Get slot
 	slot = Coke_int_GetSlotFromItem(Item, 0);
-	if(slot < 0)	return -1;
+	if(slot < 0)
+		ret = -1;
+	else
+		ret = Coke_int_IsSlotEmpty(slot);
+	pthread_mutex_unlock(&gCoke_Lock);
+
+	return ret;
+}
+
+/**
+ * \brief Get the status of several items with a single read of the slot status bits
+ */
+int Coke_GetStatus(int UNUSED(User), int NItems, const int *Items, int *Status)
+{
+	uint8_t	full[10];
+	 int	rv;
+
+	if( gbCoke_DummyMode ) {
+		for( int i = 0; i < NItems; i ++ )
+			Status[i] = (Items[i] < 0 || Items[i] > 6) ? -1 : 0;
+		return 0;
+	}
 
-	return Coke_int_IsSlotEmpty(slot);
+	pthread_mutex_lock(&gCoke_Lock);
+	rv = _ReadBits(ciCoke_StatusBitBase, 10, full);
+	pthread_mutex_unlock(&gCoke_Lock);
+	if( rv )
+		perror("Coke_GetStatus - modbus_read_bits");
+
+	for( int i = 0; i < NItems; i ++ )
+	{
+		 int	item = Items[i];
+		if( rv || item < 0 || item > 6 )
+			Status[i] = -1;
+		else if( item < 6 )
+			Status[i] = !full[item];
+		else	// Coke is available if any of the coke slots (6-9) are full
+			Status[i] = !(full[6] || full[7] || full[8] || full[9]);
+	}
+	return 0;
 }
 
 /**
@@ -94,26 +144,24 @@ int Coke_CanDispense(int UNUSED(User), int Item)
  */
 int Coke_DoDispense(int UNUSED(User), int Item)
 {
-	 int	slot;
+	 int	slot, ret;
 	// Check for 'dummy' mode
 	if( gbCoke_DummyMode )
 		return 0;
 
+	if( Item < 0 || Item > 6 )	return -1;
+	
+	// Two dispenses are never less than ciCoke_MinPeriod apart (see MinPeriodMS)
+	pthread_mutex_lock(&gCoke_Lock);
 	// Get slot
 	slot = Coke_int_GetSlotFromItem(Item, 1);
-	if(slot < 0)	return -1;
-	
-	// Make sure there are not two dispenses within n seconds
-	if( time(NULL) - gtCoke_LastDispenseTime < ciCoke_MinPeriod )
-	{
-		 int	delay = ciCoke_MinPeriod - (time(NULL) - gtCoke_LastDispenseTime);
-		Debug_Debug("Waiting for %i seconds (rate limit)", delay);
-		sleep( delay );
-		Debug_Debug("wait done");
-	}
-	gtCoke_LastDispenseTime = time(NULL);
+	if(slot < 0)
+		ret = -1;
+	else
+		ret = Coke_int_DropSlot(slot);
+	pthread_mutex_unlock(&gCoke_Lock);
 
-	return Coke_int_DropSlot(slot);
+	return ret;
 }
 
 // --- INTERNAL FUNCTIONS ---
@@ -243,15 +291,20 @@ int Coke_int_DropSlot(int Slot)
 }
 
 int _ReadBit(int BitNum, uint8_t *Value)
+{
+	return _ReadBits(BitNum, 1, Value);
+}
+
+int _ReadBits(int BitNum, int Count, uint8_t *Values)
 {
 	errno = 0;
 	if( !gCoke_Modbus && Coke_int_ConnectToPLC() )
 		return -1;
-	if( modbus_read_bits( gCoke_Modbus, BitNum, 1, Value) >= 0 )
+	if( modbus_read_bits( gCoke_Modbus, BitNum, Count, Values) >= 0 )
 		return 0;
 	if( Coke_int_ConnectToPLC() )
 		return -1;
-	if( modbus_read_bits( gCoke_Modbus, BitNum, 1, Value) >= 0 )
+	if( modbus_read_bits( gCoke_Modbus, BitNum, Count, Values) >= 0 )
 		return 0;
 	return -1;
 }
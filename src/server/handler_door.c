@@ -6,24 +6,37 @@
  *
  * This file is licenced under the 3-clause BSD Licence. See the file
  * COPYING for full details.
+ *
+ * NOTES:
+ * - The relay port is kept open between unlocks (and reopened on error)
+ * - Repeated unlocks extend a single deadline (held in a timerfd), instead
+ *   of queuing back-to-back unlock cycles.
+ * - A failed re-lock is retried every DOOR_RELOCK_RETRY seconds until it works
  */
 #define	DEBUG	1
 
 #include "common.h"
+#include "../common/config.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pty.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define DOOR_UNLOCKED_DELAY	10	// Default time in seconds before the door re-locks
+#define DOOR_RELOCK_RETRY	1	// Seconds between attempts to re-lock after a failure
 
-#define DOOR_UNLOCKED_DELAY	10	// Time in seconds before the door re-locks
+// === CONSTANTS ===
+static const char	cDoor_RelayOn[3]  = "\xff\x01\x01";
+static const char	cDoor_RelayOff[3] = "\xff\x01\x00";
 
 // === IMPORTS ===
 
@@ -32,60 +45,91 @@ void*	Door_Lock(void* Unused);
  int	Door_InitHandler();
  int	Door_CanDispense(int User, int Item);
  int	Door_DoDispense(int User, int Item);
+ int	Door_GetStatus(int User, int NItems, const int *Items, int *Status);
+static void	Door_int_StartThread(void);
+static int	Door_int_OpenPort(void);
+static int	Door_int_SendCommand(const char *Command);
 
 // === GLOBALS ===
 tHandler	gDoor_Handler = {
-	"door",
-	Door_InitHandler,
-	Door_CanDispense,
-	Door_DoDispense
+	.Name = "door",
+	.Init = Door_InitHandler,
+	.CanDispense = Door_CanDispense,
+	.DoDispense = Door_DoDispense,
+	.GetStatus = Door_GetStatus
 };
-char	*gsDoor_SerialPort;	// Set from config in main.c
-sem_t	gDoor_UnlockSemaphore;
+const tHandlerModule	gHandler_Module = {HANDLER_ABI_VERSION, &gDoor_Handler};
+const char	*gsDoor_SerialPort;
+ int	giDoor_UnlockedDelay = DOOR_UNLOCKED_DELAY;
+// - State (protected by gDoor_StateLock)
+pthread_mutex_t	gDoor_StateLock = PTHREAD_MUTEX_INITIALIZER;
+ int	giDoor_SerialFD = -1;
+ int	giDoor_TimerFD = -1;
+bool	gbDoor_Unlocked;
+// - Lock thread
+pthread_once_t	gDoor_ThreadOnce = PTHREAD_ONCE_INIT;
 pthread_t	gDoor_LockThread;
-bool	gbDoor_LockThreadStarted;
 
 // === CODE ===
+/**
+ * \brief Re-lock thread
+ *
+ * Sleeps on the deadline timer, and sends the relay off command once the
+ * last unlock has expired.
+ */
 void* Door_Lock(void* Unused __attribute__((unused)))
 {
-	gbDoor_LockThreadStarted = true;
-	while(1)
+	for(;;)
 	{
-		sem_wait(&gDoor_UnlockSemaphore);
+		uint64_t	expirations;
+		struct itimerspec	remaining;
 
-		int door_serial_handle = InitSerial(gsDoor_SerialPort, 9600);
-		if(door_serial_handle < 0)
+		if( read(giDoor_TimerFD, &expirations, sizeof(expirations)) != sizeof(expirations) )
 		{
-			fprintf(stderr, "Unable to open door serial '%s'\n", gsDoor_SerialPort);
-			perror("Opening door port");
+			if( errno == EINTR )	continue;
+			perror("Door_Lock - read(timerfd)");
+			sleep(1);
+			continue;
 		}
 
-		// Disable local echo
+		pthread_mutex_lock(&gDoor_StateLock);
+		// Check that the deadline was not extended between the timer firing
+		// and us acquiring the lock
+		timerfd_gettime(giDoor_TimerFD, &remaining);
+		if( gbDoor_Unlocked && remaining.it_value.tv_sec == 0 && remaining.it_value.tv_nsec == 0 )
 		{
-			struct termios	info;
-			tcgetattr(door_serial_handle, &info);
-			info.c_cflag &= ~CLOCAL;
-			tcsetattr(door_serial_handle, TCSANOW, &info);
+			if( Door_int_SendCommand(cDoor_RelayOff) )
+			{
+				// Never leave the door open, keep trying until it locks
+				struct itimerspec	retry = {{0,0}, {DOOR_RELOCK_RETRY,0}};
+				Log_Error("Unable to lock the door (%s), retrying in %is", strerror(errno), DOOR_RELOCK_RETRY);
+				if( timerfd_settime(giDoor_TimerFD, 0, &retry, NULL) )
+					perror("Door_Lock - timerfd_settime");
+			}
+			else
+			{
+				gbDoor_Unlocked = false;
+				#if DEBUG
+				printf("Door_Lock: Door locked\n");
+				#endif
+			}
 		}
-
-		if(write(door_serial_handle, "\xff\x01\x01", 3) != 3)	// Relay ON
-		{
-			fprintf(stderr, "Failed to write Relay ON (unlock) command, errstr: %s", strerror(errno));
-		}
-
-		sleep(DOOR_UNLOCKED_DELAY);
-
-		if(write(door_serial_handle, "\xff\x01\x00", 3) != 3)	// Relay OFF
-		{
-			fprintf(stderr, "Failed to write Relay OFF (lock) command, errstr: %s", strerror(errno));
-		}
-
-		close(door_serial_handle);
+		pthread_mutex_unlock(&gDoor_StateLock);
 	}
+	return NULL;
 }
 
 int Door_InitHandler(void)
 {
+	Config_GetValue_Str("door_serial_port", &gsDoor_SerialPort);
+	if( Config_GetValue_Int("door_unlocked_delay", &giDoor_UnlockedDelay) )
+	{
+		if( giDoor_UnlockedDelay <= 0 ) {
+			fprintf(stderr, "door_unlocked_delay must be positive, using %i\n", DOOR_UNLOCKED_DELAY);
+			giDoor_UnlockedDelay = DOOR_UNLOCKED_DELAY;
+		}
+	}
+
 	// Thread started later
 
 	return 0;
@@ -95,24 +139,48 @@ int Door_InitHandler(void)
  */
 int Door_CanDispense(int User, int Item)
 {
+	 int	flags;
 	#if DEBUG
 	printf("Door_CanDispense: (User=%i,Item=%i)\n", User, Item);
 	#endif
 	// Sanity please
 	if( Item != 0 )	return -1;
-	
-	if( !(Bank_GetFlags(User) & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
+
+	flags = Bank_GetFlags(User);
+	if( flags < 0 )	return -1;
+	if( !(flags & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
 	{
 		#if DEBUG
 		printf("Door_CanDispense: User %i not in door\n", User);
 		#endif
 		return 1;
 	}
-	
+
 	#if DEBUG
 	printf("Door_CanDispense: User %i can open the door\n", User);
 	#endif
-	
+
+	return 0;
+}
+
+/**
+ * \brief Status of all door items, from a single flags lookup
+ */
+int Door_GetStatus(int User, int NItems, const int *Items, int *Status)
+{
+	 int	status, flags;
+
+	// No user (the shared item listing): show the door as available, whether
+	// a given user may open it is answered by ITEM_INFO and checked on dispense
+	if( User < 0 )
+		status = 0;
+	else if( (flags = Bank_GetFlags(User)) < 0 )
+		status = -1;
+	else
+		status = (flags & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) ? 0 : 1;
+
+	for( int i = 0; i < NItems; i ++ )
+		Status[i] = (Items[i] != 0 ? -1 : status);
 	return 0;
 }
 
@@ -120,41 +188,141 @@ int Door_CanDispense(int User, int Item)
  * \brief Actually do a dispense from the coke machine
  */
 int Door_DoDispense(int User, int Item)
-{	
+{
+	struct itimerspec	deadline = {{0,0}, {0,0}};
+	 int	ret = 0, flags;
+
 	#if DEBUG
 	printf("Door_DoDispense: (User=%i,Item=%i)\n", User, Item);
 	#endif
 
 	// Sanity please
 	if( Item != 0 )	return -1;
-	
-	// Check if user is in door
-	if( !(Bank_GetFlags(User) & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
+
+	// Check if user is in door (a failed lookup must not open it)
+	flags = Bank_GetFlags(User);
+	if( flags < 0 )	return -1;
+	if( !(flags & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
 	{
 		#if DEBUG
 		printf("Door_CanDispense: User %i not in door\n", User);
 		#endif
 		return 1;
 	}
-	
+
 	// Door thread spun up here because program is forked after thread created
-	if( !gbDoor_LockThreadStarted )
-	{
-		// Initialize semaphore, triggers door lock release if semaphore is greater than 0
-		sem_init(&gDoor_UnlockSemaphore, 0, 0);	
+	pthread_once(&gDoor_ThreadOnce, Door_int_StartThread);
+	if( giDoor_TimerFD == -1 )
+		return -1;
+
+	pthread_mutex_lock(&gDoor_StateLock);
 
-		pthread_create(&gDoor_LockThread, NULL, &Door_Lock, NULL);
+	// Only talk to the relay if the door is currently locked, otherwise just
+	// push the deadline back.
+	if( !gbDoor_Unlocked )
+	{
+		if( Door_int_SendCommand(cDoor_RelayOn) )
+		{
+			fprintf(stderr, "Failed to write Relay ON (unlock) command, errstr: %s\n", strerror(errno));
+			ret = -1;
+		}
+		else
+			gbDoor_Unlocked = true;
 	}
 
-	if(sem_post(&gDoor_UnlockSemaphore))
+	if( ret == 0 )
 	{
-		perror("Failed to post \"Unlock Door\" semaphore, sem_post returned");
-		return -1;
+		deadline.it_value.tv_sec = giDoor_UnlockedDelay;
+		if( timerfd_settime(giDoor_TimerFD, 0, &deadline, NULL) )
+		{
+			// Can't schedule the re-lock, so don't leave the door open
+			perror("Door_DoDispense - timerfd_settime");
+			Door_int_SendCommand(cDoor_RelayOff);
+			gbDoor_Unlocked = false;
+			ret = -1;
+		}
 	}
 
+	pthread_mutex_unlock(&gDoor_StateLock);
+
 	#if DEBUG
-	printf("Door_DoDispense: User %i opened door\n", User);
+	if( ret == 0 )
+		printf("Door_DoDispense: User %i opened door\n", User);
 	#endif
 
+	return ret;
+}
+
+// --- INTERNAL FUNCTIONS ---
+void Door_int_StartThread(void)
+{
+	giDoor_TimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if( giDoor_TimerFD == -1 ) {
+		perror("Door - timerfd_create");
+		return ;
+	}
+
+	if( pthread_create(&gDoor_LockThread, NULL, &Door_Lock, NULL) ) {
+		perror("Door - pthread_create");
+		close(giDoor_TimerFD);
+		giDoor_TimerFD = -1;
+		return ;
+	}
+}
+
+/**
+ * \brief Ensure that the relay port is open
+ * \note Call with gDoor_StateLock held
+ */
+int Door_int_OpenPort(void)
+{
+	if( giDoor_SerialFD != -1 )
+		return 0;
+
+	if( !gsDoor_SerialPort ) {
+		fprintf(stderr, "No door serial port configured (door_serial_port)\n");
+		errno = ENODEV;
+		return -1;
+	}
+
+	giDoor_SerialFD = InitSerial(gsDoor_SerialPort, 9600);
+	if( giDoor_SerialFD < 0 )
+	{
+		fprintf(stderr, "Unable to open door serial '%s'\n", gsDoor_SerialPort);
+		perror("Opening door port");
+		giDoor_SerialFD = -1;
+		return -1;
+	}
+
+	// Disable local echo
+	{
+		struct termios	info;
+		tcgetattr(giDoor_SerialFD, &info);
+		info.c_cflag &= ~CLOCAL;
+		tcsetattr(giDoor_SerialFD, TCSANOW, &info);
+	}
+
 	return 0;
 }
+
+/**
+ * \brief Write a relay command, reconnecting once if the port has gone away
+ * \note Call with gDoor_StateLock held
+ */
+int Door_int_SendCommand(const char *Command)
+{
+	for( int attempt = 0; attempt < 2; attempt ++ )
+	{
+		if( Door_int_OpenPort() )
+			return -1;
+
+		if( write(giDoor_SerialFD, Command, 3) == 3 )
+			return 0;
+
+		// Drop the handle and try again with a fresh one
+		perror("Door - relay write");
+		close(giDoor_SerialFD);
+		giDoor_SerialFD = -1;
+	}
+	return -1;
+}
@@ -1,5 +1,5 @@
 /*
- * OpenDispense 2 
+ * OpenDispense 2
  * UCC (University [of WA] Computer Club) Electronic Accounting System
  * - Dispense Server
  *
@@ -7,14 +7,56 @@
  *
  * This file is licenced under the 3-clause BSD Licence. See the file
  * COPYING for full details.
+ *
+ * NOTES:
+ * - Commands are sent as a single line, responses are "<code> <text>\n"
+ *   "V<nn>" - Vend slot <nn> (2xx: Vended, 201: Slot empty, 1xx: progress)
+ *   "S<nn>" - Query slot <nn> (200: Stocked, 201: Empty)
+ *   "SA"    - Query all slots (200: <100 characters, '1' for stocked slots>)
+ * - The reader thread owns the port: it opens/closes it, writes queued
+ *   commands (flushing stale input first) and parses the responses.
+ *   Request threads queue a command, wake it through an eventfd, and wait on
+ *   a condition variable (with a per-request timeout) for the final (>=200)
+ *   response code.
+ * - After a timeout, a late reply could be taken as the answer to the next
+ *   command, so input is discarded until the line has been quiet for
+ *   SNACK_QUIET_MS. Replies naming a slot ("Slot <nn> ...") must also name
+ *   the slot that was asked about.
  */
 #include "common.h"
+#include "../common/config.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <regex.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdarg.h>
+
+#define SNACK_RESPONSE_MAX	128	// Maximum length of response text (longer is truncated)
+#define SNACK_RECONNECT_DELAY	2	// Seconds between attempts to reopen the port
+#define SNACK_VEND_TIMEOUT	15	// Default seconds to wait for a vend to complete
+#define SNACK_STATUS_TIMEOUT	2	// Default seconds to wait for a status query
+#define SNACK_QUIET_MS	500	// Silence needed before the line is used again after a timeout
+
+// === TYPES ===
+enum eSnack_RxState
+{
+	SNACK_RX_CODE,	// Reading the three digit response code
+	SNACK_RX_TEXT,	// Reading the response text
+	SNACK_RX_DISCARD	// Malformed line, skip to the next newline
+};
+enum eSnack_ReqState
+{
+	SNACK_REQ_IDLE,	// Nothing outstanding
+	SNACK_REQ_QUEUED,	// Waiting for the reader thread to send it
+	SNACK_REQ_SENT	// On the wire, waiting for the final response
+};
 
 // === IMPORTS ===
 
@@ -22,31 +64,62 @@
  int	Snack_InitHandler();
  int	Snack_CanDispense(int User, int Item);
  int	Snack_DoDispense(int User, int Item);
+ int	Snack_GetStatus(int User, int NItems, const int *Items, int *Status);
+void	*Snack_ReaderThread(void *Unused);
+static void	Snack_int_StartThread(void);
+static int	Snack_int_OpenPort(void);
+static void	Snack_int_ClosePort(void);
+static void	Snack_int_SendRequest(void);
+static void	Snack_int_Wake(void);
+static void	Snack_int_RxByte(char Byte);
+static void	Snack_int_HandleResponse(int Code, const char *Text);
+static int	Snack_int_Request(int Timeout, int Slot, char *Text, size_t TextLen, const char *Format, ...);
 
 // === GLOBALS ===
 tHandler	gSnack_Handler = {
-	"snack",
-	Snack_InitHandler,
-	Snack_CanDispense,
-	Snack_DoDispense
+	.Name = "snack",
+	.Init = Snack_InitHandler,
+	.CanDispense = Snack_CanDispense,
+	.DoDispense = Snack_DoDispense,
+	.GetStatus = Snack_GetStatus
 };
-char	*gsSnack_SerialPort = "/dev/ttyS1";
-#if 0
- int	giSnack_SerialFD;
-regex_t	gSnack_ResponseRegex;
-#endif
+const tHandlerModule	gHandler_Module = {HANDLER_ABI_VERSION, &gSnack_Handler};
+// - Config
+const char	*gsSnack_SerialPort = "/dev/ttyS1";
+ int	giSnack_VendTimeout = SNACK_VEND_TIMEOUT;
+ int	giSnack_StatusTimeout = SNACK_STATUS_TIMEOUT;
+// - Port state (protected by gSnack_Lock, only changed by the reader thread)
+pthread_mutex_t	gSnack_Lock = PTHREAD_MUTEX_INITIALIZER;
+ int	giSnack_SerialFD = -1;
+bool	gbSnack_Draining;	// Discarding input after a timeout
+// - Outstanding request (protected by gSnack_Lock)
+pthread_mutex_t	gSnack_RequestLock = PTHREAD_MUTEX_INITIALIZER;	// Only one request on the wire at a time
+pthread_cond_t	gSnack_ResponseCond = PTHREAD_COND_INITIALIZER;
+enum eSnack_ReqState	gSnack_RequestState = SNACK_REQ_IDLE;
+char	gsSnack_RequestCmd[16];
+ int	giSnack_RequestLen;
+ int	giSnack_RequestSlot;	// Slot the reply should name, -1 for any
+ int	giSnack_ResponseCode;	// 0 = No response yet, -1 = Port error
+char	gsSnack_ResponseText[SNACK_RESPONSE_MAX+1];
+// - Reader thread
+pthread_once_t	gSnack_ThreadOnce = PTHREAD_ONCE_INIT;
+pthread_t	gSnack_ReaderThread;
+ int	giSnack_WakeFD = -1;
+enum eSnack_RxState	gSnack_RxState = SNACK_RX_CODE;
+ int	giSnack_RxCode;
+ int	giSnack_RxCodeDigits;
+char	gsSnack_RxText[SNACK_RESPONSE_MAX+1];
+ int	giSnack_RxTextLen;
 
 // == CODE ===
 int Snack_InitHandler()
 {
-#if 0
-	giSnack_SerialFD = InitSerial(gsSnack_SerialPort, 9600);
-	if( giSnack_SerialFD == -1 ) {
-		fprintf(stderr, "ERROR: Unable to open snack serial port ('%s')\n", gsSnack_SerialPort);
-	}
-	
-	regcomp(&gSnack_ResponseRegex, "^(\\d\\d\\d)(.*)$", REG_EXTENDED);
-#endif
+	Config_GetValue_Str("snack_serial_port", &gsSnack_SerialPort);
+	Config_GetValue_Int("snack_vend_timeout", &giSnack_VendTimeout);
+	Config_GetValue_Int("snack_status_timeout", &giSnack_StatusTimeout);
+
+	// Port is opened (and the reader thread started) on first use, as the
+	// server forks after handlers are initialised.
 	return 0;
 }
 
@@ -54,32 +127,375 @@ int Snack_CanDispense(int UNUSED(User), int Item)
 {
 	// Sanity please
 	if( Item < 0 || Item > 99 )	return -1;
-	
-	// Hmm... could we implement slot statuses?
-	
+
+	switch( Snack_int_Request(giSnack_StatusTimeout, Item, NULL, 0, "S%02i\n", Item) )
+	{
+	case 200:	return 0;	// Stocked
+	case 201:	return 1;	// Empty
+	default:	return -1;
+	}
+}
+
+/**
+ * \brief Get the status of several slots with one "SA" query
+ */
+int Snack_GetStatus(int UNUSED(User), int NItems, const int *Items, int *Status)
+{
+	char	slots[SNACK_RESPONSE_MAX+1];
+	 int	code;
+
+	code = Snack_int_Request(giSnack_StatusTimeout, -1, slots, sizeof(slots), "SA\n");
+	// Anything but a list of slots is a stray reply
+	if( code == 200 && slots[strspn(slots, "01")] != '\0' ) {
+		Debug_Notice("Snack: Bad slot list '%s'", slots);
+		code = -1;
+	}
+
+	for( int i = 0; i < NItems; i ++ )
+	{
+		 int	item = Items[i];
+		if( code != 200 || item < 0 || item > 99 || item >= (int)strlen(slots) )
+			Status[i] = -1;
+		else
+			Status[i] = (slots[item] == '1' ? 0 : 1);
+	}
 	return 0;
 }
 
 /**
- * \brief Actually do a dispense from the coke machine
+ * \brief Actually do a dispense from the snack machine
  */
 int Snack_DoDispense(int UNUSED(User), int Item)
 {
+	 int	code;
+
 	// Sanity please
 	if( Item < 0 || Item > 99 )	return -1;
 
-#if 0
-	char	tmp[32];
-	regmatch_t	matches[4];
+	code = Snack_int_Request(giSnack_VendTimeout, Item, NULL, 0, "V%02i\n", Item);
+	if( code == 201 )
+		return 1;	// Slot empty
+	if( code < 200 || code >= 300 ) {
+		Log_Error("Snack vend of slot %i failed (response %i)", Item, code);
+		return -1;
+	}
+
+	return 0;
+}
+
+// --- Reader Thread ---
+void *Snack_ReaderThread(void *Unused __attribute__((unused)))
+{
+	for( ;; )
+	{
+		struct pollfd	pfds[2];
+		char	buf[64];
+		 int	len, rv, timeout;
+		bool	draining;
+
+		pthread_mutex_lock(&gSnack_Lock);
+		if( giSnack_SerialFD == -1 )
+		{
+			pthread_mutex_unlock(&gSnack_Lock);
+			sleep(SNACK_RECONNECT_DELAY);
+			pthread_mutex_lock(&gSnack_Lock);
+			Snack_int_OpenPort();
+			pthread_mutex_unlock(&gSnack_Lock);
+			continue ;
+		}
+		if( gSnack_RequestState == SNACK_REQ_QUEUED )
+			Snack_int_SendRequest();
+		pfds[0].fd = giSnack_SerialFD;
+		timeout = (gbSnack_Draining ? SNACK_QUIET_MS : -1);
+		pthread_mutex_unlock(&gSnack_Lock);
+
+		if( pfds[0].fd == -1 )
+			continue ;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = giSnack_WakeFD;
+		pfds[1].events = POLLIN;
+		rv = poll(pfds, 2, timeout);
+		if( rv < 0 ) {
+			if( errno == EINTR )	continue ;
+			perror("Snack_ReaderThread - poll");
+			sleep(1);
+			continue ;
+		}
+		if( rv == 0 )
+		{
+			// Quiet for long enough, the line can be used again
+			pthread_mutex_lock(&gSnack_Lock);
+			gbSnack_Draining = false;
+			pthread_cond_broadcast(&gSnack_ResponseCond);
+			pthread_mutex_unlock(&gSnack_Lock);
+			continue ;
+		}
+		if( pfds[1].revents & POLLIN )
+		{
+			uint64_t	count;
+			if( read(giSnack_WakeFD, &count, sizeof(count)) < 0 && errno != EAGAIN )
+				perror("Snack_ReaderThread - read(eventfd)");
+		}
+		if( !(pfds[0].revents & (POLLIN|POLLHUP|POLLERR)) )
+			continue ;
+
+		len = read(pfds[0].fd, buf, sizeof(buf));
+		if( len < 0 && (errno == EAGAIN || errno == EINTR) )
+			continue ;
+		if( len <= 0 )
+		{
+			// Port has gone away (e.g. USB adapter unplugged), reopen later
+			Debug_Notice("Snack serial port error/EOF, reconnecting");
+			pthread_mutex_lock(&gSnack_Lock);
+			Snack_int_ClosePort();
+			pthread_mutex_unlock(&gSnack_Lock);
+			continue ;
+		}
+
+		pthread_mutex_lock(&gSnack_Lock);
+		draining = gbSnack_Draining;
+		pthread_mutex_unlock(&gSnack_Lock);
+		if( draining ) {
+			if( giDebugLevel >= 2 )
+				Debug_Debug("Snack: Discarded %i bytes after a timeout", len);
+			continue ;
+		}
+
+		for( int i = 0; i < len; i ++ )
+			Snack_int_RxByte(buf[i]);
+	}
+	return NULL;
+}
+
+/**
+ * \brief Response parser state machine
+ * \note Only called from the reader thread
+ */
+void Snack_int_RxByte(char Byte)
+{
+	if( Byte == '\r' )	return ;
+
+	switch( gSnack_RxState )
+	{
+	case SNACK_RX_CODE:
+		if( Byte >= '0' && Byte <= '9' ) {
+			giSnack_RxCode = giSnack_RxCode * 10 + (Byte - '0');
+			giSnack_RxCodeDigits ++;
+			if( giSnack_RxCodeDigits == 3 ) {
+				giSnack_RxTextLen = 0;
+				gSnack_RxState = SNACK_RX_TEXT;
+			}
+		}
+		else if( Byte == '\n' && giSnack_RxCodeDigits == 0 ) {
+			// Blank line, ignore
+		}
+		else {
+			gSnack_RxState = (Byte == '\n' ? SNACK_RX_CODE : SNACK_RX_DISCARD);
+			giSnack_RxCode = 0;
+			giSnack_RxCodeDigits = 0;
+		}
+		break;
+	case SNACK_RX_TEXT:
+		if( Byte == '\n' ) {
+			gsSnack_RxText[giSnack_RxTextLen] = '\0';
+			Snack_int_HandleResponse(giSnack_RxCode, gsSnack_RxText);
+			giSnack_RxCode = 0;
+			giSnack_RxCodeDigits = 0;
+			gSnack_RxState = SNACK_RX_CODE;
+		}
+		else if( giSnack_RxTextLen < SNACK_RESPONSE_MAX ) {
+			// Skip the separator space
+			if( giSnack_RxTextLen == 0 && Byte == ' ' )
+				break;
+			gsSnack_RxText[giSnack_RxTextLen++] = Byte;
+		}
+		break;
+	case SNACK_RX_DISCARD:
+		if( Byte == '\n' )
+			gSnack_RxState = SNACK_RX_CODE;
+		break;
+	}
+}
+
+void Snack_int_HandleResponse(int Code, const char *Text)
+{
+	if( giDebugLevel >= 2 )
+		Debug_Debug("Snack: %03i %s", Code, Text);
+
+	// 1xx codes are progress reports, keep waiting for the final code
+	if( Code < 200 )
+		return ;
+
+	pthread_mutex_lock(&gSnack_Lock);
+	if( gSnack_RequestState == SNACK_REQ_SENT && giSnack_ResponseCode == 0 )
+	{
+		 int	slot;
+		if( giSnack_RequestSlot >= 0 && sscanf(Text, "Slot %d", &slot) == 1 && slot != giSnack_RequestSlot ) {
+			Debug_Notice("Snack: Response '%03i %s' is not for slot %02i", Code, Text, giSnack_RequestSlot);
+		}
+		else {
+			giSnack_ResponseCode = Code;
+			strcpy(gsSnack_ResponseText, Text);
+			pthread_cond_broadcast(&gSnack_ResponseCond);
+		}
+	}
+	else {
+		Debug_Notice("Snack: Unsolicited response '%03i %s'", Code, Text);
+	}
+	pthread_mutex_unlock(&gSnack_Lock);
+}
+
+// --- Internals ---
+void Snack_int_StartThread(void)
+{
+	giSnack_WakeFD = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if( giSnack_WakeFD == -1 ) {
+		perror("Snack - eventfd");
+		return ;
+	}
 
-	// Dispense
-	sprintf(tmp, "V%02i\n", Item);
-	write(giSnack_SerialFD, tmp, 2);
+	pthread_mutex_lock(&gSnack_Lock);
+	Snack_int_OpenPort();
+	pthread_mutex_unlock(&gSnack_Lock);
 
-	// Get status
-	read(giSnack_SerialFD, tmp, sizeof(tmp)-1);
-	regexec(&gSnack_ResponseRegex, tmp, sizeof(matches)/sizeof(matches[0]), matches, 0);
-#endif
+	if( pthread_create(&gSnack_ReaderThread, NULL, Snack_ReaderThread, NULL) ) {
+		perror("Snack - pthread_create");
+		close(giSnack_WakeFD);
+		giSnack_WakeFD = -1;
+	}
+}
 
+/**
+ * \note Call with gSnack_Lock held, from the reader thread
+ */
+int Snack_int_OpenPort(void)
+{
+	if( giSnack_SerialFD != -1 )
+		return 0;
+
+	giSnack_SerialFD = InitSerial(gsSnack_SerialPort, 9600);
+	if( giSnack_SerialFD == -1 ) {
+		fprintf(stderr, "ERROR: Unable to open snack serial port ('%s')\n", gsSnack_SerialPort);
+		return -1;
+	}
+
+	gSnack_RxState = SNACK_RX_CODE;
+	giSnack_RxCode = 0;
+	giSnack_RxCodeDigits = 0;
 	return 0;
 }
+
+/**
+ * \note Call with gSnack_Lock held, from the reader thread
+ */
+void Snack_int_ClosePort(void)
+{
+	if( giSnack_SerialFD == -1 )
+		return ;
+	close(giSnack_SerialFD);
+	giSnack_SerialFD = -1;
+
+	// Fail any outstanding request
+	if( gSnack_RequestState != SNACK_REQ_IDLE && giSnack_ResponseCode == 0 ) {
+		giSnack_ResponseCode = -1;
+		pthread_cond_broadcast(&gSnack_ResponseCond);
+	}
+}
+
+/**
+ * \brief Put the queued command on the wire
+ * \note Call with gSnack_Lock held, from the reader thread
+ */
+void Snack_int_SendRequest(void)
+{
+	// Anything still in the buffer can't be a reply to this command
+	tcflush(giSnack_SerialFD, TCIFLUSH);
+	gSnack_RxState = SNACK_RX_CODE;
+	giSnack_RxCode = 0;
+	giSnack_RxCodeDigits = 0;
+
+	if( write(giSnack_SerialFD, gsSnack_RequestCmd, giSnack_RequestLen) != giSnack_RequestLen )
+	{
+		perror("Snack - write");
+		Snack_int_ClosePort();
+		return ;
+	}
+	gSnack_RequestState = SNACK_REQ_SENT;
+}
+
+/**
+ * \brief Wake the reader thread (to send a request, or re-check its timeout)
+ */
+void Snack_int_Wake(void)
+{
+	uint64_t	one = 1;
+	if( write(giSnack_WakeFD, &one, sizeof(one)) != sizeof(one) )
+		perror("Snack - write(eventfd)");
+}
+
+/**
+ * \brief Send a command and wait for the final response code
+ * \param Slot	Slot the command is about (checked against the reply), or -1
+ * \param Text	Buffer for the response text (optional)
+ * \return Response code, or -1 on timeout/port error
+ */
+int Snack_int_Request(int Timeout, int Slot, char *Text, size_t TextLen, const char *Format, ...)
+{
+	 int	ret = 0;
+	va_list	args;
+	struct timespec	deadline;
+
+	pthread_once(&gSnack_ThreadOnce, Snack_int_StartThread);
+	if( giSnack_WakeFD == -1 )
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += Timeout;
+
+	pthread_mutex_lock(&gSnack_RequestLock);
+	pthread_mutex_lock(&gSnack_Lock);
+
+	// Wait out any late replies to an earlier request
+	while( gbSnack_Draining && ret != ETIMEDOUT )
+		ret = pthread_cond_timedwait(&gSnack_ResponseCond, &gSnack_Lock, &deadline);
+	if( gbSnack_Draining || giSnack_SerialFD == -1 ) {
+		pthread_mutex_unlock(&gSnack_Lock);
+		pthread_mutex_unlock(&gSnack_RequestLock);
+		return -1;
+	}
+
+	va_start(args, Format);
+	giSnack_RequestLen = vsnprintf(gsSnack_RequestCmd, sizeof(gsSnack_RequestCmd), Format, args);
+	va_end(args);
+	giSnack_RequestSlot = Slot;
+	giSnack_ResponseCode = 0;
+	gSnack_RequestState = SNACK_REQ_QUEUED;
+	Snack_int_Wake();
+
+	while( giSnack_ResponseCode == 0 )
+	{
+		if( pthread_cond_timedwait(&gSnack_ResponseCond, &gSnack_Lock, &deadline) == ETIMEDOUT ) {
+			Debug_Notice("Snack: Timed out waiting for response to '%.*s'",
+				giSnack_RequestLen-1, gsSnack_RequestCmd);
+			giSnack_ResponseCode = -1;
+			// The reply may still turn up, ignore everything until it goes quiet
+			if( gSnack_RequestState == SNACK_REQ_SENT ) {
+				gbSnack_Draining = true;
+				Snack_int_Wake();
+			}
+		}
+	}
+	ret = giSnack_ResponseCode;
+	if( Text && TextLen ) {
+		if( ret > 0 )
+			snprintf(Text, TextLen, "%s", gsSnack_ResponseText);
+		else
+			Text[0] = '\0';
+	}
+	gSnack_RequestState = SNACK_REQ_IDLE;
+
+	pthread_mutex_unlock(&gSnack_Lock);
+	pthread_mutex_unlock(&gSnack_RequestLock);
+
+	return ret;
+}
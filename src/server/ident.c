@@ -0,0 +1,393 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * ident.c - Non-blocking IDENT (RFC 1413) lookups for AUTHIDENT
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - Queries are sockets in a private epoll set, which the server thread
+ *   watches like any other FD (Ident_RunEvents when it is readable).
+ * - The query comes from the address the client connected to, so the remote
+ *   identd sees the same pair of addresses as the connection it is asked about.
+ * - Answers are kept for IDENT_CACHE_TIME, keyed by the client address and
+ *   both ports, so asking again about the same connection is instant.
+ * - Lookups that haven't finished after IDENT_TIMEOUT are failed from a
+ *   timer.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#define IDENT_PORT	113
+#define IDENT_TIMEOUT	5	// Seconds
+#define IDENT_CACHE_TIME	60	// Seconds
+#define IDENT_CACHE_SIZE	32
+#define IDENT_REPLY_MAX	512	// RFC 1413 limits replies to 1000 bytes, real ones are short
+#define IDENT_MAX_EVENTS	16
+
+// === TYPES ===
+enum eIdentStates
+{
+	IDENTSTATE_CONNECTING,
+	IDENTSTATE_READING,
+};
+
+struct sIdentQuery
+{
+	 int	Socket;
+	enum eIdentStates	State;
+	tTimer	Timeout;
+	struct sockaddr_storage	Peer;	// Client address (cache key)
+	 int	PeerPort;
+	 int	LocalPort;
+	tIdentCompletion	Complete;
+	void	*Data;
+	char	Reply[IDENT_REPLY_MAX];
+	 int	ReplyLen;
+};
+
+typedef struct sIdentCacheEnt
+{
+	time_t	Expires;
+	struct sockaddr_storage	Peer;
+	 int	PeerPort;
+	 int	LocalPort;
+	char	*Username;
+} tIdentCacheEnt;
+
+// === PROTOTYPES ===
+ int	Ident_Init(void);
+tIdentQuery	*Ident_Start(int Socket, tIdentCompletion Complete, void *Data);
+void	Ident_Cancel(tIdentQuery *Query);
+void	Ident_RunEvents(void);
+static void	Ident_int_Timeout(void *Query);
+static void	Ident_int_Progress(tIdentQuery *Query, uint32_t Events);
+static void	Ident_int_Finish(tIdentQuery *Query, const char *Username);
+static void	Ident_int_Free(tIdentQuery *Query);
+static char	*Ident_int_ParseReply(char *Reply, int PeerPort, int LocalPort);
+static int	Ident_int_GetPort(const struct sockaddr_storage *Addr);
+static void	Ident_int_SetPort(struct sockaddr_storage *Addr, int Port);
+static bool	Ident_int_SameHost(const struct sockaddr_storage *A, const struct sockaddr_storage *B);
+static tIdentCacheEnt	*Ident_int_CacheFind(const struct sockaddr_storage *Peer, int PeerPort, int LocalPort);
+static void	Ident_int_CacheAdd(const tIdentQuery *Query, const char *Username);
+
+// === GLOBALS ===
+ int	giIdent_EPollFD = -1;
+tIdentCacheEnt	gaIdent_Cache[IDENT_CACHE_SIZE];
+ int	giIdent_NextCacheSlot;
+
+// === CODE ===
+/**
+ * \brief Create the set that queries are watched in
+ * \return File descriptor that becomes readable when a query has progressed
+ */
+int Ident_Init(void)
+{
+	giIdent_EPollFD = epoll_create1(EPOLL_CLOEXEC);
+	if( giIdent_EPollFD == -1 )
+		perror("Ident_Init - epoll_create1");
+	return giIdent_EPollFD;
+}
+
+/**
+ * \brief Ask the client's host who owns a connection
+ * \param Socket	Client connection to identify
+ * \param Complete	Called with the username (NULL on failure) once known
+ * \return Query handle, or NULL if \a Complete has already been called
+ */
+tIdentQuery *Ident_Start(int Socket, tIdentCompletion Complete, void *Data)
+{
+	struct sockaddr_storage	local, remote;
+	socklen_t	len;
+	tIdentQuery	*query;
+	tIdentCacheEnt	*cached;
+
+	len = sizeof(remote);
+	if( getpeername(Socket, (struct sockaddr*)&remote, &len) ) {
+		perror("Ident_Start - getpeername");
+		Complete(Data, NULL);
+		return NULL;
+	}
+	len = sizeof(local);
+	if( getsockname(Socket, (struct sockaddr*)&local, &len) ) {
+		perror("Ident_Start - getsockname");
+		Complete(Data, NULL);
+		return NULL;
+	}
+	if( remote.ss_family != AF_INET && remote.ss_family != AF_INET6 ) {
+		Complete(Data, NULL);
+		return NULL;
+	}
+
+	cached = Ident_int_CacheFind(&remote, Ident_int_GetPort(&remote), Ident_int_GetPort(&local));
+	if( cached ) {
+		Complete(Data, cached->Username);
+		return NULL;
+	}
+
+	query = calloc(1, sizeof(*query));
+	query->Peer = remote;
+	query->PeerPort = Ident_int_GetPort(&remote);
+	query->LocalPort = Ident_int_GetPort(&local);
+	query->Complete = Complete;
+	query->Data = Data;
+	query->State = IDENTSTATE_CONNECTING;
+
+	// Connect from our end of the client's connection to port 113 on theirs
+	query->Socket = socket(remote.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if( query->Socket < 0 ) {
+		perror("Ident_Start - socket");
+		free(query);
+		Complete(Data, NULL);
+		return NULL;
+	}
+	Ident_int_SetPort(&local, 0);
+	Ident_int_SetPort(&remote, IDENT_PORT);
+	len = (remote.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	if( bind(query->Socket, (struct sockaddr*)&local, len) )
+		perror("Ident_Start - bind");
+	if( connect(query->Socket, (struct sockaddr*)&remote, len) && errno != EINPROGRESS ) {
+		close(query->Socket);
+		free(query);
+		Complete(Data, NULL);
+		return NULL;
+	}
+
+	{
+		struct epoll_event	ev = {.events = EPOLLOUT, .data.ptr = query};
+		if( epoll_ctl(giIdent_EPollFD, EPOLL_CTL_ADD, query->Socket, &ev) ) {
+			perror("Ident_Start - epoll_ctl");
+			close(query->Socket);
+			free(query);
+			Complete(Data, NULL);
+			return NULL;
+		}
+	}
+
+	Timer_Set(&query->Timeout, IDENT_TIMEOUT * 1000, Ident_int_Timeout, query);
+	return query;
+}
+
+/**
+ * \brief Abandon a query (the client went away), the callback is not called
+ */
+void Ident_Cancel(tIdentQuery *Query)
+{
+	Ident_int_Free(Query);
+}
+
+/**
+ * \brief Move on any queries that have something to do
+ * \note Called by the server thread when the Ident_Init FD is readable
+ */
+void Ident_RunEvents(void)
+{
+	struct epoll_event	events[IDENT_MAX_EVENTS];
+	 int	nEvents;
+
+	nEvents = epoll_wait(giIdent_EPollFD, events, IDENT_MAX_EVENTS, 0);
+	if( nEvents < 0 ) {
+		if( errno != EINTR )
+			perror("Ident_RunEvents - epoll_wait");
+		return ;
+	}
+	for( int i = 0; i < nEvents; i ++ )
+		Ident_int_Progress(events[i].data.ptr, events[i].events);
+}
+
+/**
+ * \brief Fail a query whose identd hasn't answered in time
+ */
+void Ident_int_Timeout(void *QueryPtr)
+{
+	tIdentQuery	*query = QueryPtr;
+	Debug_Debug("IDENT query to port %i timed out", query->PeerPort);
+	Ident_int_Finish(query, NULL);
+}
+
+void Ident_int_Progress(tIdentQuery *Query, uint32_t Events)
+{
+	if( Query->State == IDENTSTATE_CONNECTING )
+	{
+		 int	err = 0;
+		socklen_t	len = sizeof(err);
+		char	request[32];
+		 int	reqLen;
+
+		getsockopt(Query->Socket, SOL_SOCKET, SO_ERROR, &err, &len);
+		if( err || (Events & (EPOLLERR|EPOLLHUP)) ) {
+			Ident_int_Finish(Query, NULL);
+			return ;
+		}
+
+		// "<port on server>, <port on client>" from the identd's point of view
+		reqLen = snprintf(request, sizeof(request), "%i , %i\r\n", Query->PeerPort, Query->LocalPort);
+		if( send(Query->Socket, request, reqLen, MSG_DONTWAIT|MSG_NOSIGNAL) != reqLen ) {
+			Ident_int_Finish(Query, NULL);
+			return ;
+		}
+
+		Query->State = IDENTSTATE_READING;
+		{
+			struct epoll_event	ev = {.events = EPOLLIN, .data.ptr = Query};
+			epoll_ctl(giIdent_EPollFD, EPOLL_CTL_MOD, Query->Socket, &ev);
+		}
+		return ;
+	}
+
+	// IDENTSTATE_READING
+	for(;;)
+	{
+		 int	bytes;
+		char	*eol;
+
+		bytes = recv(Query->Socket, Query->Reply + Query->ReplyLen,
+			sizeof(Query->Reply) - 1 - Query->ReplyLen, MSG_DONTWAIT);
+		if( bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+			return ;
+		if( bytes <= 0 ) {
+			// Closed without a complete line
+			Ident_int_Finish(Query, NULL);
+			return ;
+		}
+		Query->ReplyLen += bytes;
+		Query->Reply[Query->ReplyLen] = '\0';
+
+		eol = strpbrk(Query->Reply, "\r\n");
+		if( eol ) {
+			*eol = '\0';
+			Ident_int_Finish(Query, Ident_int_ParseReply(Query->Reply, Query->PeerPort, Query->LocalPort));
+			return ;
+		}
+		if( Query->ReplyLen == (int)sizeof(Query->Reply) - 1 ) {
+			Ident_int_Finish(Query, NULL);
+			return ;
+		}
+	}
+}
+
+/**
+ * \brief Report the result and free the query
+ */
+void Ident_int_Finish(tIdentQuery *Query, const char *Username)
+{
+	if( Username )
+		Ident_int_CacheAdd(Query, Username);
+	// (Username may point into Query->Reply, so free afterwards)
+	Query->Complete(Query->Data, Username);
+	Ident_int_Free(Query);
+}
+
+void Ident_int_Free(tIdentQuery *Query)
+{
+	Timer_Cancel(&Query->Timeout);
+	// NOTE: close() removes the FD from the epoll set
+	close(Query->Socket);
+	free(Query);
+}
+
+/**
+ * \brief Pull the user ID out of an identd reply
+ *
+ * `<port> , <port> : USERID : <opsys> : <user id>`
+ * \return Pointer to the user ID (within \a Reply), or NULL on error
+ */
+char *Ident_int_ParseReply(char *Reply, int PeerPort, int LocalPort)
+{
+	 int	port1, port2, ofs = 0;
+	char	*pos, *user;
+
+	if( sscanf(Reply, " %i , %i :%n", &port1, &port2, &ofs) != 2 || ofs == 0 )
+		return NULL;
+	if( port1 != PeerPort || port2 != LocalPort )
+		return NULL;
+	pos = Reply + ofs;
+
+	while( isspace(*pos) )	pos ++;
+	if( strncmp(pos, "USERID", 6) != 0 )
+		return NULL;	// ERROR : <reason>
+	pos += 6;
+	while( isspace(*pos) )	pos ++;
+	if( *pos != ':' )	return NULL;
+	// Skip the operating system (and optional charset)
+	pos = strchr(pos + 1, ':');
+	if( !pos )	return NULL;
+
+	// The rest of the line is the user ID, trim surrounding whitespace
+	user = pos + 1;
+	while( isspace(*user) )	user ++;
+	pos = user + strlen(user);
+	while( pos > user && isspace(pos[-1]) )	pos --;
+	*pos = '\0';
+	if( *user == '\0' )
+		return NULL;
+	return user;
+}
+
+int Ident_int_GetPort(const struct sockaddr_storage *Addr)
+{
+	if( Addr->ss_family == AF_INET6 )
+		return ntohs( ((const struct sockaddr_in6*)Addr)->sin6_port );
+	return ntohs( ((const struct sockaddr_in*)Addr)->sin_port );
+}
+
+void Ident_int_SetPort(struct sockaddr_storage *Addr, int Port)
+{
+	if( Addr->ss_family == AF_INET6 )
+		((struct sockaddr_in6*)Addr)->sin6_port = htons(Port);
+	else
+		((struct sockaddr_in*)Addr)->sin_port = htons(Port);
+}
+
+bool Ident_int_SameHost(const struct sockaddr_storage *A, const struct sockaddr_storage *B)
+{
+	if( A->ss_family != B->ss_family )
+		return false;
+	if( A->ss_family == AF_INET6 )
+		return memcmp(&((const struct sockaddr_in6*)A)->sin6_addr,
+			&((const struct sockaddr_in6*)B)->sin6_addr, sizeof(struct in6_addr)) == 0;
+	return ((const struct sockaddr_in*)A)->sin_addr.s_addr == ((const struct sockaddr_in*)B)->sin_addr.s_addr;
+}
+
+tIdentCacheEnt *Ident_int_CacheFind(const struct sockaddr_storage *Peer, int PeerPort, int LocalPort)
+{
+	time_t	now = time(NULL);
+	for( int i = 0; i < IDENT_CACHE_SIZE; i ++ )
+	{
+		tIdentCacheEnt	*ent = &gaIdent_Cache[i];
+		if( !ent->Username || now >= ent->Expires )
+			continue ;
+		if( ent->PeerPort == PeerPort && ent->LocalPort == LocalPort && Ident_int_SameHost(&ent->Peer, Peer) )
+			return ent;
+	}
+	return NULL;
+}
+
+void Ident_int_CacheAdd(const tIdentQuery *Query, const char *Username)
+{
+	tIdentCacheEnt	*ent;
+
+	// Replace the oldest entry
+	ent = &gaIdent_Cache[giIdent_NextCacheSlot];
+	giIdent_NextCacheSlot = (giIdent_NextCacheSlot + 1) % IDENT_CACHE_SIZE;
+
+	free(ent->Username);
+	ent->Username = strdup(Username);
+	ent->Expires = time(NULL) + IDENT_CACHE_TIME;
+	ent->Peer = Query->Peer;
+	ent->PeerPort = Query->PeerPort;
+	ent->LocalPort = Query->LocalPort;
+}
@@ -18,15 +18,11 @@
 
 #define DUMP_ITEMS	0
 
-// === IMPORTS ===
-extern tHandler	gCoke_Handler;
-extern tHandler	gSnack_Handler;
-extern tHandler	gDoor_Handler;
-
 // === PROTOTYPES ===
 void	Init_Handlers(void);
 void	Load_Itemlist(void);
 void	Items_ReadFromFile(void);
+static void	Items_int_ReadFile(bool bLoadHandlers);
 char	*trim(char *__str);
 
 // === GLOBALS ===
@@ -35,11 +31,6 @@ tItem	*gaItems = NULL;
 time_t	gItems_LastUpdated;
 tHandler	gPseudo_Handler = {.Name="pseudo"};
 tHandler	gMembership_Handler = {.Name="membership"};
-tHandler	*gaHandlers[] = {
-	&gPseudo_Handler, &gMembership_Handler,
-	&gCoke_Handler, &gSnack_Handler, &gDoor_Handler
-	};
- int	giNumHandlers = sizeof(gaHandlers)/sizeof(gaHandlers[0]);
 char	*gsItemListFile = DEFAULT_ITEM_FILE;
 #if USE_INOTIFY
  int	giItem_INotifyFD;
@@ -49,11 +40,9 @@ regex_t	gItemFile_Regex;
 // === CODE ===
 void Init_Handlers()
 {
-	for( int i = 0; i < giNumHandlers; i ++ )
-	{
-		if( gaHandlers[i]->Init )
-			gaHandlers[i]->Init(0, NULL);	// TODO: Arguments
-	}
+	// Built-in handlers, everything else is loaded when the item list is first read
+	Handler_Register(&gPseudo_Handler);
+	Handler_Register(&gMembership_Handler);
 	
 	// Use inotify to watch the snack config file
 	#if USE_INOTIFY
@@ -101,17 +90,31 @@ void Load_Itemlist(void)
 		exit(-1);
 	}
 	
-	Items_ReadFromFile();
+	// Handler modules are only loaded here, on the main thread before the
+	// server starts (not by the periodic re-reads)
+	Items_int_ReadFile(true);
 	
 	// Re-read the item file periodically
 	// TODO: Be less lazy here and check the timestamp
 	AddPeriodicFunction( Items_ReadFromFile );
+	// - and keep the ENUM_ITEMS listing in step with the slot statuses
+	AddPeriodicFunction( Listing_Refresh );
 }
 
 /**
- * \brief Read the item list from disk
+ * \brief Re-read the item list from disk (if it has changed)
+ * \note Periodic function, items for handlers that aren't loaded are skipped
  */
 void Items_ReadFromFile(void)
+{
+	Items_int_ReadFile(false);
+}
+
+/**
+ * \brief Read the item list from disk
+ * \param bLoadHandlers	Load the modules for handlers the list names
+ */
+void Items_int_ReadFile(bool bLoadHandlers)
 {
 	FILE	*fp;
 	char	buffer[BUFSIZ];
@@ -178,17 +181,10 @@ void Items_ReadFromFile(void)
 		printf("Item '%s' - %i cents, %s:%i\n", desc, price, type, num);
 		#endif
 
-		handler = NULL;
-		for( i = 0; i < giNumHandlers; i ++ )
-		{
-			if( strcmp(type, gaHandlers[i]->Name) == 0 ) {
-				handler = gaHandlers[i];
-				break;
-			}
-		}
-
+		handler = Handler_GetByName(type, bLoadHandlers);
 		if( !handler ) {
-			fprintf(stderr, "Unknow item type '%s' on line %i (%s)\n", type, lineNum, desc);
+			fprintf(stderr, "Unknow item type '%s' on line %i (%s)%s\n", type, lineNum, desc,
+				bLoadHandlers ? "" : " - new handlers are only loaded at startup");
 			continue ;
 		}
 
@@ -233,6 +229,7 @@ void Items_ReadFromFile(void)
 	gaItems = items;
 	
 	gItems_LastUpdated = time(NULL);
+	Listing_Invalidate();
 }
 
 /**
@@ -313,14 +310,7 @@ void Items_UpdateFile(void)
 		num   = atoi( line + matches[2].rm_so );
 
 		// Find handler
-		handler = NULL;
-		for( i = 0; i < giNumHandlers; i ++ )
-		{
-			if( strcmp(type, gaHandlers[i]->Name) == 0 ) {
-				handler = gaHandlers[i];
-				break;
-			}
-		}
+		handler = Handler_GetByName(type, false);
 		if( !handler ) {
 			fprintf(stderr, "Warning: Unknown item type '%s' on line %i\n", type, lineNum);
 			continue ;
@@ -0,0 +1,511 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * listing.c - Pre-rendered item list (ENUM_ITEMS response)
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - The whole ENUM_ITEMS response is kept rendered, so answering it is a
+ *   single send. The generation number is bumped whenever the rendered item
+ *   lines change (item file reloads, UPDATE_ITEM, slot status changes).
+ * - Statuses are queried without a user (User = -1). The status of every
+ *   item (hidden ones too) is kept, ITEM_INFO answers from it instead of
+ *   asking the handler. Per-user checks happen when dispensing.
+ * - Listings are reference counted, a client can still be sending an old
+ *   one after it has been replaced.
+ * - Each new generation's changed/removed item lines are kept in a bounded
+ *   change log, so `ENUM_ITEMS since:<gen>` can send just the difference.
+ *   Generations start at the server's start time, so a client holding a
+ *   generation from a previous run is (almost always) told to resync.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LISTING_LOG_SIZE	256	// Maximum number of item changes remembered
+
+// === TYPES ===
+typedef struct sListingChange
+{
+	unsigned int	Generation;	//!< Generation the change was made in
+	char	*ItemID;	//!< "<type>:<id>"
+	char	*Line;	//!< New "202 Item" line, NULL if the item was removed
+} tListingChange;
+
+typedef struct sListingStatus
+{
+	tHandler	*Handler;
+	 int	ID;
+	 int	Status;	//!< CanDispense return value
+} tListingStatus;
+
+// === PROTOTYPES ===
+tListing	*Listing_Get(void);
+void	Listing_Release(tListing *Listing);
+void	Listing_Invalidate(void);
+void	Listing_Refresh(void);
+char	*Listing_GetChanges(unsigned int Since, size_t *Length);
+char	*Listing_FormatItem(const tItem *Item, int Status);
+ int	Listing_GetStatus(const tItem *Item);
+static tListing	*Listing_int_Render(tListingStatus **Statuses, int *NStatuses);
+static void	Listing_int_GetStatuses(int *Status);
+static void	Listing_int_LogChanges(const tListing *Old, const tListing *New);
+static void	Listing_int_LogChange(unsigned int Generation, const char *Line, size_t LineLen, bool bRemoved);
+static size_t	Listing_int_ItemIDLen(const char *Line);
+static const char	*Listing_int_FindLine(const tListing *Listing, const char *Line, size_t *LineLen);
+static void	Listing_int_Free(tListing *Listing);
+
+// === GLOBALS ===
+pthread_mutex_t	gListing_Lock = PTHREAD_MUTEX_INITIALIZER;	// Protects everything below
+tListing	*gpListing_Current;
+unsigned int	giListing_Generation;
+bool	gbListing_Dirty;
+// - Change log (ring buffer)
+tListingChange	gaListing_Log[LISTING_LOG_SIZE];
+ int	giListing_LogFirst;
+ int	giListing_LogCount;
+unsigned int	giListing_LogBase;	// Oldest generation that can be brought up to date
+// - Status of every item when the listing was last refreshed
+tListingStatus	*gaListing_Statuses;
+ int	giListing_NumStatuses;
+
+// === CODE ===
+/**
+ * \brief Get the current item listing
+ * \note Release with Listing_Release once sent
+ * \note If the item list has changed, the current listing is returned and
+ *       the periodic thread rebuilds it (rebuilding means asking the
+ *       hardware). It is only built here if there isn't one yet.
+ */
+tListing *Listing_Get(void)
+{
+	tListing	*ret;
+	bool	dirty;
+
+	pthread_mutex_lock(&gListing_Lock);
+	if( !gpListing_Current ) {
+		pthread_mutex_unlock(&gListing_Lock);
+		Listing_Refresh();
+		pthread_mutex_lock(&gListing_Lock);
+	}
+	dirty = gbListing_Dirty;
+	ret = gpListing_Current;
+	if( ret )
+		ret->RefCount ++;
+	pthread_mutex_unlock(&gListing_Lock);
+
+	if( dirty )
+		WakePeriodicThread();
+
+	return ret;
+}
+
+void Listing_Release(tListing *Listing)
+{
+	if( !Listing )	return ;
+	pthread_mutex_lock(&gListing_Lock);
+	if( --Listing->RefCount == 0 )
+		Listing_int_Free(Listing);
+	pthread_mutex_unlock(&gListing_Lock);
+}
+
+/**
+ * \brief Mark the listing as out of date (item list or an item changed)
+ * \note Cheap, the rebuild happens on the periodic thread, after the next
+ *       Listing_Get (or straight away, if there are WATCH subscribers)
+ */
+void Listing_Invalidate(void)
+{
+	pthread_mutex_lock(&gListing_Lock);
+	gbListing_Dirty = true;
+	pthread_mutex_unlock(&gListing_Lock);
+
+	// Subscribers want to know straight away, rebuild on the periodic thread
+	if( Watch_HaveItemWatchers() )
+		WakePeriodicThread();
+}
+
+/**
+ * \brief Re-query item statuses and rebuild the listing
+ * \note Called periodically to pick up restocked/emptied slots
+ */
+void Listing_Refresh(void)
+{
+	tListing	*new, *old;
+	tListingStatus	*statuses;
+	 int	nStatuses;
+
+	pthread_mutex_lock(&gListing_Lock);
+	gbListing_Dirty = false;
+	pthread_mutex_unlock(&gListing_Lock);
+
+	// Handlers are queried without holding the lock, so a slow one doesn't
+	// hold up clients sending the old listing
+	new = Listing_int_Render(&statuses, &nStatuses);
+	if( !new )	return ;
+
+	pthread_mutex_lock(&gListing_Lock);
+	// (Hidden items aren't in the listing, so always take the new statuses)
+	free(gaListing_Statuses);
+	gaListing_Statuses = statuses;
+	giListing_NumStatuses = nStatuses;
+	old = gpListing_Current;
+	if( old && old->BodyLength == new->BodyLength
+	 && memcmp(old->Data + old->BodyOffset, new->Data + new->BodyOffset, new->BodyLength) == 0 )
+	{
+		// Unchanged, keep the current listing (and generation)
+		pthread_mutex_unlock(&gListing_Lock);
+		Listing_int_Free(new);
+		return ;
+	}
+
+	if( giListing_Generation == 0 ) {
+		giListing_Generation = time(NULL);
+		giListing_LogBase = giListing_Generation + 1;
+	}
+	new->Generation = ++giListing_Generation;
+	// (also sends the WATCH events)
+	if( old )
+		Listing_int_LogChanges(old, new);
+	new->RefCount = 1;	// Reference held by gpListing_Current
+	// Header is rendered last, now that the generation is known
+	{
+		char	header[64];
+		 int	len = snprintf(header, sizeof(header), "201 Items %i gen:%u\n", new->Count, new->Generation);
+		new->Data = new->Data + new->BodyOffset - len;
+		memcpy(new->Data, header, len);
+		new->Length += len;
+		new->BodyOffset = len;
+	}
+	gpListing_Current = new;
+	if( old && --old->RefCount == 0 )
+		Listing_int_Free(old);
+	pthread_mutex_unlock(&gListing_Lock);
+
+	Debug_Debug("Item listing now at generation %u", new->Generation);
+}
+
+/**
+ * \brief Get the items changed since a generation (`ENUM_ITEMS since:<gen>`)
+ * \param Length	Set to the length of the returned response
+ * \return Allocated response (same format as the full listing, with
+ *         "203 Removed <item_id>" lines for removed items), or NULL if the
+ *         change log no longer reaches back to \a Since
+ */
+char *Listing_GetChanges(unsigned int Since, size_t *Length)
+{
+	tListing	*cur;
+	char	*ret, *pos;
+	size_t	len;
+	 int	count = 0;
+	bool	include[LISTING_LOG_SIZE];
+
+	// Make sure the listing (and so the log) is up to date
+	cur = Listing_Get();
+	if( !cur )	return NULL;
+
+	pthread_mutex_lock(&gListing_Lock);
+	if( Since > cur->Generation || Since + 1 < giListing_LogBase ) {
+		pthread_mutex_unlock(&gListing_Lock);
+		Listing_Release(cur);
+		return NULL;
+	}
+
+	// Only the newest change to each item is sent, walk the log backwards
+	len = 64 + sizeof("200 List end\n");
+	for( int i = giListing_LogCount; i --; )
+	{
+		const tListingChange	*ent = &gaListing_Log[(giListing_LogFirst + i) % LISTING_LOG_SIZE];
+		include[i] = false;
+		if( ent->Generation <= Since )	break;
+		for( int j = i + 1; j < giListing_LogCount; j ++ )
+		{
+			const tListingChange	*later = &gaListing_Log[(giListing_LogFirst + j) % LISTING_LOG_SIZE];
+			if( include[j] && strcmp(later->ItemID, ent->ItemID) == 0 )
+				goto _skip;
+		}
+		include[i] = true;
+		count ++;
+		len += (ent->Line ? strlen(ent->Line) : sizeof("203 Removed \n") + strlen(ent->ItemID));
+	_skip:	;
+	}
+
+	ret = malloc(len);
+	pos = ret + sprintf(ret, "201 Items %i gen:%u\n", count, cur->Generation);
+	for( int i = 0; i < giListing_LogCount && count; i ++ )
+	{
+		const tListingChange	*ent = &gaListing_Log[(giListing_LogFirst + i) % LISTING_LOG_SIZE];
+		if( ent->Generation <= Since || !include[i] )	continue;
+		if( ent->Line )
+			pos += sprintf(pos, "%s", ent->Line);
+		else
+			pos += sprintf(pos, "203 Removed %s\n", ent->ItemID);
+	}
+	pos += sprintf(pos, "200 List end\n");
+	pthread_mutex_unlock(&gListing_Lock);
+	Listing_Release(cur);
+
+	*Length = pos - ret;
+	return ret;
+}
+
+/**
+ * \brief Format an item as a "202 Item" line
+ * \param Status	Handler status for the item (CanDispense return value)
+ * \return Allocated string
+ */
+char *Listing_FormatItem(const tItem *Item, int Status)
+{
+	const char	*status;
+
+	switch(Status)
+	{
+	case  0:	status = "avail";	break;
+	case  1:	status = "sold";	break;
+	default:
+	case -1:	status = "error";	break;
+	}
+
+	if( !gbNoCostMode && Item->Price == 0 )
+		status = "error";
+	// KNOWN HACK: Naming a slot 'dead' disables it
+	if( strcmp(Item->Name, "dead") == 0 )
+		status = "sold";	// Another status?
+
+	return mkstr("202 Item %s:%i %s %i %s\n",
+		Item->Handler->Name, Item->ID, status, Item->Price, Item->Name);
+}
+
+/**
+ * \brief Get an item's status as of the last refresh (ITEM_INFO)
+ * \return CanDispense style status, -1 if it isn't known
+ */
+int Listing_GetStatus(const tItem *Item)
+{
+	tListing	*listing;
+	 int	ret = -1;
+
+	// Make sure there has been a refresh
+	listing = Listing_Get();
+	if( !listing )	return -1;
+
+	pthread_mutex_lock(&gListing_Lock);
+	for( int i = 0; i < giListing_NumStatuses; i ++ )
+	{
+		if( gaListing_Statuses[i].Handler == Item->Handler && gaListing_Statuses[i].ID == Item->ID ) {
+			ret = gaListing_Statuses[i].Status;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&gListing_Lock);
+	Listing_Release(listing);
+
+	return ret;
+}
+
+/**
+ * \brief Render the item lines of a new listing
+ * \param Statuses	Set to the status of every item (allocated)
+ * \note Space is left before the body for the header (see Listing_Refresh)
+ */
+tListing *Listing_int_Render(tListingStatus **Statuses, int *NStatuses)
+{
+	const int	ciHeaderSpace = 64;
+	const char	csFooter[] = "200 List end\n";
+	 int	nItems = giNumItems;
+	const tItem	*items = gaItems;
+	 int	status[nItems+1];
+	char	*lines[nItems+1];
+	size_t	len = 0;
+	 int	count = 0;
+	tListing	*ret;
+	char	*pos;
+
+	Listing_int_GetStatuses(status);
+
+	*Statuses = malloc( (nItems + 1) * sizeof(**Statuses) );
+	*NStatuses = (*Statuses ? nItems : 0);
+	for( int i = 0; i < *NStatuses; i ++ )
+	{
+		(*Statuses)[i].Handler = items[i].Handler;
+		(*Statuses)[i].ID = items[i].ID;
+		(*Statuses)[i].Status = status[i];
+	}
+
+	for( int i = 0; i < nItems; i ++ )
+	{
+		lines[i] = NULL;
+		if( items[i].bHidden )	continue;
+		lines[i] = Listing_FormatItem(&items[i], status[i]);
+		len += strlen(lines[i]);
+		count ++;
+	}
+
+	ret = malloc( sizeof(*ret) + ciHeaderSpace + len + sizeof(csFooter) );
+	if( !ret ) {
+		for( int i = 0; i < nItems; i ++ )
+			free(lines[i]);
+		free(*Statuses);
+		return NULL;
+	}
+	ret->Count = count;
+	ret->LineEnds = malloc( (count + 1) * sizeof(*ret->LineEnds) );
+	ret->Data = ret->Buffer;
+	ret->BodyOffset = ciHeaderSpace;
+	ret->BodyLength = len;
+	ret->Length = len + sizeof(csFooter) - 1;
+
+	pos = ret->Buffer + ciHeaderSpace;
+	count = 0;
+	for( int i = 0; i < nItems; i ++ )
+	{
+		if( !lines[i] )	continue;
+		 int	linelen = strlen(lines[i]);
+		memcpy(pos, lines[i], linelen);
+		pos += linelen;
+		ret->LineEnds[count++] = pos - (ret->Buffer + ciHeaderSpace);
+		free(lines[i]);
+	}
+	memcpy(pos, csFooter, sizeof(csFooter));
+
+	return ret;
+}
+
+/**
+ * \brief Get the status of all items, with one query per handler
+ * \param Status	Indexed the same as gaItems
+ */
+void Listing_int_GetStatuses(int *Status)
+{
+	 int	nItems = giNumItems;
+	const tItem	*items = gaItems;
+
+	for( int i = 0; i < nItems; i ++ )
+		Status[i] = -2;	// Not yet queried
+
+	for( int i = 0; i < nItems; i ++ )
+	{
+		tHandler	*handler = items[i].Handler;
+		 int	index[nItems], ids[nItems], res[nItems];
+		 int	n = 0;
+
+		if( Status[i] != -2 )	continue;
+
+		for( int j = i; j < nItems; j ++ )
+		{
+			if( items[j].Handler != handler )	continue;
+			index[n] = j;
+			ids[n] = items[j].ID;
+			n ++;
+		}
+
+		if( Handler_GetStatus(handler, -1, n, ids, res) ) {
+			for( int j = 0; j < n; j ++ )
+				res[j] = -1;
+		}
+		for( int j = 0; j < n; j ++ )
+			Status[ index[j] ] = res[j];
+	}
+}
+
+/**
+ * \brief Record the differences between two listings in the change log
+ * \note Called with gListing_Lock held
+ */
+void Listing_int_LogChanges(const tListing *Old, const tListing *New)
+{
+	const char	*body, *line;
+	size_t	start = 0, linelen;
+
+	// Added and changed items
+	body = New->Data + New->BodyOffset;
+	for( int i = 0; i < New->Count; start = New->LineEnds[i++] )
+	{
+		size_t	len = New->LineEnds[i] - start;
+		line = Listing_int_FindLine(Old, body + start, &linelen);
+		if( line && linelen == len && memcmp(line, body + start, len) == 0 )
+			continue ;
+		Listing_int_LogChange(New->Generation, body + start, len, false);
+	}
+
+	// Removed items
+	body = Old->Data + Old->BodyOffset;
+	start = 0;
+	for( int i = 0; i < Old->Count; start = Old->LineEnds[i++] )
+	{
+		if( Listing_int_FindLine(New, body + start, &linelen) )
+			continue ;
+		Listing_int_LogChange(New->Generation, body + start, Old->LineEnds[i] - start, true);
+	}
+}
+
+/**
+ * \brief Append an entry to the change log, dropping the oldest if full
+ * \param bRemoved	The item in \a Line was removed (rather than changed)
+ */
+void Listing_int_LogChange(unsigned int Generation, const char *Line, size_t LineLen, bool bRemoved)
+{
+	tListingChange	*ent;
+	const char	*id = Line + sizeof("202 Item ") - 1;
+	size_t	idlen = Listing_int_ItemIDLen(Line);
+
+	if( giListing_LogCount == LISTING_LOG_SIZE )
+	{
+		ent = &gaListing_Log[giListing_LogFirst];
+		// Clients older than this generation have missed this change
+		giListing_LogBase = ent->Generation + 1;
+		free(ent->ItemID);
+		free(ent->Line);
+		giListing_LogFirst = (giListing_LogFirst + 1) % LISTING_LOG_SIZE;
+		giListing_LogCount --;
+	}
+
+	ent = &gaListing_Log[(giListing_LogFirst + giListing_LogCount) % LISTING_LOG_SIZE];
+	ent->Generation = Generation;
+	ent->ItemID = strndup(id, idlen);
+	ent->Line = (bRemoved ? NULL : strndup(Line, LineLen));
+	giListing_LogCount ++;
+
+	Watch_ItemChanged(ent->ItemID, ent->Line);
+}
+
+/**
+ * \brief Get the length of the item ID in a "202 Item <item_id> ..." line
+ */
+size_t Listing_int_ItemIDLen(const char *Line)
+{
+	const char	*id = Line + sizeof("202 Item ") - 1;
+	return strchr(id, ' ') - id;
+}
+
+/**
+ * \brief Find the line for the same item as \a Line in a listing
+ */
+const char *Listing_int_FindLine(const tListing *Listing, const char *Line, size_t *LineLen)
+{
+	const char	*body = Listing->Data + Listing->BodyOffset;
+	size_t	idlen = Listing_int_ItemIDLen(Line) + sizeof("202 Item ");	// Includes the trailing space
+	size_t	start = 0;
+
+	for( int i = 0; i < Listing->Count; start = Listing->LineEnds[i++] )
+	{
+		if( Listing->LineEnds[i] - start < idlen )	continue;
+		if( memcmp(body + start, Line, idlen) != 0 )	continue;
+		*LineLen = Listing->LineEnds[i] - start;
+		return body + start;
+	}
+	return NULL;
+}
+
+void Listing_int_Free(tListing *Listing)
+{
+	free(Listing->LineEnds);
+	free(Listing);
+}
@@ -2,16 +2,25 @@
  * OpenDispense2
  *
  * logging.c - Debug/Logging Routines
+ *
+ * NOTES:
+ * - Log_Hold keeps this thread's Log_Info lines back until Log_Release, so
+ *   a batch that is rolled back doesn't leave records of what it would
+ *   have done.
  */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <string.h>
 #include "common.h"
 #include <syslog.h>
 
 // === GLOBALS ===
 bool	gbSyslogDisabled = true;
+__thread FILE	*gLog_HeldFile;	// Held lines, one per line
+__thread char	*gsLog_Held;
+__thread size_t	giLog_HeldLen;
 
 // === CODE ==
 void Log_Error(const char *Format, ...)
@@ -36,6 +45,15 @@ void Log_Info(const char *Format, ...)
 {
 	va_list	args;
 	
+	if( gLog_HeldFile )
+	{
+		va_start(args, Format);
+		vfprintf(gLog_HeldFile, Format, args);
+		va_end(args);
+		fputc('\n', gLog_HeldFile);
+		return ;
+	}
+	
 	if( !gbSyslogDisabled )
 	{
 		va_start(args, Format);
@@ -49,3 +67,35 @@ void Log_Info(const char *Format, ...)
 	va_end(args);
 }
 
+/**
+ * \brief Start holding back Log_Info lines from this thread
+ */
+void Log_Hold(void)
+{
+	if( gLog_HeldFile )
+		return ;
+	gLog_HeldFile = open_memstream(&gsLog_Held, &giLog_HeldLen);
+	// (if that failed, lines are just written as usual)
+}
+
+/**
+ * \brief Stop holding lines, and write or drop the ones held
+ */
+void Log_Release(bool bWrite)
+{
+	char	*line, *next;
+	
+	if( !gLog_HeldFile )
+		return ;
+	fclose(gLog_HeldFile);
+	gLog_HeldFile = NULL;
+	
+	for( line = gsLog_Held; bWrite && line && *line; line = next )
+	{
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		Log_Info("%s", line);
+	}
+	free(gsLog_Held);
+	gsLog_Held = NULL;
+}
@@ -20,6 +20,7 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <time.h>
 #include "../cokebank.h"
 #include "../common/config.h"
 
@@ -29,10 +30,15 @@ extern void	Load_Itemlist(void);
 extern void	Server_Start(void);
 extern bool	gbServer_RunInBackground;
 extern int	giServer_Port;
+extern int	giServer_Backlog;
+extern int	giServer_MaxInput;
+extern const char	*gsServer_UnixSocket;
+extern volatile sig_atomic_t	gbServer_ReloadConfig;
 extern const char	*gsItemListFile;
-extern const char	*gsCoke_ModbusAddress;
-extern int	giCoke_ModbusPort;
-extern const char	*gsDoor_SerialPort;
+extern const char	*gsHandler_Path;
+extern const char	*gsBackup_File;
+extern int	giBackup_Interval;
+extern int	giBackup_Keep;
 
 // === PROTOTYPES ===
 void	*Periodic_Thread(void *Unused);
@@ -41,12 +47,20 @@ void	*Periodic_Thread(void *Unused);
  int	giDebugLevel = 0;
 bool	gbNoCostMode = 0;
 const char	*gsCokebankPath = "cokebank.db";
+const char	*gsCokebankLibrary = "cokebank.so";
+const char	*gsConfigFile = "dispsrv.conf";
+const char	*gsBulkImportFile;	// --import, load accounts instead of running the server
+const char	*gsBulkExportFile;	// --export
+const char	*gsSnapshotFile;	// --snapshot
 // - Functions called every 20s (or so)
 #define ciMaxPeriodics	10
 struct sPeriodicCall {
 	void	(*Function)(void);
 }	gaPeriodicCalls[ciMaxPeriodics];
 pthread_t	gTimerThread;
+pthread_mutex_t	gPeriodic_Lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	gPeriodic_Cond = PTHREAD_COND_INITIALIZER;
+bool	gbPeriodic_Wake;	// Run the periodic functions now (see WakePeriodicThread)
 
 // === CODE ===
 void sigint_handler()
@@ -54,6 +68,12 @@ void sigint_handler()
 	exit(0);
 }
 
+void sighup_handler()
+{
+	// Picked up by the server loop (only the trusted hosts are reloaded)
+	gbServer_ReloadConfig = 1;
+}
+
 void PrintUsage(const char *progname)
 {
 	fprintf(stderr, "Usage: %s\n", progname);
@@ -62,12 +82,18 @@ void PrintUsage(const char *progname)
 	fprintf(stderr, "  -d    Set debug level (0 - 2, default 0)\n");
 	fprintf(stderr, "  --[dont-]daemonise\n");
 	fprintf(stderr, "        Run (or explicitly don't run) the server disconnected from the terminal\n");
+	fprintf(stderr, "  --import <file>\n");
+	fprintf(stderr, "        Load accounts from a CSV file (`-' for stdin) and exit\n");
+	fprintf(stderr, "  --export <file>\n");
+	fprintf(stderr, "        Write all accounts as CSV (`-' for stdout) and exit\n");
+	fprintf(stderr, "  --snapshot <file>\n");
+	fprintf(stderr, "        Write a consistent copy of the bank (`-' for stdout) and exit,\n");
+	fprintf(stderr, "        safe to use while the server is running\n");
 }
 
 int main(int argc, char *argv[])
 {
 	 int	i;
-	const char	*config_file = "dispsrv.conf";
 
 	// Parse Arguments
 	for( i = 1; i < argc; i++ )
@@ -87,7 +113,7 @@ int main(int argc, char *argv[])
 			{
 			case 'f':
 				if( i + 1 >= argc )	return -1;
-				config_file = argv[++i];
+				gsConfigFile = argv[++i];
 				break;
 			case 'd':
 				if( i + 1 >= argc )	return -1;
@@ -106,7 +132,7 @@ int main(int argc, char *argv[])
 			// Long arguments
 			if( strcmp(arg, "--configfile") == 0 ) {
 				if( i + 1 >= argc )	return -1;
-				config_file = argv[++i];
+				gsConfigFile = argv[++i];
 			}
 			else if( strcmp(arg, "--daemonise") == 0 ) {
 				Config_AddValue("daemonise", "true");
@@ -114,6 +140,18 @@ int main(int argc, char *argv[])
 			else if( strcmp(arg, "--dont-daemonise") == 0 ) {
 				Config_AddValue("daemonise", "false");
 			}
+			else if( strcmp(arg, "--import") == 0 ) {
+				if( i + 1 >= argc )	return -1;
+				gsBulkImportFile = argv[++i];
+			}
+			else if( strcmp(arg, "--export") == 0 ) {
+				if( i + 1 >= argc )	return -1;
+				gsBulkExportFile = argv[++i];
+			}
+			else if( strcmp(arg, "--snapshot") == 0 ) {
+				if( i + 1 >= argc )	return -1;
+				gsSnapshotFile = argv[++i];
+			}
 			else {
 				// Usage error
 				fprintf(stderr, "Unknown option '%s'\n", arg);
@@ -123,8 +161,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if( Config_ParseFile( config_file ) ) {
-		fprintf(stderr, "NOTICE: Loading of config file '%s' failed, using defaults\n", config_file);
+	if( Config_ParseFile( gsConfigFile ) ) {
+		fprintf(stderr, "NOTICE: Loading of config file '%s' failed, using defaults\n", gsConfigFile);
 	}
 
 	// Parse config values
@@ -134,13 +172,19 @@ int main(int argc, char *argv[])
 		#define OPT_CFG(variable, type, name)	     Config_GetValue_##type(name, &variable)
 		OPT_CFG(gbServer_RunInBackground, Bool, "daemonise");
 		OPT_CFG(giServer_Port, Int, "server_port");
+		OPT_CFG(giServer_Backlog, Int, "server_backlog");
+		OPT_CFG(giServer_MaxInput, Int, "client_max_input");
+		OPT_CFG(gsServer_UnixSocket, Str, "server_socket");
 		
 		REQ_CFG(gsCokebankPath, Str, "cokebank_database");
+		OPT_CFG(gsCokebankLibrary, Str, "cokebank_library");
+		OPT_CFG(gsBackup_File, Str, "backup_file");
+		OPT_CFG(giBackup_Interval, Int, "backup_interval");
+		OPT_CFG(giBackup_Keep, Int, "backup_keep");
 		REQ_CFG(gsItemListFile, Str, "items_file");
 
-		OPT_CFG(gsDoor_SerialPort, Str, "door_serial_port");
-		REQ_CFG(gsCoke_ModbusAddress, Str, "coke_modbus_address");
-		OPT_CFG(giCoke_ModbusPort,    Int,    "coke_modbus_port");
+		// Handler specific options are read by the handlers as they are loaded
+		OPT_CFG(gsHandler_Path, Str, "handler_path");
 		
 		OPT_CFG(gbNoCostMode,    Bool, "test_mode");
 		OPT_CFG(gbSyslogDisabled, Bool, "disable_syslog");
@@ -154,13 +198,24 @@ int main(int argc, char *argv[])
 	// - Cleanly tear down the server on SIGINT/SIGTERM
 	signal(SIGINT, sigint_handler);
 	signal(SIGTERM, sigint_handler);
+	signal(SIGHUP, sighup_handler);
 	// - ignore SIGPIPE to prevent a crashing client from bringing the server down too
 	signal(SIGPIPE, SIG_IGN);
 	
 	openlog("odispense2", 0, LOG_LOCAL4);
 	
+	if( Bank_Load(gsCokebankLibrary) )
+		return -1;
 	if( Bank_Initialise(gsCokebankPath) )
 		return -1;
+	
+	// Offline account tools
+	if( gsBulkImportFile )
+		return Bulk_Import(gsBulkImportFile) ? -1 : 0;
+	if( gsBulkExportFile )
+		return Bulk_Export(gsBulkExportFile) ? -1 : 0;
+	if( gsSnapshotFile )
+		return Bulk_Snapshot(gsSnapshotFile) ? -1 : 0;
 
 	Init_Handlers();
 
@@ -180,7 +235,17 @@ void *Periodic_Thread(void *Unused __attribute__((unused)))
 	
 	for( ;; )
 	{
-		sleep(10);	// Sleep for a while
+		// Sleep for a while (or until woken)
+		struct timespec	until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += 10;
+		pthread_mutex_lock(&gPeriodic_Lock);
+		while( !gbPeriodic_Wake ) {
+			if( pthread_cond_timedwait(&gPeriodic_Cond, &gPeriodic_Lock, &until) )
+				break;
+		}
+		gbPeriodic_Wake = false;
+		pthread_mutex_unlock(&gPeriodic_Lock);
 //		printf("Periodic firing\n");
 		for( i = 0; i < ciMaxPeriodics; i ++ )
 		{
@@ -196,6 +261,17 @@ void StartPeriodicThread(void)
 	pthread_create( &gTimerThread, NULL, Periodic_Thread, NULL );
 }
 
+/**
+ * \brief Run the periodic functions as soon as possible (instead of waiting)
+ */
+void WakePeriodicThread(void)
+{
+	pthread_mutex_lock(&gPeriodic_Lock);
+	gbPeriodic_Wake = true;
+	pthread_cond_signal(&gPeriodic_Cond);
+	pthread_mutex_unlock(&gPeriodic_Lock);
+}
+
 void AddPeriodicFunction(void (*Fcn)(void))
 {
 	int i;
@@ -0,0 +1,113 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * ratelimit.c - Token bucket limits per address/account
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - Each bucket is stored as the time it will next be full (GCRA), so taking
+ *   a token is one comparison and an add, and a bucket in the past is the
+ *   same as no bucket at all. Nothing needs to be swept out.
+ * - Buckets live in a fixed size open-addressed table, keyed by a hash of
+ *   the class and key. If all the probed slots are busy the one closest to
+ *   full is reused (at worst an abuser gets a fresh bucket, nobody else is
+ *   blocked).
+ * - Server thread only.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define RATELIMIT_TABLE_SIZE	4096	// Power of two
+#define RATELIMIT_MAX_PROBE	8
+
+// === TYPES ===
+typedef struct sRateBucket
+{
+	uint64_t	Hash;	// 0 = never used
+	int64_t	FullAt;	// Monotonic milliseconds when the bucket is next full
+} tRateBucket;
+
+// === PROTOTYPES ===
+ int	RateLimit_Take(enum eRateLimitClasses Class, const void *Key, size_t KeyLen);
+static int64_t	RateLimit_int_Now(void);
+static uint64_t	RateLimit_int_Hash(enum eRateLimitClasses Class, const void *Key, size_t KeyLen);
+
+// === CONSTANTS ===
+const struct sRateLimitClass {
+	 int	Burst;	// Tokens when full
+	 int	IntervalMS;	// Time to get one token back
+}	gaRateLimit_Classes[NUM_RATELIMIT_CLASSES] = {
+	[RATELIMIT_CONNECT] = {30, 200},	// Sustained 5 per second
+	[RATELIMIT_AUTH]    = {10, 3000},
+	[RATELIMIT_PIN]     = { 3, 10000},
+	[RATELIMIT_LISTING] = {10, 1000},
+};
+
+// === GLOBALS ===
+tRateBucket	gaRateLimit_Table[RATELIMIT_TABLE_SIZE];
+
+// === CODE ===
+/**
+ * \brief Take a token from a bucket
+ * \param Key	Address, account name, etc (Class separates the namespaces)
+ * \return 0 if allowed, otherwise the number of seconds until it will be
+ */
+int RateLimit_Take(enum eRateLimitClasses Class, const void *Key, size_t KeyLen)
+{
+	const struct sRateLimitClass	*class = &gaRateLimit_Classes[Class];
+	uint64_t	hash = RateLimit_int_Hash(Class, Key, KeyLen);
+	int64_t	now = RateLimit_int_Now();
+	int64_t	limit = (int64_t)(class->Burst - 1) * class->IntervalMS;
+	tRateBucket	*bucket = NULL;
+
+	// Find this key's bucket, or somewhere to put it
+	for( int i = 0; i < RATELIMIT_MAX_PROBE; i ++ )
+	{
+		tRateBucket	*slot = &gaRateLimit_Table[ (hash + i) & (RATELIMIT_TABLE_SIZE - 1) ];
+		if( slot->Hash == hash ) {
+			bucket = slot;
+			break;
+		}
+		if( !bucket || slot->FullAt < bucket->FullAt )
+			bucket = slot;
+	}
+	if( bucket->Hash != hash ) {
+		bucket->Hash = hash;
+		bucket->FullAt = now;
+	}
+
+	if( bucket->FullAt < now )
+		bucket->FullAt = now;
+	if( bucket->FullAt - now > limit )
+		return (bucket->FullAt - now - limit + 999) / 1000;
+	bucket->FullAt += class->IntervalMS;
+	return 0;
+}
+
+int64_t RateLimit_int_Now(void)
+{
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief FNV-1a over the class and key
+ */
+uint64_t RateLimit_int_Hash(enum eRateLimitClasses Class, const void *Key, size_t KeyLen)
+{
+	const uint8_t	*bytes = Key;
+	uint64_t	hash = 0xcbf29ce484222325ULL;
+
+	hash = (hash ^ (uint8_t)Class) * 0x100000001b3ULL;
+	for( size_t i = 0; i < KeyLen; i ++ )
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	return hash ? hash : 1;
+}
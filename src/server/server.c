@@ -7,11 +7,14 @@
  * This file is licenced under the 3-clause BSD Licence. See the file
  * COPYING for full details.
  */
+#define _GNU_SOURCE	// struct ucred
 #include <stdio.h>
 #include <stdlib.h>
 #include "common.h"
 #include "../common/config.h"
 #include <sys/socket.h>
+#include <sys/un.h>	// AF_UNIX listener
+#include <sys/stat.h>	// chmod
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -20,9 +23,13 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <signal.h>	// Signal handling
-#include <ident.h>	// AUTHIDENT
 #include <time.h>	// time(2)
 #include <ctype.h>
+#include <errno.h>
+#include <pwd.h>	// getpwuid (SO_PEERCRED)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>	// EXPORT
+#include <pthread.h>
 
 #define	DEBUG_TRACE_CLIENT	0
 #define HACK_NO_REFUNDS	1
@@ -30,19 +37,31 @@
 #define PIDFILE	"/var/run/dispsrv.pid"
 
 // Statistics
-#define MAX_CONNECTION_QUEUE	5
-#define INPUT_BUFFER_SIZE	256
+#define MAX_CONNECTION_QUEUE	SOMAXCONN	// Default for 'server_backlog'
+#define MAX_EVENTS	32	// epoll events handled per wakeup
+#define INPUT_BUFFER_SIZE	256	// Initial size, grown as needed
+#define MAX_INPUT_BUFFER	65536	// Default for 'client_max_input'
 #define CLIENT_TIMEOUT	10	// Seconds
+#define MAX_COMMAND_ARGS	8
+#define COMMAND_HASH_SIZE	128	// Power of two, a few times the number of commands
+#define MAX_BATCH_COMMANDS	4096
+#define MAX_EXPORTS	2	// EXPORTs running at once (each has a thread and a temporary file)
 
 #define HASH_TYPE	SHA1
 #define HASH_LENGTH	20
 
-#define MSG_STR_TOO_LONG	"499 Command too long (limit "EXPSTR(INPUT_BUFFER_SIZE)")\n"
-
-#define IDENT_TRUSTED_NETWORK 0x825F0D00
-#define IDENT_TRUSTED_NETMASK 0xFFFFFFC0
+#define MSG_STR_TOO_LONG	"499 Command too long (limit %i)\n"
+#define MSG_RATE_LIMITED	"407 Rate limited (%i seconds remaining)\n"
 
 // === TYPES ===
+struct sClientCommand;	// Command table entry (see gaServer_Commands)
+
+typedef struct sBatchCommand
+{
+	const struct sClientCommand	*Command;
+	char	*Args;	// Copy of the arguments, parsed again when the batch is run
+} tBatchCommand;
+
 typedef struct sClient
 {
 	 int	Socket;	// Client socket ID
@@ -50,6 +69,8 @@ typedef struct sClient
 	 
 	 int	bTrustedHost;
 	 int	bCanAutoAuth;	// Is the connection from a trusted host/port
+	char	*PeerName;	// Local login of an AF_UNIX peer (from SO_PEERCRED)
+	uint8_t	PeerAddr[16];	// Remote address, IPv4 as v4-mapped (rate limit key)
 	
 	char	*Username;
 	char	Salt[9];
@@ -57,41 +78,94 @@ typedef struct sClient
 	 int	UID;
 	 int	EffectiveUID;
 	 int	bIsAuthed;
+	
+	// Connection state
+	char	*InBuf;	// Received data, commands are parsed in place
+	 int	InSize;	// Allocated size of InBuf (up to giServer_MaxInput)
+	 int	InStart;	// Offset of the first unprocessed byte
+	 int	InLen;	// Unprocessed bytes
+	 int	InScanned;	// Unprocessed bytes already searched for a newline
+	char	*OutBuf;	// Replies the socket wouldn't take yet, no more commands are run until they're sent
+	 int	OutLen;
+	 int	OutSize;
+	bool	bDiscarding;	// Dropping the rest of an over-long command
+	tTimer	IdleTimer;	// Closes the connection after CLIENT_TIMEOUT without a command
+	bool	bDispensePending;	// Waiting on a handler, further commands are held
+	char	*ItemInfoID;	// Item a pending ITEM_INFO is about (waiting on its handler)
+	bool	bClosed;	// Disconnected during a dispense, freed when the handler finishes
+	tWatcher	*Watcher;	// Subscribed to events with WATCH
+	tIdentQuery	*IdentQuery;	// AUTHIDENT lookup in progress, further commands are held
+	bool	bExporting;	// Handed to an EXPORT thread, which closes the connection when done
+	 int	LastStatus;	// Code of the last reply sent (so BATCH can report each command's)
+	
+	// BATCH state
+	bool	bInBatch;	// Between BATCH BEGIN and BATCH COMMIT/ABORT, commands are queued
+	bool	bRunningBatch;	// Running the queued commands inside a bank transaction
+	tBatchCommand	*Batch;
+	 int	BatchLen;
+	 int	BatchSpace;
+	 int	BatchRejected;	// Commands that couldn't be queued (the batch won't be run)
 }	tClient;
 
 // === PROTOTYPES ===
 void	Server_Start(void);
 void	Server_Cleanup(void);
-void	Server_HandleClient(int Socket, int bTrustedHost, int bRootPort);
+void	Server_int_WatchFD(int FD, int Op, uint32_t Events);
+void	Server_int_AcceptClients(void);
+void	Server_int_AcceptUnixClients(void);
+tClient	*Server_int_AddClient(int Socket);
+ int	Server_int_RateLimit(tClient *Client, enum eRateLimitClasses Class);
+void	Server_int_PeerAuth(tClient *Client, uid_t PeerUID);
+void	Server_int_ReadClient(tClient *Client);
+void	Server_int_FlushClient(tClient *Client);
+ int	Server_int_MakeRoom(tClient *Client);
+void	Server_int_ProcessInput(tClient *Client);
+void	Server_int_IdleTimeout(void *Client);
+void	Server_int_CloseClient(tClient *Client);
 void	Server_ParseClientCommand(tClient *Client, char *CommandString);
+void	Server_int_QueueBatch(tClient *Client, const struct sClientCommand *Command, char *ArgStr);
+void	Server_int_RunBatch(tClient *Client);
+void	Server_int_FreeBatch(tClient *Client);
 // --- Commands ---
-void	Server_Cmd_USER(tClient *Client, char *Args);
-void	Server_Cmd_PASS(tClient *Client, char *Args);
-void	Server_Cmd_AUTOAUTH(tClient *Client, char *Args);
-void	Server_Cmd_AUTHIDENT(tClient *Client, char *Args);
-void	Server_Cmd_AUTHCARD(tClient* Client, char *Args);
-void	Server_Cmd_SETEUSER(tClient *Client, char *Args);
-void	Server_Cmd_ENUMITEMS(tClient *Client, char *Args);
-void	Server_Cmd_ITEMINFO(tClient *Client, char *Args);
-void	Server_Cmd_DISPENSE(tClient *Client, char *Args);
-void	Server_Cmd_REFUND(tClient *Client, char *Args);
-void	Server_Cmd_GIVE(tClient *Client, char *Args);
-void	Server_Cmd_DONATE(tClient *Client, char *Args);
-void	Server_Cmd_ADD(tClient *Client, char *Args);
-void	Server_Cmd_SET(tClient *Client, char *Args);
-void	Server_Cmd_ENUMUSERS(tClient *Client, char *Args);
-void	Server_Cmd_USERINFO(tClient *Client, char *Args);
+void	Server_Cmd_USER(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_PASS(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_AUTOAUTH(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_AUTHIDENT(tClient *Client, int nArgs, char *Args[]);
+void	Server_int_IdentComplete(void *Client, const char *Username);
+void	Server_Cmd_AUTHCARD(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_SETEUSER(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_ENUMITEMS(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_ITEMINFO(tClient *Client, int nArgs, char *Args[]);
+void	Server_int_ItemInfoComplete(void *Client, int Status);
+void	Server_Cmd_DISPENSE(tClient *Client, int nArgs, char *Args[]);
+void	Server_int_DispenseComplete(void *Client, int Result);
+void	Server_int_SendDispenseResult(tClient *Client, int Result);
+void	Server_Cmd_REFUND(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_GIVE(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_DONATE(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_ADD(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_SET(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_ENUMUSERS(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_USERINFO(tClient *Client, int nArgs, char *Args[]);
 void	_SendUserInfo(tClient *Client, int UserID);
-void	Server_Cmd_USERADD(tClient *Client, char *Args);
-void	Server_Cmd_USERFLAGS(tClient *Client, char *Args);
-void	Server_Cmd_UPDATEITEM(tClient *Client, char *Args);
-void	Server_Cmd_PINCHECK(tClient *Client, char *Args);
-void	Server_Cmd_PINSET(tClient *Client, char *Args);
-void	Server_Cmd_CARDADD(tClient *Client, char *Args);
+void	Server_Cmd_USERADD(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_USERFLAGS(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_UPDATEITEM(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_PINCHECK(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_PINSET(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_CARDADD(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_WATCH(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_BATCH(tClient *Client, int nArgs, char *Args[]);
+void	Server_Cmd_EXPORT(tClient *Client, int nArgs, char *Args[]);
+void	*Server_int_ExportThread(void *Socket);
 // --- Helpers ---
 void	Debug(tClient *Client, const char *Format, ...);
  int	sendf(int Socket, const char *Format, ...);
- int	Server_int_ParseArgs(int bUseLongArg, char *ArgStr, ...);
+ int	Server_int_Send(tClient *Client, const void *Data, int Length);
+ int	Server_int_InitCommands(void);
+const struct sClientCommand	*Server_int_GetCommand(const char *Name, size_t Length);
+static uint32_t	Server_int_CommandHash(const char *Name, size_t Length, uint32_t Seed);
+ int	Server_int_ParseArgs(tClient *Client, const struct sClientCommand *Command, char *ArgStr, char *Args[]);
  int	Server_int_ParseFlags(tClient *Client, const char *Str, int *Mask, int *Value);
 
 #define CLIENT_DEBUG_LOW(Client, ...)	do { if(giDebugLevel>1) Debug(Client, __VA_ARGS__); } while(0)
@@ -99,46 +173,76 @@ void	Debug(tClient *Client, const char *Format, ...);
 
 // === CONSTANTS ===
 // - Commands
+/*
+ * Argument specs, one character per argument (checked before the command
+ * is called, so Args[] always matches):
+ *   w	Word (or "quoted string")
+ *   i	Integer
+ *   p	Four digit PIN
+ *   r	The rest of the line, as sent (last only)
+ *   *	Any number of words (last only)
+ *   [	Everything after this is optional
+ * bBatch marks the commands that can be part of a BATCH.
+ */
 const struct sClientCommand {
 	const char	*Name;
-	void	(*Function)(tClient *Client, char *Arguments);
+	const char	*ArgSpec;
+	void	(*Function)(tClient *Client, int nArgs, char *Args[]);
+	bool	bBatch;
 }	gaServer_Commands[] = {
-	{"USER", Server_Cmd_USER},
-	{"PASS", Server_Cmd_PASS},
-	{"AUTOAUTH", Server_Cmd_AUTOAUTH},
-	{"AUTHIDENT", Server_Cmd_AUTHIDENT},
-	{"AUTHCARD", Server_Cmd_AUTHCARD},
-	{"SETEUSER", Server_Cmd_SETEUSER},
-	{"ENUM_ITEMS", Server_Cmd_ENUMITEMS},
-	{"ITEM_INFO", Server_Cmd_ITEMINFO},
-	{"DISPENSE", Server_Cmd_DISPENSE},
-	{"REFUND", Server_Cmd_REFUND},
-	{"GIVE", Server_Cmd_GIVE},
-	{"DONATE", Server_Cmd_DONATE},
-	{"ADD", Server_Cmd_ADD},
-	{"SET", Server_Cmd_SET},
-	{"ENUM_USERS", Server_Cmd_ENUMUSERS},
-	{"USER_INFO", Server_Cmd_USERINFO},
-	{"USER_ADD", Server_Cmd_USERADD},
-	{"USER_FLAGS", Server_Cmd_USERFLAGS},
-	{"UPDATE_ITEM", Server_Cmd_UPDATEITEM},
-	{"PIN_CHECK", Server_Cmd_PINCHECK},
-	{"PIN_SET", Server_Cmd_PINSET},
-	{"CARD_ADD", Server_Cmd_CARDADD},
+	{"USER", "w", Server_Cmd_USER, false},
+	{"PASS", "w", Server_Cmd_PASS, false},
+	{"AUTOAUTH", "w", Server_Cmd_AUTOAUTH, false},
+	{"AUTHIDENT", "", Server_Cmd_AUTHIDENT, false},
+	{"AUTHCARD", "w", Server_Cmd_AUTHCARD, false},
+	{"SETEUSER", "w", Server_Cmd_SETEUSER, false},
+	{"ENUM_ITEMS", "[w", Server_Cmd_ENUMITEMS, false},
+	{"ITEM_INFO", "w", Server_Cmd_ITEMINFO, false},
+	{"DISPENSE", "w", Server_Cmd_DISPENSE, true},
+	{"REFUND", "ww[i", Server_Cmd_REFUND, false},
+	{"GIVE", "wir", Server_Cmd_GIVE, true},
+	{"DONATE", "ir", Server_Cmd_DONATE, false},
+	{"ADD", "wir", Server_Cmd_ADD, true},
+	{"SET", "wir", Server_Cmd_SET, true},
+	{"ENUM_USERS", "*", Server_Cmd_ENUMUSERS, false},
+	{"USER_INFO", "w", Server_Cmd_USERINFO, false},
+	{"USER_ADD", "w", Server_Cmd_USERADD, false},
+	{"USER_FLAGS", "ww[r", Server_Cmd_USERFLAGS, false},
+	{"UPDATE_ITEM", "wir", Server_Cmd_UPDATEITEM, false},
+	{"PIN_CHECK", "wp", Server_Cmd_PINCHECK, false},
+	{"PIN_SET", "p", Server_Cmd_PINSET, false},
+	{"CARD_ADD", "w", Server_Cmd_CARDADD, false},
+	{"WATCH", "*", Server_Cmd_WATCH, false},
+	{"BATCH", "w", Server_Cmd_BATCH, false},
+	{"EXPORT", "", Server_Cmd_EXPORT, false},
 };
 #define NUM_COMMANDS	((int)(sizeof(gaServer_Commands)/sizeof(gaServer_Commands[0])))
 
 // === GLOBALS ===
 // - Configuration
  int	giServer_Port = 11020;
+ int	giServer_Backlog = MAX_CONNECTION_QUEUE;	// Pending connections before the kernel refuses more
+ int	giServer_MaxInput = MAX_INPUT_BUFFER;	// Longest command (or unprocessed commands) a client can send
  int	gbServer_RunInBackground = 0;
 char	*gsServer_LogFile = "/var/log/dispsrv.log";
 char	*gsServer_ErrorLog = "/var/log/dispsrv.err";
- int	giServer_NumTrustedHosts;
-struct in_addr	*gaServer_TrustedHosts;
+const char	*gsServer_UnixSocket;	// Path of the local listener (config 'server_socket', none if unset)
 // - State variables
  int	giServer_Socket;	// Server socket
+ int	giServer_UnixSocket = -1;	// Local (AF_UNIX) server socket
  int	giServer_NextClientID = 1;	// Debug client ID
+ int	giServer_EPollFD;
+ int	giServer_CompletionFD;	// Handler dispense completions
+ int	giServer_WatchFD;	// WATCH events
+ int	giServer_IdentFD;	// AUTHIDENT lookups
+ int	giServer_TimerFD;	// Timer wheel tick
+tClient	**gaServer_Clients;	// Indexed by socket FD
+ int	giServer_MaxClients;
+volatile sig_atomic_t	gbServer_ReloadConfig;	// Set on SIGHUP
+// - Command lookup (see Server_int_InitCommands)
+uint32_t	giServer_CommandSeed;
+ int	giServer_NumExports;	// Running export threads (atomic)
+const struct sClientCommand	*gaServer_CommandHash[COMMAND_HASH_SIZE];
  
 
 // === CODE ===
@@ -147,41 +251,65 @@ struct in_addr	*gaServer_TrustedHosts;
  */
 void Server_Start(void)
 {
-	 int	client_socket;
-	struct sockaddr_in	server_addr, client_addr;
+	struct sockaddr_storage	server_addr;
+	socklen_t	addr_len;
+	 int	bDualStack;
 
 	// Parse trusted hosts list
-	giServer_NumTrustedHosts = Config_GetValueCount("trusted_host");
-	gaServer_TrustedHosts = malloc(giServer_NumTrustedHosts * sizeof(*gaServer_TrustedHosts));
-	for( int i = 0; i < giServer_NumTrustedHosts; i ++ )
-	{
-		const char	*addr = Config_GetValue_Idx("trusted_host", i);
-		
-		if( inet_aton(addr, &gaServer_TrustedHosts[i]) == 0 ) {
-			fprintf(stderr, "Invalid IP address '%s'\n", addr);
-			continue ;
-		}
+	Trust_Load();
+
+	if( giServer_MaxInput < INPUT_BUFFER_SIZE )
+		giServer_MaxInput = INPUT_BUFFER_SIZE;
+
+	if( Server_int_InitCommands() ) {
+		fprintf(stderr, "ERROR: Unable to build the command table\n");
+		return ;
 	}
 
 	// Ignore SIGPIPE (stops crashes when the client exits early)
 	signal(SIGPIPE, SIG_IGN);
 
-	// Create Server
-	giServer_Socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	// Create Server (IPv6 accepting IPv4 as well, if the machine has IPv6)
+	giServer_Socket = socket(PF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	bDualStack = (giServer_Socket >= 0);
+	if( bDualStack ) {
+		 int	zero = 0;
+		setsockopt(giServer_Socket, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	}
+	else {
+		giServer_Socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	}
 	if( giServer_Socket < 0 ) {
 		fprintf(stderr, "ERROR: Unable to create server socket\n");
 		return ;
 	}
 	
-	// Make listen address
+	// Don't wait out TIME_WAIT from the last run when restarting
+	{
+		 int	one = 1;
+		setsockopt(giServer_Socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
+	
+	// Make listen address (all interfaces)
 	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;	// Internet Socket
-	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);	// Listen on all interfaces
-	server_addr.sin_port = htons(giServer_Port);	// Port
+	if( bDualStack ) {
+		struct sockaddr_in6	*addr6 = (struct sockaddr_in6 *) &server_addr;
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_addr = in6addr_any;
+		addr6->sin6_port = htons(giServer_Port);
+		addr_len = sizeof(*addr6);
+	}
+	else {
+		struct sockaddr_in	*addr4 = (struct sockaddr_in *) &server_addr;
+		addr4->sin_family = AF_INET;	// Internet Socket
+		addr4->sin_addr.s_addr = htonl(INADDR_ANY);	// Listen on all interfaces
+		addr4->sin_port = htons(giServer_Port);	// Port
+		addr_len = sizeof(*addr4);
+	}
 
 	// Bind
-	if( bind(giServer_Socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 ) {
-		fprintf(stderr, "ERROR: Unable to bind to 0.0.0.0:%i\n", giServer_Port);
+	if( bind(giServer_Socket, (struct sockaddr *) &server_addr, addr_len) < 0 ) {
+		fprintf(stderr, "ERROR: Unable to bind to %s:%i\n", (bDualStack ? "[::]" : "0.0.0.0"), giServer_Port);
 		perror("Binding");
 		close(giServer_Socket);
 		return ;
@@ -217,17 +345,92 @@ void Server_Start(void)
 	}
 	atexit(Server_Cleanup);
 
-	// Start the helper thread
+	// Start the helper thread (and have it build the first item listing now,
+	// rather than the first client waiting on the hardware for it)
 	StartPeriodicThread();
+	WakePeriodicThread();
+	
+	// Start handler execution contexts (dispense completions are signalled on this FD)
+	giServer_CompletionFD = Handler_StartWorkers();
+	if( giServer_CompletionFD < 0 ) {
+		fprintf(stderr, "ERROR: Unable to start handler workers\n");
+		return ;
+	}
+	giServer_WatchFD = Watch_Init();
+	if( giServer_WatchFD < 0 ) {
+		fprintf(stderr, "ERROR: Unable to create the WATCH event FD\n");
+		return ;
+	}
+	giServer_TimerFD = Timer_Init();
+	if( giServer_TimerFD < 0 ) {
+		fprintf(stderr, "ERROR: Unable to create the timer FD\n");
+		return ;
+	}
+	giServer_IdentFD = Ident_Init();
+	if( giServer_IdentFD < 0 ) {
+		fprintf(stderr, "ERROR: Unable to create the IDENT lookup FD\n");
+		return ;
+	}
+	Backup_Init();
 	
 	// Listen
-	if( listen(giServer_Socket, MAX_CONNECTION_QUEUE) < 0 ) {
+	if( listen(giServer_Socket, giServer_Backlog) < 0 ) {
 		fprintf(stderr, "ERROR: Unable to listen to socket\n");
 		perror("Listen");
 		return ;
 	}
+	fcntl(giServer_Socket, F_SETFL, fcntl(giServer_Socket, F_GETFL) | O_NONBLOCK);
+	
+	// Local listener, peers are identified by their UID instead of IDENT
+	if( gsServer_UnixSocket && gsServer_UnixSocket[0] )
+	{
+		struct sockaddr_un	local_addr = {.sun_family = AF_UNIX};
+		
+		if( strlen(gsServer_UnixSocket) >= sizeof(local_addr.sun_path) ) {
+			fprintf(stderr, "ERROR: Socket path '%s' is too long\n", gsServer_UnixSocket);
+			return ;
+		}
+		strcpy(local_addr.sun_path, gsServer_UnixSocket);
+		
+		giServer_UnixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if( giServer_UnixSocket < 0 ) {
+			fprintf(stderr, "ERROR: Unable to create local server socket\n");
+			return ;
+		}
+		// Remove a socket left behind by an unclean shutdown
+		unlink(gsServer_UnixSocket);
+		if( bind(giServer_UnixSocket, (struct sockaddr *) &local_addr, sizeof(local_addr)) < 0 ) {
+			fprintf(stderr, "ERROR: Unable to bind to '%s'\n", gsServer_UnixSocket);
+			perror("Binding");
+			return ;
+		}
+		// Anyone on the machine can connect, SO_PEERCRED says who they are
+		chmod(gsServer_UnixSocket, 0666);
+		if( listen(giServer_UnixSocket, giServer_Backlog) < 0 ) {
+			fprintf(stderr, "ERROR: Unable to listen to local socket\n");
+			perror("Listen");
+			return ;
+		}
+		fcntl(giServer_UnixSocket, F_SETFL, fcntl(giServer_UnixSocket, F_GETFL) | O_NONBLOCK);
+	}
+	
+	// Event loop
+	giServer_EPollFD = epoll_create1(EPOLL_CLOEXEC);
+	if( giServer_EPollFD < 0 ) {
+		perror("epoll_create1");
+		return ;
+	}
+	Server_int_WatchFD(giServer_Socket, EPOLL_CTL_ADD, EPOLLIN);
+	if( giServer_UnixSocket != -1 )
+		Server_int_WatchFD(giServer_UnixSocket, EPOLL_CTL_ADD, EPOLLIN);
+	Server_int_WatchFD(giServer_CompletionFD, EPOLL_CTL_ADD, EPOLLIN);
+	Server_int_WatchFD(giServer_WatchFD, EPOLL_CTL_ADD, EPOLLIN);
+	Server_int_WatchFD(giServer_IdentFD, EPOLL_CTL_ADD, EPOLLIN);
+	Server_int_WatchFD(giServer_TimerFD, EPOLL_CTL_ADD, EPOLLIN);
 	
-	Debug_Notice("Listening on 0.0.0.0:%i", giServer_Port);
+	Debug_Notice("Listening on %s:%i", (bDualStack ? "[::]" : "0.0.0.0"), giServer_Port);
+	if( giServer_UnixSocket != -1 )
+		Debug_Notice("Listening on %s", gsServer_UnixSocket);
 	
 	// write pidfile
 	{
@@ -240,201 +443,611 @@ void Server_Start(void)
 
 	for(;;)
 	{
-		uint	len = sizeof(client_addr);
-		 int	bTrusted = 0;
-		 int	bRootPort = 0;
+		struct epoll_event	events[MAX_EVENTS];
+		 int	nEvents;
+		
+		if( gbServer_ReloadConfig )
+		{
+			gbServer_ReloadConfig = 0;
+			if( Config_ReloadFile(gsConfigFile) == 0 ) {
+				Trust_Load();
+				Debug_Notice("Reloaded trusted hosts from %s", gsConfigFile);
+			}
+		}
+		
+		nEvents = epoll_wait(giServer_EPollFD, events, MAX_EVENTS, 1000);
+		if( nEvents < 0 ) {
+			if( errno == EINTR )	continue ;
+			perror("epoll_wait");
+			return ;
+		}
+		
+		for( int i = 0; i < nEvents; i ++ )
+		{
+			 int	fd = events[i].data.fd;
+			if( fd == giServer_Socket )
+				Server_int_AcceptClients();
+			else if( fd == giServer_UnixSocket )
+				Server_int_AcceptUnixClients();
+			else if( fd == giServer_CompletionFD )
+				Handler_RunCompletions();
+			else if( fd == giServer_WatchFD )
+				Watch_RunEvents();
+			else if( fd == giServer_IdentFD )
+				Ident_RunEvents();
+			else if( fd == giServer_TimerFD )
+				Timer_Run();
+			else if( fd < giServer_MaxClients && gaServer_Clients[fd] ) {
+				if( events[i].events & EPOLLOUT )
+					Server_int_FlushClient(gaServer_Clients[fd]);
+				else
+					Server_int_ReadClient(gaServer_Clients[fd]);
+			}
+		}
+		
+		// Retry subscribers that couldn't take all their events
+		Watch_FlushAll();
+	}
+}
+
+void Server_Cleanup(void)
+{
+	Debug_Debug("Close(%i)", giServer_Socket);
+	close(giServer_Socket);
+	if( giServer_UnixSocket != -1 ) {
+		close(giServer_UnixSocket);
+		unlink(gsServer_UnixSocket);
+	}
+	unlink(PIDFILE);
+}
+
+/**
+ * \brief Update the epoll registration for a file descriptor
+ */
+void Server_int_WatchFD(int FD, int Op, uint32_t Events)
+{
+	struct epoll_event	ev = {.events = Events, .data.fd = FD};
+	if( epoll_ctl(giServer_EPollFD, Op, FD, &ev) )
+		perror("epoll_ctl");
+}
+
+/**
+ * \brief Accept all pending connections on the listening socket
+ */
+void Server_int_AcceptClients(void)
+{
+	for(;;)
+	{
+		struct sockaddr_storage	client_addr;
+		socklen_t	len = sizeof(client_addr);
+		 int	client_socket;
+		 int	bTrusted;
+		 int	port;
+		uint8_t	addr[16] = {[10] = 0xFF, [11] = 0xFF};
+		tClient	*client;
 		
 		// Accept a connection
 		client_socket = accept(giServer_Socket, (struct sockaddr *) &client_addr, &len);
 		if(client_socket < 0) {
-			fprintf(stderr, "ERROR: Unable to accept client connection\n");
+			if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+				perror("ERROR: Unable to accept client connection");
 			return ;
 		}
 		
-		// Set a timeout on the user conneciton
-		{
-			struct timeval tv;
-			tv.tv_sec = CLIENT_TIMEOUT;
-			tv.tv_usec = 0;
-			if( setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) )
-			{
-				perror("setsockopt");
-				return ;
-			}
+		if( client_addr.ss_family == AF_INET6 ) {
+			port = ntohs( ((struct sockaddr_in6 *) &client_addr)->sin6_port );
+			memcpy(addr, &((struct sockaddr_in6 *) &client_addr)->sin6_addr, 16);
+		}
+		else {
+			port = ntohs( ((struct sockaddr_in *) &client_addr)->sin_port );
+			memcpy(addr + 12, &((struct sockaddr_in *) &client_addr)->sin_addr, 4);
 		}
 		
 		// Debug: Print the connection string
 		if(giDebugLevel >= 2) {
-			char	ipstr[INET_ADDRSTRLEN];
-			inet_ntop(AF_INET, &client_addr.sin_addr, ipstr, INET_ADDRSTRLEN);
-			Debug_Debug("Client connection from %s:%i",
-				ipstr, ntohs(client_addr.sin_port));
+			char	ipstr[INET6_ADDRSTRLEN];
+			if( client_addr.ss_family == AF_INET6 )
+				inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &client_addr)->sin6_addr, ipstr, sizeof(ipstr));
+			else
+				inet_ntop(AF_INET, &((struct sockaddr_in *) &client_addr)->sin_addr, ipstr, sizeof(ipstr));
+			Debug_Debug("Client connection from %s:%i", ipstr, port);
 		}
 		
-		// Doesn't matter what, localhost is trusted
-		if( ntohl( client_addr.sin_addr.s_addr ) == 0x7F000001 )
-			bTrusted = 1;
-	
-		// Check if the host is on the trusted list	
-		for( int i = 0; i < giServer_NumTrustedHosts; i ++ )
+		// Check if the host is on the trusted list (always includes localhost)
+		bTrusted = Trust_IsTrusted((struct sockaddr *) &client_addr);
+		
+		// Turn away hosts opening connections too quickly (ours are exempt)
+		if( !bTrusted )
 		{
-			if( memcmp(&client_addr.sin_addr, &gaServer_TrustedHosts[i], sizeof(struct in_addr)) == 0 )
-			{
-				bTrusted = 1;
-				break;
+			 int	wait = RateLimit_Take(RATELIMIT_CONNECT, addr, sizeof(addr));
+			if( wait ) {
+				char	msg[64];
+				 int	len = snprintf(msg, sizeof(msg), MSG_RATE_LIMITED, wait);
+				send(client_socket, msg, len, MSG_DONTWAIT);
+				close(client_socket);
+				continue ;
 			}
 		}
+		
+		client = Server_int_AddClient(client_socket);
+		if( !client )
+			continue ;
+		memcpy(client->PeerAddr, addr, sizeof(addr));
+		client->bTrustedHost = bTrusted;
+		// Root port (can AUTOAUTH if also a trusted machine)
+		client->bCanAutoAuth = bTrusted && port < 1024;
+	}
+}
 
-		// Root port (can AUTOAUTH if also a trusted machine
-		if( ntohs(client_addr.sin_port) < 1024 )
-			bRootPort = 1;
+/**
+ * \brief Accept all pending connections on the local (AF_UNIX) socket
+ *
+ * The peer's UID comes from the kernel, so it is authenticated as that
+ * user straight away without any IDENT lookup.
+ */
+void Server_int_AcceptUnixClients(void)
+{
+	for(;;)
+	{
+		struct ucred	cred;
+		socklen_t	len = sizeof(cred);
+		 int	client_socket;
+		tClient	*client;
 		
-		#if 0
-		{
-			// TODO: Make this runtime configurable
-			switch( ntohl( client_addr.sin_addr.s_addr ) )
-			{
-			case 0x7F000001:	// 127.0.0.1	localhost
-		//	case 0x825F0D00:	// 130.95.13.0
-			case 0x825F0D04:	// 130.95.13.4  merlo
-		//	case 0x825F0D05:	// 130.95.13.5  heathred (MR)
-			case 0x825F0D07:	// 130.95.13.7	motsugo
-			case 0x825F0D11:	// 130.95.13.17	mermaid
-			case 0x825F0D12:	// 130.95.13.18	mussel
-			case 0x825F0D17:	// 130.95.13.23	martello
-			case 0x825F0D2A:	// 130.95.13.42 meersau
-		//	case 0x825F0D42:	// 130.95.13.66	heathred (Clubroom)
-				bTrusted = 1;
-				break;
-			default:
-				break;
-			}
+		client_socket = accept(giServer_UnixSocket, NULL, NULL);
+		if(client_socket < 0) {
+			if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+				perror("ERROR: Unable to accept local client connection");
+			return ;
 		}
-		#endif
 		
-		// TODO: Multithread this?
-		Server_HandleClient(client_socket, bTrusted, bRootPort);
+		if( getsockopt(client_socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) ) {
+			perror("getsockopt SO_PEERCRED");
+			close(client_socket);
+			continue ;
+		}
 		
-		close(client_socket);
+		client = Server_int_AddClient(client_socket);
+		if( !client )
+			continue ;
+		if(giDebugLevel >= 2)
+			Debug_Debug("Local client connection from UID %i (PID %i)", (int)cred.uid, (int)cred.pid);
+		
+		// Local root is as trusted as a root port on a trusted host
+		client->bCanAutoAuth = (cred.uid == 0);
+		Server_int_PeerAuth(client, cred.uid);
 	}
 }
 
-void Server_Cleanup(void)
+/**
+ * \brief Set up the state for a newly accepted connection
+ * \return New client, or NULL (and the socket closed) on error
+ */
+tClient *Server_int_AddClient(int Socket)
 {
-	Debug_Debug("Close(%i)", giServer_Socket);
-	close(giServer_Socket);
-	unlink(PIDFILE);
+	tClient	*client;
+	
+	// Replies are buffered rather than blocking (see Server_int_Send), this only
+	// limits how long an EXPORT thread waits on a stalled client
+	{
+		struct timeval tv;
+		tv.tv_sec = CLIENT_TIMEOUT;
+		tv.tv_usec = 0;
+		if( setsockopt(Socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) )
+		{
+			perror("setsockopt");
+			close(Socket);
+			return NULL;
+		}
+	}
+	
+	// Grow the FD -> client table
+	if( Socket >= giServer_MaxClients )
+	{
+		 int	newmax = Socket + 64;
+		tClient	**newtab = realloc(gaServer_Clients, newmax * sizeof(*newtab));
+		if( !newtab ) {
+			perror("Server_int_AddClient - realloc");
+			close(Socket);
+			return NULL;
+		}
+		memset(newtab + giServer_MaxClients, 0, (newmax - giServer_MaxClients) * sizeof(*newtab));
+		gaServer_Clients = newtab;
+		giServer_MaxClients = newmax;
+	}
+	
+	// Initialise Client info
+	client = calloc(1, sizeof(*client));
+	if( client )
+		client->InBuf = malloc(INPUT_BUFFER_SIZE);
+	if( !client || !client->InBuf ) {
+		perror("Server_int_AddClient - calloc");
+		free(client);
+		close(Socket);
+		return NULL;
+	}
+	client->InSize = INPUT_BUFFER_SIZE;
+	client->Socket = Socket;
+	client->ID = giServer_NextClientID ++;
+	client->EffectiveUID = -1;
+	gaServer_Clients[Socket] = client;
+	Timer_Set(&client->IdleTimer, CLIENT_TIMEOUT * 1000, Server_int_IdleTimeout, client);
+	
+	Server_int_WatchFD(Socket, EPOLL_CTL_ADD, EPOLLIN);
+	return client;
 }
 
 /**
- * \brief Reads from a client socket and parses the command strings
- * \param Socket	Client socket number/handle
- * \param bTrusted	Is the client trusted?
+ * \brief Authenticate a local client as the owner of the connecting process
+ *
+ * Nothing is sent, a peer without a usable account is left unauthenticated.
  */
-void Server_HandleClient(int Socket, int bTrusted, int bRootPort)
+void Server_int_PeerAuth(tClient *Client, uid_t PeerUID)
 {
-	char	inbuf[INPUT_BUFFER_SIZE];
-	char	*buf = inbuf;
-	 int	remspace = INPUT_BUFFER_SIZE-1;
-	 int	bytes = -1;
-	tClient	clientInfo;
+	struct passwd	*pwd;
+	 int	uid, flags;
 	
-	memset(&clientInfo, 0, sizeof(clientInfo));
+	pwd = getpwuid(PeerUID);
+	if( !pwd ) {
+		CLIENT_DEBUG(Client, "No login for local UID %i", (int)PeerUID);
+		return ;
+	}
+	Client->PeerName = strdup(pwd->pw_name);
 	
-	// Initialise Client info
-	clientInfo.Socket = Socket;
-	clientInfo.ID = giServer_NextClientID ++;
-	clientInfo.bTrustedHost = bTrusted;
-	clientInfo.bCanAutoAuth = bTrusted && bRootPort;
-	clientInfo.EffectiveUID = -1;
-	
-	// Read from client
-	/*
-	 * Notes:
-	 * - The `buf` and `remspace` variables allow a line to span several
-	 *   calls to recv(), if a line is not completed in one recv() call
-	 *   it is saved to the beginning of `inbuf` and `buf` is updated to
-	 *   the end of it.
-	 */
-	// TODO: Use select() instead (to give a timeout)
-	while( (bytes = recv(Socket, buf, remspace, 0)) > 0 )
+	uid = Bank_GetAcctByName(Client->PeerName, /*bCreate=*/0);
+	if( uid < 0 ) {
+		CLIENT_DEBUG(Client, "Unknown local user '%s'", Client->PeerName);
+		return ;
+	}
+	flags = Bank_GetFlags(uid);
+	if( flags & (USER_FLAG_DISABLED|USER_FLAG_INTERNAL) ) {
+		CLIENT_DEBUG(Client, "Local user '%s' can't be used", Client->PeerName);
+		return ;
+	}
+	
+	Client->UID = uid;
+	Client->Username = strdup(Client->PeerName);
+	Client->bIsAuthed = 1;
+	CLIENT_DEBUG(Client, "Peer authenticated as '%s' (%i)", Client->Username, Client->UID);
+}
+
+/**
+ * \brief Take a token from the client's address for an action
+ *
+ * Trusted hosts and local clients aren't limited by address (many users
+ * share them), per-account limits still apply to them.
+ * \return 0 if allowed, otherwise seconds to wait (the 407 has been sent)
+ */
+int Server_int_RateLimit(tClient *Client, enum eRateLimitClasses Class)
+{
+	 int	wait;
+	
+	if( Client->bTrustedHost || Client->PeerName )
+		return 0;
+	wait = RateLimit_Take(Class, Client->PeerAddr, sizeof(Client->PeerAddr));
+	if( wait ) {
+		CLIENT_DEBUG(Client, "Rate limited (class %i) for %is", Class, wait);
+		sendf(Client->Socket, MSG_RATE_LIMITED, wait);
+	}
+	return wait;
+}
+
+/**
+ * \brief Read available data from a client and run any complete commands
+ */
+void Server_int_ReadClient(tClient *Client)
+{
+	 int	bytes, room;
+	
+	room = Server_int_MakeRoom(Client);
+	bytes = recv(Client->Socket, Client->InBuf + Client->InStart + Client->InLen, room, MSG_DONTWAIT);
+	if( bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+		return ;
+	if( bytes < 0 ) {
+		fprintf(stderr, "ERROR: Unable to recieve from client on socket %i\n", Client->Socket);
+		Server_int_CloseClient(Client);
+		return ;
+	}
+	if( bytes == 0 ) {
+		Server_int_CloseClient(Client);
+		return ;
+	}
+	
+	Client->InLen += bytes;
+	Timer_Set(&Client->IdleTimer, CLIENT_TIMEOUT * 1000, Server_int_IdleTimeout, Client);
+	
+	Server_int_ProcessInput(Client);
+	
+	// Drained the socket and used everything, go back to a small buffer
+	if( bytes < room && Client->InLen == 0 && Client->InSize > INPUT_BUFFER_SIZE )
 	{
-		char	*eol, *start;
-		buf[bytes] = '\0';	// Allow us to use stdlib string functions on it
-		
-		// Split by lines
-		start = inbuf;
-		while( (eol = strchr(start, '\n')) )
-		{
-			*eol = '\0';
-			
-			Server_ParseClientCommand(&clientInfo, start);
-			
-			start = eol + 1;
+		char	*newbuf = realloc(Client->InBuf, INPUT_BUFFER_SIZE);
+		if( newbuf ) {
+			Client->InBuf = newbuf;
+			Client->InSize = INPUT_BUFFER_SIZE;
 		}
-		
-		// Check if there was an incomplete line
-		if( *start != '\0' ) {
-			 int	tailBytes = bytes - (start-buf);
-			// Roll back in buffer
-			memcpy(inbuf, start, tailBytes);
-			remspace -= tailBytes;
-			if(remspace == 0) {
-				send(Socket, MSG_STR_TOO_LONG, sizeof(MSG_STR_TOO_LONG), 0);
-				buf = inbuf;
-				remspace = INPUT_BUFFER_SIZE - 1;
-			}
+	}
+}
+
+/**
+ * \brief Send buffered replies now that the client's socket is writable
+ */
+void Server_int_FlushClient(tClient *Client)
+{
+	 int	sent;
+	
+	sent = send(Client->Socket, Client->OutBuf, Client->OutLen, MSG_DONTWAIT|MSG_NOSIGNAL);
+	if( sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+		return ;
+	if( sent < 0 ) {
+		Server_int_CloseClient(Client);
+		return ;
+	}
+	
+	// It's reading, so it isn't idle
+	Timer_Set(&Client->IdleTimer, CLIENT_TIMEOUT * 1000, Server_int_IdleTimeout, Client);
+	Client->OutLen -= sent;
+	memmove(Client->OutBuf, Client->OutBuf + sent, Client->OutLen);
+	if( Client->OutLen > 0 )
+		return ;
+	
+	// All sent, drop the buffer (usually only needed for the odd large listing)
+	free(Client->OutBuf);
+	Client->OutBuf = NULL;
+	Client->OutSize = 0;
+	// Carry on with the commands that were held back
+	Server_int_ProcessInput(Client);
+}
+
+/**
+ * \brief Make space at the end of a client's input buffer
+ * \return Number of bytes free after the buffered data
+ *
+ * Completed commands are skipped over rather than copied out, so this only
+ * has to move anything when the end of the buffer is reached part way
+ * through a command. The buffer is grown when it is full of unprocessed
+ * data (a long command, or a client sending faster than one read at a
+ * time), and a command that won't fit in giServer_MaxInput is refused.
+ */
+int Server_int_MakeRoom(tClient *Client)
+{
+	 int	end = Client->InStart + Client->InLen;
+	
+	if( end < Client->InSize )
+		return Client->InSize - end;
+	
+	if( Client->InStart > 0 )
+	{
+		// Move the unfinished command to the front
+		memmove(Client->InBuf, Client->InBuf + Client->InStart, Client->InLen);
+		Client->InStart = 0;
+	}
+	else if( Client->InSize < giServer_MaxInput )
+	{
+		 int	newsize = Client->InSize * 2;
+		char	*newbuf;
+		if( newsize > giServer_MaxInput )
+			newsize = giServer_MaxInput;
+		newbuf = realloc(Client->InBuf, newsize);
+		if( newbuf ) {
+			Client->InBuf = newbuf;
+			Client->InSize = newsize;
 		}
-		else {
-			buf = inbuf;
-			remspace = INPUT_BUFFER_SIZE - 1;
+	}
+	
+	if( Client->InLen == Client->InSize )
+	{
+		// No newline in the whole buffer, drop it and the rest of the line
+		if( !Client->bDiscarding )
+			sendf(Client->Socket, MSG_STR_TOO_LONG, Client->InSize);
+		Client->bDiscarding = true;
+		Client->InLen = 0;
+		Client->InScanned = 0;
+	}
+	return Client->InSize - Client->InStart - Client->InLen;
+}
+
+/**
+ * \brief Run buffered commands until the buffer is empty, or a dispense is pending
+ *
+ * Also stops when a reply couldn't be sent in full, so a client that sends
+ * commands without reading the replies is only read from as fast as it reads.
+ */
+void Server_int_ProcessInput(tClient *Client)
+{
+	uint32_t	events;
+	
+	// Subscribers only get events (a reply could land in the middle of one)
+	// and an export is the last thing sent on a connection
+	if( Client->Watcher || Client->bExporting )
+		Client->InStart = Client->InLen = Client->InScanned = 0;
+	
+	// Split by lines
+	while( !Client->bDispensePending && !Client->IdentQuery && !Client->Watcher && !Client->bExporting
+		&& Client->OutLen == 0 && Client->InLen > Client->InScanned )
+	{
+		char	*start = Client->InBuf + Client->InStart;
+		char	*eol = memchr(start + Client->InScanned, '\n', Client->InLen - Client->InScanned);
+		 int	len;
+		
+		if( !eol ) {
+			// Only look at the new data next time
+			Client->InScanned = Client->InLen;
+			break;
 		}
+		*eol = '\0';
+		len = eol - start + 1;
+		Client->InStart += len;
+		Client->InLen -= len;
+		Client->InScanned = 0;
+		
+		if( Client->bDiscarding )
+			Client->bDiscarding = false;	// End of the over-long command
+		else
+			Server_ParseClientCommand(Client, start);
 	}
 	
-	// Check for errors
-	if( bytes < 0 ) {
-		fprintf(stderr, "ERROR: Unable to recieve from client on socket %i\n", Socket);
+	if( Client->InLen == 0 )
+		Client->InStart = 0;
+	
+	// Stop reading while a dispense/lookup is in progress (commands are handled in order)
+	// or while replies are waiting for the client to read them
+	if( Client->bDispensePending || Client->IdentQuery )
+		events = 0;
+	else if( Client->OutLen > 0 )
+		events = EPOLLOUT;
+	else
+		events = EPOLLIN;
+	Server_int_WatchFD(Client->Socket, EPOLL_CTL_MOD, events);
+}
+
+/**
+ * \brief Idle timer for a connection, closes it if it isn't waiting on us
+ */
+void Server_int_IdleTimeout(void *ClientPtr)
+{
+	tClient	*client = ClientPtr;
+	
+	// Subscribers are expected to be idle (they use TCP keepalives instead)
+	if( client->Watcher )
+		return ;
+	// Not idle, waiting on us (the timer is set again when it finishes)
+	if( client->bDispensePending || client->IdentQuery ) {
+		Timer_Set(&client->IdleTimer, CLIENT_TIMEOUT * 1000, Server_int_IdleTimeout, client);
 		return ;
 	}
-	
+	CLIENT_DEBUG_LOW(client, "Idle, closing");
+	Server_int_CloseClient(client);
+}
+
+void Server_int_CloseClient(tClient *Client)
+{
 	if(giDebugLevel >= 2) {
-		printf("Client %i: Disconnected\n", clientInfo.ID);
-	}
+		printf("Client %i: Disconnected\n", Client->ID);
+	}
+	
+	Timer_Cancel(&Client->IdleTimer);
+	// The handler still has a pointer, finish in Server_int_DispenseComplete
+	if( Client->bDispensePending ) {
+		if( !Client->bClosed )
+			Server_int_WatchFD(Client->Socket, EPOLL_CTL_DEL, 0);
+		Client->bClosed = true;
+		return ;
+	}
+	
+	gaServer_Clients[Client->Socket] = NULL;
+	if( Client->Watcher )
+		Watch_Remove(Client->Watcher);
+	if( Client->IdentQuery )
+		Ident_Cancel(Client->IdentQuery);
+	// NOTE: close() removes the FD from the epoll set
+	close(Client->Socket);
+	Server_int_FreeBatch(Client);
+	free(Client->InBuf);
+	free(Client->OutBuf);
+	free(Client->ItemInfoID);
+	free(Client->Username);
+	free(Client->PeerName);
+	free(Client);
 }
 
 /**
  * \brief Parses a client command and calls the required helper function
  * \param Client	Pointer to client state structure
  * \param CommandString	Command from client (single line of the command)
- * \return Heap String to return to the client
+ * \note Arguments are split in place, the command gets pointers into the line
  */
 void Server_ParseClientCommand(tClient *Client, char *CommandString)
 {
-	char	*command, *args;
-	 int	i;
+	const struct sClientCommand	*command;
+	char	*name = CommandString, *end;
+	char	*args[MAX_COMMAND_ARGS];
+	 int	nArgs;
 	
 	if( giDebugLevel >= 2 )
 		Debug(Client, "Server_ParseClientCommand: (CommandString = '%s')", CommandString);
 	
-	if( Server_int_ParseArgs(1, CommandString, &command, &args, NULL) )
-	{
-		if( command == NULL )	return ;
-		// Is this an error? (just ignore for now)
+	// Split off the command name (blank lines are ignored)
+	while( *name == ' ' || *name == '\t' )
+		name ++;
+	end = name + strcspn(name, " \t");
+	if( end == name )
+		return ;
+	
+	command = Server_int_GetCommand(name, end - name);
+	if( !command ) {
+		sendf(Client->Socket, "400 Unknown Command\n");
+		return ;
+	}
+	if( *end )
+		*end++ = '\0';
+	
+	if( Client->bInBatch && command->Function != Server_Cmd_BATCH ) {
+		Server_int_QueueBatch(Client, command, end);
+		return ;
 	}
 	
+	nArgs = Server_int_ParseArgs(Client, command, end, args);
+	if( nArgs < 0 )
+		return ;
 	
-	// Find command
-	for( i = 0; i < NUM_COMMANDS; i++ )
+	if( giDebugLevel >= 2 )
+		Debug(Client, "CMD %s (%i args)", command->Name, nArgs);
+	command->Function(Client, nArgs, args);
+}
+
+/**
+ * \brief Build the command lookup table
+ * \return Non-zero if no collision-free table could be found
+ *
+ * Picks a hash seed that gives every command its own slot, so a lookup is
+ * one hash and one compare, however many commands there are.
+ */
+int Server_int_InitCommands(void)
+{
+	for( uint32_t seed = 1; seed < 100000; seed ++ )
 	{
-		if(strcmp(command, gaServer_Commands[i].Name) == 0) {
-			if( giDebugLevel >= 2 )
-				Debug(Client, "CMD %s - \"%s\"", command, args);
-			gaServer_Commands[i].Function(Client, args);
-			return ;
+		 int	i;
+		memset(gaServer_CommandHash, 0, sizeof(gaServer_CommandHash));
+		for( i = 0; i < NUM_COMMANDS; i ++ )
+		{
+			const char	*name = gaServer_Commands[i].Name;
+			uint32_t	slot = Server_int_CommandHash(name, strlen(name), seed) & (COMMAND_HASH_SIZE - 1);
+			if( gaServer_CommandHash[slot] )
+				break;
+			gaServer_CommandHash[slot] = &gaServer_Commands[i];
+		}
+		if( i == NUM_COMMANDS ) {
+			giServer_CommandSeed = seed;
+			return 0;
 		}
 	}
+	return 1;
+}
+
+/**
+ * \brief Find a command by name
+ * \param Length	Length of the name (it doesn't need to be NUL terminated)
+ */
+const struct sClientCommand *Server_int_GetCommand(const char *Name, size_t Length)
+{
+	uint32_t	slot = Server_int_CommandHash(Name, Length, giServer_CommandSeed) & (COMMAND_HASH_SIZE - 1);
+	const struct sClientCommand	*command = gaServer_CommandHash[slot];
 	
-	sendf(Client->Socket, "400 Unknown Command\n");
+	if( !command || strncmp(command->Name, Name, Length) != 0 || command->Name[Length] != '\0' )
+		return NULL;
+	return command;
+}
+
+/**
+ * \brief FNV-1a, seeded
+ */
+uint32_t Server_int_CommandHash(const char *Name, size_t Length, uint32_t Seed)
+{
+	uint32_t	hash = 2166136261u ^ Seed;
+	for( size_t i = 0; i < Length; i ++ )
+		hash = (hash ^ (uint8_t)Name[i]) * 16777619u;
+	return hash;
 }
 
 // ---
@@ -445,15 +1058,9 @@ void Server_ParseClientCommand(tClient *Client, char *CommandString)
  * 
  * Usage: USER <username>
  */
-void Server_Cmd_USER(tClient *Client, char *Args)
+void Server_Cmd_USER(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*username;
-	
-	if( Server_int_ParseArgs(0, Args, &username, NULL) )
-	{
-		sendf(Client->Socket, "407 USER takes 1 argument\n");
-		return ;
-	}
+	char	*username = Args[0];
 	
 	// Debug!
 	if( giDebugLevel )
@@ -544,14 +1151,20 @@ bool require_auth(tClient* Client)
  * 
  * Usage: PASS <hash>
  */
-void Server_Cmd_PASS(tClient *Client, char *Args)
+void Server_Cmd_PASS(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*passhash;
-
-	if( Server_int_ParseArgs(0, Args, &passhash, NULL) )
-	{
-		sendf(Client->Socket, "407 PASS takes 1 argument\n");
+	char	*passhash = Args[0];
+	
+	// Limit password guessing, both from one place and against one account
+	if( Server_int_RateLimit(Client, RATELIMIT_AUTH) )
 		return ;
+	if( Client->Username )
+	{
+		 int	wait = RateLimit_Take(RATELIMIT_AUTH, Client->Username, strlen(Client->Username));
+		if( wait ) {
+			sendf(Client->Socket, MSG_RATE_LIMITED, wait);
+			return ;
+		}
 	}
 	
 	// Pass on to cokebank
@@ -574,18 +1187,12 @@ void Server_Cmd_PASS(tClient *Client, char *Args)
  * 
  * Usage: AUTOAUTH <user>
  */
-void Server_Cmd_AUTOAUTH(tClient *Client, char *Args)
+void Server_Cmd_AUTOAUTH(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*username;
+	char	*username = Args[0];
 	
-	if( Server_int_ParseArgs(0, Args, &username, NULL) )
-	{
-		sendf(Client->Socket, "407 AUTOAUTH takes 1 argument\n");
-		return ;
-	}
-	
-	// Check if trusted
-	if( !Client->bCanAutoAuth ) {
+	// Check if trusted (a local peer can always name itself)
+	if( !Client->bCanAutoAuth && !(Client->PeerName && strcmp(username, Client->PeerName) == 0) ) {
 		if(giDebugLevel)
 			Debug(Client, "Untrusted client attempting to AUTOAUTH");
 		sendf(Client->Socket, "401 Untrusted\n");
@@ -613,58 +1220,61 @@ void Server_Cmd_AUTOAUTH(tClient *Client, char *Args)
  *
  * Usage: AUTHIDENT
  */
-void Server_Cmd_AUTHIDENT(tClient *Client, char *Args)
+void Server_Cmd_AUTHIDENT(tClient *Client, int UNUSED(nArgs), char **UNUSED(Args))
 {
-	char	*username;
-	const int IDENT_TIMEOUT = 5;
-
-	if( Args != NULL && strlen(Args) ) {
-		sendf(Client->Socket, "407 AUTHIDENT takes no arguments\n");
-		return ;
-	}
-
 	// Check if trusted
-	if( !Client->bTrustedHost ) {
+	if( !Client->bTrustedHost && !Client->PeerName ) {
 		if(giDebugLevel)
 			Debug(Client, "Untrusted client attempting to AUTHIDENT");
 		sendf(Client->Socket, "401 Untrusted\n");
 		return ;
 	}
 
-	// Get username via IDENT
-	username = ident_id(Client->Socket, IDENT_TIMEOUT);
-	if( !username ) {
-		perror("AUTHIDENT - IDENT timed out");
-		sendf(Client->Socket, "403 Authentication failure: IDENT auth timed out\n");
+	// The kernel has already told us who local clients are
+	if( Client->PeerName ) {
+		Server_int_IdentComplete(Client, Client->PeerName);
 		return ;
 	}
 
-	int uid = Bank_GetAcctByName(username, /*bCreate=*/0);
-	if( uid < 0 ) {
-		if(giDebugLevel)
-			Debug(Client, "Unknown user '%s'", username);
-		sendf(Client->Socket, "403 Authentication failure: unknown account\n");
-		free(username);
-		return ;
+	// Get username via IDENT, the reply is sent from Server_int_IdentComplete
+	Client->IdentQuery = Ident_Start(Client->Socket, Server_int_IdentComplete, Client);
+}
+
+/**
+ * \brief IDENT lookup completion for AUTHIDENT, resumes the client's command stream
+ */
+void Server_int_IdentComplete(void *ClientPtr, const char *Username)
+{
+	tClient	*client = ClientPtr;
+	bool	bWasHeld = (client->IdentQuery != NULL);
+	
+	client->IdentQuery = NULL;
+	Timer_Set(&client->IdleTimer, CLIENT_TIMEOUT * 1000, Server_int_IdleTimeout, client);
+	
+	if( !Username ) {
+		CLIENT_DEBUG(client, "AUTHIDENT - IDENT lookup failed");
+		sendf(client->Socket, "403 Authentication failure: IDENT auth timed out\n");
 	}
-	if( ! authenticate(Client, uid, username) )
+	else
 	{
-		free(username);
-		return ;
+		int uid = Bank_GetAcctByName(Username, /*bCreate=*/0);
+		if( uid < 0 ) {
+			CLIENT_DEBUG(client, "Unknown user '%s'", Username);
+			sendf(client->Socket, "403 Authentication failure: unknown account\n");
+		}
+		else if( authenticate(client, uid, Username) ) {
+			sendf(client->Socket, "200 Auth OK\n");
+		}
 	}
-	free(username);
-
-	sendf(Client->Socket, "200 Auth OK\n");
+	
+	// Run any commands that arrived while we were waiting
+	if( bWasHeld )
+		Server_int_ProcessInput(client);
 }
 
-void Server_Cmd_AUTHCARD(tClient* Client, char *Args)
+void Server_Cmd_AUTHCARD(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char* card_id;
-	if( Server_int_ParseArgs(0, Args, &card_id, NULL) )
-	{
-		sendf(Client->Socket, "407 AUTHCARD takes 1 argument\n");
-		return ;
-	}
+	char	*card_id = Args[0];
 
 	// Check if trusted (has to be root)
 	if( Client->UID != 1 )
@@ -695,21 +1305,10 @@ void Server_Cmd_AUTHCARD(tClient* Client, char *Args)
 /**
  * \brief Set effective user
  */
-void Server_Cmd_SETEUSER(tClient *Client, char *Args)
+void Server_Cmd_SETEUSER(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*username;
-	 int	eUserFlags, userFlags;
-	
-	if( Server_int_ParseArgs(0, Args, &username, NULL) )
-	{
-		sendf(Client->Socket, "407 SETEUSER takes 1 argument\n");
-		return ;
-	}
-	
-	if( !strlen(Args) ) {
-		sendf(Client->Socket, "407 SETEUSER expects an argument\n");
-		return ;
-	}
+	char	*username = Args[0];
+	 int	eUserFlags = 0, userFlags;
 	
 	// Check authentication
 	if( !Client->bIsAuthed ) {
@@ -757,61 +1356,60 @@ void Server_Cmd_SETEUSER(tClient *Client, char *Args)
  * \brief Send an item status to the client
  * \param Client	Who to?
  * \param Item	Item to send
+ * \param Status	Handler status for the item (CanDispense return value)
  */
-void Server_int_SendItem(tClient *Client, tItem *Item)
+void Server_int_SendItem(tClient *Client, tItem *Item, int Status)
 {
-	char	*status = "avail";
-	
-	if( Item->Handler->CanDispense )
-	{
-		switch(Item->Handler->CanDispense(Client->UID, Item->ID))
-		{
-		case  0:	status = "avail";	break;
-		case  1:	status = "sold";	break;
-		default:
-		case -1:	status = "error";	break;
-		}
-	}
-	
-	if( !gbNoCostMode && Item->Price == 0 )
-		status = "error";
-	// KNOWN HACK: Naming a slot 'dead' disables it
-	if( strcmp(Item->Name, "dead") == 0 )
-		status = "sold";	// Another status?
-	
-	sendf(Client->Socket,
-		"202 Item %s:%i %s %i %s\n",
-		Item->Handler->Name, Item->ID, status, Item->Price, Item->Name
-		);
+	char	*line = Listing_FormatItem(Item, Status);
+	sendf(Client->Socket, "%s", line);
+	free(line);
 }
 
 /**
  * \brief Enumerate the items that the server knows about
+ * \note Sends the pre-rendered listing (see listing.c)
  */
-void Server_Cmd_ENUMITEMS(tClient *Client, char *Args)
+void Server_Cmd_ENUMITEMS(tClient *Client, int nArgs, char *Args[])
 {
-	 int	i, count;
+	tListing	*listing;
+
+	if( nArgs > 0 )
+	{
+		char	*since_str = Args[0], *end;
+		unsigned long	since;
+		char	*changes;
+		size_t	len;
+
+		// Only the changes since a generation the client already has
+		if( strncmp(since_str, "since:", 6) != 0 ) {
+			sendf(Client->Socket, "407 ENUM_ITEMS takes one optional argument: since:<generation>\n");
+			return ;
+		}
+		since = strtoul(since_str + 6, &end, 10);
+		if( since_str[6] == '\0' || *end != '\0' ) {
+			sendf(Client->Socket, "407 Invalid generation '%s'\n", since_str + 6);
+			return ;
+		}
 
-	if( Args != NULL && strlen(Args) ) {
-		sendf(Client->Socket, "407 ENUM_ITEMS takes no arguments\n");
+		changes = Listing_GetChanges(since, &len);
+		if( !changes ) {
+			sendf(Client->Socket, "410 Resync required\n");
+			return ;
+		}
+		Server_int_Send(Client, changes, len);
+		free(changes);
 		return ;
 	}
-	
-	// Count shown items
-	count = 0;
-	for( i = 0; i < giNumItems; i ++ ) {
-		if( gaItems[i].bHidden )	continue;
-		count ++;
-	}
-
-	sendf(Client->Socket, "201 Items %i\n", count);
 
-	for( i = 0; i < giNumItems; i ++ ) {
-		if( gaItems[i].bHidden )	continue;
-		Server_int_SendItem( Client, &gaItems[i] );
+	if( Server_int_RateLimit(Client, RATELIMIT_LISTING) )
+		return ;
+	listing = Listing_Get();
+	if( !listing ) {
+		sendf(Client->Socket, "500 Unable to list items\n");
+		return ;
 	}
-
-	sendf(Client->Socket, "200 List end\n");
+	Server_int_Send(Client, listing->Data, listing->Length);
+	Listing_Release(listing);
 }
 
 tItem *_GetItemFromString(char *String)
@@ -829,14 +1427,7 @@ tItem *_GetItemFromString(char *String)
 	*colon = '\0';
 
 	// Find handler
-	handler = NULL;
-	for( i = 0; i < giNumHandlers; i ++ )
-	{
-		if( strcmp(gaHandlers[i]->Name, type) == 0) {
-			handler = gaHandlers[i];
-			break;
-		}
-	}
+	handler = Handler_GetByName(type, false);
 	if( !handler ) {
 		return NULL;
 	}
@@ -856,23 +1447,60 @@ tItem *_GetItemFromString(char *String)
  *
  * Usage: ITEMINFO <item ID>
  */
-void Server_Cmd_ITEMINFO(tClient *Client, char *Args)
+void Server_Cmd_ITEMINFO(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
 	tItem	*item;
-	char	*itemname;
 	
-	if( Server_int_ParseArgs(0, Args, &itemname, NULL) ) {
-		sendf(Client->Socket, "407 ITEMINFO takes 1 argument\n");
-		return ;
-	}
-	item = _GetItemFromString(Args);
+	item = _GetItemFromString(Args[0]);
 	
 	if( !item ) {
 		sendf(Client->Socket, "406 Bad Item ID\n");
 		return ;
 	}
 	
-	Server_int_SendItem( Client, item );
+	// Anonymous clients get the status from the last listing refresh
+	if( !Client->bIsAuthed ) {
+		Server_int_SendItem( Client, item, Listing_GetStatus(item) );
+		return ;
+	}
+	
+	// The status can depend on the user, ask the handler (off this thread,
+	// it could block on hardware). Replied to by Server_int_ItemInfoComplete
+	Client->ItemInfoID = mkstr("%s:%i", item->Handler->Name, item->ID);
+	if( !Client->ItemInfoID || Handler_CheckDispense(item->Handler, Client->UID, item->ID, Server_int_ItemInfoComplete, Client) ) {
+		free(Client->ItemInfoID);
+		Client->ItemInfoID = NULL;
+		sendf(Client->Socket, "500 Unable to get item status\n");
+		return ;
+	}
+	Client->bDispensePending = true;
+}
+
+/**
+ * \brief Handler completion for ITEM_INFO, resumes the client's command stream
+ */
+void Server_int_ItemInfoComplete(void *ClientPtr, int Status)
+{
+	tClient	*client = ClientPtr;
+	tItem	*item;
+	
+	client->bDispensePending = false;
+	if( client->bClosed ) {
+		Server_int_CloseClient(client);
+		return ;
+	}
+	
+	// Looked up again, the item list could have been reloaded in the meantime
+	item = _GetItemFromString(client->ItemInfoID);
+	if( item )
+		Server_int_SendItem( client, item, Status );
+	else
+		sendf(client->Socket, "406 Bad Item ID\n");
+	free(client->ItemInfoID);
+	client->ItemInfoID = NULL;
+	Timer_Set(&client->IdleTimer, CLIENT_TIMEOUT * 1000, Server_int_IdleTimeout, client);
+	
+	Server_int_ProcessInput(client);
 }
 
 /**
@@ -880,18 +1508,13 @@ void Server_Cmd_ITEMINFO(tClient *Client, char *Args)
  *
  * Usage: DISPENSE <Item ID>
  */
-void Server_Cmd_DISPENSE(tClient *Client, char *Args)
+void Server_Cmd_DISPENSE(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
 	tItem	*item;
 	 int	ret;
 	 int	uid;
-	char	*itemname;
+	char	*itemname = Args[0];
 	
-	if( Server_int_ParseArgs(0, Args, &itemname, NULL) ) {
-		sendf(Client->Socket, "407 DISPENSE takes only 1 argument\n");
-		return ;
-	}
-	 
 	if( !Client->bIsAuthed ) {
 		sendf(Client->Socket, "401 Not Authenticated\n");
 		return ;
@@ -910,16 +1533,52 @@ void Server_Cmd_DISPENSE(tClient *Client, char *Args)
 		uid = Client->UID;
 	}
 
-//	if( Bank_GetFlags(Client->UID) & USER_FLAG_DISABLED  ) {
-//	}
-
-	switch( ret = DispenseItem( Client->UID, uid, item ) )
+//	if( Bank_GetFlags(Client->UID) & USER_FLAG_DISABLED  ) {
+//	}
+
+	// A batch needs the result before it commits, so only items with nothing to drive
+	if( Client->bRunningBatch ) {
+		Server_int_SendDispenseResult(Client, DispenseImmediate(Client->UID, uid, item));
+		return ;
+	}
+
+	// The reply is sent from Server_int_DispenseComplete once the handler finishes
+	ret = DispenseItem( Client->UID, uid, item, Server_int_DispenseComplete, Client );
+	if( ret == 0 )
+		Client->bDispensePending = true;
+	else
+		Server_int_SendDispenseResult(Client, ret);
+}
+
+/**
+ * \brief Handler completion for DISPENSE, resumes the client's command stream
+ */
+void Server_int_DispenseComplete(void *ClientPtr, int Result)
+{
+	tClient	*client = ClientPtr;
+	
+	if( client->bClosed ) {
+		client->bDispensePending = false;
+		Server_int_CloseClient(client);
+		return ;
+	}
+	Server_int_SendDispenseResult(client, Result);
+	client->bDispensePending = false;
+	Timer_Set(&client->IdleTimer, CLIENT_TIMEOUT * 1000, Server_int_IdleTimeout, client);
+	
+	// Run any commands that arrived while we were waiting
+	Server_int_ProcessInput(client);
+}
+
+void Server_int_SendDispenseResult(tClient *Client, int Result)
+{
+	switch( Result )
 	{
 	case 0:	sendf(Client->Socket, "200 Dispense OK\n");	return ;
 	case 1:	sendf(Client->Socket, "501 Unable to dispense\n");	return ;
 	case 2:	sendf(Client->Socket, "402 Poor You\n");	return ;
 	default:
-		sendf(Client->Socket, "500 Dispense Error (%i)\n", ret);
+		sendf(Client->Socket, "500 Dispense Error (%i)\n", Result);
 		return ;
 	}
 }
@@ -929,18 +1588,12 @@ void Server_Cmd_DISPENSE(tClient *Client, char *Args)
  *
  * Usage: REFUND <user> <item id> [<price>]
  */
-void Server_Cmd_REFUND(tClient *Client, char *Args)
+void Server_Cmd_REFUND(tClient *Client, int nArgs, char *Args[])
 {
 	tItem	*item;
 	 int	uid, price_override = 0;
-	char	*username, *itemname, *price_str;
-
-	if( Server_int_ParseArgs(0, Args, &username, &itemname, &price_str, NULL) ) {
-		if( !itemname || price_str ) {
-			sendf(Client->Socket, "407 REFUND takes 2 or 3 arguments\n");
-			return ;
-		}
-	}
+	char	*username = Args[0], *itemname = Args[1];
+	char	*price_str = (nArgs > 2 ? Args[2] : NULL);
 
 	if( !Client->bIsAuthed ) {
 		sendf(Client->Socket, "401 Not Authenticated\n");
@@ -982,18 +1635,12 @@ void Server_Cmd_REFUND(tClient *Client, char *Args)
  *
  * Usage: GIVE <dest> <ammount> <reason...>
  */
-void Server_Cmd_GIVE(tClient *Client, char *Args)
+void Server_Cmd_GIVE(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*recipient, *ammount, *reason;
+	char	*recipient = Args[0], *ammount = Args[1], *reason = Args[2];
 	 int	uid, iAmmount;
 	 int	thisUid;
 	
-	// Parse arguments
-	if( Server_int_ParseArgs(1, Args, &recipient, &ammount, &reason, NULL) ) {
-		sendf(Client->Socket, "407 GIVE takes only 3 arguments\n");
-		return ;
-	}
-	
 	// Check for authed
 	if( !Client->bIsAuthed ) {
 		sendf(Client->Socket, "401 Not Authenticated\n");
@@ -1042,18 +1689,12 @@ void Server_Cmd_GIVE(tClient *Client, char *Args)
 	}
 }
 
-void Server_Cmd_DONATE(tClient *Client, char *Args)
+void Server_Cmd_DONATE(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*ammount, *reason;
+	char	*ammount = Args[0], *reason = Args[1];
 	 int	iAmmount;
 	 int	thisUid;
 	
-	// Parse arguments
-	if( Server_int_ParseArgs(1, Args, &ammount, &reason, NULL) ) {
-		sendf(Client->Socket, "407 DONATE takes 2 arguments\n");
-		return ;
-	}
-	
 	if( !Client->bIsAuthed ) {
 		sendf(Client->Socket, "401 Not Authenticated\n");
 		return ;
@@ -1089,17 +1730,11 @@ void Server_Cmd_DONATE(tClient *Client, char *Args)
 	}
 }
 
-void Server_Cmd_ADD(tClient *Client, char *Args)
+void Server_Cmd_ADD(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*user, *ammount, *reason;
+	char	*user = Args[0], *ammount = Args[1], *reason = Args[2];
 	 int	uid, iAmmount;
 	
-	// Parse arguments
-	if( Server_int_ParseArgs(1, Args, &user, &ammount, &reason, NULL) ) {
-		sendf(Client->Socket, "407 ADD takes 3 arguments\n");
-		return ;
-	}
-	
 	if( !Client->bIsAuthed ) {
 		sendf(Client->Socket, "401 Not Authenticated\n");
 		return ;
@@ -1146,12 +1781,7 @@ void Server_Cmd_ADD(tClient *Client, char *Args)
 		// TODO: Maybe disallow changes to disabled?
 	}
 
-	// Parse ammount
 	iAmmount = atoi(ammount);
-	if( iAmmount == 0 && ammount[0] != '0' ) {
-		sendf(Client->Socket, "407 Invalid Argument\n");
-		return ;
-	}
 
 	// Do give
 	switch( DispenseAdd(Client->UID, uid, iAmmount, reason) )
@@ -1168,17 +1798,11 @@ void Server_Cmd_ADD(tClient *Client, char *Args)
 	}
 }
 
-void Server_Cmd_SET(tClient *Client, char *Args)
+void Server_Cmd_SET(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*user, *ammount, *reason;
+	char	*user = Args[0], *ammount = Args[1], *reason = Args[2];
 	 int	uid, iAmmount;
 	
-	// Parse arguments
-	if( Server_int_ParseArgs(1, Args, &user, &ammount, &reason, NULL) ) {
-		sendf(Client->Socket, "407 SET takes 3 arguments\n");
-		return ;
-	}
-	
 	if( !Client->bIsAuthed ) {
 		sendf(Client->Socket, "401 Not Authenticated\n");
 		return ;
@@ -1197,12 +1821,7 @@ void Server_Cmd_SET(tClient *Client, char *Args)
 		return ;
 	}
 
-	// Parse ammount
 	iAmmount = atoi(ammount);
-	if( iAmmount == 0 && ammount[0] != '0' ) {
-		sendf(Client->Socket, "407 Invalid Argument\n");
-		return ;
-	}
 
 	int origBalance, rv;
 	// Do give
@@ -1217,7 +1836,7 @@ void Server_Cmd_SET(tClient *Client, char *Args)
 	}
 }
 
-void Server_Cmd_ENUMUSERS(tClient *Client, char *Args)
+void Server_Cmd_ENUMUSERS(tClient *Client, int nArgs, char *Args[])
 {
 	 int	i, numRet = 0;
 	tAcctIterator	*it;
@@ -1231,98 +1850,86 @@ void Server_Cmd_ENUMUSERS(tClient *Client, char *Args)
 	time_t	timeValue;	// Time value for iterator
 	
 	// Parse arguments
-	if( Args && strlen(Args) )
+	for( int argIdx = 0; argIdx < nArgs; argIdx ++ )
 	{
-		char	*space = Args, *type, *val;
-		do
-		{
-			type = space;
-			while(*type == ' ')	type ++;
-			// Get next space
-			space = strchr(space, ' ');
-			if(space)	*space = '\0';
+		char	*type = Args[argIdx], *val;
+		
+		// Get type
+		val = strchr(type, ':');
+		if( val ) {
+			*val = '\0';
+			val ++;
 			
-			// Get type
-			val = strchr(type, ':');
-			if( val ) {
-				*val = '\0';
-				val ++;
-				
-				// Types
-				// - Minium Balance
-				if( strcmp(type, "min_balance") == 0 ) {
-					minBal = atoi(val);
+			// Types
+			// - Minium Balance
+			if( strcmp(type, "min_balance") == 0 ) {
+				minBal = atoi(val);
+			}
+			// - Maximum Balance
+			else if( strcmp(type, "max_balance") == 0 ) {
+				maxBal = atoi(val);
+			}
+			// - Flags
+			else if( strcmp(type, "flags") == 0 ) {
+				if( Server_int_ParseFlags(Client, val, &flagMask, &flagVal) )
+					return ;
+			}
+			// - Last seen before timestamp
+			else if( strcmp(type, "last_seen_before") == 0 ) {
+				lastSeenAfter = atoll(val);
+			}
+			// - Last seen after timestamp
+			else if( strcmp(type, "last_seen_after") == 0 ) {
+				lastSeenAfter = atoll(val);
+			}
+			// - Sorting 
+			else if( strcmp(type, "sort") == 0 ) {
+				char	*dash = strchr(val, '-');
+				if( dash ) {
+					*dash = '\0';
+					dash ++;
 				}
-				// - Maximum Balance
-				else if( strcmp(type, "max_balance") == 0 ) {
-					maxBal = atoi(val);
+				if( strcmp(val, "name") == 0 ) {
+					sort = BANK_ITFLAG_SORT_NAME;
 				}
-				// - Flags
-				else if( strcmp(type, "flags") == 0 ) {
-					if( Server_int_ParseFlags(Client, val, &flagMask, &flagVal) )
-						return ;
+				else if( strcmp(val, "balance") == 0 ) {
+					sort = BANK_ITFLAG_SORT_BAL;
 				}
-				// - Last seen before timestamp
-				else if( strcmp(type, "last_seen_before") == 0 ) {
-					lastSeenAfter = atoll(val);
+				else if( strcmp(val, "lastseen") == 0 ) {
+					sort = BANK_ITFLAG_SORT_LASTSEEN;
 				}
-				// - Last seen after timestamp
-				else if( strcmp(type, "last_seen_after") == 0 ) {
-					lastSeenAfter = atoll(val);
+				else {
+					sendf(Client->Socket, "407 Unknown sort field ('%s')\n", val);
+					return ;
 				}
-				// - Sorting 
-				else if( strcmp(type, "sort") == 0 ) {
-					char	*dash = strchr(val, '-');
-					if( dash ) {
-						*dash = '\0';
-						dash ++;
-					}
-					if( strcmp(val, "name") == 0 ) {
-						sort = BANK_ITFLAG_SORT_NAME;
-					}
-					else if( strcmp(val, "balance") == 0 ) {
-						sort = BANK_ITFLAG_SORT_BAL;
-					}
-					else if( strcmp(val, "lastseen") == 0 ) {
-						sort = BANK_ITFLAG_SORT_LASTSEEN;
+				// Handle sort direction
+				if( dash ) {
+					if( strcmp(dash, "desc") == 0 ) {
+						sort |= BANK_ITFLAG_REVSORT;
 					}
 					else {
-						sendf(Client->Socket, "407 Unknown sort field ('%s')\n", val);
+						sendf(Client->Socket, "407 Unknown sort direction '%s'\n", dash);
 						return ;
 					}
-					// Handle sort direction
-					if( dash ) {
-						if( strcmp(dash, "desc") == 0 ) {
-							sort |= BANK_ITFLAG_REVSORT;
-						}
-						else {
-							sendf(Client->Socket, "407 Unknown sort direction '%s'\n", dash);
-							return ;
-						}
-						dash[-1] = '-';
-					}
-				}
-				else {
-					sendf(Client->Socket, "407 Unknown argument to ENUM_USERS '%s:%s'\n", type, val);
-					return ;
+					dash[-1] = '-';
 				}
-				
-				val[-1] = ':';
 			}
 			else {
-				sendf(Client->Socket, "407 Unknown argument to ENUM_USERS '%s'\n", type);
+				sendf(Client->Socket, "407 Unknown argument to ENUM_USERS '%s:%s'\n", type, val);
 				return ;
 			}
 			
-			// Eat whitespace
-			if( space ) {
-				*space = ' ';	// Repair (to be nice)
-				space ++;
-				while(*space == ' ')	space ++;
-			}
-		}	while(space);
+			val[-1] = ':';
+		}
+		else {
+			sendf(Client->Socket, "407 Unknown argument to ENUM_USERS '%s'\n", type);
+			return ;
+		}
 	}
 	
+	if( Server_int_RateLimit(Client, RATELIMIT_LISTING) )
+		return ;
+	
 	// Create iterator
 	if( maxBal != INT_MAX ) {
 		flags = sort|BANK_ITFLAG_MAXBALANCE;
@@ -1388,16 +1995,10 @@ void Server_Cmd_ENUMUSERS(tClient *Client, char *Args)
 	sendf(Client->Socket, "200 List End\n");
 }
 
-void Server_Cmd_USERINFO(tClient *Client, char *Args)
+void Server_Cmd_USERINFO(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
 	 int	uid;
-	char	*user;
-	
-	// Parse arguments
-	if( Server_int_ParseArgs(0, Args, &user, NULL) ) {
-		sendf(Client->Socket, "407 USER_INFO takes 1 argument\n");
-		return ;
-	}
+	char	*user = Args[0];
 	
 	if( giDebugLevel )	Debug(Client, "User Info '%s'", user);
 	
@@ -1447,15 +2048,9 @@ void _SendUserInfo(tClient *Client, int UserID)
 		);
 }
 
-void Server_Cmd_USERADD(tClient *Client, char *Args)
+void Server_Cmd_USERADD(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*username;
-	
-	// Parse arguments
-	if( Server_int_ParseArgs(0, Args, &username, NULL) ) {
-		sendf(Client->Socket, "407 USER_ADD takes 1 argument\n");
-		return ;
-	}
+	char	*username = Args[0];
 	
 	// Check authentication
 	if( !Client->bIsAuthed ) {
@@ -1484,21 +2079,13 @@ void Server_Cmd_USERADD(tClient *Client, char *Args)
 	sendf(Client->Socket, "200 User Added\n");
 }
 
-void Server_Cmd_USERFLAGS(tClient *Client, char *Args)
+void Server_Cmd_USERFLAGS(tClient *Client, int nArgs, char *Args[])
 {
-	char	*username, *flags, *reason=NULL;
+	char	*username = Args[0], *flags = Args[1];
+	char	*reason = (nArgs > 2 ? Args[2] : "");
 	 int	mask=0, value=0;
 	 int	uid;
 	
-	// Parse arguments
-	if( Server_int_ParseArgs(1, Args, &username, &flags, &reason, NULL) ) {
-		if( !flags ) {
-			sendf(Client->Socket, "407 USER_FLAGS takes at least 2 arguments\n");
-			return ;
-		}
-		reason = "";
-	}
-	
 	// Check authentication
 	if(!require_auth(Client))	return;
 	
@@ -1534,16 +2121,11 @@ void Server_Cmd_USERFLAGS(tClient *Client, char *Args)
 	sendf(Client->Socket, "200 User Updated\n");
 }
 
-void Server_Cmd_UPDATEITEM(tClient *Client, char *Args)
+void Server_Cmd_UPDATEITEM(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*itemname, *price_str, *description;
+	char	*itemname = Args[0], *price_str = Args[1], *description = Args[2];
 	 int	price;
 	tItem	*item;
-	
-	if( Server_int_ParseArgs(1, Args, &itemname, &price_str, &description, NULL) ) {
-		sendf(Client->Socket, "407 UPDATE_ITEM takes 3 arguments\n");
-		return ;
-	}
 
 	if(!require_auth(Client))	return;
 
@@ -1561,8 +2143,9 @@ void Server_Cmd_UPDATEITEM(tClient *Client, char *Args)
 	}
 	
 	price = atoi(price_str);
-	if( price <= 0 && price_str[0] != '0' ) {
+	if( price < 0 ) {
 		sendf(Client->Socket, "407 Invalid price set\n");
+		return ;
 	}
 	
 	switch( DispenseUpdateItem( Client->UID, item, description, price ) )
@@ -1576,21 +2159,10 @@ void Server_Cmd_UPDATEITEM(tClient *Client, char *Args)
 	}
 }
 
-void Server_Cmd_PINCHECK(tClient *Client, char *Args)
+void Server_Cmd_PINCHECK(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*username, *pinstr;
-	 int	pin;
-
-	if( Server_int_ParseArgs(0, Args, &username, &pinstr, NULL) ) {
-		sendf(Client->Socket, "407 PIN_CHECK takes 2 arguments\n");
-		return ;
-	}
-	
-	if( !isdigit(pinstr[0]) || !isdigit(pinstr[1]) || !isdigit(pinstr[2]) || !isdigit(pinstr[3]) || pinstr[4] != '\0' ) {
-		sendf(Client->Socket, "407 PIN should be four digits\n");
-		return ;
-	}
-	pin = atoi(pinstr);
+	char	*username = Args[0];
+	 int	pin = atoi(Args[1]);
 
 	if(!require_auth(Client))	return;
 	
@@ -1607,51 +2179,33 @@ void Server_Cmd_PINCHECK(tClient *Client, char *Args)
 		return ;
 	}
 	
-	// Get the pin
-	static time_t	last_wrong_pin_time;
-	static int	backoff = 1;
-	if( time(NULL) - last_wrong_pin_time < backoff ) {
-		sendf(Client->Socket, "407 Rate limited (%i seconds remaining)\n",
-			backoff - (time(NULL) - last_wrong_pin_time));
+	// Limit guessing (per address, and per account so it can't be spread out)
+	if( Server_int_RateLimit(Client, RATELIMIT_PIN) )
 		return ;
-	}	
-	last_wrong_pin_time = time(NULL);
+	{
+		 int	wait = RateLimit_Take(RATELIMIT_PIN, &uid, sizeof(uid));
+		if( wait ) {
+			sendf(Client->Socket, MSG_RATE_LIMITED, wait);
+			return ;
+		}
+	}
+	
+	// Check the pin
 	if( !Bank_IsPinValid(uid, pin) )
 	{
 		sendf(Client->Socket, "401 Pin incorrect\n");
-		struct sockaddr_storage	addr;
-		socklen_t len = sizeof(addr);
 		char ipstr[INET6_ADDRSTRLEN];
-		getpeername(Client->Socket, (void*)&addr, &len);
-		struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-		inet_ntop(addr.ss_family, &s->sin_addr, ipstr, sizeof(ipstr));
+		inet_ntop(AF_INET6, Client->PeerAddr, ipstr, sizeof(ipstr));
 		Debug_Notice("Bad pin from %s for %s by %i", ipstr, username, Client->UID);
-		if( backoff < 5)
-			backoff ++;
 		return ;
 	}
 
-	last_wrong_pin_time = 0;
-	backoff = 1;
 	sendf(Client->Socket, "200 Pin correct\n");
 	return ;
 }
-void Server_Cmd_PINSET(tClient *Client, char *Args)
+void Server_Cmd_PINSET(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char	*pinstr;
-	 int	pin;
-	
-
-	if( Server_int_ParseArgs(0, Args, &pinstr, NULL) ) {
-		sendf(Client->Socket, "407 PIN_SET takes 1 argument\n");
-		return ;
-	}
-	
-	if( !isdigit(pinstr[0]) || !isdigit(pinstr[1]) || !isdigit(pinstr[2]) || !isdigit(pinstr[3]) || pinstr[4] != '\0' ) {
-		sendf(Client->Socket, "407 PIN should be four digits\n");
-		return ;
-	}
-	pin = atoi(pinstr);
+	 int	pin = atoi(Args[0]);
 
 	if(!require_auth(Client))	return;
 	
@@ -1662,13 +2216,9 @@ void Server_Cmd_PINSET(tClient *Client, char *Args)
 	sendf(Client->Socket, "200 Pin updated\n");
 	return ;
 }
-void Server_Cmd_CARDADD(tClient* Client, char* Args)
+void Server_Cmd_CARDADD(tClient *Client, int UNUSED(nArgs), char *Args[])
 {
-	char* card_id;
-	if( Server_int_ParseArgs(0, Args, &card_id, NULL) ) {
-		sendf(Client->Socket, "407 CARD_ADD takes 1 argument\n");
-		return ;
-	}
+	char	*card_id = Args[0];
 
 	if(!require_auth(Client))	return;
 
@@ -1682,6 +2232,299 @@ void Server_Cmd_CARDADD(tClient* Client, char* Args)
 	sendf(Client->Socket, "200 Card added\n");
 }
 
+/**
+ * \brief Subscribe to item and/or balance change events
+ * \note Events (3xx lines) are sent as they happen, until the connection is
+ *       closed. Anything else the client sends is ignored.
+ */
+void Server_Cmd_WATCH(tClient *Client, int nArgs, char *Args[])
+{
+	 int	mask = 0;
+	 int	account = -1;
+	const int	one = 1;
+
+	if( Client->Watcher ) {
+		sendf(Client->Socket, "408 Already watching\n");
+		return ;
+	}
+
+	// Parse arguments (none = everything)
+	for( int i = 0; i < nArgs; i ++ )
+	{
+		char	*arg = Args[i];
+		if( strcmp(arg, "items") == 0 )
+			mask |= WATCH_ITEMS;
+		else if( strcmp(arg, "balances") == 0 )
+			mask |= WATCH_BALANCES;
+		else if( strncmp(arg, "balance:", 8) == 0 ) {
+			mask |= WATCH_BALANCES;
+			account = Bank_GetAcctByName(arg + 8, 0);
+			if( account == -1 ) {
+				sendf(Client->Socket, "404 Invalid user '%s'\n", arg + 8);
+				return ;
+			}
+		}
+		else {
+			sendf(Client->Socket, "407 Unknown WATCH type '%s'\n", arg);
+			return ;
+		}
+	}
+	if( !mask )
+		mask = WATCH_ITEMS|WATCH_BALANCES;
+
+	Client->Watcher = Watch_Add(Client->Socket, mask, account);
+	if( !Client->Watcher ) {
+		sendf(Client->Socket, "500 Unable to watch\n");
+		return ;
+	}
+	// Subscribers don't time out, so notice dead peers
+	setsockopt(Client->Socket, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+	CLIENT_DEBUG(Client, "Watching (mask 0x%x, account %i)", mask, account);
+	sendf(Client->Socket, "200 Watching\n");
+}
+
+/**
+ * \brief Run several balance changes as one transaction
+ *
+ * Usage: BATCH BEGIN|COMMIT|ABORT
+ * Commands between BEGIN and COMMIT are checked and queued (100 Queued),
+ * then run together by COMMIT inside one bank transaction. If any of them
+ * fails, none of them happen.
+ */
+void Server_Cmd_BATCH(tClient *Client, int UNUSED(nArgs), char *Args[])
+{
+	if( strcmp(Args[0], "BEGIN") == 0 )
+	{
+		if(!require_auth(Client))	return;
+		if( Client->bInBatch ) {
+			sendf(Client->Socket, "408 Already in a batch\n");
+			return ;
+		}
+		Client->bInBatch = true;
+		sendf(Client->Socket, "200 Batch started\n");
+		return ;
+	}
+	
+	if( strcmp(Args[0], "COMMIT") != 0 && strcmp(Args[0], "ABORT") != 0 ) {
+		sendf(Client->Socket, "407 BATCH takes BEGIN, COMMIT or ABORT\n");
+		return ;
+	}
+	if( !Client->bInBatch ) {
+		sendf(Client->Socket, "407 Not in a batch\n");
+		return ;
+	}
+	
+	if( strcmp(Args[0], "ABORT") == 0 ) {
+		Server_int_FreeBatch(Client);
+		sendf(Client->Socket, "200 Batch discarded\n");
+	}
+	else if( Client->BatchRejected ) {
+		sendf(Client->Socket, "409 Batch not run (%i commands rejected)\n", Client->BatchRejected);
+		Server_int_FreeBatch(Client);
+	}
+	else {
+		Server_int_RunBatch(Client);
+	}
+}
+
+/**
+ * \brief Check a command sent inside a batch, and save it for BATCH COMMIT
+ */
+void Server_int_QueueBatch(tClient *Client, const struct sClientCommand *Command, char *ArgStr)
+{
+	char	*args[MAX_COMMAND_ARGS];
+	char	*copy;
+	
+	if( !Command->bBatch ) {
+		sendf(Client->Socket, "407 %s can't be used in a batch\n", Command->Name);
+		Client->BatchRejected ++;
+		return ;
+	}
+	if( Client->BatchLen == MAX_BATCH_COMMANDS ) {
+		sendf(Client->Socket, "407 Batch too long (limit %i)\n", MAX_BATCH_COMMANDS);
+		Client->BatchRejected ++;
+		return ;
+	}
+	
+	copy = strdup(ArgStr);
+	if( Server_int_ParseArgs(Client, Command, ArgStr, args) < 0 ) {
+		free(copy);
+		Client->BatchRejected ++;
+		return ;
+	}
+	
+	if( Client->BatchLen == Client->BatchSpace )
+	{
+		 int	newspace = Client->BatchSpace ? Client->BatchSpace * 2 : 16;
+		tBatchCommand	*newlist = realloc(Client->Batch, newspace * sizeof(*newlist));
+		if( !newlist || !copy ) {
+			free(copy);
+			sendf(Client->Socket, "500 Out of memory\n");
+			Client->BatchRejected ++;
+			return ;
+		}
+		Client->Batch = newlist;
+		Client->BatchSpace = newspace;
+	}
+	Client->Batch[Client->BatchLen].Command = Command;
+	Client->Batch[Client->BatchLen].Args = copy;
+	Client->BatchLen ++;
+	
+	sendf(Client->Socket, "100 Queued %i\n", Client->BatchLen);
+}
+
+/**
+ * \brief Run the queued commands in one bank transaction
+ *
+ * Each command's reply is sent as "202 <n> <reply>". Commands see the
+ * changes made by the ones before them (so balances are checked against
+ * the batch as a whole), and the log and WATCH events are only written if
+ * the batch is committed.
+ */
+void Server_int_RunBatch(tClient *Client)
+{
+	 int	nFailed = 0;
+	
+	if( Bank_BeginTransaction() ) {
+		sendf(Client->Socket, "500 Unable to start a transaction\n");
+		Server_int_FreeBatch(Client);
+		return ;
+	}
+	Log_Hold();
+	
+	sendf(Client->Socket, "201 Batch %i\n", Client->BatchLen);
+	Client->bInBatch = false;
+	Client->bRunningBatch = true;
+	for( int i = 0; i < Client->BatchLen; i ++ )
+	{
+		const struct sClientCommand	*command = Client->Batch[i].Command;
+		char	*args[MAX_COMMAND_ARGS];
+		char	prefix[16];
+		 int	nArgs;
+		
+		snprintf(prefix, sizeof(prefix), "202 %i ", i + 1);
+		Server_int_Send(Client, prefix, strlen(prefix));
+		
+		// Already checked when it was queued
+		Client->LastStatus = 0;
+		nArgs = Server_int_ParseArgs(Client, command, Client->Batch[i].Args, args);
+		if( nArgs >= 0 )
+			command->Function(Client, nArgs, args);
+		if( Client->LastStatus != 200 )
+			nFailed ++;
+	}
+	Client->bRunningBatch = false;
+	
+	if( nFailed ) {
+		Bank_RollbackTransaction();
+		Log_Release(false);
+		sendf(Client->Socket, "409 Batch rolled back (%i commands failed)\n", nFailed);
+	}
+	else if( Bank_CommitTransaction() ) {
+		Log_Release(false);
+		sendf(Client->Socket, "500 Batch rolled back (unable to commit)\n");
+	}
+	else {
+		Log_Release(true);
+		Log_Info("batch of %i commands by %s committed", Client->BatchLen, Client->Username);
+		sendf(Client->Socket, "200 Batch committed\n");
+	}
+	Server_int_FreeBatch(Client);
+}
+
+void Server_int_FreeBatch(tClient *Client)
+{
+	for( int i = 0; i < Client->BatchLen; i ++ )
+		free(Client->Batch[i].Args);
+	free(Client->Batch);
+	Client->Batch = NULL;
+	Client->BatchLen = 0;
+	Client->BatchSpace = 0;
+	Client->BatchRejected = 0;
+	Client->bInBatch = false;
+}
+
+/**
+ * \brief Send a consistent copy of the bank's tables
+ *
+ * Usage: EXPORT
+ * The snapshot is taken and sent by a thread of its own (see Bank_Snapshot),
+ * so neither the server nor changes to the bank wait on it. The connection
+ * is closed once it has been sent.
+ */
+void Server_Cmd_EXPORT(tClient *Client, int UNUSED(nArgs), char **UNUSED(Args))
+{
+	pthread_t	thread;
+	pthread_attr_t	attr;
+	 int	sock;
+
+	if(!require_auth(Client))	return;
+	if( !(Bank_GetFlags(Client->UID) & USER_FLAG_ADMIN) ) {
+		sendf(Client->Socket, "403 Not a coke admin\n");
+		return ;
+	}
+	if( Server_int_RateLimit(Client, RATELIMIT_LISTING) )
+		return ;
+	if( __sync_add_and_fetch(&giServer_NumExports, 1) > MAX_EXPORTS ) {
+		__sync_sub_and_fetch(&giServer_NumExports, 1);
+		sendf(Client->Socket, "501 Too many exports running, try again later\n");
+		return ;
+	}
+
+	// The thread gets its own descriptor, so this one can be closed as usual
+	sock = dup(Client->Socket);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if( sock == -1 || pthread_create(&thread, &attr, Server_int_ExportThread, (void*)(intptr_t)sock) ) {
+		if( sock != -1 )	close(sock);
+		__sync_sub_and_fetch(&giServer_NumExports, 1);
+		sendf(Client->Socket, "500 Unable to start export\n");
+		pthread_attr_destroy(&attr);
+		return ;
+	}
+	pthread_attr_destroy(&attr);
+
+	CLIENT_DEBUG(Client, "Exporting");
+	Log_Info("export by %s", Client->Username);
+	Client->bExporting = true;
+}
+
+/**
+ * \brief Take a snapshot into a temporary file and send it
+ * \note Only uses the socket it was given (not the client, which the server thread owns)
+ */
+void *Server_int_ExportThread(void *SocketPtr)
+{
+	 int	sock = (intptr_t)SocketPtr;
+	FILE	*snapshot = tmpfile();
+	char	line[64];
+	 int	len;
+
+	if( !snapshot || Bank_Snapshot(snapshot) || fflush(snapshot) ) {
+		len = snprintf(line, sizeof(line), "500 Export failed\n");
+		send(sock, line, len, 0);
+	}
+	else {
+		off_t	size = ftello(snapshot), offset = 0;
+		len = snprintf(line, sizeof(line), "201 Export %lli\n", (long long)size);
+		send(sock, line, len, 0);
+		while( offset < size )
+		{
+			if( sendfile(sock, fileno(snapshot), &offset, size - offset) <= 0 )
+				break;	// Client went away
+		}
+	}
+
+	if( snapshot )
+		fclose(snapshot);
+	// Both descriptors see the end, the server thread then closes its side
+	shutdown(sock, SHUT_RDWR);
+	close(sock);
+	__sync_sub_and_fetch(&giServer_NumExports, 1);
+	return NULL;
+}
+
 // --- INTERNAL HELPERS ---
 void Debug(tClient *Client, const char *Format, ...)
 {
@@ -1713,83 +2556,146 @@ int sendf(int Socket, const char *Format, ...)
 		printf("sendf: %s", buf);
 		#endif
 		
+		if( Socket >= 0 && Socket < giServer_MaxClients && gaServer_Clients[Socket] )
+		{
+			tClient	*client = gaServer_Clients[Socket];
+			if( isdigit(buf[0]) )
+				client->LastStatus = atoi(buf);
+			return Server_int_Send(client, buf, len);
+		}
+		
 		return send(Socket, buf, len, 0);
 	}
 }
 
-// Takes a series of char *'s in
 /**
- * \brief Parse space-separated entries into 
+ * \brief Send a reply to a client without blocking
+ * \return Length, or -1 if the connection is broken (the next read will notice)
+ *
+ * Whatever the socket won't take is kept in the client's output buffer and
+ * sent by Server_int_FlushClient once the socket is writable.
  */
-int Server_int_ParseArgs(int bUseLongLast, char *ArgStr, ...)
+int Server_int_Send(tClient *Client, const void *Data, int Length)
 {
-	va_list args;
-	char	savedChar;
-	char	**dest;
-	va_start(args, ArgStr);
-
-	// Check for null
-	if( !ArgStr )
+	 int	sent = 0;
+	
+	if( Client->OutLen == 0 )
 	{
-		while( (dest = va_arg(args, char **)) )
-			*dest = NULL;
-		va_end(args);
-		return 1;
+		sent = send(Client->Socket, Data, Length, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if( sent < 0 ) {
+			if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+				return -1;
+			sent = 0;
+		}
+		if( sent == Length )
+			return Length;
+	}
+	
+	if( Client->OutLen + Length - sent > Client->OutSize )
+	{
+		 int	newsize = Client->OutSize ? Client->OutSize : INPUT_BUFFER_SIZE;
+		char	*newbuf;
+		while( newsize < Client->OutLen + Length - sent )
+			newsize *= 2;
+		newbuf = realloc(Client->OutBuf, newsize);
+		if( !newbuf ) {
+			perror("Server_int_Send - realloc");
+			return -1;
+		}
+		Client->OutBuf = newbuf;
+		Client->OutSize = newsize;
 	}
+	memcpy(Client->OutBuf + Client->OutLen, (const char*)Data + sent, Length - sent);
+	Client->OutLen += Length - sent;
+	return Length;
+}
 
-	savedChar = *ArgStr;
+/**
+ * \brief Split a command's arguments in place and check them against its ArgSpec
+ * \param ArgStr	Everything after the command name (modified)
+ * \param Args	Filled with pointers into ArgStr (MAX_COMMAND_ARGS entries)
+ * \return Number of arguments, or -1 if they don't match (the client has been told)
+ */
+int Server_int_ParseArgs(tClient *Client, const struct sClientCommand *Command, char *ArgStr, char *Args[])
+{
+	const char	*spec = Command->ArgSpec;
+	 int	nArgs = 0;
+	bool	bOptional = false;
 	
-	while( (dest = va_arg(args, char **)) )
+	for( ;; )
 	{
-		// Trim leading spaces
+		char	*arg;
+		
 		while( *ArgStr == ' ' || *ArgStr == '\t' )
 			ArgStr ++;
-		
-		// ... oops, not enough arguments
+		if( *spec == '[' ) {
+			bOptional = true;
+			spec ++;
+		}
 		if( *ArgStr == '\0' )
-		{
-			// NULL unset arguments
-			do {
-				*dest = NULL;
-			}	while( (dest = va_arg(args, char **)) );
-		va_end(args);
-			return -1;
+			break;
+		if( *spec == '\0' || nArgs == MAX_COMMAND_ARGS )
+			goto _usage;
+		
+		if( *spec == 'r' ) {
+			// Rest of the line, verbatim
+			Args[nArgs++] = ArgStr;
+			spec ++;
+			break;
 		}
 		
-		if( *ArgStr == '"' )
-		{
-			ArgStr ++;
-			*dest = ArgStr;
-			// Read until quote
-			while( *ArgStr && *ArgStr != '"' )
-				ArgStr ++;
+		if( *ArgStr == '"' ) {
+			arg = ++ArgStr;
+			ArgStr += strcspn(ArgStr, "\"");
 		}
-		else
+		else {
+			arg = ArgStr;
+			ArgStr += strcspn(ArgStr, " \t");
+		}
+		if( *ArgStr )
+			*ArgStr++ = '\0';
+		
+		switch( *spec )
 		{
-			// Set destination
-			*dest = ArgStr;
-			// Read until a space
-			while( *ArgStr && *ArgStr != ' ' && *ArgStr != '\t' )
-				ArgStr ++;
+		case 'i': {
+			char	*end;
+			long	val = strtol(arg, &end, 10);
+			if( end == arg || *end != '\0' || val < INT_MIN || val > INT_MAX ) {
+				sendf(Client->Socket, "407 Invalid Argument, '%s' is not a number\n", arg);
+				return -1;
+			}
+			break; }
+		case 'p':
+			if( strlen(arg) != 4 || strspn(arg, "0123456789") != 4 ) {
+				sendf(Client->Socket, "407 PIN should be four digits\n");
+				return -1;
+			}
+			break;
 		}
-		savedChar = *ArgStr;	// savedChar is used to un-mangle the last string
-		*ArgStr = '\0';
-		ArgStr ++;
-	}
-	va_end(args);
-	
-	// Oops, extra arguments, and greedy not set
-	if( (savedChar == ' ' || savedChar == '\t') && !bUseLongLast ) {
-		return -1;
+		Args[nArgs++] = arg;
+		if( *spec != '*' )
+			spec ++;
 	}
 	
-	// Un-mangle last
-	if(bUseLongLast) {
-		ArgStr --;
-		*ArgStr = savedChar;
+	if( *spec == '[' )
+		bOptional = true;
+	if( bOptional || *spec == '\0' || *spec == '*' )
+		return nArgs;
+
+_usage:
+	{
+		 int	min = strcspn(Command->ArgSpec, "[*");
+		 int	max = strlen(Command->ArgSpec) - (strchr(Command->ArgSpec, '[') ? 1 : 0);
+		if( strchr(Command->ArgSpec, '*') )
+			sendf(Client->Socket, "407 %s takes at most %i arguments\n", Command->Name, MAX_COMMAND_ARGS);
+		else if( max == 0 )
+			sendf(Client->Socket, "407 %s takes no arguments\n", Command->Name);
+		else if( min == max )
+			sendf(Client->Socket, "407 %s takes %i argument%s\n", Command->Name, min, (min == 1 ? "" : "s"));
+		else
+			sendf(Client->Socket, "407 %s takes %i to %i arguments\n", Command->Name, min, max);
 	}
-	
-	return 0;	// Success!
+	return -1;
 }
 
 int Server_int_ParseFlags(tClient *Client, const char *Str, int *Mask, int *Value)
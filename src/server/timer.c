@@ -0,0 +1,197 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * timer.c - Timer wheel for the server thread (idle clients, IDENT deadlines,
+ *           handler dispense pacing)
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - Two levels: TIMER_WHEEL0_SIZE slots of TIMER_TICK_MS, then
+ *   TIMER_WHEEL1_SIZE slots covering a whole turn of the first wheel each.
+ *   Timers further out than that wait in the last slot and are looked at
+ *   again each time it comes around.
+ * - A slot is a doubly linked list of the tTimer structures themselves, so
+ *   setting and cancelling are O(1) and there is no allocation.
+ * - A timerfd ticks while any timer is set (and is stopped when none are),
+ *   Timer_Run catches up on however many ticks have passed.
+ * - Server thread only.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#define TIMER_TICK_MS	100
+#define TIMER_WHEEL0_BITS	8
+#define TIMER_WHEEL1_BITS	6
+#define TIMER_WHEEL0_SIZE	(1 << TIMER_WHEEL0_BITS)	// 25.6 seconds
+#define TIMER_WHEEL1_SIZE	(1 << TIMER_WHEEL1_BITS)	// 27 minutes
+
+// === PROTOTYPES ===
+ int	Timer_Init(void);
+void	Timer_Set(tTimer *Timer, int DelayMS, tTimerCallback Callback, void *Data);
+void	Timer_Cancel(tTimer *Timer);
+void	Timer_Run(void);
+static void	Timer_int_Insert(tTimer *Timer);
+static void	Timer_int_Arm(bool bRunning);
+static int64_t	Timer_int_NowTicks(void);
+
+// === GLOBALS ===
+ int	giTimer_FD = -1;
+ int	giTimer_NumSet;
+int64_t	giTimer_CurTick;	// Last tick that has been run
+tTimer	*gaTimer_Wheel0[TIMER_WHEEL0_SIZE];
+tTimer	*gaTimer_Wheel1[TIMER_WHEEL1_SIZE];
+
+// === CODE ===
+/**
+ * \brief Create the tick timer
+ * \return File descriptor that becomes readable when timers may be due
+ */
+int Timer_Init(void)
+{
+	giTimer_FD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if( giTimer_FD == -1 )
+		perror("Timer_Init - timerfd_create");
+	giTimer_CurTick = Timer_int_NowTicks();
+	return giTimer_FD;
+}
+
+/**
+ * \brief Set (or reset) a timer
+ * \param Timer	Timer to set, usually part of the structure it is for
+ * \param DelayMS	Milliseconds from now, rounded up to a tick
+ */
+void Timer_Set(tTimer *Timer, int DelayMS, tTimerCallback Callback, void *Data)
+{
+	Timer_Cancel(Timer);
+	if( giTimer_NumSet == 0 )
+		giTimer_CurTick = Timer_int_NowTicks();	// Not kept up to date while idle
+	Timer->Expires = Timer_int_NowTicks() + (DelayMS + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	// Never into the slot being run (a callback could set its own timer again)
+	if( Timer->Expires <= giTimer_CurTick )
+		Timer->Expires = giTimer_CurTick + 1;
+	Timer->Callback = Callback;
+	Timer->Data = Data;
+	Timer_int_Insert(Timer);
+	if( giTimer_NumSet ++ == 0 )
+		Timer_int_Arm(true);
+}
+
+/**
+ * \brief Stop a timer (does nothing if it isn't set)
+ */
+void Timer_Cancel(tTimer *Timer)
+{
+	if( !Timer->PrevNext )
+		return ;
+	*Timer->PrevNext = Timer->Next;
+	if( Timer->Next )
+		Timer->Next->PrevNext = Timer->PrevNext;
+	Timer->Next = NULL;
+	Timer->PrevNext = NULL;
+	if( -- giTimer_NumSet == 0 )
+		Timer_int_Arm(false);
+}
+
+/**
+ * \brief Run the timers that are due
+ * \note Called by the server thread when the Timer_Init FD is readable
+ */
+void Timer_Run(void)
+{
+	uint64_t	count;
+	int64_t	now = Timer_int_NowTicks();
+
+	if( read(giTimer_FD, &count, sizeof(count)) < 0 && errno != EAGAIN )
+		perror("Timer_Run - read");
+
+	while( giTimer_CurTick < now && giTimer_NumSet > 0 )
+	{
+		tTimer	*due;
+
+		giTimer_CurTick ++;
+
+		// The first wheel has come round, spread out the next slot of the second
+		if( (giTimer_CurTick & (TIMER_WHEEL0_SIZE - 1)) == 0 )
+		{
+			tTimer	*list = gaTimer_Wheel1[ (giTimer_CurTick >> TIMER_WHEEL0_BITS) & (TIMER_WHEEL1_SIZE - 1) ];
+			gaTimer_Wheel1[ (giTimer_CurTick >> TIMER_WHEEL0_BITS) & (TIMER_WHEEL1_SIZE - 1) ] = NULL;
+			while( list )
+			{
+				tTimer	*next = list->Next;
+				Timer_int_Insert(list);
+				list = next;
+			}
+		}
+
+		// Run this tick's timers (each is unlinked first, so it can be set again)
+		while( (due = gaTimer_Wheel0[giTimer_CurTick & (TIMER_WHEEL0_SIZE - 1)]) )
+		{
+			Timer_Cancel(due);
+			due->Callback(due->Data);
+		}
+	}
+	if( giTimer_NumSet == 0 )
+		giTimer_CurTick = now;
+}
+
+/**
+ * \brief Link a timer into the slot for its expiry
+ */
+void Timer_int_Insert(tTimer *Timer)
+{
+	int64_t	delta = Timer->Expires - giTimer_CurTick;
+	tTimer	**slot;
+
+	if( delta < 0 ) {
+		// Overdue (only when cascading), run with this tick
+		Timer->Expires = giTimer_CurTick;
+		delta = 0;
+	}
+
+	if( delta < TIMER_WHEEL0_SIZE )
+		slot = &gaTimer_Wheel0[ Timer->Expires & (TIMER_WHEEL0_SIZE - 1) ];
+	else if( delta < (int64_t)TIMER_WHEEL0_SIZE * TIMER_WHEEL1_SIZE )
+		slot = &gaTimer_Wheel1[ (Timer->Expires >> TIMER_WHEEL0_BITS) & (TIMER_WHEEL1_SIZE - 1) ];
+	else
+		// Too far out, park in the furthest slot and look again when it comes round
+		slot = &gaTimer_Wheel1[ ((giTimer_CurTick >> TIMER_WHEEL0_BITS) - 1) & (TIMER_WHEEL1_SIZE - 1) ];
+
+	Timer->Next = *slot;
+	if( Timer->Next )
+		Timer->Next->PrevNext = &Timer->Next;
+	Timer->PrevNext = slot;
+	*slot = Timer;
+}
+
+/**
+ * \brief Start or stop the tick (no wakeups when nothing is waiting)
+ */
+void Timer_int_Arm(bool bRunning)
+{
+	struct itimerspec	its;
+
+	memset(&its, 0, sizeof(its));
+	if( bRunning ) {
+		its.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+		its.it_value = its.it_interval;
+	}
+	if( giTimer_FD != -1 && timerfd_settime(giTimer_FD, 0, &its, NULL) )
+		perror("Timer_int_Arm - timerfd_settime");
+}
+
+int64_t Timer_int_NowTicks(void)
+{
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
@@ -0,0 +1,178 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * trust.c - Trusted host table (config 'trusted_host')
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - Entries are `<address>[/<prefix length>]`, IPv4 or IPv6. A bare address
+ *   is a single host.
+ * - The table is a binary trie per address family, one level per address
+ *   bit, so a lookup is at most 32 (or 128) steps however many entries there
+ *   are.
+ * - IPv4-mapped IPv6 addresses (from a dual-stack listener) are looked up as
+ *   IPv4.
+ */
+#include "common.h"
+#include "../common/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>	// Debug_Debug
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// === TYPES ===
+typedef struct sTrustNode	tTrustNode;
+
+struct sTrustNode
+{
+	tTrustNode	*Child[2];
+	bool	bTrusted;	// Everything under this prefix is trusted
+};
+
+// === PROTOTYPES ===
+ int	Trust_Load(void);
+bool	Trust_IsTrusted(const struct sockaddr *Addr);
+static int	Trust_int_Add(tTrustNode **Root, const uint8_t *Addr, int Bits);
+static bool	Trust_int_Lookup(const tTrustNode *Root, const uint8_t *Addr, int Bits);
+static void	Trust_int_Free(tTrustNode *Node);
+
+// === GLOBALS ===
+tTrustNode	*gpTrust_IPv4;
+tTrustNode	*gpTrust_IPv6;
+
+// === CODE ===
+/**
+ * \brief (Re)build the table from the 'trusted_host' config entries
+ * \return Number of entries that couldn't be parsed
+ */
+int Trust_Load(void)
+{
+	tTrustNode	*v4 = NULL, *v6 = NULL;
+	 int	nErrors = 0;
+	 int	nEntries = Config_GetValueCount("trusted_host");
+
+	// Doesn't matter what, localhost is trusted
+	{
+		uint8_t	lo4[4] = {127,0,0,1};
+		Trust_int_Add(&v4, lo4, 32);
+		Trust_int_Add(&v6, in6addr_loopback.s6_addr, 128);
+	}
+
+	for( int i = 0; i < nEntries; i ++ )
+	{
+		const char	*entry = Config_GetValue_Idx("trusted_host", i);
+		char	addr[INET6_ADDRSTRLEN];
+		uint8_t	bytes[16];
+		const char	*slash = strchr(entry, '/');
+		size_t	len = (slash ? (size_t)(slash - entry) : strlen(entry));
+		 int	bits = -1;
+
+		if( len >= sizeof(addr) ) {
+			fprintf(stderr, "Invalid trusted_host '%s'\n", entry);
+			nErrors ++;
+			continue ;
+		}
+		memcpy(addr, entry, len);
+		addr[len] = '\0';
+		if( slash ) {
+			char	*end;
+			bits = strtol(slash + 1, &end, 10);
+			if( end == slash + 1 || *end != '\0' || bits < 0 )
+				bits = 999;
+		}
+
+		if( inet_pton(AF_INET, addr, bytes) == 1 && bits <= 32 ) {
+			Trust_int_Add(&v4, bytes, bits < 0 ? 32 : bits);
+		}
+		else if( inet_pton(AF_INET6, addr, bytes) == 1 && bits <= 128 ) {
+			Trust_int_Add(&v6, bytes, bits < 0 ? 128 : bits);
+		}
+		else {
+			fprintf(stderr, "Invalid trusted_host '%s'\n", entry);
+			nErrors ++;
+		}
+	}
+
+	Trust_int_Free(gpTrust_IPv4);
+	Trust_int_Free(gpTrust_IPv6);
+	gpTrust_IPv4 = v4;
+	gpTrust_IPv6 = v6;
+	Debug_Debug("%i trusted host entries loaded", nEntries - nErrors);
+	return nErrors;
+}
+
+/**
+ * \brief Check if a connection comes from a trusted host
+ */
+bool Trust_IsTrusted(const struct sockaddr *Addr)
+{
+	switch( Addr->sa_family )
+	{
+	case AF_INET:
+		return Trust_int_Lookup(gpTrust_IPv4, (const uint8_t*)&((const struct sockaddr_in*)Addr)->sin_addr, 32);
+	case AF_INET6: {
+		const struct in6_addr	*addr = &((const struct sockaddr_in6*)Addr)->sin6_addr;
+		if( IN6_IS_ADDR_V4MAPPED(addr) )
+			return Trust_int_Lookup(gpTrust_IPv4, addr->s6_addr + 12, 32);
+		return Trust_int_Lookup(gpTrust_IPv6, addr->s6_addr, 128);
+		}
+	default:
+		return false;
+	}
+}
+
+int Trust_int_Add(tTrustNode **Root, const uint8_t *Addr, int Bits)
+{
+	tTrustNode	**np = Root;
+
+	for( int i = 0; ; i ++ )
+	{
+		if( !*np ) {
+			*np = calloc(1, sizeof(tTrustNode));
+			if( !*np )	return 1;
+		}
+		if( i == Bits )
+			break;
+		// A shorter prefix already covers this one
+		if( (*np)->bTrusted )
+			return 0;
+		np = &(*np)->Child[ (Addr[i/8] >> (7 - i%8)) & 1 ];
+	}
+
+	(*np)->bTrusted = true;
+	// Anything more specific is now redundant
+	Trust_int_Free((*np)->Child[0]);
+	Trust_int_Free((*np)->Child[1]);
+	(*np)->Child[0] = (*np)->Child[1] = NULL;
+	return 0;
+}
+
+bool Trust_int_Lookup(const tTrustNode *Root, const uint8_t *Addr, int Bits)
+{
+	const tTrustNode	*node = Root;
+
+	for( int i = 0; node; i ++ )
+	{
+		if( node->bTrusted )
+			return true;
+		if( i == Bits )
+			break;
+		node = node->Child[ (Addr[i/8] >> (7 - i%8)) & 1 ];
+	}
+	return false;
+}
+
+void Trust_int_Free(tTrustNode *Node)
+{
+	if( !Node )	return ;
+	Trust_int_Free(Node->Child[0]);
+	Trust_int_Free(Node->Child[1]);
+	free(Node);
+}
@@ -0,0 +1,380 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Dispense Server
+ *
+ * watch.c - WATCH subscriptions (asynchronous item/balance events)
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * NOTES:
+ * - Events can be posted from any thread (the listing is rebuilt on the
+ *   periodic thread), they are queued and signalled through an eventfd, then
+ *   handed out to subscribers by the server thread (Watch_RunEvents).
+ * - Each subscriber has a small queue. A new event for an item/account that
+ *   is already queued replaces the old one, if the queue still overflows it
+ *   is emptied and the subscriber is told it lost events (so it can resync).
+ * - Sends never block, a slow subscriber is retried from Watch_FlushAll.
+ */
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#define WATCH_QUEUE_SIZE	32	// Events queued per subscriber
+#define WATCH_LINE_MAX	256
+
+// === TYPES ===
+typedef struct sWatchEvent	tWatchEvent;
+
+enum eWatchEventTypes
+{
+	WATCHEVENT_ITEM,	// Item added, changed or status changed
+	WATCHEVENT_REMOVED,	// Item removed
+	WATCHEVENT_BALANCE,	// Account balance changed
+};
+
+struct sWatchEvent
+{
+	tWatchEvent	*Next;
+	enum eWatchEventTypes	Type;
+	 int	Account;	// WATCHEVENT_BALANCE
+	char	*ItemID;	// WATCHEVENT_ITEM/WATCHEVENT_REMOVED
+	char	*Line;	// WATCHEVENT_ITEM ("202 Item ..." line)
+};
+
+struct sWatcher
+{
+	tWatcher	*Next;
+	 int	Socket;
+	 int	Mask;	// WATCH_* flags
+	 int	Account;	// Only balance events for this account (-1 = all)
+	bool	bLost;	// Queue overflowed, send a 304 next
+	bool	bDead;	// Send failed, waiting for the server to close the connection
+	 int	NumQueued;
+	tWatchEvent	Queue[WATCH_QUEUE_SIZE];
+	// Line currently being sent
+	char	OutBuf[WATCH_LINE_MAX];
+	 int	OutLen;
+	 int	OutPos;
+};
+
+// === PROTOTYPES ===
+ int	Watch_Init(void);
+tWatcher	*Watch_Add(int Socket, int Mask, int Account);
+void	Watch_Remove(tWatcher *Watcher);
+bool	Watch_HaveItemWatchers(void);
+void	Watch_ItemChanged(const char *ItemID, const char *Line);
+void	Watch_BalanceChanged(int Account);
+void	Watch_RunEvents(void);
+void	Watch_FlushAll(void);
+static void	Watch_int_Post(tWatchEvent *Event);
+static void	Watch_int_Queue(tWatcher *Watcher, const tWatchEvent *Event);
+static void	Watch_int_Flush(tWatcher *Watcher);
+static void	Watch_int_Render(tWatcher *Watcher, const tWatchEvent *Event);
+static void	Watch_int_FreeEvent(tWatchEvent *Event);
+
+// === GLOBALS ===
+ int	giWatch_EventFD = -1;
+// - Subscribers (server thread only)
+tWatcher	*gpWatch_First;
+ int	giWatch_NumItemWatchers;	// Read from other threads, only changed by the server thread
+// - Posted events (protected by gWatch_EventLock)
+pthread_mutex_t	gWatch_EventLock = PTHREAD_MUTEX_INITIALIZER;
+tWatchEvent	*gpWatch_FirstEvent;
+tWatchEvent	*gpWatch_LastEvent;
+
+// === CODE ===
+/**
+ * \brief Create the event FD
+ * \return File descriptor that becomes readable when events are ready
+ */
+int Watch_Init(void)
+{
+	giWatch_EventFD = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if( giWatch_EventFD == -1 )
+		perror("Watch_Init - eventfd");
+	return giWatch_EventFD;
+}
+
+/**
+ * \brief Turn a connection into a subscriber
+ * \param Mask	WATCH_* flags of events to send
+ */
+tWatcher *Watch_Add(int Socket, int Mask, int Account)
+{
+	tWatcher	*ret;
+
+	ret = calloc(1, sizeof(*ret));
+	if( !ret )	return NULL;
+	ret->Socket = Socket;
+	ret->Mask = Mask;
+	ret->Account = Account;
+
+	ret->Next = gpWatch_First;
+	gpWatch_First = ret;
+	if( Mask & WATCH_ITEMS )
+		giWatch_NumItemWatchers ++;
+
+	return ret;
+}
+
+void Watch_Remove(tWatcher *Watcher)
+{
+	for( tWatcher **pnp = &gpWatch_First; *pnp; pnp = &(*pnp)->Next )
+	{
+		if( *pnp != Watcher )	continue ;
+		*pnp = Watcher->Next;
+		break;
+	}
+	if( Watcher->Mask & WATCH_ITEMS )
+		giWatch_NumItemWatchers --;
+
+	for( int i = 0; i < Watcher->NumQueued; i ++ )
+	{
+		free(Watcher->Queue[i].ItemID);
+		free(Watcher->Queue[i].Line);
+	}
+	free(Watcher);
+}
+
+/**
+ * \brief Check if anyone wants item events (if not, they needn't be prompt)
+ */
+bool Watch_HaveItemWatchers(void)
+{
+	return giWatch_NumItemWatchers > 0;
+}
+
+/**
+ * \brief Report a changed item
+ * \param Line	New "202 Item" line for the item, NULL if it was removed
+ */
+void Watch_ItemChanged(const char *ItemID, const char *Line)
+{
+	tWatchEvent	*ev;
+
+	if( giWatch_EventFD == -1 )	return ;
+
+	ev = calloc(1, sizeof(*ev));
+	ev->Type = (Line ? WATCHEVENT_ITEM : WATCHEVENT_REMOVED);
+	ev->ItemID = strdup(ItemID);
+	ev->Line = (Line ? strdup(Line) : NULL);
+	Watch_int_Post(ev);
+}
+
+/**
+ * \brief Report a change to an account's balance
+ */
+void Watch_BalanceChanged(int Account)
+{
+	tWatchEvent	*ev;
+
+	if( giWatch_EventFD == -1 )	return ;
+
+	ev = calloc(1, sizeof(*ev));
+	ev->Type = WATCHEVENT_BALANCE;
+	ev->Account = Account;
+	Watch_int_Post(ev);
+}
+
+/**
+ * \brief Hand posted events out to the subscribers
+ * \note Called by the server thread when the event FD is readable
+ */
+void Watch_RunEvents(void)
+{
+	uint64_t	count;
+	tWatchEvent	*ev, *next;
+
+	if( read(giWatch_EventFD, &count, sizeof(count)) < 0 && errno != EAGAIN )
+		perror("Watch_RunEvents - read");
+
+	pthread_mutex_lock(&gWatch_EventLock);
+	ev = gpWatch_FirstEvent;
+	gpWatch_FirstEvent = NULL;
+	gpWatch_LastEvent = NULL;
+	pthread_mutex_unlock(&gWatch_EventLock);
+
+	for( ; ev; ev = next )
+	{
+		next = ev->Next;
+		for( tWatcher *w = gpWatch_First; w; w = w->Next )
+			Watch_int_Queue(w, ev);
+		Watch_int_FreeEvent(ev);
+	}
+
+	Watch_FlushAll();
+}
+
+/**
+ * \brief Send as much queued data as possible to each subscriber
+ */
+void Watch_FlushAll(void)
+{
+	for( tWatcher *w = gpWatch_First; w; w = w->Next )
+		Watch_int_Flush(w);
+}
+
+/**
+ * \brief Add an event to the posted list (callable from any thread)
+ */
+void Watch_int_Post(tWatchEvent *Event)
+{
+	uint64_t	one = 1;
+
+	pthread_mutex_lock(&gWatch_EventLock);
+	if( gpWatch_LastEvent )
+		gpWatch_LastEvent->Next = Event;
+	else
+		gpWatch_FirstEvent = Event;
+	gpWatch_LastEvent = Event;
+	pthread_mutex_unlock(&gWatch_EventLock);
+
+	if( write(giWatch_EventFD, &one, sizeof(one)) != sizeof(one) )
+		perror("Watch_int_Post - write");
+}
+
+/**
+ * \brief Queue an event for a subscriber, coalescing with an older event for the same thing
+ */
+void Watch_int_Queue(tWatcher *Watcher, const tWatchEvent *Event)
+{
+	tWatchEvent	*slot = NULL;
+
+	if( Watcher->bDead )
+		return ;
+	if( Event->Type == WATCHEVENT_BALANCE ) {
+		if( !(Watcher->Mask & WATCH_BALANCES) )	return ;
+		if( Watcher->Account != -1 && Watcher->Account != Event->Account )	return ;
+	}
+	else {
+		if( !(Watcher->Mask & WATCH_ITEMS) )	return ;
+	}
+	// Already resyncing, nothing queued is useful
+	if( Watcher->bLost )
+		return ;
+
+	for( int i = 0; i < Watcher->NumQueued; i ++ )
+	{
+		tWatchEvent	*q = &Watcher->Queue[i];
+		if( (q->Type == WATCHEVENT_BALANCE) != (Event->Type == WATCHEVENT_BALANCE) )
+			continue ;
+		if( q->Type == WATCHEVENT_BALANCE ? q->Account == Event->Account : strcmp(q->ItemID, Event->ItemID) == 0 ) {
+			slot = q;
+			break;
+		}
+	}
+
+	if( slot ) {
+		// Balances are looked up when sent, so only items need replacing
+		if( slot->Type == WATCHEVENT_BALANCE )
+			return ;
+		free(slot->Line);
+	}
+	else if( Watcher->NumQueued == WATCH_QUEUE_SIZE ) {
+		for( int i = 0; i < Watcher->NumQueued; i ++ ) {
+			free(Watcher->Queue[i].ItemID);
+			free(Watcher->Queue[i].Line);
+		}
+		Watcher->NumQueued = 0;
+		Watcher->bLost = true;
+		return ;
+	}
+	else {
+		slot = &Watcher->Queue[Watcher->NumQueued++];
+		slot->ItemID = (Event->ItemID ? strdup(Event->ItemID) : NULL);
+	}
+
+	slot->Type = Event->Type;
+	slot->Account = Event->Account;
+	slot->Line = (Event->Line ? strdup(Event->Line) : NULL);
+}
+
+/**
+ * \brief Send queued events to a subscriber until the socket would block
+ */
+void Watch_int_Flush(tWatcher *Watcher)
+{
+	while( !Watcher->bDead )
+	{
+		if( Watcher->OutPos == Watcher->OutLen )
+		{
+			// Get the next line
+			if( Watcher->bLost ) {
+				Watcher->OutLen = snprintf(Watcher->OutBuf, WATCH_LINE_MAX, "304 Events lost\n");
+				Watcher->bLost = false;
+			}
+			else if( Watcher->NumQueued ) {
+				Watch_int_Render(Watcher, &Watcher->Queue[0]);
+				free(Watcher->Queue[0].ItemID);
+				free(Watcher->Queue[0].Line);
+				Watcher->NumQueued --;
+				memmove(&Watcher->Queue[0], &Watcher->Queue[1], Watcher->NumQueued * sizeof(tWatchEvent));
+			}
+			else
+				break;
+			Watcher->OutPos = 0;
+		}
+
+		 int	len = send(Watcher->Socket, Watcher->OutBuf + Watcher->OutPos,
+			Watcher->OutLen - Watcher->OutPos, MSG_DONTWAIT);
+		if( len < 0 ) {
+			if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+				break;
+			// The server closes the client when it sees the error/hangup
+			Watcher->bDead = true;
+			break;
+		}
+		Watcher->OutPos += len;
+	}
+}
+
+/**
+ * \brief Format an event into the subscriber's output buffer
+ */
+void Watch_int_Render(tWatcher *Watcher, const tWatchEvent *Event)
+{
+	 int	len;
+
+	switch(Event->Type)
+	{
+	case WATCHEVENT_ITEM:
+		// "202 Item ..." becomes "301 Item ..."
+		len = snprintf(Watcher->OutBuf, WATCH_LINE_MAX, "301%s", Event->Line + 3);
+		break;
+	case WATCHEVENT_REMOVED:
+		len = snprintf(Watcher->OutBuf, WATCH_LINE_MAX, "302 Removed %s\n", Event->ItemID);
+		break;
+	case WATCHEVENT_BALANCE: {
+		char	*name = Bank_GetAcctName(Event->Account);
+		len = snprintf(Watcher->OutBuf, WATCH_LINE_MAX, "303 Balance %s %i\n",
+			name, Bank_GetBalance(Event->Account));
+		free(name);
+		break; }
+	default:
+		len = 0;
+		break;
+	}
+
+	// Truncated (very long item name), keep the line terminated
+	if( len >= WATCH_LINE_MAX ) {
+		len = WATCH_LINE_MAX - 1;
+		Watcher->OutBuf[len-1] = '\n';
+	}
+	Watcher->OutLen = len;
+}
+
+void Watch_int_FreeEvent(tWatchEvent *Event)
+{
+	free(Event->ItemID);
+	free(Event->Line);
+	free(Event);
+}
@@ -0,0 +1,181 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ * - Snack machine simulator
+ *
+ * main.c - Emulates the snack machine's serial protocol on a pty
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ *
+ * Usage: snacksim [-l <link>] [-d <vend_ms>] [<slot>:<count> ...]
+ * - The pty slave path is printed on startup, and optionally symlinked to
+ *   <link> so the server config can name a fixed path.
+ * - Slots not listed on the command line are empty.
+ * - Each vend is logged to stdout as "VEND <slot>".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pty.h>
+#include <termios.h>
+
+#define MAX_SLOTS	100
+
+// === PROTOTYPES ===
+void	SigHandler(int Signum);
+void	HandleCommand(int FD, const char *Line);
+void	Respond(int FD, const char *Format, ...);
+
+// === GLOBALS ===
+const char	*gsLinkPath;
+ int	giVendDelay = 200;	// Milliseconds
+ int	gaSlotStock[MAX_SLOTS];
+
+// === CODE ===
+int main(int argc, char *argv[])
+{
+	 int	master, slave;
+	char	slavename[64];
+	char	line[32];
+	 int	linelen = 0;
+	struct termios	info;
+
+	for( int i = 1; i < argc; i ++ )
+	{
+		 int	slot, count;
+		if( strcmp(argv[i], "-l") == 0 && i + 1 < argc ) {
+			gsLinkPath = argv[++i];
+		}
+		else if( strcmp(argv[i], "-d") == 0 && i + 1 < argc ) {
+			giVendDelay = atoi(argv[++i]);
+		}
+		else if( sscanf(argv[i], "%i:%i", &slot, &count) == 2 && slot >= 0 && slot < MAX_SLOTS ) {
+			gaSlotStock[slot] = count;
+		}
+		else {
+			fprintf(stderr, "Usage: %s [-l <link>] [-d <vend_ms>] [<slot>:<count> ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if( openpty(&master, &slave, slavename, NULL, NULL) ) {
+		perror("openpty");
+		return 1;
+	}
+	// Raw mode on our side too, the server configures its own end on open
+	tcgetattr(slave, &info);
+	cfmakeraw(&info);
+	tcsetattr(slave, TCSANOW, &info);
+	// NOTE: `slave` is kept open so the master doesn't see a hangup between
+	// server reconnects.
+
+	if( gsLinkPath ) {
+		unlink(gsLinkPath);
+		if( symlink(slavename, gsLinkPath) ) {
+			perror("symlink");
+			return 1;
+		}
+	}
+	signal(SIGTERM, SigHandler);
+	signal(SIGINT, SigHandler);
+
+	printf("READY %s\n", slavename);
+	fflush(stdout);
+
+	for( ;; )
+	{
+		char	ch;
+		 int	len = read(master, &ch, 1);
+		if( len < 0 && errno == EINTR )	continue ;
+		if( len <= 0 ) {
+			perror("read");
+			break;
+		}
+
+		if( ch == '\r' )	continue ;
+		if( ch != '\n' ) {
+			if( linelen < (int)sizeof(line) - 1 )
+				line[linelen++] = ch;
+			continue ;
+		}
+		line[linelen] = '\0';
+		linelen = 0;
+
+		HandleCommand(master, line);
+	}
+
+	if( gsLinkPath )
+		unlink(gsLinkPath);
+	return 0;
+}
+
+void SigHandler(int Signum)
+{
+	if( gsLinkPath )
+		unlink(gsLinkPath);
+	_exit(128 + Signum);
+}
+
+void HandleCommand(int FD, const char *Line)
+{
+	 int	slot;
+	char	cmd;
+
+	if( strcmp(Line, "SA") == 0 ) {
+		char	slots[MAX_SLOTS+1];
+		for( int i = 0; i < MAX_SLOTS; i ++ )
+			slots[i] = (gaSlotStock[i] > 0 ? '1' : '0');
+		slots[MAX_SLOTS] = '\0';
+		Respond(FD, "200 %s\n", slots);
+		return ;
+	}
+
+	if( sscanf(Line, "%c%2d", &cmd, &slot) != 2 || slot < 0 || slot >= MAX_SLOTS ) {
+		Respond(FD, "400 Bad command\n");
+		return ;
+	}
+
+	switch(cmd)
+	{
+	case 'S':
+		if( gaSlotStock[slot] > 0 )
+			Respond(FD, "200 Slot %02i stocked\n", slot);
+		else
+			Respond(FD, "201 Slot %02i empty\n", slot);
+		break;
+	case 'V':
+		if( gaSlotStock[slot] <= 0 ) {
+			Respond(FD, "201 Slot %02i empty\n", slot);
+			break;
+		}
+		Respond(FD, "100 Vending\n");
+		usleep(giVendDelay * 1000);
+		gaSlotStock[slot] --;
+		printf("VEND %02i\n", slot);
+		fflush(stdout);
+		Respond(FD, "200 Slot %02i vended\n", slot);
+		break;
+	default:
+		Respond(FD, "400 Unknown command\n");
+		break;
+	}
+}
+
+void Respond(int FD, const char *Format, ...)
+{
+	char	buf[128];
+	va_list	args;
+	 int	len;
+
+	va_start(args, Format);
+	len = vsnprintf(buf, sizeof(buf), Format, args);
+	va_end(args);
+
+	if( write(FD, buf, len) != len )
+		perror("write");
+}
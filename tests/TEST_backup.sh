@@ -0,0 +1,50 @@
+#!/bin/bash
+set -eux
+TESTNAME=backup
+TEST_CONFIG="backup_file $(pwd)/rundir/${TESTNAME}/backup.db
+backup_keep 2"
+
+rm -f rundir/${TESTNAME}/backup.db*
+
+. _common.sh
+
+BACKUP=${BASEDIR}backup.db
+
+wait_for() {
+	for i in $(seq 20); do
+		[ -f "$1" ] && return 0
+		sleep 0.5
+	done
+	FAIL "$1 didn't appear"
+}
+restart_server() {
+	kill ${server_pid}
+	wait ${server_pid} || true
+	LD_LIBRARY_PATH=.. ../dispsrv -f ${BASEDIR}cfg_server.conf --dont-daemonise >> ${BASEDIR}server.log 2>&1 &
+	server_pid=$!
+	LOG "Server restarted on PID ${server_pid}"
+}
+
+LOG "Checking a backup is taken at startup"
+wait_for ${BACKUP}
+[ "$(sqlite3 ${BACKUP} "SELECT acct_name FROM accounts WHERE acct_uid = 0")" = "root" ] || FAIL "Backup is missing accounts"
+[ -f ${BACKUP}.tmp ] && FAIL "Temporary backup left behind"
+grep 'backup of [0-9]* pages to ' ${BASEDIR}server.log
+
+LOG "Checking the backups rotate"
+sqlite3 "${BASEDIR}cokebank.db" "INSERT INTO accounts (acct_name,acct_is_admin,acct_uid) VALUES ('${USER}',1,1);"
+restart_server
+wait_for ${BACKUP}.1
+wait_for ${BACKUP}
+[ "$(sqlite3 ${BACKUP} "SELECT acct_name FROM accounts WHERE acct_uid = 1")" = "${USER}" ] || FAIL "Newest backup is out of date"
+[ -z "$(sqlite3 ${BACKUP}.1 "SELECT acct_name FROM accounts WHERE acct_uid = 1")" ] || FAIL "Older backup was overwritten"
+
+LOG "Checking only backup_keep are kept"
+restart_server
+for i in $(seq 20); do
+	[ "$(grep -c 'backup of [0-9]* pages to ' ${BASEDIR}server.log)" = "3" ] && break
+	sleep 0.5
+done
+[ -f ${BACKUP}.2 ] && FAIL "Kept more than backup_keep backups"
+[ "$(sqlite3 ${BACKUP}.1 "SELECT acct_name FROM accounts WHERE acct_uid = 1")" = "${USER}" ] || FAIL "Backups didn't rotate"
+LOG "Success"
@@ -1,6 +1,7 @@
 #!/bin/bash
 set -eux
 TESTNAME=basic
+TEST_CONFIG="server_socket $(pwd)/rundir/${TESTNAME}/dispsrv.sock"
 
 . _common.sh
 
@@ -19,4 +20,8 @@ TRY_COMMAND $DISPENSE acct unittest_user0 +100 Unit_test
 TRY_COMMAND $DISPENSE acct unittest_user0 | grep ': $    1.00'
 TRY_COMMAND $DISPENSE acct unittest_user0 -100 Unit_test
 TRY_COMMAND $DISPENSE acct unittest_user0 | grep ': $    0.00'
+
+LOG "Checking the local socket"
+TRY_COMMAND ../dispense -H $(pwd)/${BASEDIR}dispsrv.sock acct unittest_user0 +50 Unit_test
+TRY_COMMAND $DISPENSE acct unittest_user0 | grep ': $    0.50'
 LOG "Success"
@@ -0,0 +1,41 @@
+#!/bin/bash
+set -eux
+TESTNAME=batch
+TEST_CONFIG="server_socket $(pwd)/rundir/${TESTNAME}/dispsrv.sock"
+
+. _common.sh
+
+# Local connections are authenticated as the user running the test
+SOCKET=${BASEDIR}dispsrv.sock
+sqlite3 "${BASEDIR}cokebank.db" "INSERT INTO accounts (acct_name,acct_is_admin,acct_uid) VALUES ('${USER}',1,1);"
+TRY_COMMAND $DISPENSE user add unittest_batch0
+TRY_COMMAND $DISPENSE user add unittest_batch1
+
+LOG "Committing a batch"
+printf 'BATCH BEGIN\nADD unittest_batch0 100 Unit_test\nADD unittest_batch1 250 Unit_test\nBATCH COMMIT\n' \
+	| nc -U ${SOCKET} > ${BASEDIR}batch.txt
+grep '^100 Queued 2$' ${BASEDIR}batch.txt
+grep '^201 Batch 2$' ${BASEDIR}batch.txt
+grep '^202 1 200 ' ${BASEDIR}batch.txt
+grep '^202 2 200 ' ${BASEDIR}batch.txt
+tail -n 1 ${BASEDIR}batch.txt | grep '^200 '
+TRY_COMMAND $DISPENSE acct unittest_batch0 | grep ': $    1.00'
+TRY_COMMAND $DISPENSE acct unittest_batch1 | grep ': $    2.50'
+
+LOG "Rolling back a batch with a failed command"
+printf 'BATCH BEGIN\nADD unittest_batch0 100 Unit_test\nGIVE unittest_batch1 100000 Unit_test\nADD unittest_batch1 100 Unit_test\nBATCH COMMIT\n' \
+	| nc -U ${SOCKET} > ${BASEDIR}batch.txt
+grep '^201 Batch 3$' ${BASEDIR}batch.txt
+grep '^202 1 200 ' ${BASEDIR}batch.txt
+grep -v '^202 2 200 ' ${BASEDIR}batch.txt | grep '^202 2 '
+tail -n 1 ${BASEDIR}batch.txt | grep '^409 '
+TRY_COMMAND $DISPENSE acct unittest_batch0 | grep ': $    1.00'
+TRY_COMMAND $DISPENSE acct unittest_batch1 | grep ': $    2.50'
+TRY_COMMAND $DISPENSE acct ${USER} | grep ': $    0.00'
+
+LOG "Refusing a batch with a rejected command"
+printf 'BATCH BEGIN\nADD unittest_batch0 100 Unit_test\nADD unittest_batch0\nBATCH COMMIT\n' \
+	| nc -U ${SOCKET} > ${BASEDIR}batch.txt
+tail -n 1 ${BASEDIR}batch.txt | grep '^409 '
+TRY_COMMAND $DISPENSE acct unittest_batch0 | grep ': $    1.00'
+LOG "Success"
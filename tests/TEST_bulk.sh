@@ -0,0 +1,64 @@
+#!/bin/bash
+set -eux
+TESTNAME=bulk
+TEST_CONFIG="server_socket $(pwd)/rundir/${TESTNAME}/dispsrv.sock"
+
+. _common.sh
+
+DISPSRV="../dispsrv -f ${BASEDIR}cfg_server.conf"
+SOCKET=${BASEDIR}dispsrv.sock
+export LD_LIBRARY_PATH=..
+sqlite3 "${BASEDIR}cokebank.db" "INSERT INTO accounts (acct_name,acct_is_admin,acct_uid) VALUES ('${USER}',1,1);"
+
+cat << EOF2 > ${BASEDIR}import.csv
+# name,balance,flags,cards
+unittest_bulk0,1234,"coke,admin",CARD0 CARD1
+unittest_bulk1,-50,door,
+
+unittest_bulk2,,,CARD2
+EOF2
+
+LOG "Importing accounts"
+TRY_COMMAND $DISPSRV --import ${BASEDIR}import.csv
+TRY_COMMAND $DISPENSE acct unittest_bulk0 | grep ': $   12.34 (coke,admin)'
+TRY_COMMAND $DISPENSE acct unittest_bulk1 | grep ': $   -0.50 (user,door)'
+[ "$(sqlite3 "${BASEDIR}cokebank.db" "SELECT SUM(acct_balance) FROM accounts")" = "0" ] || FAIL "Balances don't sum to zero"
+
+LOG "Exporting them again"
+TRY_COMMAND $DISPSRV --export ${BASEDIR}export.csv
+grep '^unittest_bulk0,1234,"coke,admin",CARD0 CARD1$' ${BASEDIR}export.csv
+grep '^unittest_bulk1,-50,door,$' ${BASEDIR}export.csv
+grep '^unittest_bulk2,0,,CARD2$' ${BASEDIR}export.csv
+
+LOG "Importing the export changes nothing"
+sqlite3 "${BASEDIR}cokebank.db" "SELECT acct_name,acct_balance FROM accounts ORDER BY acct_id" > ${BASEDIR}before.txt
+TRY_COMMAND $DISPSRV --import ${BASEDIR}export.csv
+sqlite3 "${BASEDIR}cokebank.db" "SELECT acct_name,acct_balance FROM accounts ORDER BY acct_id" > ${BASEDIR}after.txt
+cmp ${BASEDIR}before.txt ${BASEDIR}after.txt
+
+LOG "Refusing a badly quoted line"
+printf 'unittest_bulk3,100,,\nunittest_bulk0,0,"coke,admin" ,CARD3\n' > ${BASEDIR}bad.csv
+if $DISPSRV --import ${BASEDIR}bad.csv; then
+	FAIL "Imported a badly quoted line"
+fi
+if $DISPENSE acct unittest_bulk3; then
+	FAIL "Partial import was kept"
+fi
+TRY_COMMAND $DISPENSE acct unittest_bulk0 | grep ': $   12.34 (coke,admin)'
+
+LOG "Taking a snapshot"
+TRY_COMMAND $DISPSRV --snapshot ${BASEDIR}snapshot.txt
+grep "^@accounts"$'\t'"acct_id"$'\t'"acct_balance"$'\t' ${BASEDIR}snapshot.txt
+grep "^[0-9]*"$'\t'"1234"$'\t'".*"$'\t'"unittest_bulk0"$'\t' ${BASEDIR}snapshot.txt
+grep "^@cards"$'\t'"acct_id"$'\t'"card_name\$" ${BASEDIR}snapshot.txt
+grep "^[0-9]*"$'\t'"CARD2\$" ${BASEDIR}snapshot.txt
+grep "^@items"$'\t' ${BASEDIR}snapshot.txt
+
+LOG "Exporting from the running server"
+printf 'EXPORT\n' | nc -U ${SOCKET} > ${BASEDIR}export.txt
+size=$(sed -n '1s/^201 Export \([0-9]*\)$/\1/p' ${BASEDIR}export.txt)
+[ -n "${size}" ] || FAIL "No export header"
+tail -n +2 ${BASEDIR}export.txt > ${BASEDIR}export_body.txt
+[ "$(wc -c < ${BASEDIR}export_body.txt)" = "${size}" ] || FAIL "Export size doesn't match its header"
+cmp ${BASEDIR}snapshot.txt ${BASEDIR}export_body.txt
+LOG "Success"
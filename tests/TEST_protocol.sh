@@ -0,0 +1,47 @@
+#!/bin/bash
+set -eux
+TESTNAME=protocol
+TEST_CONFIG="trusted_host 127.0.2.0/24"
+
+. _common.sh
+
+# Loopback addresses other than 127.0.0.1 stand in for remote hosts
+TRUSTED=127.0.2.5
+UNTRUSTED=127.0.3.5
+
+LOG "Checking a trusted_host network is trusted"
+echo "AUTHIDENT" | nc -s ${TRUSTED} 127.0.0.1 ${PORT} > ${BASEDIR}reply.txt
+grep -q '^401 ' ${BASEDIR}reply.txt && FAIL "Host in a trusted network was refused"
+echo "AUTHIDENT" | nc -s ${UNTRUSTED} 127.0.0.1 ${PORT} | grep '^401 Untrusted$'
+
+LOG "Checking listings are rate limited after the burst"
+for i in $(seq 12); do echo "ENUM_ITEMS"; done | nc -s ${UNTRUSTED} 127.0.0.1 ${PORT} > ${BASEDIR}reply.txt
+[ "$(grep -c '^201 Items ' ${BASEDIR}reply.txt)" = "10" ] || FAIL "Burst wasn't 10 listings"
+grep '^407 Rate limited ([0-9]* seconds remaining)$' ${BASEDIR}reply.txt
+LOG "Checking trusted hosts aren't limited by address"
+for i in $(seq 12); do echo "ENUM_ITEMS"; done | nc -s ${TRUSTED} 127.0.0.1 ${PORT} > ${BASEDIR}reply.txt
+[ "$(grep -c '^201 Items ' ${BASEDIR}reply.txt)" = "12" ] || FAIL "Trusted host was rate limited"
+
+LOG "Checking malformed commands are refused"
+cat << EOF2 | nc 127.0.0.1 ${PORT} > ${BASEDIR}reply.txt
+FROBNICATE
+ITEM_INFO
+ITEM_INFO coke:0 coke:1
+EXPORT now
+REFUND user
+ADD user ten Unit_test
+PIN_CHECK user 12a4
+ENUM_ITEMS
+EOF2
+diff - <(grep -v '^202 ' ${BASEDIR}reply.txt | sed 's/ gen:[0-9]*$//') << EOF2
+400 Unknown Command
+407 ITEM_INFO takes 1 argument
+407 ITEM_INFO takes 1 argument
+407 EXPORT takes no arguments
+407 REFUND takes 2 to 3 arguments
+407 Invalid Argument, 'ten' is not a number
+407 PIN should be four digits
+201 Items 0
+200 List end
+EOF2
+LOG "Success"
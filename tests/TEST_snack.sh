@@ -0,0 +1,70 @@
+#!/bin/bash
+set -eux
+TESTNAME=snack
+TEST_CONFIG="snack_serial_port rundir/${TESTNAME}/snack_tty
+snack_vend_timeout 5"
+TEST_ITEMS="snack	13	128	Test Chips
+snack	33	128	Sold Out Chips"
+
+mkdir -p rundir/${TESTNAME}
+../snacksim -l rundir/${TESTNAME}/snack_tty 13:1 33:0 > rundir/${TESTNAME}/snacksim.log 2>&1 &
+snacksim_pid=$!
+
+. _common.sh
+
+trap 'kill ${snacksim_pid}; cleanup' EXIT
+
+sqlite3 "${BASEDIR}cokebank.db" "INSERT INTO accounts (acct_name,acct_is_admin,acct_uid) VALUES ('${USER}',1,1);"
+TRY_COMMAND $DISPENSE acct ${USER} +1000 Unit_test
+
+LOG "Checking slot status in the item list"
+echo "ENUM_ITEMS" | nc localhost ${PORT} > ${BASEDIR}items.txt
+grep '^202 Item snack:13 avail 128 ' ${BASEDIR}items.txt
+grep '^202 Item snack:33 sold 128 ' ${BASEDIR}items.txt
+gen=$(sed -n 's/^201 Items 2 gen:\([0-9]*\)$/\1/p' ${BASEDIR}items.txt)
+[ -n "${gen}" ] || FAIL "No listing generation"
+
+LOG "Subscribing to events"
+exec 3<>/dev/tcp/localhost/${PORT}
+echo "WATCH" >&3
+cat <&3 > ${BASEDIR}watch.txt &
+watch_pid=$!
+trap 'kill ${snacksim_pid} ${watch_pid}; cleanup' EXIT
+
+LOG "Vending from a stocked slot"
+TRY_COMMAND $DISPENSE snack:13
+TRY_COMMAND $DISPENSE acct ${USER} | grep ': $    8.72'
+grep '^VEND 13$' ${BASEDIR}snacksim.log
+
+LOG "Checking events were sent"
+for i in 1 2 3 4 5; do
+	grep -q '^301 Item snack:13 sold 128 ' ${BASEDIR}watch.txt && break
+	sleep 1
+done
+grep '^200 Watching$' ${BASEDIR}watch.txt
+grep '^301 Item snack:13 sold 128 ' ${BASEDIR}watch.txt
+grep "^303 Balance ${USER} 872\$" ${BASEDIR}watch.txt
+
+LOG "Vending from empty slots"
+if $DISPENSE snack:13; then
+	FAIL "Dispensed from an emptied slot"
+fi
+if $DISPENSE snack:33; then
+	FAIL "Dispensed from an empty slot"
+fi
+TRY_COMMAND $DISPENSE acct ${USER} | grep ': $    8.72'
+
+LOG "Checking the cached item list was updated"
+grep '^202 Item snack:13 sold 128 ' ${XDG_CACHE_HOME}/opendispense/items-localhost-${PORT}
+
+LOG "Checking the item list changed"
+echo "ENUM_ITEMS" | nc localhost ${PORT} > ${BASEDIR}items.txt
+grep '^202 Item snack:13 sold 128 ' ${BASEDIR}items.txt
+grep -q "^201 Items 2 gen:${gen}\$" ${BASEDIR}items.txt && FAIL "Listing generation not updated"
+
+LOG "Checking only the changes are sent"
+echo "ENUM_ITEMS since:${gen}" | nc localhost ${PORT} > ${BASEDIR}items.txt
+grep '^201 Items 1 gen:' ${BASEDIR}items.txt
+grep '^202 Item snack:13 sold 128 ' ${BASEDIR}items.txt
+echo "ENUM_ITEMS since:1" | nc localhost ${PORT} | grep '^410 '
+LOG "Success"
@@ -18,9 +18,11 @@ test_mode no
 
 disable_syslog yes
 coke_dummy_mode yes
+${TEST_CONFIG:-}
 EOF
 
 echo "# AUTOGENERATED Test ${TESTNAME}" > ${BASEDIR}cfg_items.conf
+echo "${TEST_ITEMS:-}" >> ${BASEDIR}cfg_items.conf
 
 LOG() {
 	echo "TEST ${TESTNAME}: "$*
@@ -37,6 +39,8 @@ TRY_COMMAND() {
 }
 
 DISPENSE="../dispense -H localhost -P ${PORT}"
+export XDG_CACHE_HOME=$(pwd)/${BASEDIR}cache
+rm -rf ${XDG_CACHE_HOME}
 
 LD_LIBRARY_PATH=.. ../dispsrv -f ${BASEDIR}cfg_server.conf --dont-daemonise > ${BASEDIR}server.log 2>&1 &
 server_pid=$!